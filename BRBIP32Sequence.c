@@ -24,6 +24,7 @@
 
 #include "BRBIP32Sequence.h"
 #include "BRCrypto.h"
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -48,7 +49,8 @@
 // - In case parse256(IL) >= n or ki = 0, the resulting key is invalid, and one should proceed with the next value for i
 //   (Note: this has probability lower than 1 in 2^127.)
 //
-static void _CKDpriv(UInt256 *k, UInt256 *c, uint32_t i)
+// hmac is the HMAC-SHA512 key schedule for c, so it can be shared when deriving several children of the same parent
+static void _CKDprivHMAC(UInt256 *k, UInt256 *c, const BRHMACCtx *hmac, uint32_t i)
 {
     uint8_t buf[sizeof(BRECPoint) + sizeof(i)];
     UInt512 I;
@@ -61,7 +63,7 @@ static void _CKDpriv(UInt256 *k, UInt256 *c, uint32_t i)
     
     UInt32SetBE(&buf[sizeof(BRECPoint)], i);
     
-    BRHMAC(&I, BRSHA512, sizeof(UInt512), c, sizeof(*c), buf, sizeof(buf)); // I = HMAC-SHA512(c, k|P(k) || i)
+    BRHMACCtxMac(hmac, &I, buf, sizeof(buf)); // I = HMAC-SHA512(c, k|P(k) || i)
     
     BRSecp256k1ModAdd(k, (UInt256 *)&I); // k = IL + k (mod n)
     *c = *(UInt256 *)&I.u8[sizeof(UInt256)]; // c = IR
@@ -70,6 +72,15 @@ static void _CKDpriv(UInt256 *k, UInt256 *c, uint32_t i)
     mem_clean(buf, sizeof(buf));
 }
 
+static void _CKDpriv(UInt256 *k, UInt256 *c, uint32_t i)
+{
+    BRHMACCtx hmac;
+    
+    BRHMACCtxInit(&hmac, BRSHA512, c, sizeof(*c));
+    _CKDprivHMAC(k, c, &hmac, i);
+    BRHMACCtxClean(&hmac);
+}
+
 // Public parent key -> public child key
 //
 // CKDpub((Kpar, cpar), i) -> (Ki, ci) computes a child extended public key from the parent extended public key.
@@ -87,13 +98,16 @@ static void _CKDpriv(UInt256 *k, UInt256 *c, uint32_t i)
 static void _CKDpub(BRECPoint *K, UInt256 *c, uint32_t i)
 {
     uint8_t buf[sizeof(*K) + sizeof(i)];
+    BRHMACCtx hmac;
     UInt512 I;
 
     if ((i & BIP32_HARD) != BIP32_HARD) { // can't derive private child key from public parent key
         *(BRECPoint *)buf = *K;
         UInt32SetBE(&buf[sizeof(*K)], i);
     
-        BRHMAC(&I, BRSHA512, sizeof(UInt512), c, sizeof(*c), buf, sizeof(buf)); // I = HMAC-SHA512(c, P(K) || i)
+        BRHMACCtxInit(&hmac, BRSHA512, c, sizeof(*c));
+        BRHMACCtxMac(&hmac, &I, buf, sizeof(buf)); // I = HMAC-SHA512(c, P(K) || i)
+        BRHMACCtxClean(&hmac);
         
         *c = *(UInt256 *)&I.u8[sizeof(UInt256)]; // c = IR
         BRSecp256k1PointAdd(K, (UInt256 *)&I); // K = P(IL) + K
@@ -153,6 +167,75 @@ size_t BRBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey mpk, uint
     return (! pubKey || sizeof(BRECPoint) <= pubKeyLen) ? sizeof(BRECPoint) : 0;
 }
 
+// returns the extended public key for path N(m/0H/chain), from which each key in chain is one derivation step away
+BRMasterPubKey BRBIP32ChainPubKey(BRMasterPubKey mpk, uint32_t chain)
+{
+    BRMasterPubKey chainPubKey = mpk;
+    BRKey key;
+    
+    assert(memcmp(&mpk, &BR_MASTER_PUBKEY_NONE, sizeof(mpk)) != 0);
+    
+    if (BRKeySetPubKey(&key, mpk.pubKey, sizeof(mpk.pubKey))) {
+        chainPubKey.fingerPrint = BRKeyHash160(&key).u32[0];
+        _CKDpub((BRECPoint *)chainPubKey.pubKey, &chainPubKey.chainCode, chain); // path N(m/0H/chain)
+    }
+    else chainPubKey = BR_MASTER_PUBKEY_NONE;
+    
+    return chainPubKey;
+}
+
+// writes the public key for path N(m/0H/chain/index) to pubKey, given the extended public key for N(m/0H/chain)
+// returns number of bytes written, or pubKeyLen needed if pubKey is NULL
+size_t BRBIP32ChildPubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey chainPubKey, uint32_t index)
+{
+    UInt256 chainCode = chainPubKey.chainCode;
+    
+    assert(memcmp(&chainPubKey, &BR_MASTER_PUBKEY_NONE, sizeof(chainPubKey)) != 0);
+    
+    if (pubKey && sizeof(BRECPoint) <= pubKeyLen) {
+        *(BRECPoint *)pubKey = *(BRECPoint *)chainPubKey.pubKey;
+        _CKDpub((BRECPoint *)pubKey, &chainCode, index); // index'th key in chain
+        var_clean(&chainCode);
+    }
+    
+    return (! pubKey || sizeof(BRECPoint) <= pubKeyLen) ? sizeof(BRECPoint) : 0;
+}
+
+// writes the public keys for paths N(m/0H/chain/start) through N(m/0H/chain/start + count - 1) to pubKeys, given the
+// extended public key for N(m/0H/chain), keeping points in parsed form and sharing one field inversion across the list
+// returns the number of keys written
+size_t BRBIP32ChildPubKeyList(BRECPoint pubKeys[], BRMasterPubKey chainPubKey, uint32_t start, size_t count)
+{
+    uint8_t buf[sizeof(BRECPoint) + sizeof(uint32_t)];
+    UInt256 *tweaks;
+    BRHMACCtx hmac;
+    UInt512 I;
+    size_t i, n;
+    
+    assert(pubKeys != NULL || count == 0);
+    assert(memcmp(&chainPubKey, &BR_MASTER_PUBKEY_NONE, sizeof(chainPubKey)) != 0);
+    if (start & BIP32_HARD) return 0; // can't derive private child key from public parent key
+    if (count > BIP32_HARD - start) count = BIP32_HARD - start;
+    if (count == 0) return 0;
+    tweaks = malloc(count*sizeof(*tweaks));
+    assert(tweaks != NULL);
+    *(BRECPoint *)buf = *(BRECPoint *)chainPubKey.pubKey;
+    BRHMACCtxInit(&hmac, BRSHA512, &chainPubKey.chainCode, sizeof(chainPubKey.chainCode)); // shared by all siblings
+    
+    for (i = 0; i < count; i++) {
+        UInt32SetBE(&buf[sizeof(BRECPoint)], start + (uint32_t)i);
+        BRHMACCtxMac(&hmac, &I, buf, sizeof(buf)); // I = HMAC-SHA512(c, P(K) || i)
+        tweaks[i] = *(UInt256 *)&I; // IL, so that Ki = P(IL) + Kpar
+    }
+    
+    n = BRSecp256k1PointAddList(pubKeys, (BRECPoint *)chainPubKey.pubKey, tweaks, count);
+    BRHMACCtxClean(&hmac);
+    var_clean(&I);
+    mem_clean(tweaks, count*sizeof(*tweaks));
+    free(tweaks);
+    return n;
+}
+
 // sets the private key for path m/0H/chain/index to key
 void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index)
 {
@@ -165,6 +248,7 @@ void BRBIP32PrivKeyList(BRKey keys[], size_t keysCount, const void *seed, size_t
 {
     UInt512 I;
     UInt256 secret, chainCode, s, c;
+    BRHMACCtx hmac;
     
     assert(keys != NULL || keysCount == 0);
     assert(seed != NULL || seedLen == 0);
@@ -178,14 +262,16 @@ void BRBIP32PrivKeyList(BRKey keys[], size_t keysCount, const void *seed, size_t
 
         _CKDpriv(&secret, &chainCode, 0 | BIP32_HARD); // path m/0H
         _CKDpriv(&secret, &chainCode, chain); // path m/0H/chain
+        BRHMACCtxInit(&hmac, BRSHA512, &chainCode, sizeof(chainCode)); // shared by all keys in chain
     
         for (size_t i = 0; i < keysCount; i++) {
             s = secret;
             c = chainCode;
-            _CKDpriv(&s, &c, indexes[i]); // index'th key in chain
+            _CKDprivHMAC(&s, &c, &hmac, indexes[i]); // index'th key in chain
             BRKeySetSecret(&keys[i], &s, 1);
         }
         
+        BRHMACCtxClean(&hmac);
         var_clean(&secret, &chainCode, &c, &s);
     }
 }
@@ -61,6 +61,18 @@ BRMasterPubKey BRBIP32MasterPubKey(const void *seed, size_t seedLen);
 // returns number of bytes written, or pubKeyLen needed if pubKey is NULL
 size_t BRBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey mpk, uint32_t chain, uint32_t index);
 
+// returns the extended public key for path N(m/0H/chain), from which each key in chain is one derivation step away
+BRMasterPubKey BRBIP32ChainPubKey(BRMasterPubKey mpk, uint32_t chain);
+
+// writes the public key for path N(m/0H/chain/index) to pubKey, given the extended public key for N(m/0H/chain)
+// returns number of bytes written, or pubKeyLen needed if pubKey is NULL
+size_t BRBIP32ChildPubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey chainPubKey, uint32_t index);
+
+// writes the public keys for paths N(m/0H/chain/start) through N(m/0H/chain/start + count - 1) to pubKeys, given the
+// extended public key for N(m/0H/chain), keeping points in parsed form and sharing one field inversion across the list
+// returns the number of keys written
+size_t BRBIP32ChildPubKeyList(BRECPoint pubKeys[], BRMasterPubKey chainPubKey, uint32_t start, size_t count);
+
 // sets the private key for path m/0H/chain/index to key
 void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index);
 
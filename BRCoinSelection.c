@@ -0,0 +1,254 @@
+//
+//  BRCoinSelection.c
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRCoinSelection.h"
+#include "BRAddress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BNB_MAX_TRIES 100000 // branch and bound search steps before giving up on a changeless selection
+
+// serialized size of a tx spending inCount coins, with or without a change output
+inline static size_t _BRCoinTxSize(const BRCoinTarget *target, size_t inCount, int change)
+{
+    return 8 + BRVarIntSize(inCount) + BRVarIntSize(target->outCount + (change ? 1 : 0)) + target->outSize +
+           inCount*TX_INPUT_SIZE + (change ? TX_OUTPUT_SIZE : 0);
+}
+
+// fee for a tx spending inCount coins with a change output
+static uint64_t _BRCoinChangeFee(const BRCoinTarget *target, size_t inCount)
+{
+    uint64_t fee = BRCoinTxFee(target->feePerKb, _BRCoinTxSize(target, inCount, 1));
+
+    // increase fee to round off remaining balance to nearest 100 satoshi
+    if (target->balance > target->amount + fee) fee += (target->balance - (target->amount + fee)) % 100;
+    return fee;
+}
+
+// most coins a tx with a change output can spend without exceeding maxSize
+static size_t _BRCoinMaxInputs(const BRCoinTarget *target, size_t coinCount)
+{
+    size_t n = 0, size = _BRCoinTxSize(target, 0, 1);
+
+    if (size < target->maxSize) n = (target->maxSize - size)/TX_INPUT_SIZE;
+    if (n > coinCount) n = coinCount;
+    while (n > 0 && _BRCoinTxSize(target, n, 1) > target->maxSize) n--;
+    return n;
+}
+
+// true if inCount coins totaling amount fund target, in which case selection is filled in
+static int _BRCoinIsFunded(const BRCoinTarget *target, size_t inCount, uint64_t amount, BRCoinSelection *selection)
+{
+    uint64_t fee = _BRCoinChangeFee(target, inCount),
+             exactFee = BRCoinTxFee(target->feePerKb, _BRCoinTxSize(target, inCount, 1)); // without rounding
+
+    if (amount != target->amount + exactFee && amount != target->amount + fee &&
+        amount < target->amount + fee + target->minChange) return 0;
+
+    selection->amount = amount;
+    selection->maxAmount = 0;
+
+    if (amount > target->amount + fee + target->minChange) { // add change output
+        selection->fee = fee;
+        selection->change = amount - (target->amount + fee);
+    }
+    else selection->fee = amount - target->amount, selection->change = 0;
+
+    return 1;
+}
+
+// orders coins by descending amount, then by idx
+static int _BRCoinCompare(const void *c1, const void *c2)
+{
+    const BRCoin *a = c1, *b = c2;
+
+    if (a->amount != b->amount) return (a->amount > b->amount) ? -1 : 1;
+    return (a->idx > b->idx) - (a->idx < b->idx);
+}
+
+// returns a copy of coins sorted by descending amount, that must be freed by calling free()
+static BRCoin *_BRCoinsSorted(const BRCoin coins[], size_t coinCount)
+{
+    BRCoin *sorted = malloc((coinCount > 0 ? coinCount : 1)*sizeof(*sorted));
+
+    assert(sorted != NULL);
+    if (coinCount > 0) memcpy(sorted, coins, coinCount*sizeof(*sorted));
+    qsort(sorted, coinCount, sizeof(*sorted), _BRCoinCompare);
+    return sorted;
+}
+
+// spends coins in the given order until target is funded, switching to BRCoinSelectLargestFirst() if that would take
+// a tx larger than maxSize
+size_t BRCoinSelectFirstFit(const BRCoinTarget *target, const BRCoin coins[], size_t coinCount, size_t selected[],
+                            BRCoinSelection *selection)
+{
+    size_t i, maxInputs;
+    uint64_t amount = 0;
+
+    assert(target != NULL);
+    assert(coins != NULL || coinCount == 0);
+    assert(selected != NULL || coinCount == 0);
+    assert(selection != NULL);
+    memset(selection, 0, sizeof(*selection));
+    maxInputs = _BRCoinMaxInputs(target, coinCount);
+
+    for (i = 0; i < maxInputs; i++) {
+        selected[i] = coins[i].idx;
+        amount += coins[i].amount;
+        if (_BRCoinIsFunded(target, i + 1, amount, selection)) return i + 1;
+    }
+
+    // spending coins in order would take too large a tx, but the largest coins might still fit
+    return (i < coinCount) ? BRCoinSelectLargestFirst(target, coins, coinCount, selected, selection) : 0;
+}
+
+// spends the smallest single coin that funds target with change, otherwise spends the largest coins until target is
+// funded
+size_t BRCoinSelectLargestFirst(const BRCoinTarget *target, const BRCoin coins[], size_t coinCount, size_t selected[],
+                                BRCoinSelection *selection)
+{
+    BRCoin *sorted;
+    size_t i = 0, lo = 0, hi = coinCount, mid, maxInputs, count = 0;
+    uint64_t amount = 0, total, need;
+
+    assert(target != NULL);
+    assert(coins != NULL || coinCount == 0);
+    assert(selected != NULL || coinCount == 0);
+    assert(selection != NULL);
+    memset(selection, 0, sizeof(*selection));
+    maxInputs = _BRCoinMaxInputs(target, coinCount);
+    if (maxInputs == 0) return 0;
+    sorted = _BRCoinsSorted(coins, coinCount);
+    need = target->amount + _BRCoinChangeFee(target, 1) + target->minChange;
+
+    while (lo < hi) { // find the smallest coin of at least need
+        mid = lo + (hi - lo)/2;
+        if (sorted[mid].amount >= need) lo = mid + 1;
+        else hi = mid;
+    }
+
+    if (lo > 0 && _BRCoinIsFunded(target, 1, sorted[lo - 1].amount, selection)) {
+        selected[0] = sorted[lo - 1].idx;
+        count = 1;
+    }
+
+    for (i = 0; count == 0 && i < maxInputs; i++) {
+        selected[i] = sorted[i].idx;
+        amount += sorted[i].amount;
+        if (_BRCoinIsFunded(target, i + 1, amount, selection)) count = i + 1;
+    }
+
+    if (count == 0 && i < coinCount) { // check if target could be funded in a tx larger than maxSize
+        for (total = amount; i < coinCount; i++) total += sorted[i].amount;
+        need = BRCoinTxFee(target->feePerKb, _BRCoinTxSize(target, maxInputs, 1));
+
+        if (total >= target->amount + BRCoinTxFee(target->feePerKb, _BRCoinTxSize(target, coinCount, 1)) &&
+            amount > need) selection->maxAmount = amount - need;
+    }
+
+    free(sorted);
+    return count;
+}
+
+// searches for coins that fund target with no change output, overpaying the fee by no more than a change output would
+// cost plus minChange, otherwise falls back to BRCoinSelectLargestFirst()
+size_t BRCoinSelectBranchAndBound(const BRCoinTarget *target, const BRCoin coins[], size_t coinCount,
+                                  size_t selected[], BRCoinSelection *selection)
+{
+    BRCoin *sorted;
+    uint8_t *included;
+    size_t i, tries, depth = 0, inCount = 0, maxInputs, count, bestCount = 0;
+    uint64_t inputFee, amount = 0, available = 0, lo, hi, bestAmount = 0, waste, bestWaste = UINT64_MAX;
+    int backtrack;
+
+    assert(target != NULL);
+    assert(coins != NULL || coinCount == 0);
+    assert(selected != NULL || coinCount == 0);
+    assert(selection != NULL);
+    memset(selection, 0, sizeof(*selection));
+    maxInputs = _BRCoinMaxInputs(target, coinCount);
+    sorted = _BRCoinsSorted(coins, coinCount);
+
+    // only search coins worth more than the fee for spending them, so adding a coin always adds to the surplus
+    inputFee = BRCoinTxFee(target->feePerKb, TX_INPUT_SIZE) + 100;
+    for (count = 0; count < coinCount && sorted[count].amount > inputFee; count++) available += sorted[count].amount;
+    included = calloc(count + 1, sizeof(*included));
+    assert(included != NULL);
+
+    // depth first search, including each coin in descending order of amount before trying without it
+    for (tries = 0; tries < BNB_MAX_TRIES && maxInputs > 0; tries++) {
+        lo = target->amount + BRCoinTxFee(target->feePerKb, _BRCoinTxSize(target, inCount, 0));
+        hi = target->amount + BRCoinTxFee(target->feePerKb, _BRCoinTxSize(target, inCount, 1)) + target->minChange;
+        backtrack = 0;
+
+        if (amount + available < lo || amount > hi) backtrack = 1; // target is out of reach, or overshot
+        else if (amount >= lo) { // funded without change, keep the selection that overpays the fee the least
+            waste = amount - lo;
+            backtrack = 1;
+
+            if (waste < bestWaste) {
+                bestWaste = waste;
+                bestAmount = amount;
+
+                for (i = 0, bestCount = 0; i < depth; i++) {
+                    if (included[i]) selected[bestCount++] = sorted[i].idx;
+                }
+            }
+
+            if (bestWaste == 0) break;
+        }
+        else if (inCount == maxInputs || depth == count) backtrack = 1;
+
+        if (backtrack) {
+            while (depth > 0 && ! included[depth - 1]) depth--, available += sorted[depth].amount;
+            if (depth == 0) break; // search is exhausted
+            included[depth - 1] = 0; // try without the last included coin
+            amount -= sorted[depth - 1].amount;
+            inCount--;
+        }
+        else {
+            available -= sorted[depth].amount;
+
+            // a coin equal to the one just left out would only repeat the branch already searched
+            if (depth > 0 && ! included[depth - 1] && sorted[depth].amount == sorted[depth - 1].amount) {
+                included[depth] = 0;
+            }
+            else included[depth] = 1, amount += sorted[depth].amount, inCount++;
+
+            depth++;
+        }
+    }
+
+    free(included);
+    free(sorted);
+
+    if (bestCount > 0) {
+        selection->amount = bestAmount;
+        selection->fee = bestAmount - target->amount;
+        selection->change = 0;
+        return bestCount;
+    }
+
+    return BRCoinSelectLargestFirst(target, coins, coinCount, selected, selection);
+}
@@ -0,0 +1,94 @@
+//
+//  BRCoinSelection.h
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRCoinSelection_h
+#define BRCoinSelection_h
+
+#include "BRTransaction.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a spendable output offered to a coin selector, all inputs are assumed to be TX_INPUT_SIZE bytes once signed
+typedef struct {
+    uint64_t amount;
+    size_t idx; // caller's index for the output, such as its position in the wallet utxo list
+} BRCoin;
+
+// the outputs a coin selector must fund
+typedef struct {
+    uint64_t amount; // total amount of the outputs
+    size_t outCount; // number of outputs, not counting change
+    size_t outSize; // serialized size of the outputs, not counting change
+    uint64_t feePerKb;
+    uint64_t minChange; // change of this amount or less is added to the fee instead of creating a change output
+    uint64_t balance; // if non-zero, fees with change are raised so the balance left after the tx is a multiple of 100
+    size_t maxSize; // largest allowed tx size in bytes, such as TX_MAX_SIZE
+} BRCoinTarget;
+
+typedef struct {
+    uint64_t amount; // total amount of the selected coins
+    uint64_t fee;
+    uint64_t change; // amount of the change output, or 0 if there is none
+    uint64_t maxAmount; // if the coins can only fund target in a tx larger than maxSize, the most the outputs can total
+} BRCoinSelection;
+
+// a coin selection strategy, writes the idx of each coin selected to fund target to selected, which must have room for
+// coinCount entries, and fills in selection
+// coins are given in the caller's preferred spending order
+// returns the number of coins selected, or 0 if target can't be funded
+typedef size_t (*BRCoinSelector)(const BRCoinTarget *target, const BRCoin coins[], size_t coinCount, size_t selected[],
+                                 BRCoinSelection *selection);
+
+// fee for a tx of the given size at feePerKb, rounded up to the nearest 100 satoshi and no less than the standard fee
+inline static uint64_t BRCoinTxFee(uint64_t feePerKb, size_t size)
+{
+    uint64_t standardFee = size*TX_FEE_PER_KB/1000,       // standard fee based on tx size
+             fee = (((size*feePerKb/1000) + 99)/100)*100; // fee using feePerKb, rounded up to nearest 100 satoshi
+
+    return (fee > standardFee) ? fee : standardFee;
+}
+
+// spends coins in the given order until target is funded, switching to BRCoinSelectLargestFirst() if that would take
+// a tx larger than maxSize
+size_t BRCoinSelectFirstFit(const BRCoinTarget *target, const BRCoin coins[], size_t coinCount, size_t selected[],
+                            BRCoinSelection *selection);
+
+// spends the smallest single coin that funds target with change, otherwise spends the largest coins until target is
+// funded
+size_t BRCoinSelectLargestFirst(const BRCoinTarget *target, const BRCoin coins[], size_t coinCount, size_t selected[],
+                                BRCoinSelection *selection);
+
+// searches for coins that fund target with no change output, overpaying the fee by no more than a change output would
+// cost plus minChange, otherwise falls back to BRCoinSelectLargestFirst()
+size_t BRCoinSelectBranchAndBound(const BRCoinTarget *target, const BRCoin coins[], size_t coinCount,
+                                  size_t selected[], BRCoinSelection *selection);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRCoinSelection_h
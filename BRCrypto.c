@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 // endian swapping
 #if __BIG_ENDIAN__ || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
@@ -110,19 +111,25 @@ void BRSHA1(void *md20, const void *data, size_t dataLen)
 #define s2(x) (ror32((x), 7) ^ ror32((x), 18) ^ ((x) >> 3))
 #define s3(x) (ror32((x), 17) ^ ror32((x), 19) ^ ((x) >> 10))
 
-static void _BRSHA256Compress(uint32_t *r, const uint32_t *x)
+static const uint32_t _k256[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SHA256_INLINE inline static __attribute__((always_inline))
+#else
+#define SHA256_INLINE inline static
+#endif
+
+SHA256_INLINE void _BRSHA256CompressBody(uint32_t *r, const uint32_t *x)
 {
-    static const uint32_t k[] = {
-        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-    };
-    
     int i;
     uint32_t a = r[0], b = r[1], c = r[2], d = r[3], e = r[4], f = r[5], g = r[6], h = r[7], t1, t2, w[64];
     
@@ -130,7 +137,7 @@ static void _BRSHA256Compress(uint32_t *r, const uint32_t *x)
     for (; i < 64; i++) w[i] = s3(w[i - 2]) + w[i - 7] + s2(w[i - 15]) + w[i - 16];
     
     for (i = 0; i < 64; i++) {
-        t1 = h + s1(e) + ch(e, f, g) + k[i] + w[i];
+        t1 = h + s1(e) + ch(e, f, g) + _k256[i] + w[i];
         t2 = s0(a) + maj(a, b, c);
         h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
     }
@@ -140,55 +147,145 @@ static void _BRSHA256Compress(uint32_t *r, const uint32_t *x)
     mem_clean(w, sizeof(w));
 }
 
-void BRSHA224(void *md28, const void *data, size_t dataLen) {
-    size_t i;
-    uint32_t x[16], buf[] = { 0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511,
-                              0x64f98fa7, 0xbefa4fa4 }; // initial buffer values
+// portable sha256 compression of count consecutive 64 byte blocks of data into state r
+static void _BRSHA256BlocksGeneric(uint32_t *r, const uint8_t *data, size_t count)
+{
+    uint32_t x[16];
+    
+    for (; count > 0; count--, data += 64) memcpy(x, data, 64), _BRSHA256CompressBody(r, x);
+    mem_clean(x, sizeof(x));
+}
 
-    assert(md28 != NULL);
-    assert(data != NULL || dataLen == 0);
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__)) && \
+    ! defined(BR_SHA_NO_SIMD)
+#define SHA256_X86 1
+#include <immintrin.h>
+#include <cpuid.h>
 
-    for (i = 0; i < dataLen; i += 64) { // process data in 64 byte blocks
-        memcpy(x, (const uint8_t *)data + i, (i + 64 < dataLen) ? 64 : dataLen - i);
-        if (i + 64 > dataLen) break;
-        _BRSHA256Compress(buf, x);
+// same code as the portable version, compiled for cpus with avx2 and bmi2 so rotations use the rorx instruction
+__attribute__((target("avx2,bmi2")))
+static void _BRSHA256BlocksAVX2(uint32_t *r, const uint8_t *data, size_t count)
+{
+    uint32_t x[16];
+    
+    for (; count > 0; count--, data += 64) memcpy(x, data, 64), _BRSHA256CompressBody(r, x);
+    mem_clean(x, sizeof(x));
+}
+
+// four rounds of sha256 using the sha extensions, m holds the next four message words
+#define _sha256ni_rnd4(m, i) (msg = _mm_add_epi32((m), _mm_loadu_si128((const __m128i *)&_k256[(i)*4])),\
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg),\
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e)))
+
+// computes the next four message words into m0 from the previous sixteen in m0 (oldest) to m3 (newest)
+#define _sha256ni_sched(m0, m1, m2, m3)\
+    (m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4)), m3))
+
+// sha256 compression using the x86 sha extensions (intel goldmont/ice lake, amd zen and later)
+__attribute__((target("sha,sse4.1")))
+static void _BRSHA256BlocksSHANI(uint32_t *r, const uint8_t *data, size_t count)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i abef, cdgh, abef0, cdgh0, msg, m0, m1, m2, m3, t;
+    
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&r[0]), 0xb1); // cdab
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&r[4]), 0x1b); // efgh
+    abef = _mm_alignr_epi8(t, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, t, 0xf0);
+    
+    for (; count > 0; count--, data += 64) {
+        abef0 = abef, cdgh0 = cdgh;
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[0]), bswap);
+        _sha256ni_rnd4(m0, 0);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[16]), bswap);
+        _sha256ni_rnd4(m1, 1);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[32]), bswap);
+        _sha256ni_rnd4(m2, 2);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[48]), bswap);
+        _sha256ni_rnd4(m3, 3);
+        
+        for (int i = 4; i < 16; i += 4) {
+            _sha256ni_sched(m0, m1, m2, m3), _sha256ni_rnd4(m0, i);
+            _sha256ni_sched(m1, m2, m3, m0), _sha256ni_rnd4(m1, i + 1);
+            _sha256ni_sched(m2, m3, m0, m1), _sha256ni_rnd4(m2, i + 2);
+            _sha256ni_sched(m3, m0, m1, m2), _sha256ni_rnd4(m3, i + 3);
+        }
+        
+        abef = _mm_add_epi32(abef, abef0);
+        cdgh = _mm_add_epi32(cdgh, cdgh0);
     }
+    
+    t = _mm_shuffle_epi32(abef, 0x1b); // feba
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1); // dchg
+    _mm_storeu_si128((__m128i *)&r[0], _mm_blend_epi16(t, cdgh, 0xf0)); // dcba
+    _mm_storeu_si128((__m128i *)&r[4], _mm_alignr_epi8(cdgh, t, 8)); // hgfe
+}
 
-    memset((uint8_t *)x + (dataLen - i), 0, 64 - (dataLen - i)); // clear remainder of x
-    ((uint8_t *)x)[dataLen - i] = 0x80; // append padding
-    if (dataLen - i >= 56) _BRSHA256Compress(buf, x), memset(x, 0, 64); // length goes to next block
-    x[14] = be32((uint32_t)(dataLen >> 29)), x[15] = be32((uint32_t)(dataLen << 3)); // append length in bits
-    _BRSHA256Compress(buf, x); // finalize
-    for (i = 0; i < 7; i++) buf[i] = be32(buf[i]); // endian swap
-    memcpy(md28, buf, 28); // write to md
+#endif // SHA256_X86
+
+static void _BRSHA256BlocksInit(uint32_t *r, const uint8_t *data, size_t count);
+
+// sha256 compression backend for the current cpu, selected on first use
+static void (*volatile _BRSHA256Blocks)(uint32_t *, const uint8_t *, size_t) = _BRSHA256BlocksInit;
+
+static void _BRSHA256BlocksInit(uint32_t *r, const uint8_t *data, size_t count)
+{
+    void (*blocks)(uint32_t *, const uint8_t *, size_t) = _BRSHA256BlocksGeneric;
+    
+#if SHA256_X86
+    unsigned eax, ebx, ecx, edx, ecx1 = 0, ebx7 = 0;
+    
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) ecx1 = ecx;
+    if (__get_cpuid_max(0, NULL) >= 7) __cpuid_count(7, 0, eax, ebx7, ecx, edx);
+    
+    if ((ebx7 & bit_SHA) && (ecx1 & bit_SSSE3) && (ecx1 & bit_SSE4_1)) blocks = _BRSHA256BlocksSHANI;
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) blocks = _BRSHA256BlocksAVX2;
+#endif
+
+    _BRSHA256Blocks = blocks; // every thread selects the same backend, so racing writes are harmless
+    blocks(r, data, count);
+}
+
+// sha256 of the final partial block of data with padding and message length, then writes the digest to md
+// prefixLen is the number of bytes already hashed into buf ahead of data, a multiple of 64
+static void _BRSHA256Final(uint32_t *buf, void *md, size_t mdLen, const uint8_t *data, size_t dataLen, size_t prefixLen)
+{
+    uint32_t x[32];
+    size_t i = dataLen & ~(size_t)63, n = (dataLen - i >= 56) ? 2 : 1, len = prefixLen + dataLen;
+    
+    memset(x, 0, 64*n); // clear remainder of x
+    memcpy(x, &data[i], dataLen - i);
+    ((uint8_t *)x)[dataLen - i] = 0x80; // append padding, length goes to the next block if it doesn't fit
+    x[n*16 - 2] = be32((uint32_t)(len >> 29)), x[n*16 - 1] = be32((uint32_t)(len << 3)); // length in bits
+    _BRSHA256Blocks(buf, (const uint8_t *)x, n); // finalize
+    for (i = 0; i < 8; i++) buf[i] = be32(buf[i]); // endian swap
+    memcpy(md, buf, mdLen); // write to md
     mem_clean(x, sizeof(x));
-    mem_clean(buf, sizeof(buf));
+    mem_clean(buf, 32);
+}
+
+void BRSHA224(void *md28, const void *data, size_t dataLen) {
+    uint32_t buf[] = { 0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511,
+                       0x64f98fa7, 0xbefa4fa4 }; // initial buffer values
+
+    assert(md28 != NULL);
+    assert(data != NULL || dataLen == 0);
+    if (dataLen >= 64) _BRSHA256Blocks(buf, data, dataLen/64); // process data in 64 byte blocks
+    _BRSHA256Final(buf, md28, 28, data, dataLen, 0);
 }
 
+static const uint32_t _iv256[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19 }; // sha256 initial buffer values
+
 void BRSHA256(void *md32, const void *data, size_t dataLen)
 {
-    size_t i;
-    uint32_t x[16], buf[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
-                              0x1f83d9ab, 0x5be0cd19 }; // initial buffer values
+    uint32_t buf[8];
     
     assert(md32 != NULL);
     assert(data != NULL || dataLen == 0);
-
-    for (i = 0; i < dataLen; i += 64) { // process data in 64 byte blocks
-        memcpy(x, (const uint8_t *)data + i, (i + 64 < dataLen) ? 64 : dataLen - i);
-        if (i + 64 > dataLen) break;
-        _BRSHA256Compress(buf, x);
-    }
-    
-    memset((uint8_t *)x + (dataLen - i), 0, 64 - (dataLen - i)); // clear remainder of x
-    ((uint8_t *)x)[dataLen - i] = 0x80; // append padding
-    if (dataLen - i >= 56) _BRSHA256Compress(buf, x), memset(x, 0, 64); // length goes to next block
-    x[14] = be32((uint32_t)(dataLen >> 29)), x[15] = be32((uint32_t)(dataLen << 3)); // append length in bits
-    _BRSHA256Compress(buf, x); // finalize
-    for (i = 0; i < 8; i++) buf[i] = be32(buf[i]); // endian swap
-    memcpy(md32, buf, 32); // write to md
-    mem_clean(x, sizeof(x));
-    mem_clean(buf, sizeof(buf));
+    memcpy(buf, _iv256, sizeof(buf)); // initial buffer values
+    if (dataLen >= 64) _BRSHA256Blocks(buf, data, dataLen/64); // process data in 64 byte blocks
+    _BRSHA256Final(buf, md32, 32, data, dataLen, 0);
 }
 
 // double-sha-256 = sha-256(sha-256(x))
@@ -202,6 +299,129 @@ void BRSHA256_2(void *md32, const void *data, size_t dataLen)
     BRSHA256(md32, t, sizeof(t));
 }
 
+#if (defined(__GNUC__) || defined(__clang__)) && ! defined(BR_SHA_NO_SIMD)
+#define SHA256_MULTI 1
+
+#if SHA256_X86
+#define SHA256_AVX2   __attribute__((target("avx2")))
+#define SHA256_AVX512 __attribute__((target("avx512f")))
+#else
+#define SHA256_AVX2
+#define SHA256_AVX512
+#endif
+
+// vectors holding the same 32bit word from 4, 8 or 16 independent sha256 instances, one instance per lane
+typedef uint32_t _sha256_x4 __attribute__((vector_size(16)));
+typedef uint32_t _sha256_x8 __attribute__((vector_size(32)));
+typedef uint32_t _sha256_x16 __attribute__((vector_size(64)));
+
+// defines sha256 compression and double-sha256 of lanes messages of dataLen bytes each stored back to back in data
+#define _sha256_multi_lanes(lanes, attr)\
+attr static void _BRSHA256Compress_x##lanes(_sha256_x##lanes *r, _sha256_x##lanes *w)\
+{\
+    _sha256_x##lanes a = r[0], b = r[1], c = r[2], d = r[3], e = r[4], f = r[5], g = r[6], h = r[7], t1, t2;\
+    \
+    for (int i = 16; i < 64; i++) w[i] = s3(w[i - 2]) + w[i - 7] + s2(w[i - 15]) + w[i - 16];\
+    \
+    for (int i = 0; i < 64; i++) {\
+        t1 = h + s1(e) + ch(e, f, g) + _k256[i] + w[i];\
+        t2 = s0(a) + maj(a, b, c);\
+        h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;\
+    }\
+    \
+    r[0] += a, r[1] += b, r[2] += c, r[3] += d, r[4] += e, r[5] += f, r[6] += g, r[7] += h;\
+}\
+\
+attr static void _BRSHA256_2_x##lanes(uint8_t *md32, const uint8_t *data, size_t dataLen)\
+{\
+    _sha256_x##lanes r[8], w[64];\
+    size_t full = dataLen/64, blocks = (dataLen + 8)/64 + 1;\
+    uint8_t tail[lanes][128];\
+    const uint8_t *p;\
+    uint32_t u;\
+    \
+    for (unsigned l = 0; l < lanes; l++) { /* padding and message length, same layout as BRSHA256() */\
+        memset(tail[l], 0, sizeof(tail[l]));\
+        memcpy(tail[l], &data[l*dataLen + full*64], dataLen - full*64);\
+        tail[l][dataLen - full*64] = 0x80;\
+        u = be32((uint32_t)(dataLen >> 29)), memcpy(&tail[l][(blocks - full)*64 - 8], &u, 4);\
+        u = be32((uint32_t)(dataLen << 3)), memcpy(&tail[l][(blocks - full)*64 - 4], &u, 4);\
+    }\
+    \
+    for (int k = 0; k < 8; k++) r[k] = (_sha256_x##lanes){ 0 } + _iv256[k];\
+    \
+    for (size_t i = 0; i < blocks; i++) {\
+        for (unsigned l = 0; l < lanes; l++) {\
+            p = (i < full) ? &data[l*dataLen + i*64] : &tail[l][(i - full)*64];\
+            for (int k = 0; k < 16; k++) memcpy(&u, &p[k*4], 4), w[k][l] = be32(u);\
+        }\
+        \
+        _BRSHA256Compress_x##lanes(r, w);\
+    }\
+    \
+    for (int k = 0; k < 8; k++) w[k] = r[k], r[k] = (_sha256_x##lanes){ 0 } + _iv256[k];\
+    for (int k = 8; k < 16; k++) w[k] = (_sha256_x##lanes){ 0 };\
+    w[8] += 0x80000000, w[15] += 32*8;\
+    _BRSHA256Compress_x##lanes(r, w);\
+    \
+    for (unsigned l = 0; l < lanes; l++) {\
+        for (int k = 0; k < 8; k++) u = be32(r[k][l]), memcpy(&md32[l*32 + k*4], &u, 4);\
+    }\
+}
+
+_sha256_multi_lanes(4, )
+_sha256_multi_lanes(8, SHA256_AVX2)
+_sha256_multi_lanes(16, SHA256_AVX512)
+
+// number of simd lanes to use for multi-buffer hashing on the current cpu, or 1 if a single stream is faster
+static unsigned _BRSHA256MultiLanes(void)
+{
+    static volatile unsigned lanes = 0;
+    
+    if (lanes == 0) {
+        uint8_t md[32];
+        
+        BRSHA256(md, "", 0); // selects the single stream backend
+#if SHA256_X86
+        if (__builtin_cpu_supports("avx512f")) lanes = 16; // about 2.5x faster than the sha extensions
+        else if (_BRSHA256Blocks == _BRSHA256BlocksSHANI) lanes = 1; // on par with 8 avx2 lanes
+        else if (__builtin_cpu_supports("avx2")) lanes = 8;
+        else lanes = 4;
+#else
+        lanes = 4;
+#endif
+    }
+    
+    return lanes;
+}
+
+#endif // SHA256_MULTI
+
+// double-sha-256 of count independent messages of dataLen bytes each, stored back to back in data, writing count
+// 32 byte digests to md32, messages are hashed in parallel simd lanes when that is faster than one at a time
+// NOTE: intended for public data such as txids, merkle nodes and block headers, intermediate state is not wiped
+void BRSHA256_2_Multi(void *md32, const void *data, size_t dataLen, size_t count)
+{
+    const uint8_t *d = data;
+    uint8_t *md = md32;
+    size_t i = 0;
+    
+    assert(md32 != NULL || count == 0);
+    assert(data != NULL || count == 0 || dataLen == 0);
+
+#if SHA256_MULTI
+    unsigned lanes = _BRSHA256MultiLanes();
+    
+    for (; lanes > 1 && i + lanes <= count; i += lanes) {
+        if (lanes == 16) _BRSHA256_2_x16(&md[i*32], &d[i*dataLen], dataLen);
+        else if (lanes == 8) _BRSHA256_2_x8(&md[i*32], &d[i*dataLen], dataLen);
+        else _BRSHA256_2_x4(&md[i*32], &d[i*dataLen], dataLen);
+    }
+#endif
+
+    for (; i < count; i++) BRSHA256_2(&md[i*32], &d[i*dataLen], dataLen); // remainder
+}
+
 // bitwise right rotation
 #define ror64(a, b) (((a) >> (b)) | ((a) << (64 - (b))))
 
@@ -249,17 +469,16 @@ static void _BRSHA512Compress(uint64_t *r, const uint64_t *x)
     mem_clean(w, sizeof(w));
 }
 
-void BRSHA384(void *md48, const void *data, size_t dataLen)
+// sha512 of data with padding and message length, then writes the first mdLen bytes of the digest to md
+// prefixLen is the number of bytes already hashed into buf ahead of data, a multiple of 128
+static void _BRSHA512Final(uint64_t *buf, void *md, size_t mdLen, const uint8_t *data, size_t dataLen,
+                           size_t prefixLen)
 {
     size_t i;
-    uint64_t x[16], buf[] = { 0xcbbb9d5dc1059ed8, 0x629a292a367cd507, 0x9159015a3070dd17, 0x152fecd8f70e5939,
-                              0x67332667ffc00b31, 0x8eb44a8768581511, 0xdb0c2e0d64f98fa7, 0x47b5481dbefa4fa4 };
+    uint64_t x[16];
     
-    assert(md48 != NULL);
-    assert(data != NULL || dataLen == 0);
-
     for (i = 0; i < dataLen; i += 128) { // process data in 128 byte blocks
-        memcpy(x, (const uint8_t *)data + i, (i + 128 < dataLen) ? 128 : dataLen - i);
+        memcpy(x, data + i, (i + 128 < dataLen) ? 128 : dataLen - i);
         if (i + 128 > dataLen) break;
         _BRSHA512Compress(buf, x);
     }
@@ -267,38 +486,36 @@ void BRSHA384(void *md48, const void *data, size_t dataLen)
     memset((uint8_t *)x + (dataLen - i), 0, 128 - (dataLen - i)); // clear remainder of x
     ((uint8_t *)x)[dataLen - i] = 0x80; // append padding
     if (dataLen - i >= 112) _BRSHA512Compress(buf, x), memset(x, 0, 128); // length goes to next block
-    x[14] = 0, x[15] = be64((uint64_t)dataLen*8); // append length in bits
+    x[14] = 0, x[15] = be64((uint64_t)(prefixLen + dataLen)*8); // append length in bits
     _BRSHA512Compress(buf, x); // finalize
-    for (i = 0; i < 6; i++) buf[i] = be64(buf[i]); // endian swap
-    memcpy(md48, buf, 48); // write to md
+    for (i = 0; i < 8; i++) buf[i] = be64(buf[i]); // endian swap
+    memcpy(md, buf, mdLen); // write to md
     mem_clean(x, sizeof(x));
-    mem_clean(buf, sizeof(buf));
+    mem_clean(buf, 64);
 }
 
-void BRSHA512(void *md64, const void *data, size_t dataLen)
+void BRSHA384(void *md48, const void *data, size_t dataLen)
 {
-    size_t i;
-    uint64_t x[16], buf[] = { 0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
-                              0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b, 0x5be0cd19137e2179 };
+    uint64_t buf[] = { 0xcbbb9d5dc1059ed8, 0x629a292a367cd507, 0x9159015a3070dd17, 0x152fecd8f70e5939,
+                       0x67332667ffc00b31, 0x8eb44a8768581511, 0xdb0c2e0d64f98fa7, 0x47b5481dbefa4fa4 };
     
-    assert(md64 != NULL);
+    assert(md48 != NULL);
     assert(data != NULL || dataLen == 0);
+    _BRSHA512Final(buf, md48, 48, data, dataLen, 0);
+}
 
-    for (i = 0; i < dataLen; i += 128) { // process data in 128 byte blocks
-        memcpy(x, (const uint8_t *)data + i, (i + 128 < dataLen) ? 128 : dataLen - i);
-        if (i + 128 > dataLen) break;
-        _BRSHA512Compress(buf, x);
-    }
+static const uint64_t _iv512[] = { 0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+                                   0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b,
+                                   0x5be0cd19137e2179 }; // sha512 initial buffer values
+
+void BRSHA512(void *md64, const void *data, size_t dataLen)
+{
+    uint64_t buf[8];
     
-    memset((uint8_t *)x + (dataLen - i), 0, 128 - (dataLen - i)); // clear remainder of x
-    ((uint8_t *)x)[dataLen - i] = 0x80; // append padding
-    if (dataLen - i >= 112) _BRSHA512Compress(buf, x), memset(x, 0, 128); // length goes to next block
-    x[14] = 0, x[15] = be64((uint64_t)dataLen*8); // append length in bits
-    _BRSHA512Compress(buf, x); // finalize
-    for (i = 0; i < 8; i++) buf[i] = be64(buf[i]); // endian swap
-    memcpy(md64, buf, 64); // write to md
-    mem_clean(x, sizeof(x));
-    mem_clean(buf, sizeof(buf));
+    assert(md64 != NULL);
+    assert(data != NULL || dataLen == 0);
+    memcpy(buf, _iv512, sizeof(buf)); // initial buffer values
+    _BRSHA512Final(buf, md64, 64, data, dataLen, 0);
 }
 
 // basic ripemd functions
@@ -658,6 +875,67 @@ void BRHMAC(void *mac, void (*hash)(void *, const void *, size_t), size_t hashLe
     mem_clean(kopad, blockLen);
 }
 
+// precomputes the hash states after the key xor ipad and key xor opad blocks, hash must be BRSHA256 or BRSHA512
+void BRHMACCtxInit(BRHMACCtx *ctx, void (*hash)(void *, const void *, size_t), const void *key, size_t keyLen)
+{
+    size_t i, blockLen = (hash == BRSHA512) ? 128 : 64;
+    uint64_t k[128/sizeof(uint64_t)], x[16];
+    
+    assert(ctx != NULL);
+    assert(hash == BRSHA256 || hash == BRSHA512);
+    assert(key != NULL || keyLen == 0);
+    
+    ctx->hash = hash;
+    memset(k, 0, sizeof(k));
+    if (keyLen > blockLen) hash(k, key, keyLen);
+    else memcpy(k, key, keyLen);
+    
+    for (i = 0; i < blockLen/sizeof(uint64_t); i++) x[i] = k[i] ^ 0x3636363636363636;
+    if (hash == BRSHA512) memcpy(ctx->inner, _iv512, sizeof(_iv512)), _BRSHA512Compress(ctx->inner, x);
+    else memcpy(ctx->inner, _iv256, sizeof(_iv256)), _BRSHA256Blocks((uint32_t *)ctx->inner, (uint8_t *)x, 1);
+    
+    for (i = 0; i < blockLen/sizeof(uint64_t); i++) x[i] = k[i] ^ 0x5c5c5c5c5c5c5c5c;
+    if (hash == BRSHA512) memcpy(ctx->outer, _iv512, sizeof(_iv512)), _BRSHA512Compress(ctx->outer, x);
+    else memcpy(ctx->outer, _iv256, sizeof(_iv256)), _BRSHA256Blocks((uint32_t *)ctx->outer, (uint8_t *)x, 1);
+    
+    mem_clean(k, sizeof(k));
+    mem_clean(x, sizeof(x));
+}
+
+// writes HMAC(key, data) to mac, using the key schedule in ctx
+void BRHMACCtxMac(const BRHMACCtx *ctx, void *mac, const void *data, size_t dataLen)
+{
+    uint64_t buf[8], t[8];
+    
+    assert(ctx != NULL);
+    assert(mac != NULL);
+    assert(data != NULL || dataLen == 0);
+    
+    if (ctx->hash == BRSHA512) {
+        memcpy(buf, ctx->inner, sizeof(buf));
+        _BRSHA512Final(buf, t, 64, data, dataLen, 128); // hash((key xor ipad) || data)
+        memcpy(buf, ctx->outer, sizeof(buf));
+        _BRSHA512Final(buf, mac, 64, (uint8_t *)t, 64, 128); // hash((key xor opad) || hash((key xor ipad) || data))
+    }
+    else {
+        memcpy(buf, ctx->inner, 32);
+        if (dataLen >= 64) _BRSHA256Blocks((uint32_t *)buf, data, dataLen/64);
+        _BRSHA256Final((uint32_t *)buf, t, 32, data, dataLen, 64);
+        memcpy(buf, ctx->outer, 32);
+        _BRSHA256Final((uint32_t *)buf, mac, 32, (uint8_t *)t, 32, 64);
+    }
+    
+    mem_clean(t, sizeof(t));
+    mem_clean(buf, sizeof(buf));
+}
+
+// wipes the key schedule in ctx
+void BRHMACCtxClean(BRHMACCtx *ctx)
+{
+    assert(ctx != NULL);
+    mem_clean(ctx, sizeof(*ctx));
+}
+
 // hmac-drbg with no prediction resistance or additional input
 // K and V must point to buffers of size hashLen, and ps (personalization string) may be NULL
 // to generate additional drbg output, use K and V from the previous call, and set seed, nonce and ps to NULL
@@ -1077,6 +1355,8 @@ void BRPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
 {
     uint8_t s[saltLen + sizeof(uint32_t)];
     uint32_t i, j, U[hashLen/sizeof(uint32_t)], T[hashLen/sizeof(uint32_t)];
+    BRHMACCtx ctx;
+    int useCtx = ((hash == BRSHA256 && hashLen == 32) || (hash == BRSHA512 && hashLen == 64));
     
     assert(dk != NULL || dkLen == 0);
     assert(hash != NULL);
@@ -1086,15 +1366,21 @@ void BRPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
     assert(rounds > 0);
     
     memcpy(s, salt, saltLen);
+    if (useCtx) BRHMACCtxInit(&ctx, hash, pw, pwLen); // pad and hash pw once for every round
     
     for (i = 0; i < (dkLen + hashLen - 1)/hashLen; i++) {
         j = be32(i + 1);
         memcpy(s + saltLen, &j, sizeof(j));
-        BRHMAC(U, hash, hashLen, pw, pwLen, s, sizeof(s)); // U1 = hmac_hash(pw, salt || be32(i))
+        
+        // U1 = hmac_hash(pw, salt || be32(i))
+        if (useCtx) BRHMACCtxMac(&ctx, U, s, sizeof(s));
+        else BRHMAC(U, hash, hashLen, pw, pwLen, s, sizeof(s));
         memcpy(T, U, sizeof(U));
         
         for (unsigned r = 1; r < rounds; r++) {
-            BRHMAC(U, hash, hashLen, pw, pwLen, U, sizeof(U)); // Urounds = hmac_hash(pw, Urounds-1)
+            // Urounds = hmac_hash(pw, Urounds-1)
+            if (useCtx) BRHMACCtxMac(&ctx, U, U, sizeof(U));
+            else BRHMAC(U, hash, hashLen, pw, pwLen, U, sizeof(U));
             for (j = 0; j < hashLen/sizeof(uint32_t); j++) T[j] ^= U[j]; // Ti = U1 ^ U2 ^ ... ^ Urounds
         }
         
@@ -1102,6 +1388,7 @@ void BRPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
         memcpy((uint8_t *)dk + i*hashLen, T, (i*hashLen + hashLen <= dkLen) ? hashLen : dkLen % hashLen);
     }
     
+    if (useCtx) BRHMACCtxClean(&ctx);
     mem_clean(s, sizeof(s));
     mem_clean(U, sizeof(U));
     mem_clean(T, sizeof(T));
@@ -1145,21 +1432,181 @@ static void _blockmix_salsa8(uint64_t *dest, const uint64_t *src, uint64_t *b, u
     }
 }
 
-// scrypt key derivation: http://www.tarsnap.com/scrypt.html
-void BRScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
-              unsigned n, unsigned r, unsigned p)
+#define SCRYPT_POW_N 1024 // scrypt parameters used for proof-of-work: n = 1024, r = 1, p = 1
+
+// pbkdf2 expansion of an 80 byte header into the 128 byte scrypt block, as 32 host endian words
+static void _BRScryptPoWExpand(uint32_t x[32], const uint8_t *header80)
 {
-    uint64_t x[16*r], y[16*r], z[8], *v = malloc(128*r*n), m;
-    uint32_t b[32*r*p];
+    uint32_t b[32];
+    
+    BRPBKDF2(b, sizeof(b), BRSHA256, 256/8, header80, 80, header80, 80, 1);
+    for (unsigned k = 0; k < 32; k++) x[k] = le32(b[k]);
+}
+
+// pbkdf2 compression of the mixed scrypt block back into a 32 byte proof-of-work hash
+static void _BRScryptPoWCompress(void *md32, const uint8_t *header80, const uint32_t x[32])
+{
+    uint32_t b[32];
+    
+    for (unsigned k = 0; k < 32; k++) b[k] = le32(x[k]);
+    BRPBKDF2(md32, 32, BRSHA256, 256/8, header80, 80, b, sizeof(b), 1);
+}
+
+// scrypt romix with n = SCRYPT_POW_N and r = 1 for a single lane, v must hold 128*SCRYPT_POW_N bytes
+static void _BRScryptPoWMix(uint64_t x[16], uint64_t *v)
+{
+    uint64_t y[16], z[8], m;
+    
+    for (unsigned j = 0; j < SCRYPT_POW_N; j += 2) {
+        memcpy(&v[j*16], x, 128);
+        _blockmix_salsa8(y, x, z, 1);
+        memcpy(&v[(j + 1)*16], y, 128);
+        _blockmix_salsa8(x, y, z, 1);
+    }
+    
+    for (unsigned j = 0; j < SCRYPT_POW_N; j += 2) {
+        m = le64(x[8]) & (SCRYPT_POW_N - 1);
+        for (unsigned k = 0; k < 16; k++) x[k] ^= v[m*16 + k];
+        _blockmix_salsa8(y, x, z, 1);
+        m = le64(y[8]) & (SCRYPT_POW_N - 1);
+        for (unsigned k = 0; k < 16; k++) y[k] ^= v[m*16 + k];
+        _blockmix_salsa8(x, y, z, 1);
+    }
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && ! defined(BR_SCRYPT_NO_SIMD)
+#define SCRYPT_POW_SIMD 1
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCRYPT_POW_AVX2 __attribute__((target("avx2")))
+#else
+#define SCRYPT_POW_AVX2
+#endif
+
+// vectors holding the same 32bit word from 4 or 8 independent scrypt instances, one instance per lane
+typedef uint32_t _scrypt_x4 __attribute__((vector_size(16)));
+typedef uint32_t _scrypt_x8 __attribute__((vector_size(32)));
+
+// defines salsa20/8, blockmix and romix over vectors of the given lane count, the word layout of the single lane
+// code is kept so v[i*32 + k] is word k of scratchpad entry i for all lanes, and x[k][l] is word k of lane l
+#define _scrypt_pow_lanes(lanes, attr)\
+attr static void _salsa20_8_x##lanes(_scrypt_x##lanes b[16])\
+{\
+    _scrypt_x##lanes x0 = b[0], x1 = b[1], x2 = b[2],  x3 = b[3],  x4 = b[4],  x5 = b[5],  x6 = b[6],  x7 = b[7],\
+                     x8 = b[8], x9 = b[9], xa = b[10], xb = b[11], xc = b[12], xd = b[13], xe = b[14], xf = b[15];\
+    \
+    for (unsigned i = 0; i < 8; i += 2) {\
+        x4 ^= rol32(x0 + xc, 7), x8 ^= rol32(x4 + x0, 9), xc ^= rol32(x8 + x4, 13), x0 ^= rol32(xc + x8, 18);\
+        x9 ^= rol32(x5 + x1, 7), xd ^= rol32(x9 + x5, 9), x1 ^= rol32(xd + x9, 13), x5 ^= rol32(x1 + xd, 18);\
+        xe ^= rol32(xa + x6, 7), x2 ^= rol32(xe + xa, 9), x6 ^= rol32(x2 + xe, 13), xa ^= rol32(x6 + x2, 18);\
+        x3 ^= rol32(xf + xb, 7), x7 ^= rol32(x3 + xf, 9), xb ^= rol32(x7 + x3, 13), xf ^= rol32(xb + x7, 18);\
+        x1 ^= rol32(x0 + x3, 7), x2 ^= rol32(x1 + x0, 9), x3 ^= rol32(x2 + x1, 13), x0 ^= rol32(x3 + x2, 18);\
+        x6 ^= rol32(x5 + x4, 7), x7 ^= rol32(x6 + x5, 9), x4 ^= rol32(x7 + x6, 13), x5 ^= rol32(x4 + x7, 18);\
+        xb ^= rol32(xa + x9, 7), x8 ^= rol32(xb + xa, 9), x9 ^= rol32(x8 + xb, 13), xa ^= rol32(x9 + x8, 18);\
+        xc ^= rol32(xf + xe, 7), xd ^= rol32(xc + xf, 9), xe ^= rol32(xd + xc, 13), xf ^= rol32(xe + xd, 18);\
+    }\
+    \
+    b[0] += x0, b[1] += x1, b[2] += x2,  b[3] += x3,  b[4] += x4,  b[5] += x5,  b[6] += x6,  b[7] += x7;\
+    b[8] += x8, b[9] += x9, b[10] += xa, b[11] += xb, b[12] += xc, b[13] += xd, b[14] += xe, b[15] += xf;\
+}\
+\
+attr static void _blockmix_salsa8_x##lanes(_scrypt_x##lanes x[32])\
+{\
+    for (unsigned k = 0; k < 16; k++) x[k] ^= x[16 + k];\
+    _salsa20_8_x##lanes(&x[0]);\
+    for (unsigned k = 0; k < 16; k++) x[16 + k] ^= x[k];\
+    _salsa20_8_x##lanes(&x[16]);\
+}\
+\
+attr static void _BRScryptPoWMix_x##lanes(uint32_t xl[lanes][32], _scrypt_x##lanes *v)\
+{\
+    _scrypt_x##lanes x[32], t[32];\
+    const uint32_t *w;\
+    \
+    for (unsigned k = 0; k < 32; k++) {\
+        for (unsigned l = 0; l < lanes; l++) x[k][l] = xl[l][k];\
+    }\
+    \
+    for (unsigned j = 0; j < SCRYPT_POW_N; j++) {\
+        memcpy(&v[j*32], x, sizeof(x));\
+        _blockmix_salsa8_x##lanes(x);\
+    }\
+    \
+    for (unsigned j = 0; j < SCRYPT_POW_N; j++) {\
+        for (unsigned l = 0; l < lanes; l++) {\
+            w = (const uint32_t *)&v[(x[16][l] & (SCRYPT_POW_N - 1))*32] + l;\
+            for (unsigned k = 0; k < 32; k++) ((uint32_t *)&t[k])[l] = w[k*lanes];\
+        }\
+        \
+        for (unsigned k = 0; k < 32; k++) x[k] ^= t[k];\
+        \
+        _blockmix_salsa8_x##lanes(x);\
+    }\
+    \
+    for (unsigned k = 0; k < 32; k++) {\
+        for (unsigned l = 0; l < lanes; l++) xl[l][k] = x[k][l];\
+    }\
+}
+
+_scrypt_pow_lanes(4, )
+_scrypt_pow_lanes(8, SCRYPT_POW_AVX2)
+
+// number of simd lanes to use for proof-of-work hashing on the current cpu
+static unsigned _BRScryptPoWLanes(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return (__builtin_cpu_supports("avx2")) ? 8 : 4;
+#else
+    return 4;
+#endif
+}
+
+#endif // SCRYPT_POW_SIMD
+
+struct BRScryptCtxStruct {
+    unsigned n, r;
+    int publicData;
+    size_t vLen;
+    void *v; // 64 byte aligned scratchpad, reused for every hash computed with the context
+};
+
+// returns a newly allocated scrypt context with a scratchpad for parameters n and r that is reused across calls, if
+// publicData is true the scratchpad and intermediate state are not wiped after each use, which is only safe when
+// the inputs are public, such as block headers, result must be freed by calling BRScryptCtxFree()
+BRScryptCtx *BRScryptCtxNew(unsigned n, unsigned r, int publicData)
+{
+    BRScryptCtx *ctx = calloc(1, sizeof(*ctx));
+    
+    assert(ctx != NULL);
+    assert(n > 0);
+    assert(r > 0);
     
-    assert(v != NULL);
+    ctx->n = n;
+    ctx->r = r;
+    ctx->publicData = publicData;
+    ctx->vLen = 128*r*n;
+#if SCRYPT_POW_SIMD
+    if (n == SCRYPT_POW_N && r == 1) ctx->vLen *= _BRScryptPoWLanes(); // room for every simd lane
+#endif
+    if (posix_memalign(&ctx->v, 64, ctx->vLen) != 0) ctx->v = NULL;
+    assert(ctx->v != NULL);
+    return ctx;
+}
+
+// scrypt key derivation using ctx scratchpad: http://www.tarsnap.com/scrypt.html
+void BRScryptCtxDerive(BRScryptCtx *ctx, void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt,
+                       size_t saltLen, unsigned p)
+{
+    assert(ctx != NULL);
     assert(dk != NULL || dkLen == 0);
     assert(pw != NULL || pwLen == 0);
     assert(salt != NULL || saltLen == 0);
-    assert(n > 0);
-    assert(r > 0);
     assert(p > 0);
     
+    unsigned n = ctx->n, r = ctx->r;
+    uint64_t x[16*r], y[16*r], z[8], *v = ctx->v, m;
+    uint32_t b[32*r*p];
+    
     BRPBKDF2(b, sizeof(b), BRSHA256, 256/8, pw, pwLen, salt, saltLen, 1);
     
     for (int i = 0; i < p; i++) {
@@ -1185,10 +1632,114 @@ void BRScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *
     }
     
     BRPBKDF2(dk, dkLen, BRSHA256, 256/8, pw, pwLen, b, sizeof(b), 1);
-    mem_clean(b, sizeof(b));
-    mem_clean(x, sizeof(x));
-    mem_clean(y, sizeof(y));
-    mem_clean(z, sizeof(z));
-    mem_clean(v, 128*r*n);
-    free(v);
+    
+    if (! ctx->publicData) {
+        mem_clean(b, sizeof(b));
+        mem_clean(x, sizeof(x));
+        mem_clean(y, sizeof(y));
+        mem_clean(z, sizeof(z));
+        mem_clean(v, 128*r*n);
+    }
+}
+
+// scrypt proof-of-work hash of count serialized 80 byte headers using ctx scratchpad, ctx must have n = 1024, r = 1
+void BRScryptCtxPoW(BRScryptCtx *ctx, void *md32, const void *headers80, size_t count)
+{
+    const uint8_t *h = headers80;
+    size_t i = 0;
+    
+    assert(ctx != NULL);
+    assert(ctx->n == SCRYPT_POW_N && ctx->r == 1);
+    assert(md32 != NULL || count == 0);
+    assert(headers80 != NULL || count == 0);
+    
+#if SCRYPT_POW_SIMD
+    unsigned lanes = _BRScryptPoWLanes();
+    
+    if (count > 1) { // hash headers in groups of lanes, padding the last group with copies of the final header
+        uint32_t x[8][32];
+        
+        for (; i < count; i += lanes) {
+            for (unsigned l = 0; l < lanes; l++) {
+                _BRScryptPoWExpand(x[l], &h[((i + l < count) ? i + l : count - 1)*80]);
+            }
+            
+            if (lanes == 8) _BRScryptPoWMix_x8(x, ctx->v);
+            else _BRScryptPoWMix_x4(x, ctx->v);
+            
+            for (unsigned l = 0; l < lanes && i + l < count; l++) {
+                _BRScryptPoWCompress((uint8_t *)md32 + (i + l)*32, &h[(i + l)*80], x[l]);
+            }
+        }
+        
+        if (! ctx->publicData) mem_clean(x, sizeof(x));
+    }
+#endif
+
+    if (i < count) { // single lane
+        uint64_t x[16];
+        
+        for (; i < count; i++) {
+            _BRScryptPoWExpand((uint32_t *)x, &h[i*80]);
+            _BRScryptPoWMix(x, ctx->v);
+            _BRScryptPoWCompress((uint8_t *)md32 + i*32, &h[i*80], (uint32_t *)x);
+        }
+        
+        if (! ctx->publicData) mem_clean(x, sizeof(x));
+    }
+    
+    if (! ctx->publicData && count > 0) mem_clean(ctx->v, ctx->vLen);
+}
+
+// frees memory allocated by BRScryptCtxNew()
+void BRScryptCtxFree(BRScryptCtx *ctx)
+{
+    assert(ctx != NULL);
+    free(ctx->v); // already wiped after each use unless the context is for public data
+    free(ctx);
+}
+
+static pthread_key_t _scryptPoWKey;
+static pthread_once_t _scryptPoWOnce = PTHREAD_ONCE_INIT;
+
+static void _BRScryptPoWCtxFree(void *ctx)
+{
+    BRScryptCtxFree(ctx);
+}
+
+static void _BRScryptPoWKeyInit(void)
+{
+    pthread_key_create(&_scryptPoWKey, _BRScryptPoWCtxFree);
+}
+
+// returns the calling thread's public data proof-of-work context, created on first use and freed on thread exit
+BRScryptCtx *BRScryptPoWThreadCtx(void)
+{
+    BRScryptCtx *ctx;
+    
+    pthread_once(&_scryptPoWOnce, _BRScryptPoWKeyInit);
+    ctx = pthread_getspecific(_scryptPoWKey);
+    
+    if (! ctx) {
+        ctx = BRScryptCtxNew(SCRYPT_POW_N, 1, 1);
+        pthread_setspecific(_scryptPoWKey, ctx);
+    }
+    
+    return ctx;
+}
+
+// scrypt key derivation: http://www.tarsnap.com/scrypt.html
+void BRScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
+              unsigned n, unsigned r, unsigned p)
+{
+    BRScryptCtx *ctx = BRScryptCtxNew(n, r, 0);
+    
+    BRScryptCtxDerive(ctx, dk, dkLen, pw, pwLen, salt, saltLen, p);
+    BRScryptCtxFree(ctx);
+}
+
+// scrypt proof-of-work hash = scrypt(header, header, n = 1024, r = 1, p = 1) of count serialized 80 byte headers
+void BRScryptPoW(void *md32, const void *headers80, size_t count)
+{
+    BRScryptCtxPoW(BRScryptPoWThreadCtx(), md32, headers80, count);
 }
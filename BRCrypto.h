@@ -44,6 +44,11 @@ void BRSHA224(void *md28, const void *data, size_t dataLen);
 // double-sha-256 = sha-256(sha-256(x))
 void BRSHA256_2(void *md32, const void *data, size_t dataLen);
 
+// double-sha-256 of count independent messages of dataLen bytes each, stored back to back in data, writing count
+// 32 byte digests to md32, messages are hashed in parallel simd lanes when that is faster than one at a time
+// NOTE: intended for public data such as txids, merkle nodes and block headers, intermediate state is not wiped
+void BRSHA256_2_Multi(void *md32, const void *data, size_t dataLen, size_t count);
+
 void BRSHA384(void *md48, const void *data, size_t dataLen);
 
 void BRSHA512(void *md64, const void *data, size_t dataLen);
@@ -72,6 +77,22 @@ uint64_t BRSip64(const void *key16, const void *data, size_t dataLen);
 void BRHMAC(void *mac, void (*hash)(void *, const void *, size_t), size_t hashLen, const void *key, size_t keyLen,
             const void *data, size_t dataLen);
 
+// HMAC key schedule, the hash states after the key xor ipad and key xor opad blocks, for computing many hmacs with the
+// same key at half the compression function calls of BRHMAC()
+typedef struct {
+    void (*hash)(void *, const void *, size_t);
+    uint64_t inner[8], outer[8];
+} BRHMACCtx;
+
+// initializes ctx for hmacs with key, hash must be BRSHA256 or BRSHA512
+void BRHMACCtxInit(BRHMACCtx *ctx, void (*hash)(void *, const void *, size_t), const void *key, size_t keyLen);
+
+// writes HMAC(key, data) to mac, using the key schedule in ctx
+void BRHMACCtxMac(const BRHMACCtx *ctx, void *mac, const void *data, size_t dataLen);
+
+// wipes the key schedule in ctx
+void BRHMACCtxClean(BRHMACCtx *ctx);
+
 // hmac-drbg with no prediction resistance or additional input
 // K and V must point to buffers of size hashLen, and ps (personalization string) may be NULL
 // to generate additional drbg output, use K and V from the previous call, and set seed, nonce and ps to NULL
@@ -107,6 +128,32 @@ void BRPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
 void BRScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
               unsigned n, unsigned r, unsigned p);
 
+// scrypt proof-of-work hash = scrypt(header, header, n = 1024, r = 1, p = 1) of count serialized 80 byte headers
+// md32 must have room for count*32 bytes, headers80 must hold count*80 bytes, and multiple headers are hashed in
+// parallel simd lanes when supported by the cpu
+void BRScryptPoW(void *md32, const void *headers80, size_t count);
+
+typedef struct BRScryptCtxStruct BRScryptCtx;
+
+// returns a newly allocated scrypt context with a scratchpad for parameters n and r that is reused across calls, if
+// publicData is true the scratchpad and intermediate state are not wiped after each use, which is only safe when
+// the inputs are public, such as block headers, result must be freed by calling BRScryptCtxFree()
+BRScryptCtx *BRScryptCtxNew(unsigned n, unsigned r, int publicData);
+
+// scrypt key derivation using ctx scratchpad, no memory is allocated
+void BRScryptCtxDerive(BRScryptCtx *ctx, void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt,
+                       size_t saltLen, unsigned p);
+
+// same as BRScryptPoW() using ctx scratchpad, no memory is allocated, ctx must have n = 1024, r = 1
+void BRScryptCtxPoW(BRScryptCtx *ctx, void *md32, const void *headers80, size_t count);
+
+// frees memory allocated by BRScryptCtxNew()
+void BRScryptCtxFree(BRScryptCtx *ctx);
+
+// returns the calling thread's public data proof-of-work context, created on first use and freed on thread exit
+// BRScryptPoW() uses this context, so only the first call on each thread allocates a scratchpad
+BRScryptCtx *BRScryptPoWThreadCtx(void);
+
 // zeros out memory in a way that can't be optimized out by the compiler
 inline static void mem_clean(void *ptr, size_t len)
 {
@@ -0,0 +1,186 @@
+//
+//  BRGCSFilter.c
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRGCSFilter.h"
+#include "BRCrypto.h"
+#include "BRAddress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// returns the high 64 bits of the 128 bit product a*b
+inline static uint64_t _BRMulHi64(uint64_t a, uint64_t b)
+{
+    uint64_t aLo = (uint32_t)a, aHi = a >> 32, bLo = (uint32_t)b, bHi = b >> 32,
+             loLo = aLo*bLo, hiLo = aHi*bLo, loHi = aLo*bHi, hiHi = aHi*bHi,
+             cross = (loLo >> 32) + (uint32_t)hiLo + loHi;
+
+    return hiHi + (hiLo >> 32) + (cross >> 32);
+}
+
+// hashes an item to a value uniformly distributed over [0, f), keyed with the first 16 bytes of blockHash
+inline static uint64_t _BRGCSHash(UInt256 blockHash, const uint8_t *item, size_t itemLen, uint64_t f)
+{
+    return _BRMulHi64(BRSip64(blockHash.u8, item, itemLen), f);
+}
+
+static int _BRGCSValueCompare(const void *v1, const void *v2)
+{
+    uint64_t a = *(const uint64_t *)v1, b = *(const uint64_t *)v2;
+
+    return (a > b) - (a < b);
+}
+
+// returns a newly allocated, sorted array of item hashes that must be freed by calling free()
+static uint64_t *_BRGCSHashItems(UInt256 blockHash, const uint8_t *items[], const size_t itemLens[], size_t itemCount,
+                                 uint64_t f)
+{
+    uint64_t *values = malloc(itemCount*sizeof(*values));
+    size_t i;
+
+    assert(values != NULL);
+    for (i = 0; i < itemCount; i++) values[i] = _BRGCSHash(blockHash, items[i], itemLens[i], f);
+    qsort(values, itemCount, sizeof(*values), _BRGCSValueCompare);
+    return values;
+}
+
+// writes the low bitCount bits of value to buf at bit offset *bit, most significant bit first
+inline static void _BRGCSWriteBits(uint8_t *buf, size_t *bit, uint64_t value, int bitCount)
+{
+    while (bitCount-- > 0) {
+        if ((value >> bitCount) & 1) buf[*bit/8] |= 0x80 >> (*bit % 8);
+        (*bit)++;
+    }
+}
+
+// reads a golomb-rice coded delta from buf at bit offset *bit, returns false if buf ends first
+inline static int _BRGCSReadDelta(const uint8_t *buf, size_t bitLen, size_t *bit, uint64_t *delta)
+{
+    uint64_t q = 0, r = 0;
+    int i;
+
+    while (*bit < bitLen && (buf[*bit/8] & (0x80 >> (*bit % 8)))) q++, (*bit)++;
+    if (*bit + 1 + GCS_BASIC_P > bitLen) return 0;
+    (*bit)++; // skip the unary terminator
+
+    for (i = 0; i < GCS_BASIC_P; i++, (*bit)++) {
+        r = (r << 1) | ((buf[*bit/8] >> (7 - *bit % 8)) & 1);
+    }
+
+    *delta = (q << GCS_BASIC_P) | r;
+    return 1;
+}
+
+// writes the serialized basic filter for the given items, which must be distinct, to buf, keyed with blockHash
+// returns number of bytes written, or total bufLen needed if buf is NULL
+size_t BRGCSFilterBuild(uint8_t *buf, size_t bufLen, UInt256 blockHash, const uint8_t *items[],
+                        const size_t itemLens[], size_t itemCount)
+{
+    uint64_t *values, last = 0, q;
+    size_t i, off = BRVarIntSize(itemCount), bit = 0, bitLen = 0, len;
+
+    assert(items != NULL || itemCount == 0);
+    assert(itemLens != NULL || itemCount == 0);
+    values = _BRGCSHashItems(blockHash, items, itemLens, itemCount, (uint64_t)itemCount*GCS_BASIC_M);
+
+    for (i = 0; i < itemCount; i++) {
+        bitLen += ((values[i] - last) >> GCS_BASIC_P) + 1 + GCS_BASIC_P;
+        last = values[i];
+    }
+
+    len = off + (bitLen + 7)/8;
+
+    if (buf && len <= bufLen) {
+        BRVarIntSet(buf, off, itemCount);
+        memset(&buf[off], 0, len - off);
+
+        for (i = 0, last = 0; i < itemCount; i++) {
+            q = (values[i] - last) >> GCS_BASIC_P;
+            while (q-- > 0) _BRGCSWriteBits(&buf[off], &bit, 1, 1); // quotient in unary
+            _BRGCSWriteBits(&buf[off], &bit, 0, 1);
+            _BRGCSWriteBits(&buf[off], &bit, values[i] - last, GCS_BASIC_P); // remainder
+            last = values[i];
+        }
+    }
+
+    free(values);
+    return (! buf || len <= bufLen) ? len : 0;
+}
+
+// returns the number of items in a serialized basic filter, or 0 if filter is malformed
+size_t BRGCSFilterCount(const uint8_t *filter, size_t filterLen)
+{
+    size_t off = 0;
+    uint64_t n = BRVarInt(filter, filterLen, &off);
+
+    return (off <= filterLen && n <= (filterLen - off)*8/(1 + GCS_BASIC_P)) ? (size_t)n : 0;
+}
+
+// true if any of items may be in the serialized basic filter for the block with blockHash
+// items are hashed and sorted once, then walked together with the decoded filter, so matching a wallet's worth of
+// scripts costs about the same as decoding the filter instead of one full decode per item
+int BRGCSFilterMatchAny(const uint8_t *filter, size_t filterLen, UInt256 blockHash, const uint8_t *items[],
+                        const size_t itemLens[], size_t itemCount)
+{
+    size_t i = 0, j, n = BRGCSFilterCount(filter, filterLen), off = 0, bit = 0, bitLen;
+    uint64_t *values, value = 0, delta;
+    int r = 0;
+
+    assert(items != NULL || itemCount == 0);
+    assert(itemLens != NULL || itemCount == 0);
+    if (n == 0 || itemCount == 0) return 0;
+    BRVarInt(filter, filterLen, &off); // the bitstream starts after the count as sent, even if not minimally encoded
+    values = _BRGCSHashItems(blockHash, items, itemLens, itemCount, (uint64_t)n*GCS_BASIC_M);
+    bitLen = (filterLen - off)*8;
+
+    for (j = 0; ! r && j < n && i < itemCount && _BRGCSReadDelta(&filter[off], bitLen, &bit, &delta); j++) {
+        value += delta;
+        while (i < itemCount && values[i] < value) i++;
+        if (i < itemCount && values[i] == value) r = 1;
+    }
+
+    free(values);
+    return r;
+}
+
+// returns the hash of a serialized filter, as committed to in filter headers and cfheaders messages
+UInt256 BRGCSFilterHash(const uint8_t *filter, size_t filterLen)
+{
+    UInt256 hash;
+
+    assert(filter != NULL || filterLen == 0);
+    BRSHA256_2(&hash, filter, filterLen);
+    return hash;
+}
+
+// returns the filter header that chains filterHash onto prevHeader
+UInt256 BRGCSFilterHeader(UInt256 filterHash, UInt256 prevHeader)
+{
+    uint8_t buf[sizeof(UInt256)*2];
+    UInt256 header;
+
+    UInt256Set(buf, filterHash);
+    UInt256Set(&buf[sizeof(UInt256)], prevHeader);
+    BRSHA256_2(&header, buf, sizeof(buf));
+    return header;
+}
@@ -0,0 +1,65 @@
+//
+//  BRGCSFilter.h
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRGCSFilter_h
+#define BRGCSFilter_h
+
+#include "BRInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// golomb-coded set filters are explained in BIP158: https://github.com/bitcoin/bips/blob/master/bip-0158.mediawiki
+
+#define GCS_FILTER_TYPE_BASIC 0x00
+#define GCS_BASIC_P           19 // golomb-rice parameter of the basic filter
+#define GCS_BASIC_M           784931 // inverse false positive rate of the basic filter
+
+// writes the serialized basic filter for the given items, which must be distinct, to buf, keyed with blockHash
+// returns number of bytes written, or total bufLen needed if buf is NULL
+size_t BRGCSFilterBuild(uint8_t *buf, size_t bufLen, UInt256 blockHash, const uint8_t *items[],
+                        const size_t itemLens[], size_t itemCount);
+
+// returns the number of items in a serialized basic filter, or 0 if filter is malformed
+size_t BRGCSFilterCount(const uint8_t *filter, size_t filterLen);
+
+// true if any of items may be in the serialized basic filter for the block with blockHash
+// items are hashed and sorted once, then walked together with the decoded filter, so matching a wallet's worth of
+// scripts costs about the same as decoding the filter instead of one full decode per item
+int BRGCSFilterMatchAny(const uint8_t *filter, size_t filterLen, UInt256 blockHash, const uint8_t *items[],
+                        const size_t itemLens[], size_t itemCount);
+
+// returns the hash of a serialized filter, as committed to in filter headers and cfheaders messages
+UInt256 BRGCSFilterHash(const uint8_t *filter, size_t filterLen);
+
+// returns the filter header that chains filterHash onto prevHeader
+UInt256 BRGCSFilterHeader(UInt256 filterHash, UInt256 prevHeader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRGCSFilter_h
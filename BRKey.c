@@ -26,6 +26,7 @@
 #include "BRAddress.h"
 #include "BRBase58.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
@@ -103,6 +104,59 @@ int BRSecp256k1PointAdd(BRECPoint *p, const UInt256 *i)
             secp256k1_ec_pubkey_serialize(_ctx, (unsigned char *)p, &pLen, &pubkey, SECP256K1_EC_COMPRESSED));
 }
 
+// multiplies secp256k1 generator by each 256bit big endian int in tweaks, adds the result to ec-point p and stores it
+// in points, parsing p only once and sharing a single field inversion across all of points
+// returns the number of points stored, stopping at the first tweak that is out of range or gives the point at infinity
+size_t BRSecp256k1PointAddList(BRECPoint points[], const BRECPoint *p, const UInt256 tweaks[], size_t count)
+{
+    secp256k1_ge ge;
+    secp256k1_gej *gej, sum;
+    secp256k1_fe *zinv, u;
+    secp256k1_scalar s;
+    size_t i, n, len;
+    int overflow = 0;
+    
+    assert(points != NULL || count == 0);
+    assert(p != NULL);
+    assert(tweaks != NULL || count == 0);
+    pthread_once(&_ctx_once, _ctx_init);
+    if (count == 0 || ! secp256k1_eckey_pubkey_parse(&ge, p->p, sizeof(p->p))) return 0;
+    gej = malloc(count*sizeof(*gej));
+    zinv = malloc(count*sizeof(*zinv));
+    assert(gej != NULL && zinv != NULL);
+    
+    for (n = 0; n < count; n++) { // P + tweak*G, kept in jacobian coordinates
+        secp256k1_scalar_set_b32(&s, tweaks[n].u8, &overflow);
+        if (overflow) break;
+        secp256k1_ecmult_gen(&_ctx->ecmult_gen_ctx, &sum, &s);
+        secp256k1_gej_add_ge_var(&gej[n], &sum, &ge, NULL);
+        if (secp256k1_gej_is_infinity(&gej[n])) break;
+    }
+    
+    if (n > 0) { // invert all z coordinates at once: zinv[i] = z[0]*...*z[i], then walk back from the inverted product
+        zinv[0] = gej[0].z;
+        for (i = 1; i < n; i++) secp256k1_fe_mul(&zinv[i], &zinv[i - 1], &gej[i].z);
+        secp256k1_fe_inv_var(&u, &zinv[n - 1]);
+        
+        for (i = n - 1; i > 0; i--) {
+            secp256k1_fe_mul(&zinv[i], &zinv[i - 1], &u); // 1/z[i]
+            secp256k1_fe_mul(&u, &u, &gej[i].z); // 1/(z[0]*...*z[i - 1])
+        }
+        
+        zinv[0] = u;
+    }
+    
+    for (i = 0; i < n; i++) {
+        secp256k1_ge_set_gej_zinv(&ge, &gej[i], &zinv[i]);
+        len = sizeof(points[i].p);
+        secp256k1_eckey_pubkey_serialize(&ge, points[i].p, &len, 1);
+    }
+    
+    free(zinv);
+    free(gej);
+    return n;
+}
+
 // multiplies secp256k1 ec-point p by 256bit big endian int i and stores the result in p
 // returns true on success
 int BRSecp256k1PointMul(BRECPoint *p, const UInt256 *i)
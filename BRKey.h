@@ -53,6 +53,11 @@ int BRSecp256k1PointGen(BRECPoint *p, const UInt256 *i);
 // returns true on success
 int BRSecp256k1PointAdd(BRECPoint *p, const UInt256 *i);
 
+// multiplies secp256k1 generator by each 256bit big endian int in tweaks, adds the result to ec-point p and stores it
+// in points, parsing p only once and sharing a single field inversion across all of points
+// returns the number of points stored, stopping at the first tweak that is out of range or gives the point at infinity
+size_t BRSecp256k1PointAddList(BRECPoint points[], const BRECPoint *p, const UInt256 tweaks[], size_t count);
+
 // multiplies secp256k1 ec-point p by 256bit big endian int i and stores the result in p
 // returns true on success
 int BRSecp256k1PointMul(BRECPoint *p, const UInt256 *i);
@@ -96,9 +96,36 @@ BRMerkleBlock *BRMerkleBlockCopy(const BRMerkleBlock *block)
     return cpy;
 }
 
+// parses the 80 byte header fields, but not the block hash or proof-of-work hash
+static size_t _BRMerkleBlockParseHeader(BRMerkleBlock *block, const uint8_t *buf)
+{
+    size_t off = 0;
+    
+    block->version = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    block->prevBlock = UInt256Get(&buf[off]);
+    off += sizeof(UInt256);
+    block->merkleRoot = UInt256Get(&buf[off]);
+    off += sizeof(UInt256);
+    block->timestamp = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    block->target = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    block->nonce = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    return off;
+}
+
 // buf must contain either a serialized merkleblock or header
 // returns a merkle block struct that must be freed by calling BRMerkleBlockFree()
 BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen)
+{
+    return BRMerkleBlockParseCached(buf, bufLen, NULL);
+}
+
+// same as BRMerkleBlockParse(), but the proof-of-work hash is taken from cache if it holds a trusted hash for the block
+// cache may be NULL
+BRMerkleBlock *BRMerkleBlockParseCached(const uint8_t *buf, size_t bufLen, BRPoWCache *cache)
 {
     BRMerkleBlock *block = (buf && 80 <= bufLen) ? BRMerkleBlockNew() : NULL;
     size_t off = 0, len = 0;
@@ -106,18 +133,8 @@ BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen)
     assert(buf != NULL || bufLen == 0);
     
     if (block) {
-        block->version = UInt32GetLE(&buf[off]);
-        off += sizeof(uint32_t);
-        block->prevBlock = UInt256Get(&buf[off]);
-        off += sizeof(UInt256);
-        block->merkleRoot = UInt256Get(&buf[off]);
-        off += sizeof(UInt256);
-        block->timestamp = UInt32GetLE(&buf[off]);
-        off += sizeof(uint32_t);
-        block->target = UInt32GetLE(&buf[off]);
-        off += sizeof(uint32_t);
-        block->nonce = UInt32GetLE(&buf[off]);
-        off += sizeof(uint32_t);
+        off = _BRMerkleBlockParseHeader(block, buf);
+        BRSHA256_2(&block->blockHash, buf, 80);
         
         if (off + sizeof(uint32_t) <= bufLen) {
             block->totalTx = UInt32GetLE(&buf[off]);
@@ -135,13 +152,52 @@ BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen)
             if (block->flags) memcpy(block->flags, &buf[off], len);
         }
         
-        BRSHA256_2(&block->blockHash, buf, 80);
-        BRScrypt(&block->powHash, sizeof(block->powHash), buf, 80, buf, 80, 1024, 1, 1);
+        if (! cache || ! BRPoWCacheLookup(cache, block->blockHash, &block->powHash)) {
+            BRScryptCtxPoW(BRScryptPoWThreadCtx(), &block->powHash, buf, 1); // reuses the thread scratchpad
+        }
     }
     
     return block;
 }
 
+// parses count serialized 80 byte block headers stored stride bytes apart in buf (81 bytes in a headers message)
+// proof-of-work hashes are computed for several headers at once, which is much faster than parsing one at a time,
+// and headers with a trusted hash in cache are not hashed at all (cache may be NULL)
+// returns number of blocks written, each of which must be freed by calling BRMerkleBlockFree()
+size_t BRMerkleBlockParseHeaders(BRMerkleBlock *blocks[], const uint8_t *buf, size_t stride, size_t count,
+                                 BRPoWCache *cache)
+{
+    uint8_t headers[32*80];
+    UInt256 blockHashes[32], powHashes[32];
+    BRMerkleBlock *miss[32];
+    BRScryptCtx *ctx = BRScryptPoWThreadCtx(); // scratchpad is allocated once per thread, not per header
+    size_t i, j, n, m;
+    
+    assert(blocks != NULL || count == 0);
+    assert(buf != NULL || count == 0);
+    assert(stride >= 80);
+    
+    for (i = 0; i < count; i += n) {
+        n = (count - i < 32) ? count - i : 32;
+        for (j = 0; j < n; j++) memcpy(&headers[j*80], &buf[(i + j)*stride], 80);
+        BRSHA256_2_Multi(blockHashes, headers, 80, n); // block hashes are computed in parallel simd lanes
+        
+        for (j = 0, m = 0; j < n; j++) {
+            blocks[i + j] = BRMerkleBlockNew();
+            _BRMerkleBlockParseHeader(blocks[i + j], &headers[j*80]);
+            blocks[i + j]->blockHash = blockHashes[j];
+            if (cache && BRPoWCacheLookup(cache, blockHashes[j], &blocks[i + j]->powHash)) continue;
+            if (m != j) memcpy(&headers[m*80], &headers[j*80], 80); // move headers that still need hashing to the front
+            miss[m++] = blocks[i + j];
+        }
+        
+        BRScryptCtxPoW(ctx, powHashes, headers, m);
+        for (j = 0; j < m; j++) miss[j]->powHash = powHashes[j];
+    }
+    
+    return count;
+}
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen)
 {
@@ -231,9 +287,11 @@ void BRMerkleBlockSetTxHashes(BRMerkleBlock *block, const UInt256 hashes[], size
     if (block->hashes) free(block->hashes);
     block->hashes = (hashesCount > 0) ? malloc(hashesCount*sizeof(UInt256)) : NULL;
     if (block->hashes) memcpy(block->hashes, hashes, hashesCount*sizeof(UInt256));
+    block->hashesCount = (block->hashes) ? hashesCount : 0;
     if (block->flags) free(block->flags);
     block->flags = (flagsLen > 0) ? malloc(flagsLen) : NULL;
     if (block->flags) memcpy(block->flags, flags, flagsLen);
+    block->flagsLen = (block->flags) ? flagsLen : 0;
 }
 
 // recursively walks the merkle tree to calculate the merkle root
@@ -264,6 +322,91 @@ static UInt256 _BRMerkleBlockRootR(const BRMerkleBlock *block, size_t *hashIdx,
     return md;
 }
 
+typedef struct {
+    UInt256 hash;
+    size_t left, right; // child node indexes, SIZE_MAX for a missing branch
+    int depth, isLeaf;
+} BRMerkleNode;
+
+// builds the partial merkle tree in the same depth first order as _BRMerkleBlockRootR(), without hashing
+// returns the node index, or SIZE_MAX for a missing branch
+static size_t _BRMerkleBlockTreeR(const BRMerkleBlock *block, size_t *hashIdx, size_t *flagIdx, int depth,
+                                  BRMerkleNode *nodes, size_t *nodesCount)
+{
+    size_t n = SIZE_MAX;
+    uint8_t flag;
+    
+    if (*flagIdx/8 < block->flagsLen && *hashIdx < block->hashesCount) {
+        flag = (block->flags[*flagIdx/8] & (1 << (*flagIdx % 8)));
+        (*flagIdx)++;
+        n = (*nodesCount)++;
+        nodes[n].depth = depth;
+        nodes[n].left = nodes[n].right = SIZE_MAX;
+        nodes[n].hash = UINT256_ZERO;
+        nodes[n].isLeaf = ! flag || depth == _ceil_log2(block->totalTx);
+        
+        if (! nodes[n].isLeaf) {
+            nodes[n].left = _BRMerkleBlockTreeR(block, hashIdx, flagIdx, depth + 1, nodes, nodesCount);
+            nodes[n].right = _BRMerkleBlockTreeR(block, hashIdx, flagIdx, depth + 1, nodes, nodesCount);
+        }
+        else nodes[n].hash = block->hashes[(*hashIdx)++]; // leaf
+    }
+    
+    return n;
+}
+
+// computes the same merkle root as _BRMerkleBlockRootR(), but one tree level at a time from the bottom up, so that all
+// node pairs on a level are hashed together with BRSHA256_2_Multi()
+static UInt256 _BRMerkleBlockRoot(const BRMerkleBlock *block)
+{
+    size_t hashIdx = 0, flagIdx = 0, nodesCount = 0, levelIdx[66] = { 0 }, i, j, n;
+    BRMerkleNode *nodes = (block->flagsLen > 0) ? malloc(block->flagsLen*8*sizeof(*nodes)) : NULL;
+    size_t *level = NULL; // internal node indexes, ordered by depth
+    UInt256 md = UINT256_ZERO, (*pairs)[2] = NULL, *mds = NULL, l, r;
+    int depth, cve = 0;
+    
+    if (block->flagsLen > 0 && block->hashesCount > 0) {
+        assert(nodes != NULL);
+        _BRMerkleBlockTreeR(block, &hashIdx, &flagIdx, 0, nodes, &nodesCount);
+        level = malloc(nodesCount*sizeof(*level));
+        pairs = malloc(nodesCount*sizeof(*pairs));
+        mds = malloc(nodesCount*sizeof(*mds));
+        assert(level != NULL && pairs != NULL && mds != NULL);
+    }
+    
+    for (i = 0; i < nodesCount; i++) if (! nodes[i].isLeaf) levelIdx[nodes[i].depth + 2]++; // depth < 64
+    for (depth = 0; depth < 64; depth++) levelIdx[depth + 2] += levelIdx[depth + 1];
+    for (i = 0; i < nodesCount; i++) if (! nodes[i].isLeaf) level[levelIdx[nodes[i].depth + 1]++] = i;
+    
+    // internal nodes at depth are now level[levelIdx[depth]] to level[levelIdx[depth + 1] - 1]
+    for (depth = 63; ! cve && depth >= 0; depth--) { // deepest level first
+        for (j = levelIdx[depth], n = 0; ! cve && j < levelIdx[depth + 1]; j++, n++) {
+            i = level[j];
+            l = (nodes[i].left != SIZE_MAX) ? nodes[nodes[i].left].hash : UINT256_ZERO;
+            r = (nodes[i].right != SIZE_MAX) ? nodes[nodes[i].right].hash : UINT256_ZERO;
+            if (UInt256IsZero(l) || UInt256Eq(l, r)) cve = 1; // (CVE-2012-2459), see _BRMerkleBlockRootR()
+            if (UInt256IsZero(r)) r = l; // if right branch is missing, dup left branch
+            pairs[n][0] = l, pairs[n][1] = r;
+        }
+        
+        if (cve || n == 0) continue;
+        BRSHA256_2_Multi(mds, pairs, sizeof(*pairs), n);
+        for (j = levelIdx[depth], n = 0; j < levelIdx[depth + 1]; j++, n++) nodes[level[j]].hash = mds[n];
+    }
+    
+    if (cve) { // malformed tree, fall back to the recursive walk so the exact same result is returned
+        hashIdx = flagIdx = 0;
+        md = _BRMerkleBlockRootR(block, &hashIdx, &flagIdx, 0);
+    }
+    else if (nodesCount > 0) md = nodes[0].hash;
+    
+    if (nodes) free(nodes);
+    if (level) free(level);
+    if (pairs) free(pairs);
+    if (mds) free(mds);
+    return md;
+}
+
 // true if merkle tree and timestamp are valid, and proof-of-work matches the stated difficulty target
 // NOTE: this only checks if the block difficulty matches the difficulty target in the header, it does not check if the
 // target is correct for the block's height in the chain - use BRMerkleBlockVerifyDifficulty() for that
@@ -274,8 +417,7 @@ int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime)
     // target is in "compact" format, where the most significant byte is the size of the value in bytes, next
     // bit is the sign, and the last 23 bits is the value after having been right shifted by (size - 3)*8 bits
     const uint32_t size = block->target >> 24, target = block->target & 0x007fffff;
-    size_t hashIdx = 0, flagIdx = 0;
-    UInt256 merkleRoot = _BRMerkleBlockRootR(block, &hashIdx, &flagIdx, 0), t = UINT256_ZERO;
+    UInt256 merkleRoot = _BRMerkleBlockRoot(block), t = UINT256_ZERO;
     int r = 1;
     
     // check if merkle root is correct
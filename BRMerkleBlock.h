@@ -25,6 +25,7 @@
 #ifndef BRMerkleBlock_h
 #define BRMerkleBlock_h
 
+#include "BRPoWCache.h"
 #include "BRInt.h"
 #include <stddef.h>
 #include <inttypes.h>
@@ -67,6 +68,17 @@ BRMerkleBlock *BRMerkleBlockCopy(const BRMerkleBlock *block);
 // returns a merkle block struct that must be freed by calling BRMerkleBlockFree()
 BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen);
 
+// same as BRMerkleBlockParse(), but the proof-of-work hash is taken from cache if it holds a trusted hash for the block
+// cache may be NULL
+BRMerkleBlock *BRMerkleBlockParseCached(const uint8_t *buf, size_t bufLen, BRPoWCache *cache);
+
+// parses count serialized 80 byte block headers stored stride bytes apart in buf (81 bytes in a headers message)
+// proof-of-work hashes are computed for several headers at once, which is much faster than parsing one at a time,
+// and headers with a trusted hash in cache are not hashed at all (cache may be NULL)
+// returns number of blocks written, each of which must be freed by calling BRMerkleBlockFree()
+size_t BRMerkleBlockParseHeaders(BRMerkleBlock *blocks[], const uint8_t *buf, size_t stride, size_t count,
+                                 BRPoWCache *cache);
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen);
 
@@ -24,10 +24,12 @@
 
 #include "BRPeer.h"
 #include "BRMerkleBlock.h"
+#include "BRGCSFilter.h"
 #include "BRAddress.h"
 #include "BRSet.h"
 #include "BRArray.h"
 #include "BRCrypto.h"
+#include "BRThreadPool.h"
 #include "BRInt.h"
 #include <stdlib.h>
 #include <float.h>
@@ -40,21 +42,41 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>	
 #include <arpa/inet.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define PEER_LOOP_SUPPORTED 1 // BRPeerLoop is built on epoll, on other platforms peers always get their own thread
+#endif
+
 #define HEADER_LENGTH      24
 #define MAX_MSG_LENGTH     0x02000000
 #define MAX_GETDATA_HASHES 50000
+#define MIN_TX_LENGTH      60 // serialized tx with one input and one output, both with empty scripts
 #define ENABLED_SERVICES   0ULL  // we don't provide full blocks to remote nodes
 #define PROTOCOL_VERSION   70002
 #define MIN_PROTO_VERSION  70002 // peers earlier than this protocol version not supported (need v0.9 txFee relay rules)
 #define LOCAL_HOST         ((UInt128) { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 })
 #define CONNECT_TIMEOUT    3.0
 #define MESSAGE_TIMEOUT    10.0
+#define RECV_CHUNK         0x10000 // bytes requested per socket read, more when a larger message is partly received
+#define RECV_IDLE_SIZE     0x40000 // receive buffers larger than this are shrunk once they have been fully parsed
 
 #define PTHREAD_STACK_SIZE  (512 * 1024)
 
+#define HEADER_BATCH_CHUNK  64 // headers verified per worker job, a multiple of the widest scrypt simd group
+#define MAX_HEADER_BATCHES  3  // headers messages being verified at once before the peer thread waits on the oldest
+
+#define LOOP_TICK           0.25 // timer wheel slot length in seconds
+#define LOOP_WHEEL_SLOTS    64   // timers further out than the wheel span wait in their slot for a later round
+#define LOOP_MAX_EVENTS     64   // socket events handled per epoll_wait() call
+#define LOOP_REQ_CONNECT    0x01 // requests from other threads for the loop thread serving a peer
+#define LOOP_REQ_DISCONNECT 0x02
+#define LOOP_REQ_TIMERS     0x04
+
 // the standard blockchain download protocol works as follows (for SPV mode):
 // - local peer sends getblocks
 // - remote peer reponds with inv containing up to 500 block hashes
@@ -90,6 +112,28 @@ typedef enum {
     inv_filtered_block = 3
 } inv_type;
 
+// headers from a single headers message, verified in chunks on the shared thread pool while the peer thread goes back
+// to reading from the network, then relayed in order by the peer thread once every chunk is done
+typedef struct {
+    uint8_t *headers; // serialized headers, 81 bytes apart as in the headers message
+    size_t count, next, pending; // next is the first header of the next chunk, pending is the count of unfinished jobs
+    uint32_t now;
+    BRPoWCache *powCache;
+    BRMerkleBlock **blocks;
+    uint8_t *valid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} BRHeaderBatch;
+
+// connection states of a peer served by a BRPeerLoop
+typedef enum {
+    loop_idle = 0,
+    loop_connecting,
+    loop_open
+} loop_state;
+
+typedef struct BRPeerLoopThreadStruct BRPeerLoopThread;
+
 typedef struct {
     BRPeer peer; // superstruct on top of BRPeer
     uint32_t magicNumber;
@@ -101,12 +145,14 @@ typedef struct {
     char *useragent;
     uint32_t version, lastblock, earliestKeyTime, currentBlockHeight;
     double startTime, pingTime;
-    volatile double disconnectTime, mempoolTime;
+    volatile double disconnectTime, mempoolTime, callbackTime;
     int sentVerack, gotVerack, sentGetaddr, sentFilter, sentGetdata, sentMempool, sentGetblocks;
     UInt256 lastBlockHash;
     BRMerkleBlock *currentBlock;
     UInt256 *currentBlockTxHashes, *knownBlockHashes, *knownTxHashes;
     BRSet *knownTxHashSet;
+    BRHeaderBatch **headerBatches;
+    BRPoWCache *powCache;
     volatile int socket;
     void *info;
     void (*connected)(void *info);
@@ -122,11 +168,31 @@ typedef struct {
     BRTransaction *(*requestedTx)(void *info, UInt256 txHash);
     int (*networkIsReachable)(void *info);
     void (*threadCleanup)(void *info);
+    int (*blockInv)(void *info, const UInt256 blockHashes[], size_t blockCount);
+    void (*relayedCfheaders)(void *info, UInt256 stopHash, UInt256 prevFilterHeader, const UInt256 filterHashes[],
+                             size_t hashesCount);
+    void (*relayedCfilter)(void *info, UInt256 blockHash, const uint8_t *filter, size_t filterLen); // filter mode
+    void (*relayedFullBlock)(void *info, BRMerkleBlock *block, BRTransaction *txs[], size_t txCount);
     void **volatile pongInfo;
     void (**volatile pongCallback)(void *info, int success);
     void *volatile mempoolInfo;
     void (*volatile mempoolCallback)(void *info, int success);
+    void (*volatile scheduledCallback)(void *info);
     pthread_t thread;
+    BRPeerLoop *loop; // when set, connections are served by a loop thread instead of a thread of their own
+    BRPeerLoopThread *loopThread;
+    loop_state loopState; // changed by the loop thread while holding both loopThread->lock and sendLock
+    int loopRequests, watchingOut;
+    BRPeer *timerPrev, *timerNext; // timer wheel slot list
+    uint64_t timerTick;
+    double msgTimeout;
+    uint8_t *recvBuf; // bytes read from the socket, recvLen unparsed bytes start at recvOff
+    size_t recvSize, recvOff, recvLen, recvNeed; // recvNeed is the number of bytes left of a partly received message
+    uint8_t *sendBuf; // bytes waiting for the socket to accept them, starting at sendOff
+    size_t sendOff, sendHighWater;
+    int sendCongested;
+    void (*sendQueue)(void *info, int congested);
+    pthread_mutex_t sendLock;
 } BRPeerContext;
 
 void BRPeerSendVersionMessage(BRPeer *peer);
@@ -348,7 +414,7 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
             r = 0;
         }
         else {
-            if (! ctx->sentFilter && ! ctx->sentGetblocks) blockCount = 0;
+            if (! ctx->sentFilter && ! ctx->sentGetblocks && ! ctx->relayedCfilter) blockCount = 0;
             if (blockCount == 1 && UInt256Eq(ctx->lastBlockHash, UInt256Get(blocks[0]))) blockCount = 0;
             if (blockCount == 1) ctx->lastBlockHash = UInt256Get(blocks[0]);
 
@@ -365,6 +431,9 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
             }
         
             if (ctx->needsFilterUpdate) blockCount = 0;
+            
+            // block hashes taken by blockInv are requested by its caller, along with the next batch of block hashes
+            if (blockCount > 0 && ctx->blockInv && ctx->blockInv(ctx->info, blockHashes, blockCount)) blockCount = 0;
         
             for (i = 0, j = 0; i < txCount; i++) {
                 hash = UInt256Get(transactions[i]);
@@ -441,6 +510,125 @@ static int _BRPeerAcceptTxMessage(BRPeer *peer, const uint8_t *msg, size_t msgLe
     return r;
 }
 
+// parses and verifies the next chunk of headers in batch
+static void _BRHeaderBatchJob(void *info)
+{
+    BRHeaderBatch *batch = info;
+    size_t i, n;
+    
+    pthread_mutex_lock(&batch->lock);
+    i = batch->next;
+    n = (batch->count - i < HEADER_BATCH_CHUNK) ? batch->count - i : HEADER_BATCH_CHUNK;
+    batch->next += n;
+    pthread_mutex_unlock(&batch->lock);
+    
+    BRMerkleBlockParseHeaders(&batch->blocks[i], &batch->headers[81*i], 81, n, batch->powCache);
+    for (size_t j = i; j < i + n; j++) batch->valid[j] = BRMerkleBlockIsValid(batch->blocks[j], batch->now);
+    
+    pthread_mutex_lock(&batch->lock);
+    if (--batch->pending == 0) pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void _BRHeaderBatchFree(BRHeaderBatch *batch)
+{
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->cond);
+    free(batch->headers);
+    free(batch->blocks);
+    free(batch->valid);
+    free(batch);
+}
+
+// relays verified header batches to the relayedBlock callback in the order they were received
+// if wait is true, waits for batches still being verified, otherwise stops at the first unfinished batch
+// returns false if an invalid header was found, in which case all remaining batches are discarded
+static int _BRPeerRelayHeaders(BRPeer *peer, int wait)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRHeaderBatch *batch;
+    int r = 1;
+    
+    while (array_count(ctx->headerBatches) > 0) {
+        batch = ctx->headerBatches[0];
+        pthread_mutex_lock(&batch->lock);
+        
+        if (batch->pending > 0 && ! wait && r) {
+            pthread_mutex_unlock(&batch->lock);
+            break;
+        }
+        
+        while (batch->pending > 0) pthread_cond_wait(&batch->cond, &batch->lock);
+        pthread_mutex_unlock(&batch->lock);
+        array_rm(ctx->headerBatches, 0);
+        
+        for (size_t i = 0; i < batch->count; i++) {
+            BRMerkleBlock *block = batch->blocks[i];
+            
+            if (! r) {
+                BRMerkleBlockFree(block);
+            }
+            else if (! batch->valid[i]) {
+                peer_log(peer, "invalid block header: %s", u256hex(block->blockHash));
+                BRMerkleBlockFree(block);
+                r = 0;
+            }
+            else if (ctx->relayedBlock) {
+                ctx->relayedBlock(ctx->info, block);
+            }
+            else BRMerkleBlockFree(block);
+        }
+        
+        _BRHeaderBatchFree(batch);
+    }
+    
+    return r;
+}
+
+// queues count serialized headers for verification, spread across the shared thread pool when there are enough of them
+// returns false if an invalid header was found while relaying earlier batches
+static int _BRPeerQueueHeaders(BRPeer *peer, const uint8_t *headers, size_t count, uint32_t now)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRHeaderBatch *batch = calloc(1, sizeof(*batch));
+    size_t jobCount = (count + HEADER_BATCH_CHUNK - 1)/HEADER_BATCH_CHUNK;
+    int r = 1;
+    
+    assert(batch != NULL);
+    batch->headers = malloc(81*count);
+    batch->blocks = calloc(count, sizeof(*batch->blocks));
+    batch->valid = calloc(count, sizeof(*batch->valid));
+    assert(batch->headers != NULL || count == 0);
+    assert(batch->blocks != NULL || count == 0);
+    assert(batch->valid != NULL || count == 0);
+    if (count > 0) memcpy(batch->headers, headers, 81*count);
+    batch->count = count;
+    batch->pending = jobCount;
+    batch->now = now;
+    batch->powCache = ctx->powCache;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+    
+    // limit the number of batches in flight, so a fast peer can't get too far ahead of verification
+    if (array_count(ctx->headerBatches) >= MAX_HEADER_BATCHES) {
+        BRHeaderBatch *oldest = ctx->headerBatches[0];
+
+        pthread_mutex_lock(&oldest->lock);
+        while (oldest->pending > 0) pthread_cond_wait(&oldest->cond, &oldest->lock);
+        pthread_mutex_unlock(&oldest->lock);
+    }
+    
+    array_add(ctx->headerBatches, batch);
+    
+    if (jobCount > 1) {
+        for (size_t i = 0; i < jobCount; i++) BRThreadPoolAdd(BRThreadPoolShared(), batch, _BRHeaderBatchJob);
+    }
+    else if (jobCount == 1) _BRHeaderBatchJob(batch); // not worth a thread hop
+    
+    if (! _BRPeerRelayHeaders(peer, 0)) r = 0;
+    return r;
+}
+
 static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
@@ -452,6 +640,10 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
                  BRVarIntSize(count) + 81*count, count);
         r = 0;
     }
+    else if (ctx->relayedCfilter) { // in compact filter mode the caller requests each batch of headers
+        peer_log(peer, "got %zu header(s)", count);
+        if (count > 0) r = _BRPeerQueueHeaders(peer, &msg[off], count, (uint32_t)time(NULL));
+    }
     else {
         peer_log(peer, "got %zu header(s)", count);
     
@@ -480,19 +672,8 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
             }
             else BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
 
-            for (size_t i = 0; r && i < count; i++) {
-                BRMerkleBlock *block = BRMerkleBlockParse(&msg[off + 81*i], 81);
-                
-                if (! BRMerkleBlockIsValid(block, (uint32_t)now)) {
-                    peer_log(peer, "invalid block header: %s", u256hex(block->blockHash));
-                    BRMerkleBlockFree(block);
-                    r = 0;
-                }
-                else if (ctx->relayedBlock) {
-                    ctx->relayedBlock(ctx->info, block);
-                }
-                else BRMerkleBlockFree(block);
-            }
+            // headers are verified off the peer thread, so reading the next headers message overlaps with hashing
+            r = _BRPeerQueueHeaders(peer, &msg[off], count, (uint32_t)now);
         }
         else {
             peer_log(peer, "non-standard headers message, %zu is fewer header(s) than expected", count);
@@ -539,9 +720,13 @@ static int _BRPeerAcceptGetdataMessage(BRPeer *peer, const uint8_t *msg, size_t
                     if (ctx->requestedTx) tx = ctx->requestedTx(ctx->info, hash);
 
                     if (tx && BRTransactionSize(tx) < TX_MAX_SIZE) {
-                        uint8_t buf[BRTransactionSerialize(tx, NULL, 0)];
-                        size_t bufLen = BRTransactionSerialize(tx, buf, sizeof(buf));
-                        char txHex[bufLen*2 + 1];
+                        size_t bufLen = BRTransactionSerialize(tx, NULL, 0);
+                        uint8_t *buf = malloc(bufLen); // serialized once and sent in place, not on the peer's stack
+                        char *txHex = malloc(bufLen*2 + 1);
+                        
+                        assert(buf != NULL && txHex != NULL);
+                        bufLen = BRTransactionSerialize(tx, buf, bufLen);
+                        txHex[0] = '\0';
                         
                         for (size_t j = 0; j < bufLen; j++) {
                             sprintf(&txHex[j*2], "%02x", buf[j]);
@@ -549,6 +734,8 @@ static int _BRPeerAcceptGetdataMessage(BRPeer *peer, const uint8_t *msg, size_t
                         
                         peer_log(peer, "publishing tx: %s", txHex);
                         BRPeerSendMessage(peer, buf, bufLen, MSG_TX);
+                        free(txHex);
+                        free(buf);
                         break;
                     }
                     
@@ -692,7 +879,7 @@ static int _BRPeerAcceptMerkleblockMessage(BRPeer *peer, const uint8_t *msg, siz
     // a merkleblock message, the remote node is expected to send tx messages for the tx referenced in the block. When a
     // non-tx message is received we should have all the tx in the merkleblock.
     BRPeerContext *ctx = (BRPeerContext *)peer;
-    BRMerkleBlock *block = BRMerkleBlockParse(msg, msgLen);
+    BRMerkleBlock *block = BRMerkleBlockParseCached(msg, msgLen, ctx->powCache);
     int r = 1;
   
     if (! block) {
@@ -740,6 +927,163 @@ static int _BRPeerAcceptMerkleblockMessage(BRPeer *peer, const uint8_t *msg, siz
     return r;
 }
 
+// returns the serialized length of the tx at the start of buf, or 0 if buf ends before the tx does
+static size_t _BRPeerTxLength(const uint8_t *buf, size_t bufLen)
+{
+    size_t i, len = 0, off = sizeof(uint32_t), count;
+    uint64_t sLen;
+
+    count = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+
+    for (off += len, i = 0; len > 0 && off <= bufLen && i < count; i++) { // inputs
+        off += sizeof(UInt256) + sizeof(uint32_t);
+        sLen = BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+        off += (sLen <= bufLen) ? len + (size_t)sLen + sizeof(uint32_t) : bufLen + 1;
+    }
+
+    count = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+
+    for (off += len, i = 0; len > 0 && off <= bufLen && i < count; i++) { // outputs
+        off += sizeof(uint64_t);
+        sLen = BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+        off += (sLen <= bufLen) ? len + (size_t)sLen : bufLen + 1;
+    }
+
+    off += sizeof(uint32_t); // lockTime
+    return (len > 0 && off <= bufLen) ? off : 0;
+}
+
+// full blocks are only requested in compact filter mode, for blocks that matched their filter
+static int _BRPeerAcceptBlockMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRMerkleBlock *block = (msgLen >= 80) ? BRMerkleBlockParseCached(msg, 80, ctx->powCache) : NULL;
+    size_t i, txLen, off = 80, len = 0, count = 0, nodes = 0, txCount = 0;
+    UInt256 *hashes = NULL;
+    BRTransaction **txs = NULL;
+    int r = 1;
+    
+    if (block) count = (size_t)BRVarInt(&msg[off], msgLen - off, &len);
+    off += len;
+
+    if (! block || len == 0 || count == 0 || count > (msgLen - off)/MIN_TX_LENGTH) {
+        peer_log(peer, "malformed block message with length: %zu", msgLen);
+        r = 0;
+    }
+    else if (! ctx->relayedFullBlock || ! ctx->sentGetdata) {
+        peer_log(peer, "dropping block %s, full blocks are only requested in compact filter mode",
+                 u256hex(block->blockHash));
+    }
+    else {
+        hashes = malloc(count*sizeof(*hashes));
+        txs = calloc(count, sizeof(*txs));
+        assert(hashes != NULL);
+        assert(txs != NULL);
+        
+        for (i = 0; i < count; i++) {
+            txLen = _BRPeerTxLength(&msg[off], msgLen - off);
+            if (txLen == 0) break;
+            BRSHA256_2(&hashes[i], &msg[off], txLen);
+            txs[i] = BRTransactionParse(&msg[off], txLen);
+            off += txLen;
+        }
+        
+        if (i < count || off != msgLen) {
+            peer_log(peer, "malformed block message with length: %zu", msgLen);
+            r = 0;
+        }
+        else { // a merkle tree with every node flagged holds all of the block's tx hashes
+            for (i = count; i > 1; i = (i + 1)/2) nodes += i;
+
+            uint8_t flags[(nodes + 1 + 7)/8];
+
+            memset(flags, 0xff, sizeof(flags));
+            block->totalTx = (uint32_t)count;
+            BRMerkleBlockSetTxHashes(block, hashes, count, flags, sizeof(flags));
+        }
+        
+        if (r && ! BRMerkleBlockIsValid(block, (uint32_t)time(NULL))) {
+            peer_log(peer, "invalid block: %s", u256hex(block->blockHash));
+            r = 0;
+        }
+        else if (r) {
+            peer_log(peer, "got block %s with %zu tx", u256hex(block->blockHash), count);
+            
+            for (i = 0; i < count; i++) { // only relay tx that parsed to the same hash as the raw tx
+                if (txs[i] && ! UInt256Eq(txs[i]->txHash, hashes[i])) BRTransactionFree(txs[i]);
+                else if (txs[i]) txs[txCount++] = txs[i];
+            }
+            
+            ctx->relayedFullBlock(ctx->info, block, txs, txCount);
+            block = NULL;
+        }
+        else for (i = 0; i < count; i++) if (txs[i]) BRTransactionFree(txs[i]);
+        
+        free(txs);
+        free(hashes);
+    }
+
+    if (block) BRMerkleBlockFree(block);
+    return r;
+}
+
+// described in BIP157: https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
+static int _BRPeerAcceptCfheadersMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t off = sizeof(uint8_t) + sizeof(UInt256)*2, len = 0,
+           count = (off <= msgLen) ? (size_t)BRVarInt(&msg[off], msgLen - off, &len) : 0;
+    int r = 1;
+    
+    if (len == 0 || off + len > msgLen || count > (msgLen - off - len)/sizeof(UInt256)) {
+        peer_log(peer, "malformed cfheaders message, length is %zu, should be %zu for %zu hash(es)", msgLen,
+                 off + BRVarIntSize(count) + sizeof(UInt256)*count, count);
+        r = 0;
+    }
+    else if (msg[0] != GCS_FILTER_TYPE_BASIC || ! ctx->relayedCfheaders) {
+        peer_log(peer, "dropping cfheaders for filter type %"PRIu8", not requested", msg[0]);
+    }
+    else {
+        UInt256 *hashes = malloc(count*sizeof(*hashes) + 1); // up to 2000 hashes, kept off the peer thread's stack
+        
+        assert(hashes != NULL);
+        peer_log(peer, "got cfheaders with %zu filter hash(es)", count);
+        off += len;
+        
+        for (size_t i = 0; i < count; i++) {
+            hashes[i] = UInt256Get(&msg[off]);
+            off += sizeof(UInt256);
+        }
+        
+        ctx->relayedCfheaders(ctx->info, UInt256Get(&msg[sizeof(uint8_t)]),
+                              UInt256Get(&msg[sizeof(uint8_t) + sizeof(UInt256)]), hashes, count);
+        free(hashes);
+    }
+    
+    return r;
+}
+
+// described in BIP157: https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
+static int _BRPeerAcceptCfilterMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t off = sizeof(uint8_t) + sizeof(UInt256), len = 0,
+           filterLen = (off <= msgLen) ? (size_t)BRVarInt(&msg[off], msgLen - off, &len) : 0;
+    int r = 1;
+    
+    if (len == 0 || off + len > msgLen || filterLen > msgLen - off - len) {
+        peer_log(peer, "malformed cfilter message, length is %zu, should be %zu", msgLen,
+                 off + BRVarIntSize(filterLen) + filterLen);
+        r = 0;
+    }
+    else if (msg[0] != GCS_FILTER_TYPE_BASIC || ! ctx->relayedCfilter) {
+        peer_log(peer, "dropping cfilter for filter type %"PRIu8", not requested", msg[0]);
+    }
+    else ctx->relayedCfilter(ctx->info, UInt256Get(&msg[sizeof(uint8_t)]), &msg[off + len], filterLen);
+    
+    return r;
+}
+
 // described in BIP61: https://github.com/bitcoin/bips/blob/master/bip-0061.mediawiki
 static int _BRPeerAcceptRejectMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
 {
@@ -814,7 +1158,11 @@ static int _BRPeerAcceptMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen,
     BRPeerContext *ctx = (BRPeerContext *)peer;
     int r = 1;
     
-    if (ctx->currentBlock && strncmp(MSG_TX, type, 12) != 0) { // if we receive a non-tx message, merkleblock is done
+    // headers still being verified must be relayed before any other message is processed, to keep callbacks in order
+    if (array_count(ctx->headerBatches) > 0 && strncmp(MSG_HEADERS, type, 12) != 0 && ! _BRPeerRelayHeaders(peer, 1)) {
+        r = 0;
+    }
+    else if (ctx->currentBlock && strncmp(MSG_TX, type, 12) != 0) { // a non-tx message means the merkleblock is done
         peer_log(peer, "incomplete merkleblock %s, expected %zu more tx, got %s", u256hex(ctx->currentBlock->blockHash),
                  array_count(ctx->currentBlockTxHashes), type);
         array_clear(ctx->currentBlockTxHashes);
@@ -833,6 +1181,9 @@ static int _BRPeerAcceptMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen,
     else if (strncmp(MSG_PING, type, 12) == 0) r = _BRPeerAcceptPingMessage(peer, msg, msgLen);
     else if (strncmp(MSG_PONG, type, 12) == 0) r = _BRPeerAcceptPongMessage(peer, msg, msgLen);
     else if (strncmp(MSG_MERKLEBLOCK, type, 12) == 0) r = _BRPeerAcceptMerkleblockMessage(peer, msg, msgLen);
+    else if (strncmp(MSG_BLOCK, type, 12) == 0) r = _BRPeerAcceptBlockMessage(peer, msg, msgLen);
+    else if (strncmp(MSG_CFHEADERS, type, 12) == 0) r = _BRPeerAcceptCfheadersMessage(peer, msg, msgLen);
+    else if (strncmp(MSG_CFILTER, type, 12) == 0) r = _BRPeerAcceptCfilterMessage(peer, msg, msgLen);
     else if (strncmp(MSG_REJECT, type, 12) == 0) r = _BRPeerAcceptRejectMessage(peer, msg, msgLen);
     else if (strncmp(MSG_FEEFILTER, type, 12) == 0) r = _BRPeerAcceptFeeFilterMessage(peer, msg, msgLen);
     else peer_log(peer, "dropping %s, length %zu, not implemented", type, msgLen);
@@ -840,6 +1191,24 @@ static int _BRPeerAcceptMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen,
     return r;
 }
 
+// fills in addr with the address of peer for a socket in domain, and returns the length of addr
+static socklen_t _BRPeerSockAddr(const BRPeer *peer, int domain, struct sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    
+    if (domain == PF_INET6) {
+        ((struct sockaddr_in6 *)addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)addr)->sin6_addr = *(const struct in6_addr *)&peer->address;
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons(peer->port);
+        return sizeof(struct sockaddr_in6);
+    }
+    
+    ((struct sockaddr_in *)addr)->sin_family = AF_INET;
+    ((struct sockaddr_in *)addr)->sin_addr = *(const struct in_addr *)&peer->address.u32[3];
+    ((struct sockaddr_in *)addr)->sin_port = htons(peer->port);
+    return sizeof(struct sockaddr_in);
+}
+
 static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *error)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
@@ -870,20 +1239,7 @@ static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *erro
     }
 
     if (r) {
-        memset(&addr, 0, sizeof(addr));
-        
-        if (domain == PF_INET6) {
-            ((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
-            ((struct sockaddr_in6 *)&addr)->sin6_addr = *(struct in6_addr *)&peer->address;
-            ((struct sockaddr_in6 *)&addr)->sin6_port = htons(peer->port);
-            addrLen = sizeof(struct sockaddr_in6);
-        }
-        else {
-            ((struct sockaddr_in *)&addr)->sin_family = AF_INET;
-            ((struct sockaddr_in *)&addr)->sin_addr = *(struct in_addr *)&peer->address.u32[3];
-            ((struct sockaddr_in *)&addr)->sin_port = htons(peer->port);
-            addrLen = sizeof(struct sockaddr_in);
-        }
+        addrLen = _BRPeerSockAddr(peer, domain, &addr);
         
         if (connect(ctx->socket, (struct sockaddr *)&addr, addrLen) < 0) err = errno;
         
@@ -916,113 +1272,160 @@ static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *erro
     return r;
 }
 
-static void *_peerThreadRoutine(void *arg)
+// writes as much of iov as socket accepts in a single call and advances iov past what was written, returns an errno.h
+// code if nothing could be written
+static int _BRPeerSendv(int socket, struct iovec iov[], size_t *iovCount)
 {
-    BRPeer *peer = arg;
-    BRPeerContext *ctx = arg;
-    int socket, error = 0;
+    struct msghdr mh;
+    ssize_t n;
+    size_t i;
+    
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = *iovCount;
+    n = sendmsg(socket, &mh, MSG_NOSIGNAL);
+    if (n < 0) return errno;
+    
+    for (i = 0; i < *iovCount && (size_t)n >= iov[i].iov_len; i++) n -= iov[i].iov_len;
+    if (i < *iovCount) iov[i].iov_base = (uint8_t *)iov[i].iov_base + n, iov[i].iov_len -= n;
+    *iovCount -= i;
+    memmove(iov, &iov[i], *iovCount*sizeof(*iov));
+    return 0;
+}
 
-    pthread_cleanup_push(ctx->threadCleanup, ctx->info);
+// returns the offset in buf of the first magic number at or after off, or of the trailing bytes that could still be the
+// start of one once more bytes arrive
+static size_t _BRPeerFindMagic(const uint8_t *buf, size_t off, size_t len, uint32_t magicNumber)
+{
+    const uint8_t *p;
     
-    if (_BRPeerOpenSocket(peer, PF_INET6, CONNECT_TIMEOUT, &error)) {
-        struct timeval tv;
-        double time = 0, msgTimeout;
-        uint8_t header[HEADER_LENGTH], *payload = malloc(0x1000);
-        size_t len = 0, payloadLen = 0x1000;
-        ssize_t n = 0;
+    while (off + sizeof(uint32_t) <= len) { // scan for the first magic byte, then compare the rest
+        p = memchr(&buf[off], magicNumber & 0xff, len + 1 - sizeof(uint32_t) - off);
+        if (! p) return len + 1 - sizeof(uint32_t);
+        off = p - buf;
+        if (UInt32GetLE(p) == magicNumber) break;
+        off++;
+    }
+    
+    return off;
+}
 
-        assert(payload != NULL);
-        gettimeofday(&tv, NULL);
-        ctx->startTime = tv.tv_sec + (double)tv.tv_usec/1000000;
-        BRPeerSendVersionMessage(peer);
-        
-        while (ctx->socket >= 0 && ! error) {
-            len = 0;
-            socket = ctx->socket;
-            
-            while (socket >= 0 && ! error && len < HEADER_LENGTH) {
-                n = read(socket, &header[len], sizeof(header) - len);
-                if (n > 0) len += n;
-                if (n == 0) error = ECONNRESET;
-                if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                gettimeofday(&tv, NULL);
-                time = tv.tv_sec + (double)tv.tv_usec/1000000;
-                if (! error && time >= ctx->disconnectTime) error = ETIMEDOUT;
+// true if data can be read from socket without blocking, or if checking failed and recv() should report the error
+static int _BRPeerSocketReadable(int socket)
+{
+    struct timeval tv = { 0, 0 };
+    fd_set fds;
+    
+    FD_ZERO(&fds);
+    FD_SET(socket, &fds);
+    return (select(socket + 1, &fds, NULL, NULL, &tv) != 0);
+}
 
-                if (! error && time >= ctx->mempoolTime) {
-                    peer_log(peer, "done waiting for mempool response");
-                    BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
-                    ctx->mempoolCallback = NULL;
-                    ctx->mempoolTime = DBL_MAX;
-                }
-                
-                while (sizeof(uint32_t) <= len && UInt32GetLE(header) != ctx->magicNumber) {
-                    memmove(header, &header[1], --len); // consume one byte at a time until we find the magic number
-                }
-                
-                socket = ctx->socket;
-            }
+// reads what socket has available into the receive buffer, returns the number of bytes read, and sets error to an
+// errno.h code on failure
+static size_t _BRPeerRecv(BRPeer *peer, int socket, int *error)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t len = (ctx->recvNeed > RECV_CHUNK) ? ctx->recvNeed : RECV_CHUNK;
+    ssize_t n;
+    
+    // slide unparsed bytes to the front only when there isn't room after them, so a partial message is moved at most
+    // once per read instead of after every message
+    if (ctx->recvOff > 0 && ctx->recvSize - ctx->recvOff - ctx->recvLen < len) {
+        memmove(ctx->recvBuf, &ctx->recvBuf[ctx->recvOff], ctx->recvLen);
+        ctx->recvOff = 0;
+    }
+    
+    if (ctx->recvSize - ctx->recvOff - ctx->recvLen < len) {
+        ctx->recvSize = ctx->recvOff + ctx->recvLen + len;
+        ctx->recvBuf = realloc(ctx->recvBuf, ctx->recvSize);
+        assert(ctx->recvBuf != NULL);
+    }
+    
+    n = read(socket, &ctx->recvBuf[ctx->recvOff + ctx->recvLen], len);
+    if (n > 0) ctx->recvLen += n;
+    if (n == 0) *error = ECONNRESET;
+    if (n < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) *error = errno;
+    return (n > 0) ? n : 0;
+}
+
+// accepts each complete message in the receive buffer, returns an errno.h code if the stream is invalid
+static int _BRPeerAcceptMessages(BRPeer *peer, double now)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t off = ctx->recvOff, len = ctx->recvOff + ctx->recvLen;
+    const uint8_t *header;
+    uint32_t msgLen, checksum;
+    UInt256 hash;
+    int error = 0;
+    
+    ctx->recvNeed = 0;
+    
+    while (! error && ctx->socket >= 0) {
+        off = _BRPeerFindMagic(ctx->recvBuf, off, len, ctx->magicNumber); // skip any garbage before the next message
+        if (len - off < HEADER_LENGTH) break;
+        header = &ctx->recvBuf[off];
+        msgLen = UInt32GetLE(&header[16]);
+        checksum = UInt32GetLE(&header[20]);
+        
+        if (header[15] != 0) { // verify header type field is NULL terminated
+            peer_log(peer, "malformed message header: type not NULL terminated");
+            error = EPROTO;
+        }
+        else if (msgLen > MAX_MSG_LENGTH) { // check message length
+            peer_log(peer, "error reading %s, message length %"PRIu32" is too long", &header[4], msgLen);
+            error = EPROTO;
+        }
+        else if (len - off - HEADER_LENGTH < msgLen) { // wait for the rest of the payload
+            ctx->recvNeed = HEADER_LENGTH + msgLen - (len - off);
+            break;
+        }
+        else {
+            BRSHA256_2(&hash, &header[HEADER_LENGTH], msgLen);
             
-            if (error) {
-                peer_log(peer, "%s", strerror(error));
-            }
-            else if (header[15] != 0) { // verify header type field is NULL terminated
-                peer_log(peer, "malformed message header: type not NULL terminated");
+            if (UInt32GetLE(&hash) != checksum) { // verify checksum
+                peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%"PRIu32
+                         ", SHA256_2:%s", &header[4], UInt32GetLE(&hash), checksum, msgLen, u256hex(hash));
                 error = EPROTO;
             }
-            else if (len == HEADER_LENGTH) {
-                const char *type = (const char *)(&header[4]);
-                uint32_t msgLen = UInt32GetLE(&header[16]);
-                uint32_t checksum = UInt32GetLE(&header[20]);
-                UInt256 hash;
-                
-                if (msgLen > MAX_MSG_LENGTH) { // check message length
-                    peer_log(peer, "error reading %s, message length %"PRIu32" is too long", type, msgLen);
-                    error = EPROTO;
-                }
-                else {
-                    if (msgLen > payloadLen) payload = realloc(payload, (payloadLen = msgLen));
-                    assert(payload != NULL);
-                    len = 0;
-                    socket = ctx->socket;
-                    msgTimeout = time + MESSAGE_TIMEOUT;
-                    
-                    while (socket >= 0 && ! error && len < msgLen) {
-                        n = read(socket, &payload[len], msgLen - len);
-                        if (n > 0) len += n;
-                        if (n == 0) error = ECONNRESET;
-                        if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                        gettimeofday(&tv, NULL);
-                        time = tv.tv_sec + (double)tv.tv_usec/1000000;
-                        if (n > 0) msgTimeout = time + MESSAGE_TIMEOUT;
-                        if (! error && time >= msgTimeout) error = ETIMEDOUT;
-                        socket = ctx->socket;
-                    }
-                    
-                    if (error) {
-                        peer_log(peer, "%s", strerror(error));
-                    }
-                    else if (len == msgLen) {
-                        BRSHA256_2(&hash, payload, msgLen);
-                        
-                        if (UInt32GetLE(&hash) != checksum) { // verify checksum
-                            peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%"PRIu32
-                                     ", SHA256_2:%s", type, UInt32GetLE(&hash), checksum, msgLen, u256hex(hash));
-                            error = EPROTO;
-                        }
-                        else if (! _BRPeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
-                    }
-                }
+            else if (! _BRPeerAcceptMessage(peer, &header[HEADER_LENGTH], msgLen, (const char *)&header[4])) {
+                error = EPROTO;
             }
+            
+            off += HEADER_LENGTH + msgLen;
         }
-        
-        free(payload);
     }
     
+    ctx->recvLen = len - off;
+    ctx->recvOff = (ctx->recvLen > 0) ? off : 0;
+    
+    if (ctx->recvLen == 0 && ctx->recvSize > RECV_IDLE_SIZE) { // give back the memory used by a large message
+        free(ctx->recvBuf);
+        ctx->recvBuf = NULL;
+        ctx->recvSize = 0;
+    }
+    
+    // time out a message whose header has arrived once its payload stops arriving
+    ctx->msgTimeout = (ctx->recvLen >= HEADER_LENGTH) ? now + MESSAGE_TIMEOUT : DBL_MAX;
+    return error;
+}
+
+// closes the socket, fails any pending ping and mempool callbacks, and calls the disconnected callback, which may free
+// peer
+static void _BRPeerDidDisconnect(BRPeer *peer, int error)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    int socket;
+    
+    if (array_count(ctx->headerBatches) > 0) _BRPeerRelayHeaders(peer, 1); // finish headers received before disconnect
     socket = ctx->socket;
     ctx->socket = -1;
     ctx->status = BRPeerStatusDisconnected;
     if (socket >= 0) close(socket);
+    if (ctx->recvBuf) free(ctx->recvBuf);
+    ctx->recvBuf = NULL;
+    ctx->recvSize = ctx->recvOff = ctx->recvLen = ctx->recvNeed = 0;
+    ctx->msgTimeout = DBL_MAX;
     peer_log(peer, "disconnected");
     
     while (array_count(ctx->pongCallback) > 0) {
@@ -1037,6 +1440,62 @@ static void *_peerThreadRoutine(void *arg)
     if (ctx->mempoolCallback) ctx->mempoolCallback(ctx->mempoolInfo, 0);
     ctx->mempoolCallback = NULL;
     if (ctx->disconnected) ctx->disconnected(ctx->info, error);
+}
+
+static void *_peerThreadRoutine(void *arg)
+{
+    BRPeer *peer = arg;
+    BRPeerContext *ctx = arg;
+    int socket, error = 0;
+
+    pthread_cleanup_push(ctx->threadCleanup, ctx->info);
+    
+    if (_BRPeerOpenSocket(peer, PF_INET6, CONNECT_TIMEOUT, &error)) {
+        struct timeval tv;
+        double time = 0;
+
+        gettimeofday(&tv, NULL);
+        ctx->startTime = tv.tv_sec + (double)tv.tv_usec/1000000;
+        BRPeerSendVersionMessage(peer);
+        
+        while (! error && (socket = ctx->socket) >= 0) {
+            // relay any header batches that finished verifying while we were waiting on the network, and if nothing is
+            // waiting to be read, wait for the rest here rather than in recv() until the receive timeout, since the
+            // next request may depend on them
+            if (array_count(ctx->headerBatches) > 0 &&
+                ! _BRPeerRelayHeaders(peer, ! _BRPeerSocketReadable(socket))) {
+                error = EPROTO;
+                break;
+            }
+            
+            // read as much as is available, up to the socket's receive timeout, and accept every message it completes
+            if (_BRPeerRecv(peer, socket, &error) > 0 && ! error) {
+                gettimeofday(&tv, NULL);
+                time = tv.tv_sec + (double)tv.tv_usec/1000000;
+                error = _BRPeerAcceptMessages(peer, time);
+            }
+            
+            gettimeofday(&tv, NULL);
+            time = tv.tv_sec + (double)tv.tv_usec/1000000;
+            if (! error && (time >= ctx->disconnectTime || time >= ctx->msgTimeout)) error = ETIMEDOUT;
+
+            if (! error && time >= ctx->mempoolTime) {
+                peer_log(peer, "done waiting for mempool response");
+                BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
+                ctx->mempoolCallback = NULL;
+                ctx->mempoolTime = DBL_MAX;
+            }
+            
+            if (! error && time >= ctx->callbackTime) {
+                ctx->callbackTime = DBL_MAX;
+                if (ctx->scheduledCallback) ctx->scheduledCallback(ctx->info);
+            }
+        }
+        
+        if (error) peer_log(peer, "%s", strerror(error));
+    }
+    
+    _BRPeerDidDisconnect(peer, error);
     pthread_cleanup_pop(1);
     return NULL; // detached threads don't need to return a value
 }
@@ -1045,6 +1504,519 @@ static void _dummyThreadCleanup(void *info)
 {
 }
 
+#if PEER_LOOP_SUPPORTED
+
+// one epoll instance and timer wheel of a BRPeerLoop, served by a single thread so callbacks for a peer are never made
+// concurrently
+struct BRPeerLoopThreadStruct {
+    int epoll, wakeup; // wakeup is an eventfd that other threads write to after adding a request
+    pthread_t thread;
+    pthread_mutex_t lock; // guards requests, and loopRequests of each peer
+    BRPeer **requests; // peers with connect, disconnect or timer requests from other threads
+    BRPeer *wheel[LOOP_WHEEL_SLOTS]; // peers waiting on a timer, in the slot for timerTick
+    uint64_t tick; // last tick the wheel was advanced to, in units of LOOP_TICK
+    volatile int stop;
+};
+
+struct BRPeerLoopStruct {
+    BRPeerLoopThread *threads;
+    size_t threadCount, next;
+    BRThreadPool *jobs;
+    pthread_mutex_t lock;
+};
+
+inline static double _BRPeerLoopNow(void)
+{
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (double)tv.tv_usec/1000000;
+}
+
+// sets the socket events the loop thread waits on for peer, must be called with sendLock held
+static void _BRPeerLoopWatch(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    struct epoll_event event = { EPOLLIN, { peer } };
+    
+    ctx->watchingOut = (ctx->loopState == loop_connecting || ctx->sendOff < array_count(ctx->sendBuf));
+    if (ctx->loopState == loop_connecting) event.events = 0;
+    if (ctx->watchingOut) event.events |= EPOLLOUT;
+    if (ctx->socket >= 0) epoll_ctl(ctx->loopThread->epoll, EPOLL_CTL_MOD, ctx->socket, &event);
+}
+
+// queues a request for the loop thread serving peer, requests other than connect are dropped while peer is idle
+static void _BRPeerLoopRequest(BRPeer *peer, int request)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeerLoopThread *thread = ctx->loopThread;
+    uint64_t one = 1;
+    int queued = 0;
+    
+    pthread_mutex_lock(&thread->lock);
+    
+    if (request == LOOP_REQ_CONNECT && ctx->loopState == loop_idle) {
+        pthread_mutex_lock(&ctx->sendLock);
+        ctx->loopState = loop_connecting;
+        pthread_mutex_unlock(&ctx->sendLock);
+    }
+    
+    if (ctx->loopState != loop_idle) {
+        if (ctx->loopRequests == 0) array_add(thread->requests, peer);
+        ctx->loopRequests |= request;
+        queued = 1;
+    }
+    
+    pthread_mutex_unlock(&thread->lock);
+    if (queued && write(thread->wakeup, &one, sizeof(one)) < 0) peer_log(peer, "%s", strerror(errno));
+}
+
+static void _BRPeerLoopUnschedule(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeer **slot = &ctx->loopThread->wheel[ctx->timerTick % LOOP_WHEEL_SLOTS];
+    
+    if (ctx->timerTick == 0) return; // not in the wheel
+    if (ctx->timerPrev) ((BRPeerContext *)ctx->timerPrev)->timerNext = ctx->timerNext;
+    else *slot = ctx->timerNext;
+    if (ctx->timerNext) ((BRPeerContext *)ctx->timerNext)->timerPrev = ctx->timerPrev;
+    ctx->timerPrev = ctx->timerNext = NULL;
+    ctx->timerTick = 0;
+}
+
+// moves peer to the timer wheel slot for its next deadline, peers without one are checked once per wheel round
+static void _BRPeerLoopSchedule(BRPeer *peer, double now)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeerLoopThread *thread = ctx->loopThread;
+    double deadline = ctx->disconnectTime;
+    uint64_t tick = thread->tick + LOOP_WHEEL_SLOTS;
+    BRPeer **slot;
+    
+    if (ctx->mempoolTime < deadline) deadline = ctx->mempoolTime;
+    if (ctx->callbackTime < deadline) deadline = ctx->callbackTime;
+    if (ctx->msgTimeout < deadline) deadline = ctx->msgTimeout;
+    // headers are verified on the shared thread pool, so poll for finished batches each tick
+    if (array_count(ctx->headerBatches) > 0 && now < deadline) deadline = now;
+    if (deadline < tick*LOOP_TICK) tick = (uint64_t)(deadline/LOOP_TICK) + 1;
+    if (tick <= thread->tick) tick = thread->tick + 1;
+    _BRPeerLoopUnschedule(peer);
+    slot = &thread->wheel[tick % LOOP_WHEEL_SLOTS];
+    ctx->timerTick = tick;
+    ctx->timerNext = *slot;
+    if (*slot) ((BRPeerContext *)*slot)->timerPrev = peer;
+    *slot = peer;
+}
+
+// ends the connection, then makes the callbacks a peer thread would make before exiting, which may free peer
+static void _BRPeerLoopClose(BRPeer *peer, int error)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeerLoopThread *thread = ctx->loopThread;
+    void (*threadCleanup)(void *) = ctx->threadCleanup;
+    void *info = ctx->info;
+    
+    _BRPeerLoopUnschedule(peer);
+    pthread_mutex_lock(&thread->lock);
+    
+    for (size_t i = array_count(thread->requests); ctx->loopRequests && i > 0; i--) {
+        if (thread->requests[i - 1] == peer) array_rm(thread->requests, i - 1);
+    }
+    
+    ctx->loopRequests = 0;
+    pthread_mutex_lock(&ctx->sendLock);
+    ctx->loopState = loop_idle;
+    array_clear(ctx->sendBuf);
+    ctx->sendOff = 0;
+    ctx->sendCongested = 0;
+    pthread_mutex_unlock(&ctx->sendLock);
+    pthread_mutex_unlock(&thread->lock);
+    if (ctx->socket >= 0) epoll_ctl(thread->epoll, EPOLL_CTL_DEL, ctx->socket, NULL);
+    _BRPeerDidDisconnect(peer, error);
+    threadCleanup(info);
+}
+
+// starts a non-blocking connect, falling back to IPv4 like _BRPeerOpenSocket()
+static void _BRPeerLoopConnect(BRPeer *peer, int domain, double now)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    struct sockaddr_storage addr;
+    socklen_t addrLen = _BRPeerSockAddr(peer, domain, &addr);
+    struct epoll_event event = { EPOLLOUT, { peer } };
+    int err = 0, on = 1;
+    
+    ctx->socket = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ctx->socket < 0) err = errno;
+    
+    if (! err) {
+        setsockopt(ctx->socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        if (connect(ctx->socket, (struct sockaddr *)&addr, addrLen) < 0 && errno != EINPROGRESS) err = errno;
+        
+        if (err && domain == PF_INET6 && _BRPeerIsIPv4(peer)) {
+            close(ctx->socket);
+            _BRPeerLoopConnect(peer, PF_INET, now); // fallback to IPv4
+            return;
+        }
+    }
+    
+    if (! err && epoll_ctl(ctx->loopThread->epoll, EPOLL_CTL_ADD, ctx->socket, &event) < 0) err = errno;
+    
+    if (err) {
+        peer_log(peer, "connect error: %s", strerror(err));
+        _BRPeerLoopClose(peer, err);
+    }
+    else _BRPeerLoopSchedule(peer, now);
+}
+
+// updates sendCongested after the send queue changed, must be called with sendLock held, returns true if it changed
+static int _BRPeerLoopSendCongested(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t queued = array_count(ctx->sendBuf) - ctx->sendOff;
+    int congested = ctx->sendCongested;
+    
+    if (ctx->sendHighWater == 0) congested = 0;
+    else if (queued > ctx->sendHighWater) congested = 1;
+    else if (queued <= ctx->sendHighWater/2) congested = 0;
+    if (congested == ctx->sendCongested) return 0;
+    ctx->sendCongested = congested;
+    return 1;
+}
+
+// sends as much of the send queue as the socket accepts, returns an errno.h code if the socket failed
+static int _BRPeerLoopFlush(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    void (*sendQueue)(void *, int) = NULL;
+    ssize_t n = 0;
+    int error = 0;
+    
+    pthread_mutex_lock(&ctx->sendLock);
+    
+    // the socket is only closed after loopState leaves loop_open, so it can't be closed while sendLock is held here
+    while (! error && ctx->loopState == loop_open && ctx->sendOff < array_count(ctx->sendBuf)) {
+        n = send(ctx->socket, &ctx->sendBuf[ctx->sendOff], array_count(ctx->sendBuf) - ctx->sendOff, MSG_NOSIGNAL);
+        if (n >= 0) ctx->sendOff += n;
+        else if (errno == EWOULDBLOCK || errno == EAGAIN) break;
+        else if (errno != EINTR) error = errno;
+    }
+    
+    if (ctx->sendOff == array_count(ctx->sendBuf)) {
+        array_clear(ctx->sendBuf);
+        ctx->sendOff = 0;
+    }
+    
+    if (ctx->loopState == loop_open && ctx->watchingOut != (ctx->sendOff < array_count(ctx->sendBuf))) {
+        _BRPeerLoopWatch(peer);
+    }
+    
+    if (! error && _BRPeerLoopSendCongested(peer)) sendQueue = ctx->sendQueue;
+    pthread_mutex_unlock(&ctx->sendLock);
+    if (sendQueue) sendQueue(ctx->info, 0);
+    return error;
+}
+
+// sends a message from any thread, writing straight from iov when nothing is queued ahead of it, and only copying what
+// the socket doesn't accept right away into the send queue for the loop thread
+static void _BRPeerLoopSend(BRPeer *peer, struct iovec iov[], size_t iovCount)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    void (*sendQueue)(void *, int) = NULL;
+    int congested = 0, error = 0;
+    
+    pthread_mutex_lock(&ctx->sendLock);
+    if (ctx->loopState != loop_open) error = ENOTCONN;
+    
+    while (! error && iovCount > 0 && array_count(ctx->sendBuf) == 0) { // nothing is queued ahead of this message
+        error = _BRPeerSendv(ctx->socket, iov, &iovCount);
+        if (error == EINTR) error = 0;
+        else if (error == EWOULDBLOCK || error == EAGAIN) break;
+    }
+    
+    if (error == EWOULDBLOCK || error == EAGAIN) error = 0;
+    
+    for (size_t i = 0; ! error && i < iovCount; i++) {
+        array_add_array(ctx->sendBuf, (uint8_t *)iov[i].iov_base, iov[i].iov_len);
+    }
+    
+    if (! error && iovCount > 0 && ! ctx->watchingOut) _BRPeerLoopWatch(peer);
+    if (! error && _BRPeerLoopSendCongested(peer)) sendQueue = ctx->sendQueue, congested = ctx->sendCongested;
+    pthread_mutex_unlock(&ctx->sendLock);
+    if (sendQueue) sendQueue(ctx->info, congested);
+    
+    if (error) {
+        peer_log(peer, "%s", strerror(error));
+        BRPeerDisconnect(peer);
+    }
+}
+
+// checks the timers of peer, and closes the connection if it timed out
+static void _BRPeerLoopTimers(BRPeer *peer, double now)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    int error = 0;
+    
+    if (array_count(ctx->headerBatches) > 0 && ! _BRPeerRelayHeaders(peer, 0)) error = EPROTO;
+    if (! error && (now >= ctx->disconnectTime || now >= ctx->msgTimeout)) error = ETIMEDOUT;
+    
+    if (! error && now >= ctx->mempoolTime) {
+        peer_log(peer, "done waiting for mempool response");
+        BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
+        ctx->mempoolCallback = NULL;
+        ctx->mempoolTime = DBL_MAX;
+    }
+    
+    if (! error && now >= ctx->callbackTime) {
+        ctx->callbackTime = DBL_MAX;
+        if (ctx->scheduledCallback) ctx->scheduledCallback(ctx->info);
+    }
+    
+    if (error) {
+        peer_log(peer, "%s", strerror(error));
+        _BRPeerLoopClose(peer, error);
+    }
+    else _BRPeerLoopSchedule(peer, now);
+}
+
+// handles socket events for peer, which acts as its connect/handshake/read/write state machine
+static void _BRPeerLoopEvent(BRPeer *peer, uint32_t events, double now)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeerLoopThread *thread = ctx->loopThread;
+    socklen_t optLen = sizeof(int);
+    int error = 0;
+    
+    if (ctx->loopState == loop_connecting) {
+        if (getsockopt(ctx->socket, SOL_SOCKET, SO_ERROR, &error, &optLen) < 0) error = errno;
+        
+        if (error) {
+            peer_log(peer, "connect error: %s", strerror(error));
+            _BRPeerLoopClose(peer, error);
+            return;
+        }
+        
+        peer_log(peer, "socket connected");
+        pthread_mutex_lock(&thread->lock);
+        pthread_mutex_lock(&ctx->sendLock);
+        ctx->loopState = loop_open;
+        _BRPeerLoopWatch(peer);
+        pthread_mutex_unlock(&ctx->sendLock);
+        pthread_mutex_unlock(&thread->lock);
+        ctx->startTime = now;
+        BRPeerSendVersionMessage(peer);
+    }
+    else {
+        // relay any header batches that finished verifying while we were waiting on the network
+        if (array_count(ctx->headerBatches) > 0 && ! _BRPeerRelayHeaders(peer, 0)) error = EPROTO;
+        if (! error && (events & EPOLLOUT)) error = _BRPeerLoopFlush(peer);
+        
+        if (! error && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && _BRPeerRecv(peer, ctx->socket, &error) > 0 &&
+            ! error) error = _BRPeerAcceptMessages(peer, now);
+        
+        if (error) {
+            peer_log(peer, "%s", strerror(error));
+            _BRPeerLoopClose(peer, error);
+            return;
+        }
+    }
+    
+    _BRPeerLoopSchedule(peer, now);
+}
+
+// handles requests queued by other threads
+static void _BRPeerLoopRequests(BRPeerLoopThread *thread, double now)
+{
+    BRPeer *peer;
+    BRPeerContext *ctx;
+    uint64_t count;
+    int requests;
+    
+    if (read(thread->wakeup, &count, sizeof(count)) < 0 && errno != EAGAIN) return;
+    pthread_mutex_lock(&thread->lock);
+    
+    while (array_count(thread->requests) > 0) {
+        peer = thread->requests[array_count(thread->requests) - 1];
+        ctx = (BRPeerContext *)peer;
+        array_set_count(thread->requests, array_count(thread->requests) - 1);
+        requests = ctx->loopRequests;
+        ctx->loopRequests = 0;
+        pthread_mutex_unlock(&thread->lock);
+        
+        if ((requests & LOOP_REQ_DISCONNECT) && ctx->socket >= 0) {
+            // report ECONNRESET like a peer thread, whose read fails once BRPeerDisconnect() shuts down the socket
+            peer_log(peer, "%s", strerror(ECONNRESET));
+            _BRPeerLoopClose(peer, ECONNRESET);
+        }
+        else if (requests & LOOP_REQ_DISCONNECT) _BRPeerLoopClose(peer, 0);
+        else if ((requests & LOOP_REQ_CONNECT) && ctx->socket < 0) _BRPeerLoopConnect(peer, PF_INET6, now);
+        else _BRPeerLoopSchedule(peer, now);
+        pthread_mutex_lock(&thread->lock);
+    }
+    
+    pthread_mutex_unlock(&thread->lock);
+}
+
+// advances the timer wheel to now, checking the timers of each peer whose tick has come
+static void _BRPeerLoopTick(BRPeerLoopThread *thread, double now)
+{
+    uint64_t tick = (uint64_t)(now/LOOP_TICK);
+    BRPeer *peer, *next;
+    
+    if (tick > thread->tick + LOOP_WHEEL_SLOTS) thread->tick = tick - LOOP_WHEEL_SLOTS; // visit each slot only once
+    
+    while (thread->tick < tick) {
+        thread->tick++;
+        
+        for (peer = thread->wheel[thread->tick % LOOP_WHEEL_SLOTS]; peer; peer = next) {
+            next = ((BRPeerContext *)peer)->timerNext; // peer may be rescheduled into this slot, or freed
+            if (((BRPeerContext *)peer)->timerTick <= thread->tick) _BRPeerLoopTimers(peer, now);
+        }
+    }
+}
+
+static void *_BRPeerLoopThreadRoutine(void *arg)
+{
+    BRPeerLoopThread *thread = arg;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    double now;
+    int i, count, timeout, wakeup;
+    
+    while (! thread->stop) {
+        now = _BRPeerLoopNow();
+        timeout = (int)(((thread->tick + 1)*LOOP_TICK - now)*1000) + 1; // wait until the next tick
+        count = epoll_wait(thread->epoll, events, LOOP_MAX_EVENTS, (timeout > 0) ? timeout : 0);
+        now = _BRPeerLoopNow();
+        
+        // requests are handled after socket events, since a disconnect request may free a peer with events pending
+        for (i = 0, wakeup = 0; i < count; i++) {
+            if (events[i].data.ptr) _BRPeerLoopEvent(events[i].data.ptr, events[i].events, now);
+            else wakeup = 1;
+        }
+        
+        if (wakeup) _BRPeerLoopRequests(thread, now);
+        _BRPeerLoopTick(thread, now);
+    }
+    
+    return NULL;
+}
+
+// returns a newly allocated event loop that serves peer connections from threadCount threads, and runs blocking jobs
+// such as DNS lookups on threadCount helper threads, or NULL if the platform doesn't support it
+// must be freed by calling BRPeerLoopFree()
+BRPeerLoop *BRPeerLoopNew(size_t threadCount)
+{
+    BRPeerLoop *loop = calloc(1, sizeof(*loop));
+    BRPeerLoopThread *thread;
+    struct epoll_event event = { EPOLLIN, { NULL } };
+    pthread_attr_t attr;
+    size_t i;
+    int r = 1, err = 0;
+    
+    assert(loop != NULL);
+    if (threadCount == 0) threadCount = 1;
+    loop->threads = calloc(threadCount, sizeof(*loop->threads));
+    assert(loop->threads != NULL);
+    pthread_mutex_init(&loop->lock, NULL);
+    if ((err = pthread_attr_init(&attr)) != 0) r = 0;
+    else if ((err = pthread_attr_setstacksize(&attr, PTHREAD_STACK_SIZE)) != 0) r = 0;
+    
+    for (i = 0; r && i < threadCount; i++) {
+        thread = &loop->threads[i];
+        thread->tick = (uint64_t)(_BRPeerLoopNow()/LOOP_TICK);
+        thread->epoll = epoll_create1(EPOLL_CLOEXEC);
+        thread->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        array_new(thread->requests, 10);
+        pthread_mutex_init(&thread->lock, NULL);
+        
+        if (thread->epoll < 0 || thread->wakeup < 0 ||
+            epoll_ctl(thread->epoll, EPOLL_CTL_ADD, thread->wakeup, &event) < 0 ||
+            (err = pthread_create(&thread->thread, &attr, _BRPeerLoopThreadRoutine, thread)) != 0) {
+            if (err == 0) err = errno; // pthread_create() returns its error instead of setting errno
+            if (thread->epoll >= 0) close(thread->epoll);
+            if (thread->wakeup >= 0) close(thread->wakeup);
+            array_free(thread->requests);
+            pthread_mutex_destroy(&thread->lock);
+            r = 0;
+        }
+        else loop->threadCount++;
+    }
+    
+    pthread_attr_destroy(&attr);
+    if (r) loop->jobs = BRThreadPoolNew(threadCount);
+    
+    if (! r) {
+        _peer_log("error creating peer loop: %s\n", strerror(err));
+        BRPeerLoopFree(loop);
+        loop = NULL;
+    }
+    
+    return loop;
+}
+
+// queues job(info) to run on a helper thread of loop, so it doesn't hold up peer connections
+void BRPeerLoopAddJob(BRPeerLoop *loop, void *info, void (*job)(void *info))
+{
+    assert(loop != NULL);
+    assert(job != NULL);
+    BRThreadPoolAdd(loop->jobs, info, job);
+}
+
+// stops the loop threads and frees memory allocated for loop, peers served by loop must be disconnected first
+void BRPeerLoopFree(BRPeerLoop *loop)
+{
+    BRPeerLoopThread *thread;
+    uint64_t one = 1;
+    
+    assert(loop != NULL);
+    if (loop->jobs) BRThreadPoolFree(loop->jobs);
+    
+    for (size_t i = 0; i < loop->threadCount; i++) {
+        thread = &loop->threads[i];
+        thread->stop = 1;
+        if (write(thread->wakeup, &one, sizeof(one)) < 0) _peer_log("error stopping peer loop: %s\n", strerror(errno));
+        pthread_join(thread->thread, NULL);
+        close(thread->epoll);
+        close(thread->wakeup);
+        array_free(thread->requests);
+        pthread_mutex_destroy(&thread->lock);
+    }
+    
+    pthread_mutex_destroy(&loop->lock);
+    free(loop->threads);
+    free(loop);
+}
+
+#else // ! PEER_LOOP_SUPPORTED
+
+struct BRPeerLoopThreadStruct {
+    int unused;
+};
+
+static void _BRPeerLoopRequest(BRPeer *peer, int request)
+{
+}
+
+static void _BRPeerLoopSend(BRPeer *peer, struct iovec iov[], size_t iovCount)
+{
+}
+
+BRPeerLoop *BRPeerLoopNew(size_t threadCount)
+{
+    return NULL;
+}
+
+void BRPeerLoopAddJob(BRPeerLoop *loop, void *info, void (*job)(void *info))
+{
+    assert(loop != NULL);
+}
+
+void BRPeerLoopFree(BRPeerLoop *loop)
+{
+    assert(loop != NULL);
+}
+
+#endif // PEER_LOOP_SUPPORTED
+
 // returns a newly allocated BRPeer struct that must be freed by calling BRPeerFree()
 BRPeer *BRPeerNew(uint32_t magicNumber)
 {
@@ -1057,13 +2029,18 @@ BRPeer *BRPeerNew(uint32_t magicNumber)
     array_new(ctx->currentBlockTxHashes, 10);
     array_new(ctx->knownTxHashes, 10);
     ctx->knownTxHashSet = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    array_new(ctx->headerBatches, MAX_HEADER_BATCHES);
     array_new(ctx->pongInfo, 10);
     array_new(ctx->pongCallback, 10);
     ctx->pingTime = DBL_MAX;
     ctx->mempoolTime = DBL_MAX;
+    ctx->callbackTime = DBL_MAX;
     ctx->disconnectTime = DBL_MAX;
+    ctx->msgTimeout = DBL_MAX;
     ctx->socket = -1;
     ctx->threadCleanup = _dummyThreadCleanup;
+    array_new(ctx->sendBuf, 0);
+    pthread_mutex_init(&ctx->sendLock, NULL);
     return &ctx->peer;
 }
 
@@ -1079,6 +2056,7 @@ BRPeer *BRPeerNew(uint32_t magicNumber)
 // BRTransaction *requestedTx(void *, UInt256) - called when "getdata" message with a tx hash is received from peer
 // int networkIsReachable(void *) - must return true when networking is available, false otherwise
 // void threadCleanup(void *) - called before a thread terminates to faciliate any needed cleanup
+// - for a peer served by a BRPeerLoop, called on the loop thread after each connection ends
 void BRPeerSetCallbacks(BRPeer *peer, void *info,
                         void (*connected)(void *info),
                         void (*disconnected)(void *info, int error),
@@ -1117,6 +2095,57 @@ void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime)
     ((BRPeerContext *)peer)->earliestKeyTime = earliestKeyTime;
 }
 
+// proof-of-work hashes for known headers are taken from cache instead of being recomputed, cache may be NULL
+// cache must remain valid until the peer is freed
+void BRPeerSetPoWCache(BRPeer *peer, BRPoWCache *cache)
+{
+    ((BRPeerContext *)peer)->powCache = cache;
+}
+
+// connections to peer are served by loop instead of a thread of their own, or by their own thread if loop is NULL
+// callbacks are then made from a loop thread that's shared with other peers, so they shouldn't block for long
+// not thread-safe, set while peer is disconnected, loop must outlive peer
+void BRPeerSetLoop(BRPeer *peer, BRPeerLoop *loop)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    
+    assert(ctx->status == BRPeerStatusDisconnected);
+    ctx->loop = loop;
+    ctx->loopThread = NULL;
+#if PEER_LOOP_SUPPORTED
+    if (loop) { // spread peers across the loop threads
+        pthread_mutex_lock(&loop->lock);
+        ctx->loopThread = &loop->threads[loop->next++ % loop->threadCount];
+        pthread_mutex_unlock(&loop->lock);
+    }
+#endif
+}
+
+// sendQueue is called with congested set once more than highWater bytes are queued for a peer served by a BRPeerLoop
+// because its socket isn't keeping up, and with congested cleared once the queue drains to half of that, or never if
+// highWater is 0, it's called with the info given to BRPeerSetCallbacks() from whichever thread crossed the mark
+void BRPeerSetSendQueueCallback(BRPeer *peer, size_t highWater, void (*sendQueue)(void *info, int congested))
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    
+    pthread_mutex_lock(&ctx->sendLock);
+    ctx->sendHighWater = highWater;
+    ctx->sendQueue = sendQueue;
+    pthread_mutex_unlock(&ctx->sendLock);
+}
+
+// number of bytes of sent messages still queued for a peer served by a BRPeerLoop
+size_t BRPeerSendQueueLength(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t queued;
+    
+    pthread_mutex_lock(&ctx->sendLock);
+    queued = array_count(ctx->sendBuf) - ctx->sendOff;
+    pthread_mutex_unlock(&ctx->sendLock);
+    return queued;
+}
+
 // call this when local block height changes (helps detect tarpit nodes)
 void BRPeerSetCurrentBlockHeight(BRPeer *peer, uint32_t currentBlockHeight)
 {
@@ -1150,7 +2179,10 @@ void BRPeerConnect(BRPeer *peer)
             gettimeofday(&tv, NULL);
             ctx->disconnectTime = tv.tv_sec + (double)tv.tv_usec/1000000 + CONNECT_TIMEOUT;
 
-            if (pthread_attr_init(&attr) != 0) {
+            if (ctx->loop) {
+                _BRPeerLoopRequest(peer, LOOP_REQ_CONNECT);
+            }
+            else if (pthread_attr_init(&attr) != 0) {
                 error = ENOMEM;
                 peer_log(peer, "error creating thread");
                 ctx->status = BRPeerStatusDisconnected;
@@ -1175,7 +2207,10 @@ void BRPeerDisconnect(BRPeer *peer)
     BRPeerContext *ctx = (BRPeerContext *)peer;
     int socket = ctx->socket;
 
-    if (socket >= 0) {
+    if (ctx->loop) {
+        _BRPeerLoopRequest(peer, LOOP_REQ_DISCONNECT); // the loop thread closes the socket
+    }
+    else if (socket >= 0) {
         ctx->socket = -1;
         if (shutdown(socket, SHUT_RDWR) < 0) peer_log(peer, "%s", strerror(errno));
         close(socket);
@@ -1190,6 +2225,49 @@ void BRPeerScheduleDisconnect(BRPeer *peer, double seconds)
     
     gettimeofday(&tv, NULL);
     ctx->disconnectTime = (seconds < 0) ? DBL_MAX : tv.tv_sec + (double)tv.tv_usec/1000000 + seconds;
+    if (ctx->loop) _BRPeerLoopRequest(peer, LOOP_REQ_TIMERS);
+}
+
+// call this to (re)schedule a call to callback with the info given to BRPeerSetCallbacks() in the given number of
+// seconds, or < 0 to cancel, the call is made from the thread serving peer, and only while it's connected
+void BRPeerScheduleCallback(BRPeer *peer, double seconds, void (*callback)(void *info))
+{
+    BRPeerContext *ctx = ((BRPeerContext *)peer);
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    ctx->scheduledCallback = callback;
+    ctx->callbackTime = (seconds < 0) ? DBL_MAX : tv.tv_sec + (double)tv.tv_usec/1000000 + seconds;
+    if (ctx->loop) _BRPeerLoopRequest(peer, LOOP_REQ_TIMERS);
+}
+
+// blockInv is called with the block hashes from each inv message, and if it returns true, the blocks aren't requested
+// from peer, and neither is the next batch of block hashes after a full one, leaving both to the caller
+// not thread-safe, set while peer is disconnected or from a peer callback
+void BRPeerSetBlockInvCallback(BRPeer *peer, int (*blockInv)(void *info, const UInt256 blockHashes[],
+                                                             size_t blockCount))
+{
+    ((BRPeerContext *)peer)->blockInv = blockInv;
+}
+
+// switches peer to BIP157 compact filter mode: headers messages are relayed without requesting the next batch of
+// headers or switching to getblocks, and getdata requests full blocks
+// relayedCfheaders is called with the basic filter hashes for the blocks up to stopHash, and the filter header before
+// them, relayedCfilter with each basic filter, which is only valid for the duration of the callback
+// relayedFullBlock is called with each full block as a merkleblock that matches all of its tx, and the block's tx in a
+// single call, the callee takes ownership of block and each tx, but the txs array is only valid during the callback
+// not thread-safe, set while peer is disconnected or from a peer callback
+void BRPeerSetCompactFilterCallbacks(BRPeer *peer,
+                                     void (*relayedCfheaders)(void *info, UInt256 stopHash, UInt256 prevFilterHeader,
+                                                              const UInt256 filterHashes[], size_t hashesCount),
+                                     void (*relayedCfilter)(void *info, UInt256 blockHash, const uint8_t *filter,
+                                                            size_t filterLen),
+                                     void (*relayedFullBlock)(void *info, BRMerkleBlock *block, BRTransaction *txs[],
+                                                              size_t txCount))
+{
+    ((BRPeerContext *)peer)->relayedCfheaders = relayedCfheaders;
+    ((BRPeerContext *)peer)->relayedCfilter = relayedCfilter;
+    ((BRPeerContext *)peer)->relayedFullBlock = relayedFullBlock;
 }
 
 // call this when wallet addresses need to be added to bloom filter
@@ -1255,31 +2333,33 @@ void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const ch
     }
     else {
         BRPeerContext *ctx = (BRPeerContext *)peer;
-        uint8_t buf[HEADER_LENGTH + msgLen], hash[32];
-        size_t off = 0;
-        ssize_t n = 0;
+        uint8_t header[HEADER_LENGTH], hash[32];
+        struct iovec iov[2] = { { header, sizeof(header) }, { (void *)msg, msgLen } }; // payload is sent in place
+        size_t off = 0, iovCount = (msgLen > 0) ? 2 : 1;
         struct timeval tv;
         int socket, error = 0;
         
-        UInt32SetLE(&buf[off], ctx->magicNumber);
+        UInt32SetLE(&header[off], ctx->magicNumber);
         off += sizeof(uint32_t);
-        strncpy((char *)&buf[off], type, 12);
+        strncpy((char *)&header[off], type, 12);
         off += 12;
-        UInt32SetLE(&buf[off], (uint32_t)msgLen);
+        UInt32SetLE(&header[off], (uint32_t)msgLen);
         off += sizeof(uint32_t);
         BRSHA256_2(hash, msg, msgLen);
-        memcpy(&buf[off], hash, sizeof(uint32_t));
-        off += sizeof(uint32_t);
-        memcpy(&buf[off], msg, msgLen);
+        memcpy(&header[off], hash, sizeof(uint32_t));
         peer_log(peer, "sending %s", type);
-        msgLen = 0;
         socket = ctx->socket;
         if (socket < 0) error = ENOTCONN;
         
-        while (socket >= 0 && ! error && msgLen < sizeof(buf)) {
-            n = send(socket, &buf[msgLen], sizeof(buf) - msgLen, MSG_NOSIGNAL);
-            if (n >= 0) msgLen += n;
-            if (n < 0 && errno != EWOULDBLOCK) error = errno;
+        if (ctx->loop) {
+            _BRPeerLoopSend(peer, iov, iovCount);
+            socket = -1;
+            error = 0;
+        }
+        
+        while (socket >= 0 && ! error && iovCount > 0) {
+            error = _BRPeerSendv(socket, iov, &iovCount);
+            if (error == EWOULDBLOCK || error == EAGAIN || error == EINTR) error = 0;
             gettimeofday(&tv, NULL);
             if (! error && tv.tv_sec + (double)tv.tv_usec/1000000 >= ctx->disconnectTime) error = ETIMEDOUT;
             socket = ctx->socket;
@@ -1367,6 +2447,7 @@ void BRPeerSendMempool(BRPeer *peer, const UInt256 knownTxHashes[], size_t known
             ctx->mempoolTime = tv.tv_sec + (double)tv.tv_usec/1000000 + 10.0;
             ctx->mempoolInfo = info;
             ctx->mempoolCallback = completionCallback;
+            if (ctx->loop) _BRPeerLoopRequest(peer, LOOP_REQ_TIMERS);
         }
         
         BRPeerSendMessage(peer, NULL, 0, MSG_MEMPOOL);
@@ -1462,7 +2543,9 @@ void BRPeerSendGetdata(BRPeer *peer, const UInt256 txHashes[], size_t txCount, c
     }
     else if (count > 0) {
         size_t msgLen = BRVarIntSize(count) + (sizeof(uint32_t) + sizeof(UInt256))*(count);
-        uint8_t msg[msgLen];
+        uint8_t *msg = malloc(msgLen); // up to MAX_GETDATA_HASHES items is too large for a peer thread's stack
+
+        assert(msg != NULL);
 
         off += BRVarIntSet(&msg[off], (off <= msgLen ? msgLen - off : 0), count);
         
@@ -1473,8 +2556,8 @@ void BRPeerSendGetdata(BRPeer *peer, const UInt256 txHashes[], size_t txCount, c
             off += sizeof(UInt256);
         }
         
-        for (i = 0; i < blockCount; i++) {
-            UInt32SetLE(&msg[off], inv_filtered_block);
+        for (i = 0; i < blockCount; i++) { // compact filter mode downloads full blocks
+            UInt32SetLE(&msg[off], (((BRPeerContext *)peer)->relayedCfilter) ? inv_block : inv_filtered_block);
             off += sizeof(uint32_t);
             UInt256Set(&msg[off], blockHashes[i]);
             off += sizeof(UInt256);
@@ -1482,9 +2565,34 @@ void BRPeerSendGetdata(BRPeer *peer, const UInt256 txHashes[], size_t txCount, c
         
         ((BRPeerContext *)peer)->sentGetdata = 1;
         BRPeerSendMessage(peer, msg, off, MSG_GETDATA);
+        free(msg);
     }
 }
 
+// sends a getcfheaders message requesting basic filter hashes for the blocks from startHeight through stopHash
+void BRPeerSendGetcfheaders(BRPeer *peer, uint32_t startHeight, UInt256 stopHash)
+{
+    uint8_t msg[sizeof(uint8_t) + sizeof(uint32_t) + sizeof(UInt256)];
+    
+    msg[0] = GCS_FILTER_TYPE_BASIC;
+    UInt32SetLE(&msg[sizeof(uint8_t)], startHeight);
+    UInt256Set(&msg[sizeof(uint8_t) + sizeof(uint32_t)], stopHash);
+    peer_log(peer, "calling getcfheaders with start height %"PRIu32" and stop %s", startHeight, u256hex(stopHash));
+    BRPeerSendMessage(peer, msg, sizeof(msg), MSG_GETCFHEADERS);
+}
+
+// sends a getcfilters message requesting basic filters for the blocks from startHeight through stopHash
+void BRPeerSendGetcfilters(BRPeer *peer, uint32_t startHeight, UInt256 stopHash)
+{
+    uint8_t msg[sizeof(uint8_t) + sizeof(uint32_t) + sizeof(UInt256)];
+    
+    msg[0] = GCS_FILTER_TYPE_BASIC;
+    UInt32SetLE(&msg[sizeof(uint8_t)], startHeight);
+    UInt256Set(&msg[sizeof(uint8_t) + sizeof(uint32_t)], stopHash);
+    peer_log(peer, "calling getcfilters with start height %"PRIu32" and stop %s", startHeight, u256hex(stopHash));
+    BRPeerSendMessage(peer, msg, sizeof(msg), MSG_GETCFILTERS);
+}
+
 void BRPeerSendGetaddr(BRPeer *peer)
 {
     ((BRPeerContext *)peer)->sentGetaddr = 1;
@@ -1529,12 +2637,23 @@ void BRPeerFree(BRPeer *peer)
     if (ctx->knownBlockHashes) array_free(ctx->knownBlockHashes);
     if (ctx->knownTxHashes) array_free(ctx->knownTxHashes);
     if (ctx->knownTxHashSet) BRSetFree(ctx->knownTxHashSet);
+    
+    if (ctx->headerBatches) {
+        ctx->relayedBlock = NULL; // discard any headers still being verified
+        _BRPeerRelayHeaders(peer, 1);
+        array_free(ctx->headerBatches);
+    }
+    
     if (ctx->pongCallback) array_free(ctx->pongCallback);
     if (ctx->pongInfo) array_free(ctx->pongInfo);
+    if (ctx->recvBuf) free(ctx->recvBuf);
+    if (ctx->sendBuf) array_free(ctx->sendBuf);
+    pthread_mutex_destroy(&ctx->sendLock);
     free(ctx);
 }
 
 void BRPeerAcceptMessageTest(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type)
 {
     _BRPeerAcceptMessage(peer, msg, msgLen, type);
+    _BRPeerRelayHeaders(peer, 1);
 }
@@ -55,6 +55,7 @@ extern "C" {
 #define SERVICES_NODE_NETWORK 0x01 // services value indicating a node carries full blocks, not just headers
 #define SERVICES_NODE_BLOOM   0x04 // BIP111: https://github.com/bitcoin/bips/blob/master/bip-0111.mediawiki
 #define SERVICES_NODE_BCASH   0x20 // https://github.com/Bitcoin-UAHF/spec/blob/master/uahf-technical-spec.md
+#define SERVICES_NODE_COMPACT_FILTERS 0x40 // BIP157: https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
     
 #define BR_VERSION "1.0"
 #define USER_AGENT "/sumpay:" BR_VERSION "/"
@@ -82,6 +83,10 @@ extern "C" {
 #define MSG_ALERT       "alert"
 #define MSG_REJECT      "reject"   // described in BIP61: https://github.com/bitcoin/bips/blob/master/bip-0061.mediawiki
 #define MSG_FEEFILTER   "feefilter"// described in BIP133 https://github.com/bitcoin/bips/blob/master/bip-0133.mediawiki
+#define MSG_GETCFILTERS "getcfilters" // compact filter messages are described in BIP157
+#define MSG_CFILTER     "cfilter"
+#define MSG_GETCFHEADERS "getcfheaders"
+#define MSG_CFHEADERS   "cfheaders"
 
 #define REJECT_INVALID     0x10 // transaction is invalid for some reason (invalid signature, output value > input, etc)
 #define REJECT_SPENT       0x12 // an input is already spent
@@ -105,6 +110,9 @@ typedef struct {
 
 #define BR_PEER_NONE ((BRPeer) { UINT128_ZERO, 0, 0, 0, 0 })
 
+// an event loop serving the connections of any number of peers from a few threads, using non-blocking sockets
+typedef struct BRPeerLoopStruct BRPeerLoop;
+
 // NOTE: BRPeer functions are not thread-safe
 
 // returns a newly allocated BRPeer struct that must be freed by calling BRPeerFree()
@@ -121,7 +129,8 @@ BRPeer *BRPeerNew(uint32_t magicNumber);
 // void notfound(void *, const UInt256[], size_t, const UInt256[], size_t) - called when "notfound" message is received
 // BRTransaction *requestedTx(void *, UInt256) - called when "getdata" message with a tx hash is received from peer
 // int networkIsReachable(void *) - must return true when networking is available, false otherwise
-// void threadCleanup(void *) - called before a thread terminates to faciliate any needed cleanup    
+// void threadCleanup(void *) - called before a thread terminates to faciliate any needed cleanup
+// - for a peer served by a BRPeerLoop, called on the loop thread after each connection ends
 void BRPeerSetCallbacks(BRPeer *peer, void *info,
                         void (*connected)(void *info),
                         void (*disconnected)(void *info, int error),
@@ -140,9 +149,26 @@ void BRPeerSetCallbacks(BRPeer *peer, void *info,
 // set earliestKeyTime to wallet creation time in order to speed up initial sync
 void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime);
 
+// proof-of-work hashes for known headers are taken from cache instead of being recomputed, cache may be NULL
+// cache must remain valid until the peer is freed
+void BRPeerSetPoWCache(BRPeer *peer, BRPoWCache *cache);
+
 // call this when local best block height changes (helps detect tarpit nodes)
 void BRPeerSetCurrentBlockHeight(BRPeer *peer, uint32_t currentBlockHeight);
 
+// connections to peer are served by loop instead of a thread of their own, or by their own thread if loop is NULL
+// callbacks are then made from a loop thread that's shared with other peers, so they shouldn't block for long
+// not thread-safe, set while peer is disconnected, loop must outlive peer
+void BRPeerSetLoop(BRPeer *peer, BRPeerLoop *loop);
+
+// sendQueue is called with congested set once more than highWater bytes are queued for a peer served by a BRPeerLoop
+// because its socket isn't keeping up, and with congested cleared once the queue drains to half of that, or never if
+// highWater is 0, it's called with the info given to BRPeerSetCallbacks() from whichever thread crossed the mark
+void BRPeerSetSendQueueCallback(BRPeer *peer, size_t highWater, void (*sendQueue)(void *info, int congested));
+
+// number of bytes of sent messages still queued for a peer served by a BRPeerLoop
+size_t BRPeerSendQueueLength(BRPeer *peer);
+
 // current connection status
 BRPeerStatus BRPeerConnectStatus(BRPeer *peer);
 
@@ -155,6 +181,31 @@ void BRPeerDisconnect(BRPeer *peer);
 // call this to (re)schedule a disconnect in the given number of seconds, or < 0 to cancel (useful for sync timeout)
 void BRPeerScheduleDisconnect(BRPeer *peer, double seconds);
 
+// call this to (re)schedule a call to callback with the info given to BRPeerSetCallbacks() in the given number of
+// seconds, or < 0 to cancel, the call is made from the thread serving peer, and only while it's connected
+void BRPeerScheduleCallback(BRPeer *peer, double seconds, void (*callback)(void *info));
+
+// blockInv is called with the block hashes from each inv message, and if it returns true, the blocks aren't requested
+// from peer, and neither is the next batch of block hashes after a full one, leaving both to the caller
+// not thread-safe, set while peer is disconnected or from a peer callback
+void BRPeerSetBlockInvCallback(BRPeer *peer, int (*blockInv)(void *info, const UInt256 blockHashes[],
+                                                             size_t blockCount));
+
+// switches peer to BIP157 compact filter mode: headers messages are relayed without requesting the next batch of
+// headers or switching to getblocks, and getdata requests full blocks
+// relayedCfheaders is called with the basic filter hashes for the blocks up to stopHash, and the filter header before
+// them, relayedCfilter with each basic filter, which is only valid for the duration of the callback
+// relayedFullBlock is called with each full block as a merkleblock that matches all of its tx, and the block's tx in a
+// single call, the callee takes ownership of block and each tx, but the txs array is only valid during the callback
+// not thread-safe, set while peer is disconnected or from a peer callback
+void BRPeerSetCompactFilterCallbacks(BRPeer *peer,
+                                     void (*relayedCfheaders)(void *info, UInt256 stopHash, UInt256 prevFilterHeader,
+                                                              const UInt256 filterHashes[], size_t hashesCount),
+                                     void (*relayedCfilter)(void *info, UInt256 blockHash, const uint8_t *filter,
+                                                            size_t filterLen),
+                                     void (*relayedFullBlock)(void *info, BRMerkleBlock *block, BRTransaction *txs[],
+                                                              size_t txCount));
+
 // set this to true when wallet addresses need to be added to bloom filter
 void BRPeerSetNeedsFilterUpdate(BRPeer *peer, int needsFilterUpdate);
 
@@ -186,6 +237,8 @@ void BRPeerSendGetblocks(BRPeer *peer, const UInt256 locators[], size_t locators
 void BRPeerSendInv(BRPeer *peer, const UInt256 txHashes[], size_t txCount);
 void BRPeerSendGetdata(BRPeer *peer, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
                        size_t blockCount);
+void BRPeerSendGetcfheaders(BRPeer *peer, uint32_t startHeight, UInt256 stopHash);
+void BRPeerSendGetcfilters(BRPeer *peer, uint32_t startHeight, UInt256 stopHash);
 void BRPeerSendGetaddr(BRPeer *peer);
 void BRPeerSendPing(BRPeer *peer, void *info, void (*pongCallback)(void *info, int success));
 
@@ -212,6 +265,17 @@ inline static int BRPeerEq(const void *peer, const void *otherPeer)
 // frees memory allocated for peer
 void BRPeerFree(BRPeer *peer);
 
+// returns a newly allocated event loop that serves peer connections from threadCount threads, and runs blocking jobs
+// such as DNS lookups on threadCount helper threads, or NULL if the platform doesn't support it
+// must be freed by calling BRPeerLoopFree()
+BRPeerLoop *BRPeerLoopNew(size_t threadCount);
+
+// queues job(info) to run on a helper thread of loop, so it doesn't hold up peer connections
+void BRPeerLoopAddJob(BRPeerLoop *loop, void *info, void (*job)(void *info));
+
+// stops the loop threads and frees memory allocated for loop, peers served by loop must be disconnected first
+void BRPeerLoopFree(BRPeerLoop *loop);
+
 #ifdef __cplusplus
 }
 #endif
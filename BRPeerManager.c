@@ -24,6 +24,7 @@
 
 #include "BRPeerManager.h"
 #include "BRBloomFilter.h"
+#include "BRGCSFilter.h"
 #include "BRSet.h"
 #include "BRArray.h"
 #include "BRInt.h"
@@ -43,6 +44,12 @@
 #define MAX_CONNECT_FAILURES  20 // notify user of network problems after this many connect failures in a row
 #define PEER_FLAG_SYNCED      0x01
 #define PEER_FLAG_NEEDSUPDATE 0x02
+#define BLOCK_WINDOW          100  // most merkleblocks requested from a single peer at once during a parallel sync
+#define BLOCK_QUEUE_MAX       1000 // ask for the next batch of block hashes once fewer than this many blocks are queued
+#define BLOCK_STALL_TIMEOUT   5    // seconds to wait for the oldest queued block before requesting it from another peer
+#define FILTER_BATCH_MAX      1000 // most compact filters requested at once, the BIP157 limit
+#define FILTER_HEADERS_AHEAD  1000 // more headers are requested while the chain is less than this far past filterHeight
+#define FILTER_RECHECK_BLOCKS 3000 // blocks past the last checked filter that can have been saved as a transition block
 
 #define genesis_block_hash(params) UInt256Reverse((params)->checkpoints[0].hash)
 
@@ -69,6 +76,27 @@ typedef struct {
     BRPeer *peers;
 } BRTxPeerList;
 
+typedef struct {
+    UInt256 blockHash;
+    BRPeer *peer; // peer the block was requested from, or that relayed it once it's been received
+    time_t requestTime;
+    BRMerkleBlock *block; // held until every block queued before it has been added to the chain
+    BRTransaction **txs; // tx relayed along with block
+} BRQueuedBlock;
+
+typedef struct {
+    BRPeer *peer;
+    BRTransaction **txs; // tx relayed since peer's last merkleblock, which arrive ahead of the block they belong to
+    size_t inFlight; // blocks requested from peer that it hasn't relayed yet
+    int stalled;
+} BRSyncPeer;
+
+typedef struct {
+    UInt256 blockHash;
+    uint8_t *filter;
+    size_t filterLen;
+} BRQueuedFilter;
+
 // true if peer is contained in the list of peers associated with txHash
 static int _BRTxPeerListHasPeer(const BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
 {
@@ -170,6 +198,7 @@ struct BRPeerManagerStruct {
     const BRChainParams *params;
     BRWallet *wallet;
     int isConnected, connectFailureCount, misbehavinCount, dnsThreadCount, maxConnectCount;
+    int maxPeerCount, downloadPeerCount; // maxConnectCount when no fixed peer is set, peers to download blocks from
     BRPeer *peers, *downloadPeer, fixedPeer, **connectedPeers;
     char downloadPeerName[INET6_ADDRSTRLEN + 6];
     uint32_t earliestKeyTime, syncStartHeight, filterUpdateHeight, estimatedHeight;
@@ -177,9 +206,24 @@ struct BRPeerManagerStruct {
     double fpRate, averageTxPerBlock;
     BRSet *blocks, *orphans, *checkpoints;
     BRMerkleBlock *lastBlock, *lastOrphan;
+    BRPoWCache *powCache;
+    BRPeerLoop *peerLoop;
     BRTxPeerList *txRelays, *txRequests;
     BRPublishedTx *publishedTx;
     UInt256 *publishedTxHashes;
+    BRTransaction **blockTx; // tx relayed during sync, registered in one batch with their merkleblock
+    BRQueuedBlock *blockQueue; // block hashes from downloadPeer's inv messages during a parallel sync, in chain order
+    size_t blockQueueHead; // blocks before this in blockQueue have already been added to the chain
+    BRSyncPeer *syncPeers; // peers merkleblocks are downloaded from during a parallel sync
+    UInt256 blockQueueTip; // last block hash queued, used as a locator for the next batch of block hashes
+    int needsGetblocks;
+    int compactFilters; // sync with BIP157 compact block filters instead of a bloom filter
+    int headersPending, needsHeaders, filtersPending, filtersSynced;
+    uint32_t filterHeight, filterStartHeight, filterHeaderHeight; // filters have been checked through filterHeight
+    UInt256 filterHeader, filterBlockHash; // filter header at filterHeaderHeight, block that matched its filter
+    UInt256 *filterBlockHashes, *filterHashes; // blocks from filterStartHeight on that filters were requested for
+    size_t filtersReceived;
+    BRQueuedFilter *filters; // filters received but not yet checked, in chain order starting at filterHeight + 1
     void *info;
     void (*syncStarted)(void *info);
     void (*syncStopped)(void *info, int error);
@@ -205,9 +249,70 @@ static void _BRPeerManagerPeerMisbehavin(BRPeerManager *manager, BRPeer *peer)
     BRPeerDisconnect(peer);
 }
 
+// returns the sync peer entry for peer if merkleblocks are being downloaded from it in a parallel sync
+static BRSyncPeer *_BRPeerManagerSyncPeer(BRPeerManager *manager, const BRPeer *peer)
+{
+    for (size_t i = array_count(manager->syncPeers); i > 0; i--) {
+        if (manager->syncPeers[i - 1].peer == peer) return &manager->syncPeers[i - 1];
+    }
+    
+    return NULL;
+}
+
+// cancels the timeout for blocks requested from a peer other than downloadPeer, unless there's a pending tx publish
+static void _BRPeerManagerCancelBlockTimeout(BRPeerManager *manager, BRPeer *peer)
+{
+    for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
+        if (manager->publishedTx[i - 1].callback != NULL) return;
+    }
+    
+    if (peer != manager->downloadPeer) BRPeerScheduleDisconnect(peer, -1);
+}
+
+// stops a parallel sync, dropping queued blocks that haven't been added to the chain yet
+static void _BRPeerManagerResetBlockQueue(BRPeerManager *manager)
+{
+    BRQueuedBlock *q;
+    BRSyncPeer *s;
+    
+    for (size_t i = array_count(manager->blockQueue); i > manager->blockQueueHead; i--) {
+        q = &manager->blockQueue[i - 1];
+        if (q->block) BRMerkleBlockFree(q->block);
+        if (! q->txs) continue;
+        for (size_t j = array_count(q->txs); j > 0; j--) BRTransactionFree(q->txs[j - 1]);
+        array_free(q->txs);
+    }
+    
+    for (size_t i = array_count(manager->syncPeers); i > 0; i--) {
+        s = &manager->syncPeers[i - 1];
+        for (size_t j = array_count(s->txs); j > 0; j--) BRTransactionFree(s->txs[j - 1]);
+        array_free(s->txs);
+        if (s->inFlight > 0) _BRPeerManagerCancelBlockTimeout(manager, s->peer);
+    }
+    
+    array_clear(manager->blockQueue);
+    array_clear(manager->syncPeers);
+    manager->blockQueueHead = 0;
+    manager->needsGetblocks = 0;
+}
+
+// drops compact filters that haven't been checked yet along with any pending requests, which the next download peer
+// makes again starting from filterHeight
+static void _BRPeerManagerResetFilters(BRPeerManager *manager)
+{
+    for (size_t i = array_count(manager->filters); i > 0; i--) free(manager->filters[i - 1].filter);
+    array_clear(manager->filters);
+    array_clear(manager->filterBlockHashes);
+    array_clear(manager->filterHashes);
+    manager->filtersReceived = 0;
+    manager->filterBlockHash = UINT256_ZERO;
+    manager->headersPending = manager->needsHeaders = manager->filtersPending = manager->filtersSynced = 0;
+}
+
 static void _BRPeerManagerSyncStopped(BRPeerManager *manager)
 {
     manager->syncStartHeight = 0;
+    _BRPeerManagerResetBlockQueue(manager);
 
     if (manager->downloadPeer) {
         // don't cancel timeout if there's a pending tx publish callback
@@ -343,6 +448,126 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
     BRPeerSendFilterload(peer, data, len);
 }
 
+static void _blockStallTimeout(void *info);
+
+// requests queued blocks from sync peers with room in their window, after first handing the blocks of a peer that's
+// holding up the queue to the others, and asks downloadPeer for the next batch of block hashes once the queue has room
+static void _BRPeerManagerRequestBlocks(BRPeerManager *manager)
+{
+    BRQueuedBlock *q = NULL;
+    BRSyncPeer *s;
+    BRPeer *stalled = NULL;
+    UInt256 blockHashes[BLOCK_WINDOW];
+    size_t i, j, n, ready = 0, count = array_count(manager->blockQueue);
+    time_t now = time(NULL);
+    
+    for (i = manager->blockQueueHead; i < count && manager->blockQueue[i].block; i++);
+    if (i < count) q = &manager->blockQueue[i]; // oldest queued block that hasn't been received yet
+    
+    if (q && q->peer && q->requestTime + BLOCK_STALL_TIMEOUT < now && array_count(manager->syncPeers) > 1) {
+        stalled = q->peer;
+        peer_log(stalled, "stalled on block %s, requesting its blocks from other peers", u256hex(q->blockHash));
+        s = _BRPeerManagerSyncPeer(manager, stalled);
+        
+        if (s) {
+            s->stalled = 1;
+            s->inFlight = 0;
+        }
+        
+        for (j = i; j < count; j++) {
+            if (manager->blockQueue[j].peer == stalled && ! manager->blockQueue[j].block) {
+                manager->blockQueue[j].peer = NULL;
+            }
+        }
+    }
+    
+    for (i = 0; i < array_count(manager->syncPeers); i++) if (! manager->syncPeers[i].stalled) ready++;
+    for (i = 0; ready == 0 && i < array_count(manager->syncPeers); i++) manager->syncPeers[i].stalled = 0;
+    
+    // queue entries before j have all been requested, so each peer picks up where the previous one left off
+    for (i = 0, j = manager->blockQueueHead; i < array_count(manager->syncPeers) && j < count; i++) {
+        s = &manager->syncPeers[i];
+        if (s->stalled || s->inFlight > BLOCK_WINDOW/2) continue; // top up the window once it's half empty
+        if (BRPeerConnectStatus(s->peer) != BRPeerStatusConnected) continue;
+        
+        for (n = 0; j < count && s->inFlight + n < BLOCK_WINDOW; j++) {
+            q = &manager->blockQueue[j];
+            if (q->peer || q->block) continue;
+            if (BRPeerLastBlock(s->peer) < manager->lastBlock->height + j - manager->blockQueueHead + 1) break;
+            q->peer = s->peer;
+            q->requestTime = now;
+            blockHashes[n++] = q->blockHash;
+        }
+        
+        if (n == 0) continue;
+        if (s->inFlight == 0 && s->peer != manager->downloadPeer) BRPeerScheduleDisconnect(s->peer, PROTOCOL_TIMEOUT);
+        s->inFlight += n;
+        BRPeerSendGetdata(s->peer, NULL, 0, blockHashes, n);
+    }
+    
+    if (manager->needsGetblocks && manager->downloadPeer && count - manager->blockQueueHead < BLOCK_QUEUE_MAX) {
+        UInt256 locators[] = { manager->blockQueueTip, manager->lastBlock->blockHash };
+        
+        manager->needsGetblocks = 0;
+        BRPeerSendGetblocks(manager->downloadPeer, locators, 2, UINT256_ZERO);
+    }
+    
+    // check for a stall again once the oldest outstanding block is overdue, even if no other peer event comes first
+    for (i = manager->blockQueueHead, q = NULL; i < count && ! q; i++) {
+        if (! manager->blockQueue[i].block) q = &manager->blockQueue[i];
+    }
+    
+    if (q && q->peer && array_count(manager->syncPeers) > 1) {
+        BRPeerScheduleCallback(q->peer, (double)(q->requestTime + BLOCK_STALL_TIMEOUT + 1 - now), _blockStallTimeout);
+    }
+}
+
+static void _blockStallTimeout(void *info)
+{
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    
+    pthread_mutex_lock(&manager->lock);
+    if (array_count(manager->syncPeers) > 0) _BRPeerManagerRequestBlocks(manager);
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// starts downloading merkleblocks from peer as part of a parallel sync
+static void _BRPeerManagerAddSyncPeer(BRPeerManager *manager, BRPeer *peer)
+{
+    BRSyncPeer *s;
+    
+    if (_BRPeerManagerSyncPeer(manager, peer) || array_count(manager->syncPeers) >= manager->downloadPeerCount) return;
+    
+    if (peer != manager->downloadPeer) { // messages are handled in order, so blocks requested next use this filter
+        uint8_t data[BRBloomFilterSerialize(manager->bloomFilter, NULL, 0)];
+        size_t len = BRBloomFilterSerialize(manager->bloomFilter, data, sizeof(data));
+        
+        BRPeerSendFilterload(peer, data, len);
+    }
+    
+    array_add(manager->syncPeers, ((BRSyncPeer) { peer, NULL, 0, 0 }));
+    s = &manager->syncPeers[array_count(manager->syncPeers) - 1];
+    array_new(s->txs, 10);
+}
+
+// stops downloading merkleblocks from peer, and hands the blocks it hasn't relayed yet to the other sync peers, blocks
+// it already relayed stay queued until they're added to the chain
+static void _BRPeerManagerRemoveSyncPeer(BRPeerManager *manager, BRPeer *peer)
+{
+    BRSyncPeer *s = _BRPeerManagerSyncPeer(manager, peer);
+    
+    if (! s) return;
+    
+    for (size_t i = manager->blockQueueHead; i < array_count(manager->blockQueue); i++) {
+        if (manager->blockQueue[i].peer == peer) manager->blockQueue[i].peer = NULL;
+    }
+    
+    for (size_t i = array_count(s->txs); i > 0; i--) BRTransactionFree(s->txs[i - 1]);
+    array_free(s->txs);
+    array_rm(manager->syncPeers, s - manager->syncPeers);
+    _BRPeerManagerRequestBlocks(manager);
+}
+
 static void _updateFilterRerequestDone(void *info, int success)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
@@ -437,6 +662,8 @@ static void _BRPeerManagerUpdateFilter(BRPeerManager *manager)
         BRPeerSetNeedsFilterUpdate(manager->downloadPeer, 1);
         manager->downloadPeer->flags |= PEER_FLAG_NEEDSUPDATE;
         peer_log(manager->downloadPeer, "filter update needed, waiting for pong");
+        // queued blocks were matched against the old filter, downloadPeer requests them again with the new one
+        _BRPeerManagerResetBlockQueue(manager);
         info = calloc(1, sizeof(*info));
         assert(info != NULL);
         info->peer = manager->downloadPeer;
@@ -446,6 +673,79 @@ static void _BRPeerManagerUpdateFilter(BRPeerManager *manager)
     }
 }
 
+// checks that at least the next <gap limit> unused wallet addresses are matched by the bloom filter, and if not, updates
+// the filter
+static void _BRPeerManagerCheckFilter(BRPeerManager *manager)
+{
+    BRAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
+    UInt160 hash;
+
+    if (manager->bloomFilter == NULL) return; // bloom filter is already being updated
+    BRWalletUnusedAddrs(manager->wallet, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+    BRWalletUnusedAddrs(manager->wallet, addrs + SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+
+    for (size_t i = 0; i < SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL; i++) {
+        if (! BRAddressHash160(&hash, addrs[i].s) ||
+            BRBloomFilterContainsData(manager->bloomFilter, hash.u8, sizeof(hash))) continue;
+        if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
+        manager->bloomFilter = NULL; // reset bloom filter so it's recreated with new wallet addresses
+        _BRPeerManagerUpdateFilter(manager);
+        break;
+    }
+}
+
+// registers the tx held back in manager->blockTx with a single wallet update, and frees those that aren't wallet tx
+static void _BRPeerManagerRegisterBlockTx(BRPeerManager *manager, BRPeer *peer)
+{
+    BRTransaction **txs = manager->blockTx, *tx;
+    UInt256 *hashes;
+    size_t i, count, total = 0;
+
+    array_new(hashes, array_count(txs));
+
+    while (array_count(txs) > 0) {
+        for (i = 0, count = 0; i < array_count(txs); i++) { // move wallet tx to the front
+            if (! BRWalletContainsTransaction(manager->wallet, txs[i])) continue;
+            tx = txs[i], txs[i] = txs[count], txs[count++] = tx;
+        }
+
+        // tx that spend from or use addresses of the registered tx may be wallet tx on the next pass
+        if (count == 0) break;
+        array_set_count(hashes, count);
+        for (i = 0; i < count; i++) hashes[i] = txs[i]->txHash;
+        BRWalletRegisterTransactions(manager->wallet, txs, count);
+        total += count;
+
+        for (i = 0; i < count; i++) {
+            tx = BRWalletTransactionForHash(manager->wallet, hashes[i]);
+            if (tx && tx != txs[i]) BRTransactionFree(txs[i]); // tx was already registered
+            if (! tx) continue;
+
+            if (BRWalletAmountSentByTx(manager->wallet, tx) > 0 && BRWalletTransactionIsValid(manager->wallet, tx)) {
+                _BRPeerManagerAddTxToPublishList(manager, tx, NULL, NULL); // add valid send tx to mempool
+            }
+
+            _BRTxPeerListRemovePeer(manager->txRequests, tx->txHash, peer);
+        }
+
+        array_rm_range(txs, 0, count);
+    }
+
+    for (i = array_count(txs); i > 0; i--) BRTransactionFree(txs[i - 1]);
+    array_clear(txs);
+    array_free(hashes);
+
+    if (total > 0) {
+        // reschedule sync timeout
+        if (manager->syncStartHeight > 0 && peer == manager->downloadPeer) {
+            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
+        }
+
+        // the transactions likely consumed one or more wallet addresses
+        _BRPeerManagerCheckFilter(manager);
+    }
+}
+
 // unconfirmed transactions that aren't in the mempools of any of connected peers have likely dropped off the network
 static void _requestUnrelayedTxGetdataDone(void *info, int success)
 {
@@ -606,7 +906,11 @@ static void _BRPeerManagerLoadMempools(BRPeerManager *manager)
         info->peer = peer;
         info->manager = manager;
         
-        if (peer != manager->downloadPeer || manager->fpRate > BLOOM_REDUCED_FALSEPOSITIVE_RATE*5.0) {
+        if (manager->compactFilters) { // without a bloom filter there's no filtered mempool to request
+            _BRPeerManagerPublishPendingTx(manager, peer);
+            BRPeerSendPing(peer, info, _mempoolDone);
+        }
+        else if (peer != manager->downloadPeer || manager->fpRate > BLOOM_REDUCED_FALSEPOSITIVE_RATE*5.0) {
             _BRPeerManagerLoadBloomFilter(manager, peer);
             _BRPeerManagerPublishPendingTx(manager, peer);
             BRPeerSendPing(peer, info, _loadBloomFilterDone); // load mempool after updating bloomfilter
@@ -616,6 +920,194 @@ static void _BRPeerManagerLoadMempools(BRPeerManager *manager)
     }
 }
 
+// saves up to saveCount blocks ending with block, starting at a difficulty transition
+static void _BRPeerManagerSaveBlocks(BRPeerManager *manager, BRMerkleBlock *block, size_t saveCount)
+{
+    BRMerkleBlock *saveBlocks[saveCount], *b;
+    size_t i, j;
+    
+    for (i = 0, b = block; b && i < saveCount; i++) {
+        assert(b->height != BLOCK_UNKNOWN_HEIGHT); // verify all blocks to be saved are in the chain
+        saveBlocks[i] = b;
+        b = BRSetGet(manager->blocks, &b->prevBlock);
+    }
+    
+    // make sure the set of blocks to be saved starts at a difficulty interval
+    j = (i > 0) ? saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL : 0;
+    if (j > 0) i -= (i > BLOCK_DIFFICULTY_INTERVAL - j) ? BLOCK_DIFFICULTY_INTERVAL - j : i;
+    assert(i == 0 || (saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL) == 0);
+    if (i > 0 && manager->saveBlocks) manager->saveBlocks(manager->info, (i > 1 ? 1 : 0), saveBlocks, i);
+}
+
+static void _BRPeerManagerSyncFilters(BRPeerManager *manager);
+
+static void _getheadersDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    
+    free(info);
+    pthread_mutex_lock(&manager->lock);
+    
+    if (success && peer == manager->downloadPeer) { // headers are relayed before the pong
+        manager->headersPending = 0;
+        _BRPeerManagerSyncFilters(manager);
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+}
+
+static void _getcfiltersDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    
+    free(info);
+    pthread_mutex_lock(&manager->lock);
+    
+    if (success && peer == manager->downloadPeer) {
+        if (manager->filtersReceived < array_count(manager->filterBlockHashes)) {
+            peer_log(peer, "missing compact filters, received %zu of %zu", manager->filtersReceived,
+                     array_count(manager->filterBlockHashes));
+            BRPeerDisconnect(peer);
+        }
+        else {
+            array_clear(manager->filterBlockHashes);
+            array_clear(manager->filterHashes);
+            manager->filtersReceived = 0;
+            manager->filtersPending = 0;
+            _BRPeerManagerSyncFilters(manager);
+        }
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// checks queued compact filters against wallet scripts, and requests the next headers, filters, or matching block
+// from downloadPeer as needed, stopping at the first filter that matches until its block has been added to the chain
+static void _BRPeerManagerSyncFilters(BRPeerManager *manager)
+{
+    BRPeer *peer = manager->downloadPeer;
+    BRPeerCallbackInfo *info;
+    BRMerkleBlock *b;
+    size_t i, count;
+    uint32_t start, stop;
+    
+    if (! manager->compactFilters || ! peer || BRPeerConnectStatus(peer) != BRPeerStatusConnected) return;
+    if (manager->filterHeight > manager->lastBlock->height) manager->filterHeight = manager->lastBlock->height;
+    if (manager->filterHeight < manager->lastBlock->height) manager->filtersSynced = 0;
+    
+    if (UInt256IsZero(manager->filterBlockHash) && array_count(manager->filters) > 0) {
+        // generate spare addresses so payments to addresses past the gap limit are still found
+        BRWalletUnusedAddrs(manager->wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL + 100, 0);
+        BRWalletUnusedAddrs(manager->wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL + 100, 1);
+        
+        size_t addrsCount = BRWalletAllAddrs(manager->wallet, NULL, 0), bufLen = 0, off = 0;
+        BRAddress *addrs = malloc((addrsCount + 1)*sizeof(*addrs));
+        const uint8_t **scripts = malloc((addrsCount + 1)*sizeof(*scripts));
+        size_t *scriptLens = malloc((addrsCount + 1)*sizeof(*scriptLens));
+        uint8_t *buf;
+        
+        assert(addrs != NULL && scripts != NULL && scriptLens != NULL);
+        addrsCount = BRWalletAllAddrs(manager->wallet, addrs, addrsCount);
+        for (i = 0; i < addrsCount; i++) bufLen += BRAddressScriptPubKey(NULL, 0, addrs[i].s);
+        buf = malloc(bufLen + 1);
+        assert(buf != NULL);
+        
+        for (i = 0, count = 0; i < addrsCount; i++) { // the filter matches scripts paying to or spent from wallet
+            scriptLens[count] = BRAddressScriptPubKey(&buf[off], bufLen - off, addrs[i].s);
+            if (scriptLens[count] == 0) continue;
+            scripts[count] = &buf[off];
+            off += scriptLens[count++];
+        }
+        
+        for (i = 0; i < array_count(manager->filters) && UInt256IsZero(manager->filterBlockHash); i++) {
+            BRQueuedFilter *f = &manager->filters[i];
+            
+            if (BRGCSFilterMatchAny(f->filter, f->filterLen, f->blockHash, scripts, scriptLens, count)) {
+                peer_log(peer, "compact filter matched block #%"PRIu32", requesting it", manager->filterHeight + 1);
+                manager->filterBlockHash = f->blockHash; // filterHeight advances once the block has been added
+                BRPeerSendGetdata(peer, NULL, 0, &f->blockHash, 1);
+            }
+            else manager->filterHeight++;
+            
+            free(f->filter);
+        }
+        
+        array_rm_range(manager->filters, 0, i);
+        free(buf);
+        free(scriptLens);
+        free(scripts);
+        free(addrs);
+    }
+    
+    // request the next range of filters, skipping blocks from more than a week before earliestKeyTime
+    while (! manager->filtersPending && array_count(manager->filters) == 0 &&
+           UInt256IsZero(manager->filterBlockHash) && manager->filterHeight < manager->lastBlock->height) {
+        start = manager->filterHeight + 1;
+        stop = start + FILTER_BATCH_MAX - 1;
+        if (stop > manager->lastBlock->height) stop = manager->lastBlock->height;
+        for (b = manager->lastBlock; b && b->height > stop; b = BRSetGet(manager->blocks, &b->prevBlock));
+        if (! b) break;
+        
+        if (b->timestamp + 7*24*60*60 < manager->earliestKeyTime + 2*60*60) {
+            manager->filterHeight = stop;
+            continue;
+        }
+        
+        array_set_count(manager->filterBlockHashes, stop - start + 1);
+        
+        for (i = array_count(manager->filterBlockHashes); b && i > 0; i--) {
+            manager->filterBlockHashes[i - 1] = b->blockHash;
+            b = BRSetGet(manager->blocks, &b->prevBlock);
+        }
+        
+        if (i > 0) { // chain is missing blocks before stop
+            array_clear(manager->filterBlockHashes);
+            break;
+        }
+        
+        manager->filterStartHeight = start;
+        BRPeerSendGetcfheaders(peer, start, manager->filterBlockHashes[stop - start]);
+        BRPeerSendGetcfilters(peer, start, manager->filterBlockHashes[stop - start]);
+        info = calloc(1, sizeof(*info));
+        assert(info != NULL);
+        info->peer = peer;
+        info->manager = manager;
+        BRPeerSendPing(peer, info, _getcfiltersDone); // cfilters are relayed before the pong
+        manager->filtersPending = 1;
+    }
+    
+    // headers are kept within FILTER_HEADERS_AHEAD (plus one getheaders reply) of the filters that have been checked
+    if (! manager->headersPending && (manager->lastBlock->height < manager->estimatedHeight || manager->needsHeaders) &&
+        manager->lastBlock->height < manager->filterHeight + FILTER_HEADERS_AHEAD) {
+        UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
+        
+        count = _BRPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
+        BRPeerSendGetheaders(peer, locators, count, UINT256_ZERO);
+        info = calloc(1, sizeof(*info));
+        assert(info != NULL);
+        info->peer = peer;
+        info->manager = manager;
+        BRPeerSendPing(peer, info, _getheadersDone);
+        manager->headersPending = 1;
+        manager->needsHeaders = 0;
+    }
+    
+    if (! manager->filtersSynced && manager->filterHeight == manager->lastBlock->height &&
+        manager->lastBlock->height >= manager->estimatedHeight && ! manager->headersPending &&
+        ! manager->needsHeaders && UInt256IsZero(manager->filterBlockHash)) { // chain and filters are caught up
+        count = (manager->lastBlock->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
+        manager->filtersSynced = 1;
+        _BRPeerManagerSaveBlocks(manager, manager->lastBlock, count);
+        
+        if (manager->syncStartHeight > 0) {
+            manager->connectFailureCount = 0;
+            _BRPeerManagerLoadMempools(manager);
+        }
+    }
+}
+
 // returns a UINT128_ZERO terminated array of addresses for hostname that must be freed, or NULL if lookup failed
 static UInt128 *_addressLookup(const char *hostname)
 {
@@ -645,14 +1137,13 @@ static UInt128 *_addressLookup(const char *hostname)
     return addrList;
 }
 
-static void *_findPeersThreadRoutine(void *arg)
+static void _findPeersJob(void *arg)
 {
     BRPeerManager *manager = ((BRFindPeersInfo *)arg)->manager;
     uint64_t services = ((BRFindPeersInfo *)arg)->services;
     UInt128 *addrList, *addr;
     time_t now = time(NULL), age;
     
-    pthread_cleanup_push(manager->threadCleanup, manager->info);
     addrList = _addressLookup(((BRFindPeersInfo *)arg)->hostname);
     free(arg);
     pthread_mutex_lock(&manager->lock);
@@ -665,6 +1156,14 @@ static void *_findPeersThreadRoutine(void *arg)
     manager->dnsThreadCount--;
     pthread_mutex_unlock(&manager->lock);
     if (addrList) free(addrList);
+}
+
+static void *_findPeersThreadRoutine(void *arg)
+{
+    BRPeerManager *manager = ((BRFindPeersInfo *)arg)->manager;
+    
+    pthread_cleanup_push(manager->threadCleanup, manager->info);
+    _findPeersJob(arg);
     pthread_cleanup_pop(1);
     return NULL;
 }
@@ -693,8 +1192,14 @@ static void _BRPeerManagerFindPeers(BRPeerManager *manager)
             info->manager = manager;
             info->hostname = manager->params->dnsSeeds[i];
             info->services = services;
-            if (pthread_attr_init(&attr) == 0 && pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
-                pthread_create(&thread, &attr, _findPeersThreadRoutine, info) == 0) manager->dnsThreadCount++;
+            
+            if (manager->peerLoop) {
+                BRPeerLoopAddJob(manager->peerLoop, info, _findPeersJob);
+                manager->dnsThreadCount++;
+            }
+            else if (pthread_attr_init(&attr) == 0 &&
+                     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
+                     pthread_create(&thread, &attr, _findPeersThreadRoutine, info) == 0) manager->dnsThreadCount++;
         }
 
         for (addr = addrList = _addressLookup(manager->params->dnsSeeds[0]); addr && ! UInt128IsZero(*addr); addr++) {
@@ -709,7 +1214,7 @@ static void _BRPeerManagerFindPeers(BRPeerManager *manager)
             pthread_mutex_unlock(&manager->lock);
             nanosleep(&ts, NULL); // pthread_yield() isn't POSIX standard :(
             pthread_mutex_lock(&manager->lock);
-        } while (manager->dnsThreadCount > 0 && array_count(manager->peers) < PEER_MAX_CONNECTIONS);
+        } while (manager->dnsThreadCount > 0 && array_count(manager->peers) < manager->maxConnectCount);
     
         qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
     }
@@ -738,14 +1243,31 @@ static void _peerConnected(void *info)
         peer_log(peer, "node isn't synced");
         BRPeerDisconnect(peer);
     }
-    else if (BRPeerVersion(peer) >= 70011 && (peer->services & SERVICES_NODE_BLOOM) != SERVICES_NODE_BLOOM) {
+    else if (manager->compactFilters &&
+             (peer->services & SERVICES_NODE_COMPACT_FILTERS) != SERVICES_NODE_COMPACT_FILTERS) {
+        peer_log(peer, "node doesn't serve compact block filters");
+        BRPeerDisconnect(peer);
+    }
+    else if (! manager->compactFilters && BRPeerVersion(peer) >= 70011 &&
+             (peer->services & SERVICES_NODE_BLOOM) != SERVICES_NODE_BLOOM) {
         peer_log(peer, "node doesn't support SPV mode");
         BRPeerDisconnect(peer);
     }
     else if (manager->downloadPeer && // check if we should stick with the existing download peer
              (BRPeerLastBlock(manager->downloadPeer) >= BRPeerLastBlock(peer) ||
               manager->lastBlock->height >= BRPeerLastBlock(peer))) {
-        if (manager->lastBlock->height >= BRPeerLastBlock(peer)) { // only load bloom filter if we're done syncing
+        if (manager->compactFilters && manager->lastBlock->height >= BRPeerLastBlock(peer) &&
+            manager->filtersSynced) { // there's no bloom filter to load in compact filter mode
+            manager->connectFailureCount = 0;
+            _BRPeerManagerPublishPendingTx(manager, peer);
+            peerInfo = calloc(1, sizeof(*peerInfo));
+            assert(peerInfo != NULL);
+            peerInfo->peer = peer;
+            peerInfo->manager = manager;
+            BRPeerSendPing(peer, peerInfo, _mempoolDone);
+        }
+        else if (! manager->compactFilters && manager->lastBlock->height >= BRPeerLastBlock(peer)) {
+            // only load bloom filter if we're done syncing
             manager->connectFailureCount = 0; // also reset connect failure count if we're already synced
             _BRPeerManagerLoadBloomFilter(manager, peer);
             _BRPeerManagerPublishPendingTx(manager, peer);
@@ -772,14 +1294,24 @@ static void _peerConnected(void *info)
             BRPeerDisconnect(manager->downloadPeer);
         }
         
+        _BRPeerManagerResetBlockQueue(manager);
+        _BRPeerManagerResetFilters(manager);
         manager->downloadPeer = peer;
         manager->isConnected = 1;
         manager->estimatedHeight = BRPeerLastBlock(peer);
-        _BRPeerManagerLoadBloomFilter(manager, peer);
+        if (! manager->compactFilters) _BRPeerManagerLoadBloomFilter(manager, peer);
         BRPeerSetCurrentBlockHeight(peer, manager->lastBlock->height);
         _BRPeerManagerPublishPendingTx(manager, peer);
             
-        if (manager->lastBlock->height < BRPeerLastBlock(peer)) { // start blockchain sync
+        if (manager->compactFilters) { // headers, filters, and matched blocks are requested as the sync progresses
+            if (manager->lastBlock->height < BRPeerLastBlock(peer) ||
+                manager->filterHeight < manager->lastBlock->height) {
+                BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // schedule sync timeout
+            }
+            
+            _BRPeerManagerSyncFilters(manager);
+        }
+        else if (manager->lastBlock->height < BRPeerLastBlock(peer)) { // start blockchain sync
             UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
             size_t count = _BRPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
             
@@ -839,10 +1371,14 @@ static void _peerDisconnected(void *info, int error)
     }
 
     if (peer == manager->downloadPeer) { // download peer disconnected
+        _BRPeerManagerResetBlockQueue(manager);
+        _BRPeerManagerResetFilters(manager);
+        _BRPeerManagerRegisterBlockTx(manager, peer);
         manager->isConnected = 0;
         manager->downloadPeer = NULL;
         if (manager->connectFailureCount > MAX_CONNECT_FAILURES) manager->connectFailureCount = MAX_CONNECT_FAILURES;
     }
+    else _BRPeerManagerRemoveSyncPeer(manager, peer);
 
     if (! manager->isConnected && manager->connectFailureCount == MAX_CONNECT_FAILURES) {
         _BRPeerManagerSyncStopped(manager);
@@ -918,6 +1454,7 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRSyncPeer *syncPeer;
     void *txInfo = NULL;
     void (*txCallback)(void *, int) = NULL;
     int isWalletTx = 0, hasPendingCallbacks = 0;
@@ -925,6 +1462,7 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
     
     pthread_mutex_lock(&manager->lock);
     peer_log(peer, "relayed tx: %s", u256hex(tx->txHash));
+    syncPeer = _BRPeerManagerSyncPeer(manager, peer);
     
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
         if (UInt256Eq(manager->publishedTxHashes[i - 1], tx->txHash)) {
@@ -937,14 +1475,31 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
 
-    // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
-    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || peer != manager->downloadPeer)) {
+    // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer,
+    // or a sync peer still waiting on requested blocks
+    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 ||
+                                  (peer != manager->downloadPeer && (! syncPeer || syncPeer->inFlight == 0)))) {
         BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
     }
 
-    if (manager->syncStartHeight == 0 || BRWalletContainsTransaction(manager->wallet, tx)) {
-        isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx);
-        if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, tx->txHash);
+    if (manager->syncStartHeight > 0 && syncPeer && relayCount == 0) {
+        // during a parallel sync, tx are held with the next merkleblock from the same peer
+        array_add(syncPeer->txs, tx);
+        tx = NULL;
+    }
+    else if (manager->syncStartHeight > 0 && peer == manager->downloadPeer && relayCount == 0) {
+        // hold back tx relayed during sync to register them together when their merkleblock is complete
+        array_add(manager->blockTx, tx);
+        tx = NULL;
+    }
+    else if (manager->syncStartHeight == 0 || BRWalletContainsTransaction(manager->wallet, tx)) {
+        UInt256 txHash = tx->txHash;
+        BRTransaction *t;
+
+        isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx); // wallet takes ownership unless tx is known
+        t = BRWalletTransactionForHash(manager->wallet, txHash);
+        if (t && t != tx) BRTransactionFree(tx); // tx was already known
+        tx = (isWalletTx) ? t : NULL;
     }
     else {
         BRTransactionFree(tx);
@@ -966,25 +1521,7 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
         if (manager->syncStartHeight == 0) relayCount = _BRTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
         
         _BRTxPeerListRemovePeer(manager->txRequests, tx->txHash, peer);
-        
-        if (manager->bloomFilter != NULL) { // check if bloom filter is already being updated
-            BRAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
-            UInt160 hash;
-
-            // the transaction likely consumed one or more wallet addresses, so check that at least the next <gap limit>
-            // unused addresses are still matched by the bloom filter
-            BRWalletUnusedAddrs(manager->wallet, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
-            BRWalletUnusedAddrs(manager->wallet, addrs + SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
-
-            for (size_t i = 0; i < SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL; i++) {
-                if (! BRAddressHash160(&hash, addrs[i].s) ||
-                    BRBloomFilterContainsData(manager->bloomFilter, hash.u8, sizeof(hash))) continue;
-                if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
-                manager->bloomFilter = NULL; // reset bloom filter so it's recreated with new wallet addresses
-                _BRPeerManagerUpdateFilter(manager);
-                break;
-            }
-        }
+        _BRPeerManagerCheckFilter(manager); // the transaction likely consumed one or more wallet addresses
     }
     
     // set timestamp when tx is verified
@@ -1026,8 +1563,12 @@ static void _peerHasTx(void *info, UInt256 txHash)
     }
 
     if (tx) {
-        isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx);
-        if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, tx->txHash);
+        // a published non-wallet tx is left out of the wallet's pool, which could free it
+        if (BRWalletContainsTransaction(manager->wallet, tx)) {
+            isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx);
+        }
+        
+        if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, txHash);
 
         // reschedule sync timeout
         if (manager->syncStartHeight > 0 && peer == manager->downloadPeer && isWalletTx) {
@@ -1084,6 +1625,133 @@ static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code)
     if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
 }
 
+// holds a block relayed by a sync peer in the block queue until every block queued before it has been added to the
+// chain, returns true if block was queued
+static int _BRPeerManagerQueueBlock(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *block)
+{
+    BRSyncPeer *s = _BRPeerManagerSyncPeer(manager, peer), *s2 = NULL;
+    BRQueuedBlock *q = NULL;
+    size_t i;
+    
+    if (! s) return 0;
+    
+    for (i = manager->blockQueueHead; ! q && i < array_count(manager->blockQueue); i++) {
+        if (UInt256Eq(manager->blockQueue[i].blockHash, block->blockHash)) q = &manager->blockQueue[i];
+    }
+    
+    if (q && ! q->block) {
+        s2 = (q->peer) ? _BRPeerManagerSyncPeer(manager, q->peer) : NULL; // peer the block was requested from
+        if (s2 && s2->inFlight > 0) s2->inFlight--;
+        if (s2 && s2 != s && s2->inFlight == 0) _BRPeerManagerCancelBlockTimeout(manager, s2->peer);
+        q->peer = peer;
+        q->block = block;
+        q->txs = s->txs;
+        array_new(s->txs, 10);
+    }
+    else if (q) { // block was also requested from a peer that stalled, and has already been received
+        BRMerkleBlockFree(block);
+        for (i = array_count(s->txs); i > 0; i--) BRTransactionFree(s->txs[i - 1]);
+        array_clear(s->txs);
+    }
+    else { // block wasn't queued, its tx are registered right away
+        array_add_array(manager->blockTx, s->txs, array_count(s->txs));
+        array_clear(s->txs);
+    }
+    
+    s->stalled = 0;
+    
+    if (peer != manager->downloadPeer) { // reschedule or cancel the timeout for blocks requested from peer
+        if (s->inFlight > 0) BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
+        else _BRPeerManagerCancelBlockTimeout(manager, peer);
+    }
+    
+    _BRPeerManagerRequestBlocks(manager);
+    
+    // registering tx may start a filter update, which resets the block queue
+    if (! q && array_count(manager->blockTx) > 0) _BRPeerManagerRegisterBlockTx(manager, peer);
+    return (q != NULL);
+}
+
+// removes the oldest block in the block queue if it has been received, and returns it along with the peer that relayed
+// it (downloadPeer if that peer has since disconnected) after registering the tx relayed along with it
+static BRMerkleBlock *_BRPeerManagerDequeueBlock(BRPeerManager *manager, BRPeer **peer)
+{
+    BRQueuedBlock *q = (manager->blockQueueHead < array_count(manager->blockQueue)) ?
+                       &manager->blockQueue[manager->blockQueueHead] : NULL;
+    BRMerkleBlock *block = (q) ? q->block : NULL;
+    
+    if (! block) return NULL;
+    *peer = (q->peer) ? q->peer : manager->downloadPeer;
+    
+    if (q->txs) {
+        array_add_array(manager->blockTx, q->txs, array_count(q->txs));
+        array_free(q->txs);
+    }
+    
+    if (++manager->blockQueueHead >= BLOCK_WINDOW) {
+        array_rm_range(manager->blockQueue, 0, manager->blockQueueHead);
+        manager->blockQueueHead = 0;
+    }
+    
+    // registering tx may start a filter update, which resets the block queue
+    if (array_count(manager->blockTx) > 0) _BRPeerManagerRegisterBlockTx(manager, *peer);
+    return block;
+}
+
+static int _peerBlockInv(void *info, const UInt256 blockHashes[], size_t blockCount)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    size_t i, j;
+    int r = 0;
+    
+    pthread_mutex_lock(&manager->lock);
+    
+    if (manager->compactFilters) { // new blocks are found with getheaders, and only downloaded if they match a filter
+        if (peer == manager->downloadPeer) {
+            manager->needsHeaders = 1;
+            _BRPeerManagerSyncFilters(manager);
+        }
+        
+        r = 1;
+    }
+    // during a parallel sync, blocks from downloadPeer's inv messages are requested from several peers at once, and
+    // headers are still downloaded from downloadPeer alone
+    else if (manager->downloadPeerCount > 1 && peer == manager->downloadPeer && manager->syncStartHeight > 0 &&
+             manager->bloomFilter && (peer->flags & PEER_FLAG_NEEDSUPDATE) == 0 &&
+             manager->lastBlock->timestamp + 7*24*60*60 >= manager->earliestKeyTime) {
+        _BRPeerManagerAddSyncPeer(manager, peer);
+        
+        for (i = array_count(manager->connectedPeers); i > 0; i--) {
+            BRPeer *p = manager->connectedPeers[i - 1];
+            
+            if (BRPeerConnectStatus(p) != BRPeerStatusConnected || BRPeerLastBlock(p) <= manager->lastBlock->height) {
+                continue;
+            }
+            
+            if ((p->flags & PEER_FLAG_NEEDSUPDATE) == 0) _BRPeerManagerAddSyncPeer(manager, p);
+        }
+        
+        for (i = 0; i < blockCount; i++) {
+            for (j = array_count(manager->blockQueue); j > manager->blockQueueHead; j--) {
+                if (UInt256Eq(manager->blockQueue[j - 1].blockHash, blockHashes[i])) break;
+            }
+            
+            if (j == manager->blockQueueHead) {
+                array_add(manager->blockQueue, ((BRQueuedBlock) { blockHashes[i], NULL, 0, NULL, NULL }));
+            }
+        }
+        
+        manager->blockQueueTip = blockHashes[blockCount - 1];
+        manager->needsGetblocks = (blockCount >= 500);
+        _BRPeerManagerRequestBlocks(manager);
+        r = 1;
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+    return r;
+}
+
 static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *block, BRMerkleBlock *prev, BRPeer *peer)
 {
     int r = 1;
@@ -1137,20 +1805,20 @@ static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *bloc
     return r;
 }
 
-static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
+// adds block relayed by peer to the chain, sets notify if transaction confirmations may have changed, and returns the
+// next block if it was received earlier as an orphan, must be called with manager->lock held
+static BRMerkleBlock *_BRPeerManagerAddBlock(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *block, int *notify)
 {
-    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
-    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     size_t txCount = BRMerkleBlockTxHashes(block, NULL, 0);
     UInt256 _txHashes[(sizeof(UInt256)*txCount <= 0x1000) ? txCount : 0],
             *txHashes = (sizeof(UInt256)*txCount <= 0x1000) ? _txHashes : malloc(txCount*sizeof(*txHashes));
-    size_t i, j, fpCount = 0, saveCount = 0;
+    size_t i, fpCount = 0, saveCount = 0;
     BRMerkleBlock orphan, *b, *b2, *prev, *next = NULL;
     uint32_t txTime = 0;
     
     assert(txHashes != NULL);
     txCount = BRMerkleBlockTxHashes(block, txHashes, txCount);
-    pthread_mutex_lock(&manager->lock);
+    if (array_count(manager->blockTx) > 0 && peer == manager->downloadPeer) _BRPeerManagerRegisterBlockTx(manager, peer);
     prev = BRSetGet(manager->blocks, &block->prevBlock);
 
     if (prev) {
@@ -1159,7 +1827,8 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
     }
     
     // track the observed bloom filter false positive rate using a low pass filter to smooth out variance
-    if (peer == manager->downloadPeer && block->totalTx > 0) {
+    if (! manager->compactFilters && (peer == manager->downloadPeer || _BRPeerManagerSyncPeer(manager, peer)) &&
+        block->totalTx > 0) {
         for (i = 0; i < txCount; i++) { // wallet tx are not false-positives
             if (! BRWalletTransactionForHash(manager->wallet, txHashes[i])) fpCount++;
         }
@@ -1184,12 +1853,15 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         }
     }
 
-    // ignore block headers that are newer than one week before earliestKeyTime (it's a header if it has 0 totalTx)
-    if (block->totalTx == 0 && block->timestamp + 7*24*60*60 > manager->earliestKeyTime + 2*60*60) {
+    // ignore block headers that are newer than one week before earliestKeyTime (it's a header if it has 0 totalTx),
+    // except in compact filter mode where every block starts out as a header
+    if (! manager->compactFilters && block->totalTx == 0 &&
+        block->timestamp + 7*24*60*60 > manager->earliestKeyTime + 2*60*60) {
         BRMerkleBlockFree(block);
         block = NULL;
     }
-    else if (manager->bloomFilter == NULL) { // ingore potentially incomplete blocks when a filter update is pending
+    else if (! manager->compactFilters && manager->bloomFilter == NULL) {
+        // ingore potentially incomplete blocks when a filter update is pending
         BRMerkleBlockFree(block);
         block = NULL;
 
@@ -1236,6 +1908,7 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         
         BRSetAdd(manager->blocks, block);
         manager->lastBlock = block;
+        if (manager->powCache) BRPoWCacheAdd(manager->powCache, block->blockHash, block->powHash, block->height);
         if (txCount > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, txCount, block->height, txTime);
         if (manager->downloadPeer) BRPeerSetCurrentBlockHeight(manager->downloadPeer, block->height);
             
@@ -1246,7 +1919,8 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         
         if ((block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) saveCount = 1; // save transition block immediately
         
-        if (block->height == manager->estimatedHeight) { // chain download is complete
+        // chain download is complete, in compact filter mode once the filters are also done
+        if (block->height == manager->estimatedHeight && ! manager->compactFilters) {
             saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
             _BRPeerManagerLoadMempools(manager);
         }
@@ -1287,6 +1961,7 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
     else { // new block is on a fork
         peer_log(peer, "chain fork reached height %"PRIu32, block->height);
         BRSetAdd(manager->blocks, block);
+        if (manager->powCache) BRPoWCacheAdd(manager->powCache, block->blockHash, block->powHash, block->height);
 
         // TODO: calculate chain work and use that instead of block height to determine longest chain
         if (block->height > manager->lastBlock->height) { // check if fork is now longer than main chain
@@ -1300,30 +1975,46 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
             
             peer_log(peer, "reorganizing chain from height %"PRIu32", new height is %"PRIu32, b->height, block->height);
         
-            BRWalletSetTxUnconfirmedAfter(manager->wallet, b->height); // mark tx after the join point as unconfirmed
-
-            b = block;
-        
-            while (b && b2 && b->height > b2->height) { // set transaction heights for new main chain
-                size_t count = BRMerkleBlockTxHashes(b, NULL, 0);
-                uint32_t height = b->height, timestamp = b->timestamp;
-                
-                if (count > txCount) {
-                    txHashes = (txHashes != _txHashes) ? realloc(txHashes, count*sizeof(*txHashes)) :
-                               malloc(count*sizeof(*txHashes));
-                    assert(txHashes != NULL);
-                    txCount = count;
-                }
+            uint32_t joinHeight = b->height;
+            size_t n = 0, blockCount = 0, hashCount = 0;
+            
+            for (b = block; b && b2 && b->height > b2->height; b = BRSetGet(manager->blocks, &b->prevBlock)) {
+                hashCount += BRMerkleBlockTxHashes(b, NULL, 0);
+                blockCount++;
+            }
+            
+            BRWalletBlockTxs *forkBlocks = malloc((blockCount + 1)*sizeof(*forkBlocks));
+            UInt256 *forkHashes = malloc((hashCount + 1)*sizeof(*forkHashes));
+            
+            assert(forkBlocks != NULL && forkHashes != NULL);
+            
+            for (b = block, i = blockCount; b && i > 0; i--) { // collect transactions for new main chain, oldest first
+                uint32_t timestamp = b->timestamp;
                 
-                count = BRMerkleBlockTxHashes(b, txHashes, count);
+                forkBlocks[i - 1].txHashes = &forkHashes[n];
+                forkBlocks[i - 1].txCount = BRMerkleBlockTxHashes(b, &forkHashes[n], hashCount - n);
+                forkBlocks[i - 1].blockHeight = b->height;
+                n += forkBlocks[i - 1].txCount;
                 b = BRSetGet(manager->blocks, &b->prevBlock);
                 if (b) timestamp = timestamp/2 + b->timestamp/2;
-                if (count > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, count, height, timestamp);
+                forkBlocks[i - 1].timestamp = timestamp;
+            }
+            
+            // mark tx after the join point as unconfirmed and set transaction heights for new main chain
+            BRWalletReorganize(manager->wallet, joinHeight, forkBlocks, blockCount);
+            free(forkHashes);
+            free(forkBlocks);
+            
+            if (manager->compactFilters && manager->filterHeight > joinHeight) { // check filters for the new blocks
+                for (i = array_count(manager->filters); i > 0; i--) free(manager->filters[i - 1].filter);
+                array_clear(manager->filters);
+                manager->filterBlockHash = UINT256_ZERO;
+                manager->filterHeight = joinHeight;
             }
         
             manager->lastBlock = block;
             
-            if (block->height == manager->estimatedHeight) { // chain download is complete
+            if (block->height == manager->estimatedHeight && ! manager->compactFilters) { // chain download is complete
                 saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
                 _BRPeerManagerLoadMempools(manager);
             }
@@ -1340,27 +2031,159 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         next = BRSetRemove(manager->orphans, &orphan);
     }
     
-    BRMerkleBlock *saveBlocks[saveCount];
+    if (saveCount > 0) _BRPeerManagerSaveBlocks(manager, block, saveCount);
     
-    for (i = 0, b = block; b && i < saveCount; i++) {
-        assert(b->height != BLOCK_UNKNOWN_HEIGHT); // verify all blocks to be saved are in the chain
-        saveBlocks[i] = b;
-        b = BRSetGet(manager->blocks, &b->prevBlock);
+    // notify that transaction confirmations may have changed
+    if (block && block->height != BLOCK_UNKNOWN_HEIGHT && block->height >= BRPeerLastBlock(peer)) *notify = 1;
+    return next;
+}
+
+static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    UInt256 blockHash;
+    int queued, matched, notify = 0;
+    
+    pthread_mutex_lock(&manager->lock);
+    matched = (peer == manager->downloadPeer && UInt256Eq(block->blockHash, manager->filterBlockHash));
+    queued = _BRPeerManagerQueueBlock(manager, peer, block);
+    if (queued) block = _BRPeerManagerDequeueBlock(manager, &peer);
+    
+    while (block) {
+        blockHash = block->blockHash;
+        block = _BRPeerManagerAddBlock(manager, peer, block, &notify); // next block if it was received as an orphan
+        
+        if (queued && ! UInt256Eq(manager->lastBlock->blockHash, blockHash)) {
+            // queued blocks are expected to extend the chain in order, start over from lastBlock if one didn't
+            peer_log(peer, "queued block %s didn't extend the chain, requesting blocks again", u256hex(blockHash));
+            _BRPeerManagerResetBlockQueue(manager);
+            
+            if (manager->downloadPeer) {
+                UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
+                size_t count = _BRPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
+                
+                BRPeerSendGetblocks(manager->downloadPeer, locators, count, UINT256_ZERO);
+            }
+        }
+        else if (queued && manager->downloadPeer && manager->lastBlock->height < manager->estimatedHeight) {
+            BRPeerScheduleDisconnect(manager->downloadPeer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        }
+        
+        queued = (! block && (block = _BRPeerManagerDequeueBlock(manager, &peer)) != NULL);
+    }
+    
+    if (matched) { // the block that matched its filter has been added, with its tx, so move on to the next filter
+        manager->filterBlockHash = UINT256_ZERO;
+        manager->filterHeight++;
+    }
+    
+    _BRPeerManagerSyncFilters(manager);
+    pthread_mutex_unlock(&manager->lock);
+    if (notify && manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
+}
+
+// a full block that matched its compact filter, only its wallet tx are kept and registered before the block is added
+static void _peerRelayedFullBlock(void *info, BRMerkleBlock *block, BRTransaction *txs[], size_t txCount)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    size_t i, count, total = 0;
+
+    pthread_mutex_lock(&manager->lock);
+    
+    // tx that spend from wallet tx registered on an earlier pass are only recognized on the next one
+    do {
+        for (i = 0, count = 0; i < txCount; i++) {
+            if (! txs[i] || ! BRWalletContainsTransaction(manager->wallet, txs[i])) continue;
+            array_add(manager->blockTx, txs[i]);
+            txs[i] = NULL;
+            count++;
+        }
+        
+        if (count > 0) _BRPeerManagerRegisterBlockTx(manager, peer);
+        total += count;
+    } while (count > 0);
+    
+    for (i = 0; i < txCount; i++) if (txs[i]) BRTransactionFree(txs[i]);
+    if (total > 0) peer_log(peer, "block %s has %zu wallet tx", u256hex(block->blockHash), total);
+    pthread_mutex_unlock(&manager->lock);
+    _peerRelayedBlock(info, block);
+}
+
+static void _peerRelayedCfheaders(void *info, UInt256 stopHash, UInt256 prevFilterHeader,
+                                  const UInt256 filterHashes[], size_t hashesCount)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    size_t count;
+    
+    pthread_mutex_lock(&manager->lock);
+    count = array_count(manager->filterBlockHashes);
+    
+    if (peer != manager->downloadPeer) {
+        peer_log(peer, "relayed unrequested cfheaders");
+    }
+    else if (count == 0 || array_count(manager->filterHashes) > 0 || hashesCount != count ||
+             ! UInt256Eq(stopHash, manager->filterBlockHashes[count - 1])) {
+        peer_log(peer, "relayed cfheaders that don't match the requested range");
+        _BRPeerManagerPeerMisbehavin(manager, peer);
+    }
+    else if (! UInt256IsZero(manager->filterHeader) && manager->filterHeaderHeight + 1 == manager->filterStartHeight &&
+             ! UInt256Eq(prevFilterHeader, manager->filterHeader)) { // filter header chain has to be continuous
+        peer_log(peer, "relayed cfheaders that don't connect to the previous filter header");
+        _BRPeerManagerPeerMisbehavin(manager, peer);
+    }
+    else {
+        array_add_array(manager->filterHashes, filterHashes, hashesCount);
+        manager->filterHeader = prevFilterHeader;
+        
+        for (size_t i = 0; i < hashesCount; i++) {
+            manager->filterHeader = BRGCSFilterHeader(filterHashes[i], manager->filterHeader);
+        }
+        
+        manager->filterHeaderHeight = manager->filterStartHeight + (uint32_t)hashesCount - 1;
     }
     
-    // make sure the set of blocks to be saved starts at a difficulty interval
-    j = (i > 0) ? saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL : 0;
-    if (j > 0) i -= (i > BLOCK_DIFFICULTY_INTERVAL - j) ? BLOCK_DIFFICULTY_INTERVAL - j : i;
-    assert(i == 0 || (saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL) == 0);
-    if (i > 0 && manager->saveBlocks) manager->saveBlocks(manager->info, (i > 1 ? 1 : 0), saveBlocks, i);
     pthread_mutex_unlock(&manager->lock);
+}
+
+static void _peerRelayedCfilter(void *info, UInt256 blockHash, const uint8_t *filter, size_t filterLen)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    size_t i;
+    BRQueuedFilter f;
     
-    if (block && block->height != BLOCK_UNKNOWN_HEIGHT && block->height >= BRPeerLastBlock(peer) &&
-        manager->txStatusUpdate) {
-        manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
+    pthread_mutex_lock(&manager->lock);
+    i = manager->filtersReceived;
+    
+    if (peer != manager->downloadPeer) {
+        peer_log(peer, "relayed unrequested cfilter");
+    }
+    else if (i >= array_count(manager->filterHashes) || ! UInt256Eq(blockHash, manager->filterBlockHashes[i]) ||
+             ! UInt256Eq(BRGCSFilterHash(filter, filterLen), manager->filterHashes[i])) {
+        peer_log(peer, "relayed cfilter that doesn't match its cfheaders entry: %s", u256hex(blockHash));
+        _BRPeerManagerPeerMisbehavin(manager, peer);
+    }
+    else {
+        manager->filtersReceived++;
+        
+        // after a chain reorganization, filters for blocks that are no longer next in line are dropped
+        if (manager->filterStartHeight + i == manager->filterHeight + array_count(manager->filters) + 1) {
+            f.blockHash = blockHash;
+            f.filter = malloc(filterLen + 1);
+            assert(f.filter != NULL);
+            memcpy(f.filter, filter, filterLen);
+            f.filterLen = filterLen;
+            array_add(manager->filters, f);
+        }
+        
+        // filters are checked together once the whole range is in, so wallet scripts are only collected once
+        if (manager->syncStartHeight > 0) BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
     }
     
-    if (next) _peerRelayedBlock(info, next);
+    pthread_mutex_unlock(&manager->lock);
 }
 
 static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCount,
@@ -1368,6 +2191,7 @@ static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCou
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRSyncPeer *syncPeer;
 
     pthread_mutex_lock(&manager->lock);
 
@@ -1376,6 +2200,30 @@ static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCou
         _BRTxPeerListRemovePeer(manager->txRequests, txHashes[i], peer);
     }
 
+    for (size_t i = 0; i < blockCount && peer == manager->downloadPeer; i++) {
+        if (! UInt256Eq(blockHashes[i], manager->filterBlockHash)) continue;
+        peer_log(peer, "block %s matched its compact filter, but peer doesn't have it", u256hex(blockHashes[i]));
+        BRPeerDisconnect(peer);
+    }
+
+    if (blockCount > 0 && (syncPeer = _BRPeerManagerSyncPeer(manager, peer))) {
+        for (size_t i = manager->blockQueueHead; i < array_count(manager->blockQueue); i++) {
+            BRQueuedBlock *q = &manager->blockQueue[i];
+            
+            if (q->peer != peer || q->block) continue;
+            
+            for (size_t j = 0; j < blockCount; j++) { // request blocks that peer doesn't have from other sync peers
+                if (! UInt256Eq(q->blockHash, blockHashes[j])) continue;
+                q->peer = NULL;
+                if (syncPeer->inFlight > 0) syncPeer->inFlight--;
+                syncPeer->stalled = 1;
+                break;
+            }
+        }
+        
+        _BRPeerManagerRequestBlocks(manager);
+    }
+
     pthread_mutex_unlock(&manager->lock);
 }
 
@@ -1426,7 +2274,11 @@ static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
     }
 
     _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
-    if (pubTx.tx) BRWalletRegisterTransaction(manager->wallet, pubTx.tx);
+    // a published non-wallet tx is left out of the wallet's pool, which could free it
+    if (pubTx.tx && BRWalletContainsTransaction(manager->wallet, pubTx.tx)) {
+        BRWalletRegisterTransaction(manager->wallet, pubTx.tx);
+    }
+    
     if (pubTx.tx && ! BRWalletTransactionIsValid(manager->wallet, pubTx.tx)) error = EINVAL;
     pthread_mutex_unlock(&manager->lock);
     if (pubTx.callback) pubTx.callback(pubTx.info, error);
@@ -1469,7 +2321,8 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     manager->wallet = wallet;
     manager->earliestKeyTime = earliestKeyTime;
     manager->averageTxPerBlock = 1400;
-    manager->maxConnectCount = PEER_MAX_CONNECTIONS;
+    manager->maxConnectCount = manager->maxPeerCount = PEER_MAX_CONNECTIONS;
+    manager->downloadPeerCount = 1;
     array_new(manager->peers, peersCount);
     if (peers) array_add_array(manager->peers, peers, peersCount);
     qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
@@ -1512,6 +2365,12 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     array_new(manager->txRequests, 10);
     array_new(manager->publishedTx, 10);
     array_new(manager->publishedTxHashes, 10);
+    array_new(manager->blockTx, 10);
+    array_new(manager->blockQueue, 1000);
+    array_new(manager->syncPeers, PEER_MAX_CONNECTIONS);
+    array_new(manager->filters, FILTER_BATCH_MAX);
+    array_new(manager->filterBlockHashes, FILTER_BATCH_MAX);
+    array_new(manager->filterHashes, FILTER_BATCH_MAX);
     pthread_mutex_init(&manager->lock, NULL);
     manager->threadCleanup = _dummyThreadCleanup;
     return manager;
@@ -1555,12 +2414,93 @@ void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t
     assert(manager != NULL);
     BRPeerManagerDisconnect(manager);
     pthread_mutex_lock(&manager->lock);
-    manager->maxConnectCount = UInt128IsZero(address) ? PEER_MAX_CONNECTIONS : 1;
+    manager->maxConnectCount = UInt128IsZero(address) ? manager->maxPeerCount : 1;
     manager->fixedPeer = ((BRPeer) { address, port, 0, 0, 0 });
     array_clear(manager->peers);
     pthread_mutex_unlock(&manager->lock);
 }
 
+// known headers that are downloaded again, such as during a rescan, take their proof-of-work hash from cache instead
+// of recomputing scrypt, the cache is seeded with the blocks already in the chain and updated as new blocks are added,
+// so it holds an entry for every block the manager has seen (see BRPoWCacheNew(), the cache has no size bound)
+// set the cache once before calling BRPeerManagerConnect(), cache must outlive the manager
+void BRPeerManagerSetPoWCache(BRPeerManager *manager, BRPoWCache *cache)
+{
+    BRMerkleBlock *block = NULL;
+
+    assert(manager != NULL);
+    pthread_mutex_lock(&manager->lock);
+    manager->powCache = cache;
+
+    while (cache && (block = BRSetIterate(manager->blocks, block)) != NULL) {
+        if (UInt256IsZero(block->powHash) || block->height == BLOCK_UNKNOWN_HEIGHT) continue; // skip checkpoints
+        BRPoWCacheAdd(cache, block->blockHash, block->powHash, block->height);
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// peer connections are served by loop instead of a thread per peer, and DNS lookups run as loop jobs instead of on
+// threads of their own, so many managers can share a few threads, see BRPeerSetLoop()
+// not thread-safe, set the loop once before calling BRPeerManagerConnect(), loop must outlive the manager
+void BRPeerManagerSetPeerLoop(BRPeerManager *manager, BRPeerLoop *loop)
+{
+    assert(manager != NULL);
+    pthread_mutex_lock(&manager->lock);
+    manager->peerLoop = loop;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// sets the number of peers to stay connected to, PEER_MAX_CONNECTIONS by default, a fixed peer overrides this with 1
+// not thread-safe, set the count once before calling BRPeerManagerConnect()
+void BRPeerManagerSetMaxConnectCount(BRPeerManager *manager, int count)
+{
+    assert(manager != NULL);
+    assert(count > 0);
+    pthread_mutex_lock(&manager->lock);
+    manager->maxPeerCount = count;
+    if (UInt128IsZero(manager->fixedPeer.address)) manager->maxConnectCount = count;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// during chain sync, merkleblocks are downloaded from up to count connected peers at once instead of just the download
+// peer, which still supplies the block hashes, and the blocks are added to the chain in order as they arrive
+// the default count of 1 downloads every block from the download peer, count is also limited by the connected peers
+// not thread-safe, set the count once before calling BRPeerManagerConnect()
+void BRPeerManagerSetDownloadPeerCount(BRPeerManager *manager, int count)
+{
+    assert(manager != NULL);
+    assert(count > 0);
+    pthread_mutex_lock(&manager->lock);
+    manager->downloadPeerCount = count;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// syncs with BIP157/158 compact block filters instead of BIP37 bloom filters: headers and filters are downloaded for
+// the chain after earliestKeyTime, and full blocks only when their filter matches a wallet address
+// not thread-safe, call once before calling BRPeerManagerConnect()
+void BRPeerManagerSetCompactFilters(BRPeerManager *manager, int enabled)
+{
+    BRMerkleBlock *b;
+    
+    assert(manager != NULL);
+    pthread_mutex_lock(&manager->lock);
+    manager->compactFilters = enabled;
+    manager->filterHeight = manager->lastBlock->height;
+    manager->filterHeaderHeight = 0;
+    
+    // the chain is only saved ahead of the filters that were checked when lastBlock is a difficulty transition, so
+    // check the filters of the blocks before it again
+    if ((manager->lastBlock->height % BLOCK_DIFFICULTY_INTERVAL) == 0) {
+        for (b = manager->lastBlock; b && b->height + FILTER_RECHECK_BLOCKS > manager->lastBlock->height;
+             b = BRSetGet(manager->blocks, &b->prevBlock)) {
+            manager->filterHeight = b->height;
+        }
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+}
+
 // current connect status
 BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager)
 {
@@ -1588,7 +2528,7 @@ void BRPeerManagerConnect(BRPeerManager *manager)
     
     if ((! manager->downloadPeer || manager->lastBlock->height < manager->estimatedHeight) &&
         manager->syncStartHeight == 0) {
-        manager->syncStartHeight = manager->lastBlock->height + 1;
+        manager->syncStartHeight = ((manager->compactFilters) ? manager->filterHeight : manager->lastBlock->height) + 1;
         pthread_mutex_unlock(&manager->lock);
         if (manager->syncStarted) manager->syncStarted(manager->info);
         pthread_mutex_lock(&manager->lock);
@@ -1637,6 +2577,15 @@ void BRPeerManagerConnect(BRPeerManager *manager)
                                    _peerRelayedTx, _peerHasTx, _peerRejectedTx, _peerRelayedBlock, _peerDataNotfound,
                                    _peerSetFeePerKb, _peerRequestedTx, _peerNetworkIsReachable, _peerThreadCleanup);
                 BRPeerSetEarliestKeyTime(info->peer, manager->earliestKeyTime);
+                BRPeerSetPoWCache(info->peer, manager->powCache);
+                BRPeerSetLoop(info->peer, manager->peerLoop);
+                BRPeerSetBlockInvCallback(info->peer, _peerBlockInv);
+                
+                if (manager->compactFilters) {
+                    BRPeerSetCompactFilterCallbacks(info->peer, _peerRelayedCfheaders, _peerRelayedCfilter,
+                                                    _peerRelayedFullBlock);
+                }
+                
                 BRPeerConnect(info->peer);
             }
         }
@@ -1833,17 +2782,20 @@ uint32_t BRPeerManagerLastBlockTimestamp(BRPeerManager *manager)
 double BRPeerManagerSyncProgress(BRPeerManager *manager, uint32_t startHeight)
 {
     double progress;
+    uint32_t height;
     
     assert(manager != NULL);
     pthread_mutex_lock(&manager->lock);
     if (startHeight == 0) startHeight = manager->syncStartHeight;
+    height = manager->lastBlock->height;
+    if (manager->compactFilters && manager->filterHeight < height) height = manager->filterHeight; // filters lag
     
     if (! manager->downloadPeer && manager->syncStartHeight == 0) {
         progress = 0.0;
     }
-    else if (! manager->downloadPeer || manager->lastBlock->height < manager->estimatedHeight) {
-        if (manager->lastBlock->height > startHeight && manager->estimatedHeight > startHeight) {
-            progress = 0.1 + 0.9*(manager->lastBlock->height - startHeight)/(manager->estimatedHeight - startHeight);
+    else if (! manager->downloadPeer || height < manager->estimatedHeight) {
+        if (height > startHeight && manager->estimatedHeight > startHeight) {
+            progress = 0.1 + 0.9*(height - startHeight)/(manager->estimatedHeight - startHeight);
         }
         else progress = 0.05;
     }
@@ -1983,6 +2935,8 @@ void BRPeerManagerFree(BRPeerManager *manager)
     
     assert(manager != NULL);
     pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerResetBlockQueue(manager);
+    _BRPeerManagerResetFilters(manager);
     array_free(manager->peers);
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) BRPeerFree(manager->connectedPeers[i - 1]);
     array_free(manager->connectedPeers);
@@ -2003,6 +2957,13 @@ void BRPeerManagerFree(BRPeerManager *manager)
 
     array_free(manager->publishedTx);
     array_free(manager->publishedTxHashes);
+    for (size_t i = array_count(manager->blockTx); i > 0; i--) BRTransactionFree(manager->blockTx[i - 1]);
+    array_free(manager->blockTx);
+    array_free(manager->blockQueue);
+    array_free(manager->syncPeers);
+    array_free(manager->filters);
+    array_free(manager->filterBlockHashes);
+    array_free(manager->filterHashes);
     pthread_mutex_unlock(&manager->lock);
     pthread_mutex_destroy(&manager->lock);
     free(manager);
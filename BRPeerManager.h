@@ -69,6 +69,32 @@ void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
 // set address to UINT128_ZERO to revert to default behavior
 void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t port);
 
+// known headers that are downloaded again, such as during a rescan, take their proof-of-work hash from cache instead
+// of recomputing scrypt, the cache is seeded with the blocks already in the chain and updated as new blocks are added,
+// so it holds an entry for every block the manager has seen (see BRPoWCacheNew(), the cache has no size bound)
+// set the cache once before calling BRPeerManagerConnect(), cache must outlive the manager
+void BRPeerManagerSetPoWCache(BRPeerManager *manager, BRPoWCache *cache);
+
+// peer connections are served by loop instead of a thread per peer, and DNS lookups run as loop jobs instead of on
+// threads of their own, so many managers can share a few threads, see BRPeerSetLoop()
+// not thread-safe, set the loop once before calling BRPeerManagerConnect(), loop must outlive the manager
+void BRPeerManagerSetPeerLoop(BRPeerManager *manager, BRPeerLoop *loop);
+
+// sets the number of peers to stay connected to, PEER_MAX_CONNECTIONS by default, a fixed peer overrides this with 1
+// not thread-safe, set the count once before calling BRPeerManagerConnect()
+void BRPeerManagerSetMaxConnectCount(BRPeerManager *manager, int count);
+
+// during chain sync, merkleblocks are downloaded from up to count connected peers at once instead of just the download
+// peer, which still supplies the block hashes, and the blocks are added to the chain in order as they arrive
+// the default count of 1 downloads every block from the download peer, count is also limited by the connected peers
+// not thread-safe, set the count once before calling BRPeerManagerConnect()
+void BRPeerManagerSetDownloadPeerCount(BRPeerManager *manager, int count);
+
+// syncs with BIP157/158 compact block filters instead of BIP37 bloom filters: headers and filters are downloaded for
+// the chain after earliestKeyTime, and full blocks only when their filter matches a wallet address
+// not thread-safe, call once before calling BRPeerManagerConnect()
+void BRPeerManagerSetCompactFilters(BRPeerManager *manager, int enabled);
+
 // current connect status
 BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager);
 
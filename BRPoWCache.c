@@ -0,0 +1,210 @@
+//
+//  BRPoWCache.c
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRPoWCache.h"
+#include "BRAddress.h"
+#include "BRSet.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <assert.h>
+
+#define POW_CACHE_ENTRY_SIZE (sizeof(UInt256) + sizeof(UInt256) + sizeof(uint32_t)) // serialized size of an entry
+
+typedef struct {
+    UInt256 blockHash;
+    UInt256 powHash;
+    uint32_t height;
+} BRPoWCacheEntry;
+
+struct BRPoWCacheStruct {
+    BRSet *entries;
+    BRPoWCacheTrust trust;
+    uint32_t trustHeight;
+    pthread_mutex_t lock;
+};
+
+inline static size_t _BRPoWCacheEntryHash(const void *entry)
+{
+    return (size_t)((const BRPoWCacheEntry *)entry)->blockHash.u32[0];
+}
+
+inline static int _BRPoWCacheEntryEq(const void *entry, const void *otherEntry)
+{
+    return (entry == otherEntry ||
+            UInt256Eq(((const BRPoWCacheEntry *)entry)->blockHash, ((const BRPoWCacheEntry *)otherEntry)->blockHash));
+}
+
+// adds or replaces an entry, cache must be locked
+static int _BRPoWCacheAddEntry(BRPoWCache *cache, UInt256 blockHash, UInt256 powHash, uint32_t height)
+{
+    BRPoWCacheEntry *entry = BRSetGet(cache->entries, &blockHash);
+    int r = 0;
+    
+    if (! entry) {
+        entry = calloc(1, sizeof(*entry));
+        assert(entry != NULL);
+        entry->blockHash = blockHash;
+        BRSetAdd(cache->entries, entry);
+        r = 1;
+    }
+    
+    entry->powHash = powHash;
+    entry->height = height;
+    return r;
+}
+
+// returns a newly allocated blockHash -> powHash cache that must be freed by calling BRPoWCacheFree()
+// the cache has no size bound, each entry takes about 100 bytes and is kept until the cache is freed
+BRPoWCache *BRPoWCacheNew(BRPoWCacheTrust trust, uint32_t trustHeight)
+{
+    BRPoWCache *cache = calloc(1, sizeof(*cache));
+    
+    assert(cache != NULL);
+    cache->entries = BRSetNew(_BRPoWCacheEntryHash, _BRPoWCacheEntryEq, 1024);
+    cache->trust = trust;
+    cache->trustHeight = trustHeight;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+// changes the policy that decides which cached hashes are used
+void BRPoWCacheSetTrust(BRPoWCache *cache, BRPoWCacheTrust trust, uint32_t trustHeight)
+{
+    assert(cache != NULL);
+    pthread_mutex_lock(&cache->lock);
+    cache->trust = trust;
+    cache->trustHeight = trustHeight;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// adds or replaces the proof-of-work hash for a validated block at the given height
+void BRPoWCacheAdd(BRPoWCache *cache, UInt256 blockHash, UInt256 powHash, uint32_t height)
+{
+    assert(cache != NULL);
+    assert(! UInt256IsZero(powHash));
+    pthread_mutex_lock(&cache->lock);
+    _BRPoWCacheAddEntry(cache, blockHash, powHash, height);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// true if the cache holds a trusted proof-of-work hash for blockHash, which is then written to powHash
+int BRPoWCacheLookup(BRPoWCache *cache, UInt256 blockHash, UInt256 *powHash)
+{
+    const BRPoWCacheEntry *entry;
+    int r = 0;
+    
+    assert(cache != NULL);
+    assert(powHash != NULL);
+    pthread_mutex_lock(&cache->lock);
+    entry = (cache->trust != BRPoWCacheTrustNone) ? BRSetGet(cache->entries, &blockHash) : NULL;
+    
+    if (entry && (cache->trust == BRPoWCacheTrustAll || entry->height <= cache->trustHeight)) {
+        *powHash = entry->powHash;
+        r = 1;
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    return r;
+}
+
+// returns the number of cached hashes
+size_t BRPoWCacheCount(BRPoWCache *cache)
+{
+    size_t count;
+    
+    assert(cache != NULL);
+    pthread_mutex_lock(&cache->lock);
+    count = BRSetCount(cache->entries);
+    pthread_mutex_unlock(&cache->lock);
+    return count;
+}
+
+// serializes the cache for persistent storage, e.g. along with saved blocks
+// returns number of bytes written to buf, or total bufLen needed if buf is NULL
+size_t BRPoWCacheSerialize(BRPoWCache *cache, uint8_t *buf, size_t bufLen)
+{
+    const BRPoWCacheEntry *entry = NULL;
+    size_t off = 0, count, len;
+    
+    assert(cache != NULL);
+    assert(buf != NULL || bufLen == 0);
+    pthread_mutex_lock(&cache->lock);
+    count = BRSetCount(cache->entries);
+    len = BRVarIntSize(count) + count*POW_CACHE_ENTRY_SIZE;
+    
+    if (buf && len <= bufLen) {
+        off += BRVarIntSet(&buf[off], bufLen - off, count);
+        
+        while ((entry = BRSetIterate(cache->entries, entry)) != NULL) {
+            UInt256Set(&buf[off], entry->blockHash);
+            off += sizeof(UInt256);
+            UInt256Set(&buf[off], entry->powHash);
+            off += sizeof(UInt256);
+            UInt32SetLE(&buf[off], entry->height);
+            off += sizeof(uint32_t);
+        }
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    return (! buf || len <= bufLen) ? len : 0;
+}
+
+// adds hashes from a cache serialized with BRPoWCacheSerialize(), returns the number of hashes added
+size_t BRPoWCacheParse(BRPoWCache *cache, const uint8_t *buf, size_t bufLen)
+{
+    size_t off = 0, len = 0, count, added = 0;
+    UInt256 blockHash, powHash;
+    
+    assert(cache != NULL);
+    assert(buf != NULL || bufLen == 0);
+    count = (size_t)BRVarInt(buf, bufLen, &len);
+    off += len;
+    pthread_mutex_lock(&cache->lock);
+    
+    for (size_t i = 0; i < count && off + POW_CACHE_ENTRY_SIZE <= bufLen; i++) {
+        blockHash = UInt256Get(&buf[off]);
+        off += sizeof(UInt256);
+        powHash = UInt256Get(&buf[off]);
+        off += sizeof(UInt256);
+        if (! UInt256IsZero(powHash)) added += _BRPoWCacheAddEntry(cache, blockHash, powHash, UInt32GetLE(&buf[off]));
+        off += sizeof(uint32_t);
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    return added;
+}
+
+static void _BRPoWCacheEntryFree(void *info, void *entry)
+{
+    free(entry);
+}
+
+// frees memory allocated for cache
+void BRPoWCacheFree(BRPoWCache *cache)
+{
+    assert(cache != NULL);
+    BRSetApply(cache->entries, NULL, _BRPoWCacheEntryFree);
+    BRSetFree(cache->entries);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
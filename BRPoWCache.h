@@ -0,0 +1,74 @@
+//
+//  BRPoWCache.h
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRPoWCache_h
+#define BRPoWCache_h
+
+#include "BRInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    BRPoWCacheTrustNone = 0, // cached hashes are never used, every header is hashed (the cache is still updated)
+    BRPoWCacheTrustBelowHeight, // cached hashes are used for blocks at or below trustHeight, e.g. the last checkpoint
+    BRPoWCacheTrustAll // cached hashes are used for any block that was previously validated
+} BRPoWCacheTrust;
+
+typedef struct BRPoWCacheStruct BRPoWCache;
+
+// returns a newly allocated blockHash -> powHash cache that must be freed by calling BRPoWCacheFree()
+// the cache has no size bound, each entry takes about 100 bytes and is kept until the cache is freed
+// the cache lets known headers skip scrypt when they are downloaded again, such as during a rescan
+BRPoWCache *BRPoWCacheNew(BRPoWCacheTrust trust, uint32_t trustHeight);
+
+// changes the policy that decides which cached hashes are used
+void BRPoWCacheSetTrust(BRPoWCache *cache, BRPoWCacheTrust trust, uint32_t trustHeight);
+
+// adds or replaces the proof-of-work hash for a validated block at the given height
+void BRPoWCacheAdd(BRPoWCache *cache, UInt256 blockHash, UInt256 powHash, uint32_t height);
+
+// true if the cache holds a trusted proof-of-work hash for blockHash, which is then written to powHash
+int BRPoWCacheLookup(BRPoWCache *cache, UInt256 blockHash, UInt256 *powHash);
+
+// returns the number of cached hashes
+size_t BRPoWCacheCount(BRPoWCache *cache);
+
+// serializes the cache for persistent storage, e.g. along with saved blocks
+// returns number of bytes written to buf, or total bufLen needed if buf is NULL
+size_t BRPoWCacheSerialize(BRPoWCache *cache, uint8_t *buf, size_t bufLen);
+
+// adds hashes from a cache serialized with BRPoWCacheSerialize(), returns the number of hashes added
+size_t BRPoWCacheParse(BRPoWCache *cache, const uint8_t *buf, size_t bufLen);
+
+// frees memory allocated for cache
+void BRPoWCacheFree(BRPoWCache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRPoWCache_h
@@ -0,0 +1,235 @@
+//
+//  BRThreadPool.c
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRThreadPool.h"
+#include "BRArray.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define PTHREAD_STACK_SIZE  (512 * 1024)
+#define MAX_THREAD_COUNT    64
+
+typedef struct {
+    void *info;
+    void (*job)(void *info);
+} BRThreadPoolJob;
+
+struct BRThreadPoolStruct {
+    BRThreadPoolJob *jobs; // FIFO queue of jobs waiting for a worker thread
+    size_t jobIdx; // index of the next job in jobs to start
+    pthread_t *threads;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+typedef struct {
+    void *info;
+    void (*apply)(void *info, size_t i);
+    size_t count, next, done;
+    int refCount; // the calling thread plus each queued helper job
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} BRThreadPoolApplyContext;
+
+static void *_poolThreadRoutine(void *arg)
+{
+    BRThreadPool *pool = arg;
+    BRThreadPoolJob job;
+
+    pthread_mutex_lock(&pool->lock);
+    
+    for (;;) {
+        while (pool->jobIdx == array_count(pool->jobs) && ! pool->stopping) pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->jobIdx == array_count(pool->jobs)) break; // stopping with no jobs left
+        job = pool->jobs[pool->jobIdx++];
+        
+        if (pool->jobIdx == array_count(pool->jobs)) { // queue is drained, reset it
+            array_clear(pool->jobs);
+            pool->jobIdx = 0;
+        }
+        
+        pthread_mutex_unlock(&pool->lock);
+        job.job(job.info);
+        pthread_mutex_lock(&pool->lock);
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// returns a newly allocated pool of threadCount worker threads that must be freed by calling BRThreadPoolFree()
+BRThreadPool *BRThreadPoolNew(size_t threadCount)
+{
+    BRThreadPool *pool = calloc(1, sizeof(*pool));
+    pthread_attr_t attr;
+    pthread_t thread;
+    
+    assert(pool != NULL);
+    assert(threadCount > 0);
+    array_new(pool->jobs, 10);
+    array_new(pool->threads, threadCount);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    
+    if (pthread_attr_init(&attr) == 0) {
+        if (pthread_attr_setstacksize(&attr, PTHREAD_STACK_SIZE) == 0) {
+            for (size_t i = 0; i < threadCount; i++) {
+                if (pthread_create(&thread, &attr, _poolThreadRoutine, pool) == 0) array_add(pool->threads, thread);
+            }
+        }
+        
+        pthread_attr_destroy(&attr);
+    }
+    
+    assert(array_count(pool->threads) > 0);
+    return pool;
+}
+
+static BRThreadPool *_sharedPool = NULL;
+static pthread_once_t _sharedPoolOnce = PTHREAD_ONCE_INIT;
+
+static void _BRThreadPoolSharedInit(void)
+{
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    if (cpuCount < 1) cpuCount = 1;
+    if (cpuCount > MAX_THREAD_COUNT) cpuCount = MAX_THREAD_COUNT;
+    _sharedPool = BRThreadPoolNew((size_t)cpuCount);
+}
+
+// returns a process wide pool with one worker thread per online cpu, created on first use and never freed
+BRThreadPool *BRThreadPoolShared(void)
+{
+    pthread_once(&_sharedPoolOnce, _BRThreadPoolSharedInit);
+    return _sharedPool;
+}
+
+// returns the number of worker threads in pool
+size_t BRThreadPoolThreadCount(const BRThreadPool *pool)
+{
+    assert(pool != NULL);
+    return array_count(pool->threads);
+}
+
+// queues job(info) to run on a worker thread, jobs are started in the order they were added
+void BRThreadPoolAdd(BRThreadPool *pool, void *info, void (*job)(void *info))
+{
+    assert(pool != NULL);
+    assert(job != NULL);
+    pthread_mutex_lock(&pool->lock);
+    assert(! pool->stopping);
+    array_add(pool->jobs, ((BRThreadPoolJob) { info, job }));
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// claims and runs items from ctx until none are left, must be called with ctx->lock held
+static void _BRThreadPoolApplyWork(BRThreadPoolApplyContext *ctx)
+{
+    size_t i;
+    
+    while (ctx->next < ctx->count) {
+        i = ctx->next++;
+        pthread_mutex_unlock(&ctx->lock);
+        ctx->apply(ctx->info, i);
+        pthread_mutex_lock(&ctx->lock);
+        if (++ctx->done == ctx->count) pthread_cond_broadcast(&ctx->cond);
+    }
+}
+
+// drops a reference to ctx and frees it if it was the last one, must be called with ctx->lock held
+static void _BRThreadPoolApplyRelease(BRThreadPoolApplyContext *ctx)
+{
+    int refCount = --ctx->refCount;
+    
+    pthread_mutex_unlock(&ctx->lock);
+    
+    if (refCount == 0) {
+        pthread_mutex_destroy(&ctx->lock);
+        pthread_cond_destroy(&ctx->cond);
+        free(ctx);
+    }
+}
+
+static void _BRThreadPoolApplyJob(void *info)
+{
+    BRThreadPoolApplyContext *ctx = info;
+    
+    pthread_mutex_lock(&ctx->lock);
+    _BRThreadPoolApplyWork(ctx);
+    _BRThreadPoolApplyRelease(ctx);
+}
+
+// calls apply(info, i) once for each i in [0, count), spreading the calls across the worker threads and the calling
+// thread, and returns after all calls have completed
+void BRThreadPoolApply(BRThreadPool *pool, void *info, void (*apply)(void *info, size_t i), size_t count)
+{
+    BRThreadPoolApplyContext *ctx;
+    size_t helpers;
+    
+    assert(pool != NULL);
+    assert(apply != NULL);
+    
+    if (count <= 1) { // nothing to spread
+        if (count == 1) apply(info, 0);
+        return;
+    }
+    
+    // ctx is reference counted since helper jobs may still be waiting in the queue after all calls have completed
+    helpers = array_count(pool->threads);
+    if (helpers > count - 1) helpers = count - 1;
+    ctx = calloc(1, sizeof(*ctx));
+    assert(ctx != NULL);
+    ctx->info = info;
+    ctx->apply = apply;
+    ctx->count = count;
+    ctx->refCount = (int)helpers + 1;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    for (size_t i = 0; i < helpers; i++) BRThreadPoolAdd(pool, ctx, _BRThreadPoolApplyJob);
+    
+    pthread_mutex_lock(&ctx->lock);
+    _BRThreadPoolApplyWork(ctx);
+    while (ctx->done < ctx->count) pthread_cond_wait(&ctx->cond, &ctx->lock);
+    _BRThreadPoolApplyRelease(ctx);
+}
+
+// waits for queued jobs to finish, then stops the worker threads and frees memory allocated for pool
+void BRThreadPoolFree(BRThreadPool *pool)
+{
+    assert(pool != NULL);
+    assert(pool != _sharedPool);
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < array_count(pool->threads); i++) pthread_join(pool->threads[i], NULL);
+    array_free(pool->jobs);
+    array_free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool);
+}
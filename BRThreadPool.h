@@ -0,0 +1,58 @@
+//
+//  BRThreadPool.h
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRThreadPool_h
+#define BRThreadPool_h
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct BRThreadPoolStruct BRThreadPool;
+
+// returns a newly allocated pool of threadCount worker threads that must be freed by calling BRThreadPoolFree()
+BRThreadPool *BRThreadPoolNew(size_t threadCount);
+
+// returns a process wide pool with one worker thread per online cpu, created on first use and never freed
+BRThreadPool *BRThreadPoolShared(void);
+
+// returns the number of worker threads in pool
+size_t BRThreadPoolThreadCount(const BRThreadPool *pool);
+
+// queues job(info) to run on a worker thread, jobs are started in the order they were added
+void BRThreadPoolAdd(BRThreadPool *pool, void *info, void (*job)(void *info));
+
+// calls apply(info, i) once for each i in [0, count), spreading the calls across the worker threads and the calling
+// thread, and returns after all calls have completed
+void BRThreadPoolApply(BRThreadPool *pool, void *info, void (*apply)(void *info, size_t i), size_t count);
+
+// waits for queued jobs to finish, then stops the worker threads and frees memory allocated for pool
+void BRThreadPoolFree(BRThreadPool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRThreadPool_h
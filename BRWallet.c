@@ -23,99 +23,395 @@
 //  THE SOFTWARE.
 
 #include "BRWallet.h"
+#include "BRCrypto.h"
 #include "BRSet.h"
 #include "BRAddress.h"
 #include "BRArray.h"
+#include "BRThreadPool.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <float.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <assert.h>
 
+#ifndef BR_WALLET_VERIFY_BALANCE
+#ifdef DEBUG
+#define BR_WALLET_VERIFY_BALANCE 1 // cross-check each incremental balance update against a full rebuild
+#else
+#define BR_WALLET_VERIFY_BALANCE 0
+#endif
+#endif
+
+#define BR_WALLET_ADDR_CHUNK 32 // new addresses are derived in chunks of this many, spread across the shared thread pool
+
+#define BR_WALLET_POOL_MAX_AGE (24*60*60) // non-wallet tx not relayed again for this many seconds are evicted
+
+#define BR_WALLET_SNAPSHOT_MAGIC   0x53575242 // "BRWS"
+#define BR_WALLET_SNAPSHOT_VERSION 1
+
+typedef enum {
+    BRWalletUndoSetAdd,  // item was added to set, replacing an equal item if replaced is not NULL
+    BRWalletUndoUTXOAdd, // utxo was appended to wallet->utxos, with item pointing to its tx output
+    BRWalletUndoUTXORm   // utxo was removed from wallet->utxos at idx, with item pointing to its tx output
+} BRWalletUndoType;
+
+typedef struct {
+    BRWalletUndoType type;
+    BRSet *set;
+    void *item, *replaced;
+    BRUTXO utxo;
+    size_t idx;
+} BRWalletUndo;
+
+typedef struct {
+    UInt256 txHash; // first member, so nodes can be looked up with a tx or a tx hash
+    BRTransaction *tx; // wallet tx with this hash while it's in wallet->transactions, otherwise NULL
+    uint32_t blockHeight; // blockHeight tx is sorted by
+    size_t rank; // topological rank of tx among wallet->transactions with the same blockHeight
+    BRTransaction **spenders; // registered wallet tx that spend outputs of this hash, or NULL
+} BRWalletTxNode;
+
+typedef struct {
+    BRAddress address; // first member, so entries can be looked up with an address
+    uint32_t index; // position of address in its chain
+    int internal; // true if address is in wallet->internalChain
+} BRWalletAddrIdx;
+
+typedef struct {
+    BRAddress address; // first member, so entries can be looked up with an address
+    BRTransaction **txs; // registered wallet tx with an input or output at address
+    BRUTXO *utxos; // entries of wallet->utxos with an output at address, or NULL
+    uint64_t balance; // total amount of utxos
+} BRWalletAddrTxs;
+
+typedef struct {
+    const BRTxOutput *output; // first member, so entries can be looked up with a pointer to an output
+    size_t idx; // position of the output's utxo in wallet->utxos
+} BRWalletUnspent;
+
+typedef struct {
+    size_t pos; // position in wallet->transactions
+    BRTransaction *tx;
+} BRWalletTxAtPos;
+
+typedef struct {
+    BRMasterPubKey chainPubKey; // extended public key for N(m/0H/chain)
+    uint32_t start; // chain index of addrs[0]
+    size_t count; // number of addresses to derive
+    BRAddress *addrs; // derived addresses, BR_ADDRESS_NONE if derivation failed
+} BRWalletAddrBatch;
+
+typedef struct _BRWalletPoolTx {
+    UInt256 txHash; // first member, so entries can be looked up with a tx or a tx hash
+    BRTransaction *tx; // unconfirmed non-wallet tx, also in wallet->allTx
+    size_t size; // serialized size of tx, counted against wallet->poolMaxSize
+    time_t lastSeen; // time tx was last registered
+    struct _BRWalletPoolTx *older, *newer; // neighbouring entries in the order they were last seen
+} BRWalletPoolTx;
+
+typedef struct {
+    size_t undoIdx; // start of the tx's entries in wallet->undo
+    uint64_t totalSent, totalReceived; // totals before the tx was applied
+} BRWalletTxUndo;
+
 struct BRWalletStruct {
     uint64_t balance, totalSent, totalReceived, feePerKb, *balanceHist;
+    _Atomic uint64_t pubBalance, pubTotalSent, pubTotalReceived; // copies published after each balance update
+    BRCoinSelector coinSelector; // strategy for choosing utxos to fund new transactions
     uint32_t blockHeight;
     BRUTXO *utxos;
     BRTransaction **transactions;
     BRMasterPubKey masterPubKey;
+    BRMasterPubKey chainPubKeys[2]; // extended public keys for N(m/0H/0) and N(m/0H/1), to derive addresses in one step
     BRAddress *internalChain, *externalChain;
-    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedAddrs, *allAddrs;
+    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedAddrs;
+    BRSet *allAddrs; // chain and index of each address generated with BRWalletUnusedAddrs()
+    BRSet *txNodes; // sort keys and spenders of wallet transactions, and of the tx they spend from
+    BRSet *addrTxs; // wallet tx and utxos at each address that appears in a wallet tx
+    BRSet *unspent; // position in wallet->utxos of each tx output currently in the UTXO set
+    BRWalletUnspent **unspentAt; // entries of wallet->unspent, in the same order as wallet->utxos
+    BRSet *poolTx; // unconfirmed non-wallet tx kept for invalid tx checks and child-pays-for-parent fees
+    BRWalletPoolTx *poolOldest, *poolNewest; // poolTx entries, least recently seen first
+    size_t poolSize, poolMaxSize; // total size of poolTx entries, and the budget they're evicted to fit within
+    BRWalletUndo *undo; // journal of balance state changes, used to roll back to any position in wallet->transactions
+    BRWalletTxUndo *txUndo; // journal position and totals for each tx that has been applied to the balance
+    size_t balanceFrom; // position from which balance must be recalculated, or SIZE_MAX if nothing is stale
+    time_t balanceTime; // time used for pending tx checks at the last balance update
+    uint32_t balanceHeight; // blockHeight used for pending tx checks at the last balance update
     void *callbackInfo;
     void (*balanceChanged)(void *info, uint64_t balance);
     void (*txAdded)(void *info, BRTransaction *tx);
     void (*txUpdated)(void *info, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight, uint32_t timestamp);
     void (*txDeleted)(void *info, UInt256 txHash, int notifyUser, int recommendRescan);
-    pthread_mutex_t lock;
+    pthread_rwlock_t lock; // held for reading by queries, and for writing by anything that changes wallet state
 };
 
-inline static uint64_t _txFee(uint64_t feePerKb, size_t size)
+// highest chain position of any tx output address that appears in the given chain
+inline static size_t _BRWalletTxChainIndex(BRWallet *wallet, const BRTransaction *tx, int internal)
 {
-    uint64_t standardFee = size*TX_FEE_PER_KB/1000,       // standard fee based on tx size
-             fee = (((size*feePerKb/1000) + 99)/100)*100; // fee using feePerKb, rounded up to nearest 100 satoshi
+    const BRWalletAddrIdx *idx;
+    size_t i = SIZE_MAX;
+    
+    for (size_t j = 0; j < tx->outCount; j++) {
+        idx = BRSetGet(wallet->allAddrs, tx->outputs[j].address);
+        if (idx && idx->internal == internal && (i == SIZE_MAX || idx->index > i)) i = idx->index;
+    }
     
-    return (fee > standardFee) ? fee : standardFee;
+    return i;
 }
 
-// chain position of first tx output address that appears in chain
-inline static size_t _txChainIndex(const BRTransaction *tx, const BRAddress *addrChain)
+// orders tx from the same block by chain position of their first output address that appears in a chain, if known
+inline static int _BRWalletTxChainCompare(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
 {
-    for (size_t i = array_count(addrChain); i > 0; i--) {
-        for (size_t j = 0; j < tx->outCount; j++) {
-            if (BRAddressEq(tx->outputs[j].address, &addrChain[i - 1])) return i - 1;
-        }
+    size_t i, j;
+
+    i = _BRWalletTxChainIndex(wallet, tx1, 1);
+    j = _BRWalletTxChainIndex(wallet, tx2, (i == SIZE_MAX) ? 0 : 1);
+    if (i == SIZE_MAX && j != SIZE_MAX) i = _BRWalletTxChainIndex(wallet, tx1, 0);
+    if (i != SIZE_MAX && j != SIZE_MAX && i != j) return (i > j) ? 1 : -1;
+    return 0;
+}
+
+// returns the node for txHash, adding an empty one if it doesn't exist
+static BRWalletTxNode *_BRWalletTxNode(BRWallet *wallet, UInt256 txHash)
+{
+    BRWalletTxNode *node = BRSetGet(wallet->txNodes, &txHash);
+
+    if (! node) {
+        node = calloc(1, sizeof(*node));
+        assert(node != NULL);
+        node->txHash = txHash;
+        BRSetAdd(wallet->txNodes, node);
     }
-    
-    return SIZE_MAX;
+
+    return node;
 }
 
-inline static int _BRWalletTxIsAscending(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
+// removes and frees node once it's neither in wallet->transactions nor spent from by any wallet tx
+static void _BRWalletTxNodeRelease(BRWallet *wallet, BRWalletTxNode *node)
 {
-    if (! tx1 || ! tx2) return 0;
-    if (tx1->blockHeight > tx2->blockHeight) return 1;
-    if (tx1->blockHeight < tx2->blockHeight) return 0;
-    
-    for (size_t i = 0; i < tx1->inCount; i++) {
-        if (UInt256Eq(tx1->inputs[i].txHash, tx2->txHash)) return 1;
+    if (! node || node->tx || (node->spenders && array_count(node->spenders) > 0)) return;
+    BRSetRemove(wallet->txNodes, node);
+    if (node->spenders) array_free(node->spenders);
+    free(node);
+}
+
+// returns the address index entry for addr, adding an empty one if it doesn't exist
+static BRWalletAddrTxs *_BRWalletAddrTxs(BRWallet *wallet, const char *addr)
+{
+    BRWalletAddrTxs *e = BRSetGet(wallet->addrTxs, addr);
+
+    if (! e) {
+        e = calloc(1, sizeof(*e));
+        assert(e != NULL);
+        strncpy(e->address.s, addr, sizeof(e->address.s) - 1);
+        array_new(e->txs, 1);
+        BRSetAdd(wallet->addrTxs, e);
     }
-    
-    for (size_t i = 0; i < tx2->inCount; i++) {
-        if (UInt256Eq(tx2->inputs[i].txHash, tx1->txHash)) return 0;
+
+    return e;
+}
+
+// removes and frees an address index entry once no wallet tx or utxos are at its address
+static void _BRWalletAddrTxsRelease(BRWallet *wallet, BRWalletAddrTxs *e)
+{
+    if (! e || array_count(e->txs) > 0 || (e->utxos && array_count(e->utxos) > 0)) return;
+    BRSetRemove(wallet->addrTxs, e);
+    array_free(e->txs);
+    if (e->utxos) array_free(e->utxos);
+    free(e);
+}
+
+// adds utxo, which spends output o, to the address index
+static void _BRWalletAddrUTXOAdd(BRWallet *wallet, const BRTxOutput *o, BRUTXO utxo)
+{
+    BRWalletAddrTxs *e = _BRWalletAddrTxs(wallet, o->address);
+
+    if (! e->utxos) array_new(e->utxos, 1);
+    array_add(e->utxos, utxo);
+    e->balance += o->amount;
+}
+
+// removes utxo, which spends output o, from the address index
+static void _BRWalletAddrUTXORm(BRWallet *wallet, const BRTxOutput *o, BRUTXO utxo)
+{
+    BRWalletAddrTxs *e = BRSetGet(wallet->addrTxs, o->address);
+    size_t i;
+
+    for (i = (e && e->utxos) ? array_count(e->utxos) : 0; i > 0; i--) {
+        if (! BRUTXOEq(&e->utxos[i - 1], &utxo)) continue;
+        array_rm(e->utxos, i - 1);
+        e->balance -= o->amount;
+        break;
     }
 
-    for (size_t i = 0; i < tx1->inCount; i++) {
-        if (_BRWalletTxIsAscending(wallet, BRSetGet(wallet->allTx, &(tx1->inputs[i].txHash)), tx2)) return 1;
+    _BRWalletAddrTxsRelease(wallet, e);
+}
+
+// address of input or output i of tx, counting inputs first
+inline static const char *_BRWalletTxAddr(const BRTransaction *tx, size_t i)
+{
+    return (i < tx->inCount) ? tx->inputs[i].address : tx->outputs[i - tx->inCount].address;
+}
+
+// records tx as a spender of each tx it spends from, and in the address index for each of its addresses
+static void _BRWalletLinkTx(BRWallet *wallet, BRTransaction *tx)
+{
+    BRWalletTxNode *node;
+    BRWalletAddrTxs *e;
+    size_t i, j;
+
+    _BRWalletTxNode(wallet, tx->txHash);
+
+    for (i = 0; i < tx->inCount; i++) {
+        for (j = 0; j < i && ! UInt256Eq(tx->inputs[j].txHash, tx->inputs[i].txHash); j++);
+        if (j < i) continue; // already linked by an earlier input
+        node = _BRWalletTxNode(wallet, tx->inputs[i].txHash);
+        if (! node->spenders) array_new(node->spenders, 1);
+        array_add(node->spenders, tx);
     }
 
-    return 0;
+    for (i = 0; i < tx->inCount + tx->outCount; i++) {
+        if (_BRWalletTxAddr(tx, i)[0] == '\0') continue;
+        e = _BRWalletAddrTxs(wallet, _BRWalletTxAddr(tx, i));
+        // an address tx already appears at was added to last
+        if (array_count(e->txs) == 0 || e->txs[array_count(e->txs) - 1] != tx) array_add(e->txs, tx);
+    }
 }
 
-inline static int _BRWalletTxCompare(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
+// reverses _BRWalletLinkTx(), and frees the node for tx and its address index entries if they're no longer needed
+static void _BRWalletUnlinkTx(BRWallet *wallet, BRTransaction *tx)
 {
+    BRWalletTxNode *node;
+    BRWalletAddrTxs *e;
     size_t i, j;
 
-    if (_BRWalletTxIsAscending(wallet, tx1, tx2)) return 1;
-    if (_BRWalletTxIsAscending(wallet, tx2, tx1)) return -1;
-    i = _txChainIndex(tx1, wallet->internalChain);
-    j = _txChainIndex(tx2, (i == SIZE_MAX) ? wallet->externalChain : wallet->internalChain);
-    if (i == SIZE_MAX && j != SIZE_MAX) i = _txChainIndex((BRTransaction *)tx1, wallet->externalChain);
-    if (i != SIZE_MAX && j != SIZE_MAX && i != j) return (i > j) ? 1 : -1;
-    return 0;
+    for (i = 0; i < tx->inCount; i++) {
+        for (j = 0; j < i && ! UInt256Eq(tx->inputs[j].txHash, tx->inputs[i].txHash); j++);
+        if (j < i) continue;
+        node = BRSetGet(wallet->txNodes, &tx->inputs[i].txHash);
+
+        for (j = 0; node && node->spenders && j < array_count(node->spenders); j++) {
+            if (node->spenders[j] != tx) continue;
+            array_rm(node->spenders, j);
+            break;
+        }
+
+        _BRWalletTxNodeRelease(wallet, node);
+    }
+
+    _BRWalletTxNodeRelease(wallet, BRSetGet(wallet->txNodes, tx));
+
+    for (i = 0; i < tx->inCount + tx->outCount; i++) {
+        e = (_BRWalletTxAddr(tx, i)[0] != '\0') ? BRSetGet(wallet->addrTxs, _BRWalletTxAddr(tx, i)) : NULL;
+
+        for (j = (e) ? array_count(e->txs) : 0; j > 0; j--) {
+            if (e->txs[j - 1] != tx) continue;
+            array_rm(e->txs, j - 1);
+            break;
+        }
+
+        _BRWalletAddrTxsRelease(wallet, e);
+    }
 }
 
-// inserts tx into wallet->transactions, keeping wallet->transactions sorted by date, oldest first (insertion sort)
-inline static void _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
+// returns the first position in wallet->transactions with a sort key greater than blockHeight and rank
+static size_t _BRWalletTxUpperBound(BRWallet *wallet, uint32_t blockHeight, size_t rank)
 {
-    size_t i = array_count(wallet->transactions);
-    
-    array_set_count(wallet->transactions, i + 1);
-    
-    while (i > 0 && _BRWalletTxCompare(wallet, wallet->transactions[i - 1], tx) > 0) {
-        wallet->transactions[i] = wallet->transactions[i - 1];
-        i--;
+    size_t lo = 0, hi = array_count(wallet->transactions), mid;
+    BRWalletTxNode *node;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        node = BRSetGet(wallet->txNodes, wallet->transactions[mid]);
+
+        if (node->blockHeight > blockHeight || (node->blockHeight == blockHeight && node->rank > rank)) hi = mid;
+        else lo = mid + 1;
     }
-    
-    wallet->transactions[i] = tx;
+
+    return lo;
+}
+
+// returns the position of tx in wallet->transactions, or SIZE_MAX if it isn't there
+static size_t _BRWalletTxPos(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRWalletTxNode *node = BRSetGet(wallet->txNodes, tx);
+    size_t i;
+
+    if (! node || ! node->tx) return SIZE_MAX;
+    i = _BRWalletTxUpperBound(wallet, node->blockHeight, node->rank);
+    while (i > 0 && wallet->transactions[i - 1] != node->tx) i--; // search tx with an equal sort key
+    assert(i > 0);
+    return i - 1;
+}
+
+// removes tx from wallet->transactions, and returns the position it was removed from, or SIZE_MAX if it wasn't there
+static size_t _BRWalletRemoveTx(BRWallet *wallet, const BRTransaction *tx)
+{
+    size_t i = _BRWalletTxPos(wallet, tx);
+
+    if (i != SIZE_MAX) {
+        ((BRWalletTxNode *)BRSetGet(wallet->txNodes, tx))->tx = NULL;
+        array_rm(wallet->transactions, i);
+    }
+
+    return i;
+}
+
+// inserts tx into wallet->transactions, keeping wallet->transactions sorted by date, oldest first
+// tx is sorted by blockHeight and then by topological rank, so it always follows any wallet tx from the same block
+// that it spends from, and otherwise it follows the tx already in that block, unless their chain position is greater
+// wallet tx from the same block that spend from tx are moved after it
+// returns the lowest position in wallet->transactions that changed
+static size_t _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
+{
+    BRTransaction **moved = NULL, *t = tx;
+    BRWalletTxNode *node, *n;
+    size_t i, j, rank, from = SIZE_MAX;
+
+    while (t) {
+        node = BRSetGet(wallet->txNodes, t);
+        assert(node != NULL);
+        i = _BRWalletRemoveTx(wallet, t);
+        if (i < from) from = i;
+
+        for (j = 0, rank = 0; j < t->inCount; j++) { // rank follows wallet tx it spends from in the same block
+            n = BRSetGet(wallet->txNodes, &t->inputs[j].txHash);
+            if (n && n->tx && n->blockHeight == t->blockHeight && n->rank >= rank) rank = n->rank + 1;
+        }
+
+        i = _BRWalletTxUpperBound(wallet, t->blockHeight, SIZE_MAX);
+        n = (i > 0) ? BRSetGet(wallet->txNodes, wallet->transactions[i - 1]) : NULL;
+        if (n && n->blockHeight == t->blockHeight && n->rank > rank) rank = n->rank; // and tx already in the block
+
+        while (i > 0 && (n = BRSetGet(wallet->txNodes, wallet->transactions[i - 1]))->blockHeight == t->blockHeight &&
+               n->rank == rank && _BRWalletTxChainCompare(wallet, wallet->transactions[i - 1], t) > 0) i--;
+
+        array_insert(wallet->transactions, i, t);
+        node->tx = t;
+        node->blockHeight = t->blockHeight;
+        node->rank = rank;
+        if (i < from) from = i;
+
+        for (j = 0; node->spenders && j < array_count(node->spenders); j++) {
+            n = BRSetGet(wallet->txNodes, node->spenders[j]);
+            if (! n->tx || n->blockHeight != node->blockHeight || n->rank > rank) continue;
+            if (! moved) array_new(moved, 10);
+            array_add(moved, n->tx);
+        }
+
+        t = NULL;
+
+        if (moved && array_count(moved) > 0) {
+            t = moved[array_count(moved) - 1];
+            array_rm_last(moved);
+        }
+    }
+
+    if (moved) array_free(moved);
+    return from;
 }
 
 // non-threadsafe version of BRWalletContainsTransaction()
@@ -137,6 +433,82 @@ static int _BRWalletContainsTx(BRWallet *wallet, const BRTransaction *tx)
     return r;
 }
 
+// moves a pool entry to the newest end of the pool's eviction order
+static void _BRWalletPoolTouch(BRWallet *wallet, BRWalletPoolTx *e, time_t now)
+{
+    if (e->older) e->older->newer = e->newer;
+    else if (wallet->poolOldest == e) wallet->poolOldest = e->newer;
+    if (e->newer) e->newer->older = e->older;
+    else if (wallet->poolNewest == e) wallet->poolNewest = e->older;
+    e->older = wallet->poolNewest;
+    e->newer = NULL;
+    if (wallet->poolNewest) wallet->poolNewest->newer = e;
+    else wallet->poolOldest = e;
+    wallet->poolNewest = e;
+    e->lastSeen = now;
+}
+
+// removes tx from the pool of unconfirmed non-wallet tx if it's there, leaving it in wallet->allTx
+static void _BRWalletPoolRemove(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRWalletPoolTx *e = BRSetRemove(wallet->poolTx, tx);
+
+    if (e) {
+        if (e->older) e->older->newer = e->newer;
+        else wallet->poolOldest = e->newer;
+        if (e->newer) e->newer->older = e->older;
+        else wallet->poolNewest = e->older;
+        wallet->poolSize -= e->size;
+        free(e);
+    }
+}
+
+// evicts and frees the least recently seen pool tx until the pool fits within wallet->poolMaxSize, along with any
+// that haven't been seen for BR_WALLET_POOL_MAX_AGE
+// tx that registered wallet tx spend from are kept, since their pending and valid status depend on them
+static void _BRWalletPoolEvict(BRWallet *wallet, time_t now)
+{
+    BRWalletPoolTx *e = wallet->poolOldest, *next;
+    BRWalletTxNode *node;
+    BRTransaction *tx;
+
+    while (e && (wallet->poolSize > wallet->poolMaxSize || e->lastSeen + BR_WALLET_POOL_MAX_AGE < now)) {
+        next = e->newer;
+        node = BRSetGet(wallet->txNodes, e);
+
+        if (! node || ! node->spenders || array_count(node->spenders) == 0) {
+            tx = e->tx;
+            _BRWalletPoolRemove(wallet, tx);
+            BRSetRemove(wallet->allTx, tx);
+            BRTransactionFree(tx);
+        }
+
+        e = next;
+    }
+}
+
+// takes ownership of a non-wallet tx that isn't in wallet->allTx, keeping it in the pool if it's unconfirmed, and
+// otherwise freeing it
+static void _BRWalletPoolAdd(BRWallet *wallet, BRTransaction *tx, time_t now)
+{
+    BRWalletPoolTx *e;
+    size_t size = BRTransactionSize(tx);
+
+    if (tx->blockHeight == TX_UNCONFIRMED && size <= wallet->poolMaxSize) {
+        e = calloc(1, sizeof(*e));
+        assert(e != NULL);
+        e->txHash = tx->txHash;
+        e->tx = tx;
+        e->size = size;
+        BRSetAdd(wallet->allTx, tx);
+        BRSetAdd(wallet->poolTx, e);
+        wallet->poolSize += size;
+        _BRWalletPoolTouch(wallet, e, now);
+        _BRWalletPoolEvict(wallet, now);
+    }
+    else BRTransactionFree(tx);
+}
+
 //static int _BRWalletTxIsSend(BRWallet *wallet, BRTransaction *tx)
 //{
 //    int r = 0;
@@ -148,7 +520,9 @@ static int _BRWalletContainsTx(BRWallet *wallet, const BRTransaction *tx)
 //    return r;
 //}
 
-static void _BRWalletUpdateBalance(BRWallet *wallet)
+#if BR_WALLET_VERIFY_BALANCE
+// full balance rebuild, used to verify the result of incremental balance updates
+static void _BRWalletRebuildBalance(BRWallet *wallet)
 {
     int isInvalid, isPending;
     uint64_t balance = 0, prevBalance = 0;
@@ -243,20 +617,337 @@ static void _BRWalletUpdateBalance(BRWallet *wallet)
     assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
     wallet->balance = balance;
 }
+#endif
 
-// allocates and populates a BRWallet struct which must be freed by calling BRWalletFree()
-BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk)
+inline static size_t _BRPtrHash(const void *ptr)
 {
-    BRWallet *wallet = NULL;
-    BRTransaction *tx;
+    return (size_t)(((uintptr_t)ptr >> 3)*0x01000193);
+}
+
+inline static size_t _BRUnspentHash(const void *e)
+{
+    return _BRPtrHash(*(const BRTxOutput * const *)e);
+}
+
+inline static int _BRUnspentEq(const void *e, const void *otherE)
+{
+    return (*(const BRTxOutput * const *)e == *(const BRTxOutput * const *)otherE);
+}
+
+// inserts utxo, which spends output o, into wallet->utxos at position idx
+static void _BRWalletUTXOInsert(BRWallet *wallet, size_t idx, const BRTxOutput *o, BRUTXO utxo)
+{
+    BRWalletUnspent *e = malloc(sizeof(*e));
+
+    assert(e != NULL);
+    e->output = o;
+    array_insert(wallet->utxos, idx, utxo);
+    array_insert(wallet->unspentAt, idx, e);
+    BRSetAdd(wallet->unspent, e);
+    for (; idx < array_count(wallet->unspentAt); idx++) wallet->unspentAt[idx]->idx = idx;
+}
+
+// removes the utxo at position idx from wallet->utxos
+static void _BRWalletUTXORm(BRWallet *wallet, size_t idx)
+{
+    BRSetRemove(wallet->unspent, wallet->unspentAt[idx]);
+    free(wallet->unspentAt[idx]);
+    array_rm(wallet->utxos, idx);
+    array_rm(wallet->unspentAt, idx);
+    for (; idx < array_count(wallet->unspentAt); idx++) wallet->unspentAt[idx]->idx = idx;
+}
+
+// adds item to set, recording the change in the balance journal so it can be rolled back
+inline static void _BRWalletUndoSetAdd(BRWallet *wallet, BRSet *set, void *item)
+{
+    BRWalletUndo u = { BRWalletUndoSetAdd, set, item, BRSetAdd(set, item), { UINT256_ZERO, 0 }, 0 };
+
+    array_add(wallet->undo, u);
+}
+
+// removes the given output from the UTXO set if present, recording the change in the balance journal
+static void _BRWalletUndoSpend(BRWallet *wallet, UInt256 hash, uint32_t n)
+{
+    BRTransaction *t = BRSetGet(wallet->allTx, &hash);
+    const BRTxOutput *o = (t && n < t->outCount) ? &t->outputs[n] : NULL;
+    BRWalletUnspent *e = (o) ? BRSetGet(wallet->unspent, &o) : NULL;
+    size_t i;
+
+    if (! e) return;
+    i = e->idx;
+    array_add(wallet->undo, ((BRWalletUndo) { BRWalletUndoUTXORm, NULL, (void *)o, NULL, wallet->utxos[i], i }));
+    _BRWalletAddrUTXORm(wallet, o, wallet->utxos[i]);
+    _BRWalletUTXORm(wallet, i);
+    wallet->balance -= o->amount;
+}
+
+// applies wallet->transactions[i] to the balance state left by wallet->transactions[0..i-1], recording each change in
+// the balance journal
+static void _BRWalletApplyTx(BRWallet *wallet, size_t i, time_t now)
+{
+    BRTransaction *tx = wallet->transactions[i], *t;
+    uint64_t prevBalance = wallet->balance;
+    int isInvalid, isPending;
+    size_t j, k;
+
+    assert(i == array_count(wallet->txUndo));
+    array_add(wallet->txUndo, ((BRWalletTxUndo) { array_count(wallet->undo), wallet->totalSent,
+                                                  wallet->totalReceived }));
+
+    // check if any inputs are invalid or already spent
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        for (j = 0, isInvalid = 0; ! isInvalid && j < tx->inCount; j++) {
+            if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
+                BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash)) isInvalid = 1;
+        }
+
+        if (isInvalid) {
+            _BRWalletUndoSetAdd(wallet, wallet->invalidTx, tx);
+            array_add(wallet->balanceHist, wallet->balance);
+            return;
+        }
+    }
+
+    // add inputs to spent output set
+    for (j = 0; j < tx->inCount; j++) {
+        _BRWalletUndoSetAdd(wallet, wallet->spentOutputs, &tx->inputs[j]);
+    }
+
+    // check if tx is pending
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        isPending = (BRTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
+
+        for (j = 0; ! isPending && j < tx->outCount; j++) {
+            if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
+        }
+
+        for (j = 0; ! isPending && j < tx->inCount; j++) {
+            if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
+                tx->lockTime > wallet->blockHeight + 1) isPending = 1; // future lockTime
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
+            if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
+            // TODO: XXX handle BIP68 check lock time verify rules
+        }
+
+        if (isPending) {
+            _BRWalletUndoSetAdd(wallet, wallet->pendingTx, tx);
+            array_add(wallet->balanceHist, wallet->balance);
+            return;
+        }
+    }
+
+    // add outputs to UTXO set
+    // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
+    // TODO: don't add coin generation outputs < 100 blocks deep
+    // NOTE: balance/UTXOs will then need to be recalculated when last block changes
+    for (j = 0; j < tx->outCount; j++) {
+        if (tx->outputs[j].address[0] != '\0') {
+            _BRWalletUndoSetAdd(wallet, wallet->usedAddrs, tx->outputs[j].address);
+
+            if (BRSetContains(wallet->allAddrs, tx->outputs[j].address)) {
+                _BRWalletUTXOInsert(wallet, array_count(wallet->utxos), &tx->outputs[j],
+                                    ((BRUTXO) { tx->txHash, (uint32_t)j }));
+                array_add(wallet->undo, ((BRWalletUndo) { BRWalletUndoUTXOAdd, NULL, &tx->outputs[j], NULL,
+                                                          wallet->utxos[array_count(wallet->utxos) - 1],
+                                                          array_count(wallet->utxos) - 1 }));
+                _BRWalletAddrUTXOAdd(wallet, &tx->outputs[j], ((BRUTXO) { tx->txHash, (uint32_t)j }));
+                wallet->balance += tx->outputs[j].amount;
+            }
+        }
+    }
+
+    // transaction ordering is not guaranteed, so any output in the spent output set must be removed from the UTXO set,
+    // but the only outputs that can be in both are those spent by this tx, outputs of this tx spent by an earlier tx,
+    // and those spent by pending tx since the last tx that was applied to the UTXO set
+    for (j = 0; j < tx->inCount; j++) {
+        _BRWalletUndoSpend(wallet, tx->inputs[j].txHash, tx->inputs[j].index);
+    }
+
+    for (j = 0; j < tx->outCount; j++) {
+        if (BRSetContains(wallet->spentOutputs, &((BRUTXO) { tx->txHash, (uint32_t)j }))) {
+            _BRWalletUndoSpend(wallet, tx->txHash, (uint32_t)j);
+        }
+    }
+
+    for (k = i; k > 0; k--) {
+        t = wallet->transactions[k - 1];
+        if (BRSetContains(wallet->invalidTx, t)) continue;
+        if (! BRSetContains(wallet->pendingTx, t)) break;
+
+        for (j = 0; j < t->inCount; j++) {
+            _BRWalletUndoSpend(wallet, t->inputs[j].txHash, t->inputs[j].index);
+        }
+    }
+
+    if (prevBalance < wallet->balance) wallet->totalReceived += wallet->balance - prevBalance;
+    if (wallet->balance < prevBalance) wallet->totalSent += prevBalance - wallet->balance;
+    array_add(wallet->balanceHist, wallet->balance);
+}
+
+// rolls the balance state back to what it was before wallet->transactions[i] was applied
+static void _BRWalletRollbackBalance(BRWallet *wallet, size_t i)
+{
+    BRWalletUndo *u;
+
+    if (i >= array_count(wallet->txUndo)) return;
+
+    for (size_t j = array_count(wallet->undo); j > wallet->txUndo[i].undoIdx; j--) {
+        u = &wallet->undo[j - 1];
+
+        if (u->type == BRWalletUndoSetAdd && u->replaced) BRSetAdd(u->set, u->replaced);
+        else if (u->type == BRWalletUndoSetAdd) BRSetRemove(u->set, u->item);
+        else if (u->type == BRWalletUndoUTXOAdd) {
+            _BRWalletUTXORm(wallet, array_count(wallet->utxos) - 1);
+            _BRWalletAddrUTXORm(wallet, u->item, u->utxo);
+        }
+        else {
+            _BRWalletUTXOInsert(wallet, u->idx, u->item, u->utxo);
+            _BRWalletAddrUTXOAdd(wallet, u->item, u->utxo);
+        }
+    }
+
+    array_set_count(wallet->undo, wallet->txUndo[i].undoIdx);
+    wallet->totalSent = wallet->txUndo[i].totalSent;
+    wallet->totalReceived = wallet->txUndo[i].totalReceived;
+    wallet->balance = (i > 0) ? wallet->balanceHist[i - 1] : 0;
+    array_set_count(wallet->balanceHist, i);
+    array_set_count(wallet->txUndo, i);
+}
+
+#if BR_WALLET_VERIFY_BALANCE
+// asserts that the current balance state matches the result of a full rebuild
+static void _BRWalletVerifyBalance(BRWallet *wallet)
+{
+    BRSet *sets[] = { wallet->spentOutputs, wallet->invalidTx, wallet->pendingTx, wallet->usedAddrs };
+    size_t i, j, setCounts[4], utxoCount = array_count(wallet->utxos), txCount = array_count(wallet->balanceHist),
+           addrCount, indexed = 0;
+    uint64_t balance = wallet->balance, totalSent = wallet->totalSent, totalReceived = wallet->totalReceived, amount,
+             indexedBalance = 0;
+    BRUTXO *utxos = malloc((utxoCount + 1)*sizeof(*utxos));
+    uint64_t *balanceHist = malloc((txCount + 1)*sizeof(*balanceHist));
+    BRWalletAddrTxs **entries;
+    const BRTransaction *t;
+    void **setItems[4];
+
+    assert(utxos != NULL && balanceHist != NULL);
+    for (i = 0; i < utxoCount; i++) utxos[i] = wallet->utxos[i];
+    for (i = 0; i < txCount; i++) balanceHist[i] = wallet->balanceHist[i];
+
+    for (i = 0; i < 4; i++) {
+        setCounts[i] = BRSetCount(sets[i]);
+        setItems[i] = malloc((setCounts[i] + 1)*sizeof(void *));
+        assert(setItems[i] != NULL);
+        BRSetAll(sets[i], setItems[i], setCounts[i]);
+    }
+
+    _BRWalletRebuildBalance(wallet);
+    assert(wallet->balance == balance);
+    assert(wallet->totalSent == totalSent);
+    assert(wallet->totalReceived == totalReceived);
+    assert(array_count(wallet->utxos) == utxoCount);
+    assert(array_count(wallet->balanceHist) == txCount);
+    for (i = 0; i < utxoCount; i++) assert(BRUTXOEq(&wallet->utxos[i], &utxos[i]));
+    assert(BRSetCount(wallet->unspent) == utxoCount && array_count(wallet->unspentAt) == utxoCount);
+    
+    for (i = 0; i < utxoCount; i++) { // each utxo's entry in the unspent set holds its output and position
+        t = BRSetGet(wallet->allTx, &utxos[i].hash);
+        assert(t != NULL && wallet->unspentAt[i]->output == &t->outputs[utxos[i].n]);
+        assert(wallet->unspentAt[i]->idx == i);
+        assert(BRSetGet(wallet->unspent, wallet->unspentAt[i]) == wallet->unspentAt[i]);
+    }
+
+    for (i = 0; i < txCount; i++) assert(wallet->balanceHist[i] == balanceHist[i]);
+
+    for (i = 0; i < 4; i++) {
+        assert(BRSetCount(sets[i]) == setCounts[i]);
+        for (j = 0; j < setCounts[i]; j++) assert(BRSetContains(sets[i], setItems[i][j]));
+        free(setItems[i]);
+    }
+
+    addrCount = BRSetCount(wallet->addrTxs);
+    entries = malloc((addrCount + 1)*sizeof(*entries));
+    assert(entries != NULL);
+    BRSetAll(wallet->addrTxs, (void **)entries, addrCount);
+
+    for (i = 0; i < addrCount; i++) { // the address index holds each utxo once, under its own address
+        for (j = 0, amount = 0; entries[i]->utxos && j < array_count(entries[i]->utxos); j++) {
+            t = BRSetGet(wallet->allTx, &entries[i]->utxos[j].hash);
+            assert(t != NULL &&
+                   BRSetContains(wallet->unspent, &(const BRTxOutput *) { &t->outputs[entries[i]->utxos[j].n] }));
+            assert(BRAddressEq(t->outputs[entries[i]->utxos[j].n].address, entries[i]->address.s));
+            amount += t->outputs[entries[i]->utxos[j].n].amount;
+        }
+
+        assert(entries[i]->balance == amount);
+        indexed += j;
+        indexedBalance += amount;
+    }
+
+    assert(indexed == utxoCount);
+    assert(indexedBalance == balance);
+    free(entries);
+
+    free(balanceHist);
+    free(utxos);
+}
+#endif
+
+// publishes the balance and totals for BRWalletBalance(), BRWalletTotalSent() and BRWalletTotalReceived() to read
+// without taking the wallet lock
+inline static void _BRWalletPublishBalance(BRWallet *wallet)
+{
+    atomic_store_explicit(&wallet->pubBalance, wallet->balance, memory_order_release);
+    atomic_store_explicit(&wallet->pubTotalSent, wallet->totalSent, memory_order_release);
+    atomic_store_explicit(&wallet->pubTotalReceived, wallet->totalReceived, memory_order_release);
+}
+
+// updates the balance state after wallet->transactions has changed at or after position from, by rolling back the
+// history suffix and applying it again, so that only the affected outputs are touched
+static void _BRWalletUpdateBalance(BRWallet *wallet, size_t from)
+{
+    time_t now = time(NULL);
+    size_t i = array_count(wallet->transactions);
+
+    if (wallet->balanceFrom < from) from = wallet->balanceFrom;
+
+    // the pending status of unconfirmed tx depends on time and blockHeight, so recheck them if it might have changed
+    if (BRSetCount(wallet->pendingTx) > 0 || now < wallet->balanceTime || wallet->blockHeight < wallet->balanceHeight) {
+        while (i > 0 && wallet->transactions[i - 1]->blockHeight == TX_UNCONFIRMED) i--;
+        if (i < from) from = i;
+    }
+
+    if (from > array_count(wallet->txUndo)) from = array_count(wallet->txUndo);
+    _BRWalletRollbackBalance(wallet, from);
+
+    for (i = from; i < array_count(wallet->transactions); i++) {
+        _BRWalletApplyTx(wallet, i, now);
+    }
+
+    assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
+    wallet->balanceFrom = SIZE_MAX;
+    wallet->balanceTime = now;
+    wallet->balanceHeight = wallet->blockHeight;
+#if BR_WALLET_VERIFY_BALANCE
+    _BRWalletVerifyBalance(wallet);
+#endif
+    _BRWalletPublishBalance(wallet);
+}
+
+// allocates an empty BRWallet struct with room for txCount transactions
+static BRWallet *_BRWalletAlloc(size_t txCount, BRMasterPubKey mpk)
+{
+    BRWallet *wallet = calloc(1, sizeof(*wallet));
 
-    assert(transactions != NULL || txCount == 0);
-    wallet = calloc(1, sizeof(*wallet));
     assert(wallet != NULL);
     array_new(wallet->utxos, 100);
+    array_new(wallet->unspentAt, 100);
     array_new(wallet->transactions, txCount + 100);
     wallet->feePerKb = DEFAULT_FEE_PER_KB;
+    wallet->coinSelector = BRCoinSelectFirstFit;
     wallet->masterPubKey = mpk;
+    wallet->chainPubKeys[0] = BRBIP32ChainPubKey(mpk, SEQUENCE_EXTERNAL_CHAIN);
+    wallet->chainPubKeys[1] = BRBIP32ChainPubKey(mpk, SEQUENCE_INTERNAL_CHAIN);
     array_new(wallet->internalChain, 100);
     array_new(wallet->externalChain, 100);
     array_new(wallet->balanceHist, txCount + 100);
@@ -266,12 +957,32 @@ BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPub
     wallet->spentOutputs = BRSetNew(BRUTXOHash, BRUTXOEq, txCount + 100);
     wallet->usedAddrs = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
     wallet->allAddrs = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
-    pthread_mutex_init(&wallet->lock, NULL);
+    wallet->txNodes = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
+    wallet->unspent = BRSetNew(_BRUnspentHash, _BRUnspentEq, txCount + 100);
+    wallet->poolTx = BRSetNew(BRTransactionHash, BRTransactionEq, 100);
+    wallet->addrTxs = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
+    wallet->poolMaxSize = DEFAULT_TX_POOL_SIZE;
+    array_new(wallet->undo, txCount*4 + 100);
+    array_new(wallet->txUndo, txCount + 100);
+    wallet->balanceFrom = SIZE_MAX;
+    pthread_rwlock_init(&wallet->lock, NULL);
+    return wallet;
+}
+
+// allocates and populates a BRWallet struct which must be freed by calling BRWalletFree()
+BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk)
+{
+    BRWallet *wallet = NULL;
+    BRTransaction *tx;
+
+    assert(transactions != NULL || txCount == 0);
+    wallet = _BRWalletAlloc(txCount, mpk);
 
     for (size_t i = 0; transactions && i < txCount; i++) {
         tx = transactions[i];
         if (! BRTransactionIsSigned(tx) || BRSetContains(wallet->allTx, tx)) continue;
         BRSetAdd(wallet->allTx, tx);
+        _BRWalletLinkTx(wallet, tx);
         _BRWalletInsertTx(wallet, tx);
 
         for (size_t j = 0; j < tx->outCount; j++) {
@@ -281,7 +992,8 @@ BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPub
     
     BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
     BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
-    _BRWalletUpdateBalance(wallet);
+    BRSetClear(wallet->usedAddrs); // used addresses are re-added through the balance journal
+    _BRWalletUpdateBalance(wallet, 0);
 
     if (txCount > 0 && ! _BRWalletContainsTx(wallet, transactions[0])) { // verify transactions match master pubKey
         BRWalletFree(wallet);
@@ -291,6 +1003,346 @@ BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPub
     return wallet;
 }
 
+inline static size_t _BRSnapshotSetU32(uint8_t *buf, size_t bufLen, size_t off, uint32_t u)
+{
+    if (buf && off + sizeof(uint32_t) <= bufLen) UInt32SetLE(&buf[off], u);
+    return off + sizeof(uint32_t);
+}
+
+inline static size_t _BRSnapshotSetU64(uint8_t *buf, size_t bufLen, size_t off, uint64_t u)
+{
+    if (buf && off + sizeof(uint64_t) <= bufLen) UInt64SetLE(&buf[off], u);
+    return off + sizeof(uint64_t);
+}
+
+inline static size_t _BRSnapshotSetVarInt(uint8_t *buf, size_t bufLen, size_t off, uint64_t i)
+{
+    if (buf && off + BRVarIntSize(i) <= bufLen) BRVarIntSet(&buf[off], bufLen - off, i);
+    return off + BRVarIntSize(i);
+}
+
+inline static size_t _BRSnapshotSetBytes(uint8_t *buf, size_t bufLen, size_t off, const void *bytes, size_t len)
+{
+    if (buf && off + len <= bufLen) memcpy(&buf[off], bytes, len);
+    return off + len;
+}
+
+inline static uint32_t _BRSnapshotU32(const uint8_t *buf, size_t bufLen, size_t *off)
+{
+    uint32_t u = (*off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[*off]) : 0;
+
+    *off += sizeof(uint32_t);
+    return u;
+}
+
+inline static uint64_t _BRSnapshotU64(const uint8_t *buf, size_t bufLen, size_t *off)
+{
+    uint64_t u = (*off + sizeof(uint64_t) <= bufLen) ? UInt64GetLE(&buf[*off]) : 0;
+
+    *off += sizeof(uint64_t);
+    return u;
+}
+
+inline static uint64_t _BRSnapshotVarInt(const uint8_t *buf, size_t bufLen, size_t *off)
+{
+    size_t len = 0;
+    uint64_t i = (*off < bufLen) ? BRVarInt(&buf[*off], bufLen - *off, &len) : 0;
+
+    *off += (len > 0) ? len : bufLen + 1; // a truncated varint leaves off past the end of buf
+    return i;
+}
+
+inline static void _BRSnapshotBytes(const uint8_t *buf, size_t bufLen, size_t *off, void *bytes, size_t len)
+{
+    if (*off + len <= bufLen) memcpy(bytes, &buf[*off], len);
+    else memset(bytes, 0, len);
+    *off += len;
+}
+
+// writes a versioned snapshot of wallet state to buf, covering the sorted tx order, address chains, utxos, balance
+// history and the balance journal that spent outputs and the utxo set are restored from
+// returns number of bytes written, or total bufLen needed if buf is NULL or too small
+size_t BRWalletSnapshot(BRWallet *wallet, uint8_t *buf, size_t bufLen)
+{
+    BRTransaction *tx;
+    BRWalletTxNode *node;
+    BRWalletUndo *u;
+    BRAddress *chain;
+    BRSet *sets[4];
+    size_t i, j, k, len, off = 0;
+
+    assert(wallet != NULL);
+    assert(buf != NULL || bufLen == 0);
+    pthread_rwlock_rdlock(&wallet->lock);
+    sets[0] = wallet->invalidTx, sets[1] = wallet->pendingTx, sets[2] = wallet->spentOutputs;
+    sets[3] = wallet->usedAddrs;
+    off = _BRSnapshotSetU32(buf, bufLen, off, BR_WALLET_SNAPSHOT_MAGIC);
+    off = _BRSnapshotSetU32(buf, bufLen, off, BR_WALLET_SNAPSHOT_VERSION);
+    off = _BRSnapshotSetU32(buf, bufLen, off, wallet->masterPubKey.fingerPrint);
+    off = _BRSnapshotSetBytes(buf, bufLen, off, &wallet->masterPubKey.chainCode, sizeof(UInt256));
+    off = _BRSnapshotSetBytes(buf, bufLen, off, wallet->masterPubKey.pubKey, sizeof(wallet->masterPubKey.pubKey));
+    off = _BRSnapshotSetU32(buf, bufLen, off, wallet->blockHeight);
+    off = _BRSnapshotSetU32(buf, bufLen, off, wallet->balanceHeight);
+    off = _BRSnapshotSetU64(buf, bufLen, off, (uint64_t)wallet->balanceTime);
+    off = _BRSnapshotSetU64(buf, bufLen, off, (wallet->balanceFrom == SIZE_MAX) ? UINT64_MAX : wallet->balanceFrom);
+    off = _BRSnapshotSetU64(buf, bufLen, off, wallet->balance);
+    off = _BRSnapshotSetU64(buf, bufLen, off, wallet->totalSent);
+    off = _BRSnapshotSetU64(buf, bufLen, off, wallet->totalReceived);
+
+    // transactions in sorted order, with their sort keys
+    off = _BRSnapshotSetVarInt(buf, bufLen, off, array_count(wallet->transactions));
+
+    for (i = 0; i < array_count(wallet->transactions); i++) {
+        tx = wallet->transactions[i];
+        node = BRSetGet(wallet->txNodes, tx);
+        off = _BRSnapshotSetBytes(buf, bufLen, off, &tx->txHash, sizeof(UInt256));
+        off = _BRSnapshotSetU32(buf, bufLen, off, node->blockHeight);
+        off = _BRSnapshotSetVarInt(buf, bufLen, off, node->rank);
+    }
+
+    // balance history, and where each tx's entries start in the balance journal
+    off = _BRSnapshotSetVarInt(buf, bufLen, off, array_count(wallet->txUndo));
+
+    for (i = 0; i < array_count(wallet->txUndo); i++) {
+        off = _BRSnapshotSetU64(buf, bufLen, off, wallet->balanceHist[i]);
+        off = _BRSnapshotSetVarInt(buf, bufLen, off, wallet->txUndo[i].undoIdx);
+        off = _BRSnapshotSetU64(buf, bufLen, off, wallet->txUndo[i].totalSent);
+        off = _BRSnapshotSetU64(buf, bufLen, off, wallet->txUndo[i].totalReceived);
+    }
+
+    for (k = 0; k < 2; k++) { // external then internal address chain
+        chain = (k == 0) ? wallet->externalChain : wallet->internalChain;
+        off = _BRSnapshotSetVarInt(buf, bufLen, off, array_count(chain));
+
+        for (i = 0; i < array_count(chain); i++) {
+            len = strlen(chain[i].s);
+            off = _BRSnapshotSetVarInt(buf, bufLen, off, len);
+            off = _BRSnapshotSetBytes(buf, bufLen, off, chain[i].s, len);
+        }
+    }
+
+    // balance journal, with set items given as an input or output index of the tx the entry belongs to
+    off = _BRSnapshotSetVarInt(buf, bufLen, off, array_count(wallet->undo));
+
+    for (j = 0, i = 0; j < array_count(wallet->undo); j++) {
+        while (i + 1 < array_count(wallet->txUndo) && wallet->txUndo[i + 1].undoIdx <= j) i++;
+        tx = wallet->transactions[i];
+        u = &wallet->undo[j];
+        off = _BRSnapshotSetVarInt(buf, bufLen, off, u->type);
+
+        if (u->type == BRWalletUndoSetAdd) {
+            for (k = 0; k + 1 < sizeof(sets)/sizeof(*sets) && sets[k] != u->set; k++);
+            off = _BRSnapshotSetVarInt(buf, bufLen, off, k);
+            if (u->set == wallet->spentOutputs) len = (size_t)((BRTxInput *)u->item - tx->inputs);
+            else if (u->set == wallet->usedAddrs) len = (size_t)((uint8_t *)u->item - (uint8_t *)tx->outputs)/sizeof(BRTxOutput);
+            else len = 0;
+            off = _BRSnapshotSetVarInt(buf, bufLen, off, len);
+        }
+        else {
+            off = _BRSnapshotSetBytes(buf, bufLen, off, &u->utxo.hash, sizeof(UInt256));
+            off = _BRSnapshotSetU32(buf, bufLen, off, u->utxo.n);
+            off = _BRSnapshotSetVarInt(buf, bufLen, off, u->idx);
+        }
+    }
+
+    pthread_rwlock_unlock(&wallet->lock);
+    if (buf && off + sizeof(UInt256) <= bufLen) BRSHA256_2(&buf[off], buf, off); // checksum
+    return off + sizeof(UInt256);
+}
+
+// replays balance journal entry u, belonging to tx, to rebuild the balance state it recorded, returns true on success
+static int _BRWalletReplayUndo(BRWallet *wallet, BRTransaction *tx, BRWalletUndo *u, size_t setIdx, size_t n)
+{
+    BRSet *sets[] = { wallet->invalidTx, wallet->pendingTx, wallet->spentOutputs, wallet->usedAddrs };
+    BRTransaction *t;
+
+    if (u->type == BRWalletUndoSetAdd) {
+        if (setIdx >= sizeof(sets)/sizeof(*sets)) return 0;
+        u->set = sets[setIdx];
+        if (u->set == wallet->spentOutputs && n >= tx->inCount) return 0;
+        if (u->set == wallet->usedAddrs && n >= tx->outCount) return 0;
+        u->item = (u->set == wallet->spentOutputs) ? (void *)&tx->inputs[n] :
+                  (u->set == wallet->usedAddrs) ? (void *)tx->outputs[n].address : (void *)tx;
+        u->replaced = BRSetAdd(u->set, u->item);
+        return 1;
+    }
+
+    t = BRSetGet(wallet->allTx, &u->utxo.hash);
+    if (! t || u->utxo.n >= t->outCount) return 0;
+    u->item = &t->outputs[u->utxo.n];
+
+    if (u->type == BRWalletUndoUTXOAdd && u->idx == array_count(wallet->utxos)) {
+        _BRWalletUTXOInsert(wallet, u->idx, u->item, u->utxo);
+        _BRWalletAddrUTXOAdd(wallet, u->item, u->utxo);
+    }
+    else if (u->type == BRWalletUndoUTXORm && u->idx < array_count(wallet->utxos) &&
+             BRUTXOEq(&wallet->utxos[u->idx], &u->utxo)) {
+        _BRWalletUTXORm(wallet, u->idx);
+        _BRWalletAddrUTXORm(wallet, u->item, u->utxo);
+    }
+    else return 0;
+
+    return 1;
+}
+
+// allocates and populates a BRWallet struct from transactions and a snapshot written by BRWalletSnapshot(), without
+// sorting transactions, deriving address chains or rebuilding the balance as BRWalletNew() does
+// transactions must be the same set of wallet transactions the snapshot was taken with
+// returns NULL if the snapshot fails its checksum, is from another version, or doesn't match mpk or transactions, in
+// which case transactions are left as they were and may be passed to BRWalletNew() instead
+BRWallet *BRWalletNewFromSnapshot(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk,
+                                  const uint8_t *snapshot, size_t snapshotLen)
+{
+    BRWallet *wallet = NULL;
+    BRTransaction *tx;
+    BRWalletTxNode *node;
+    BRWalletTxUndo txUndo;
+    BRWalletUndo u;
+    BRWalletAddrIdx *idx;
+    BRMasterPubKey snapMpk;
+    BRAddress addr, **chain;
+    UInt256 md, txHash;
+    size_t i, j, k, n, len, count, off = 0;
+    uint64_t balance, balanceFrom;
+    uint32_t blockHeight;
+    int r = 1;
+
+    assert(transactions != NULL || txCount == 0);
+    assert(snapshot != NULL || snapshotLen == 0);
+    if (! snapshot || snapshotLen < sizeof(UInt256)) return NULL;
+    len = snapshotLen - sizeof(UInt256);
+    BRSHA256_2(&md, snapshot, len);
+    if (! UInt256Eq(md, UInt256Get(&snapshot[len]))) return NULL;
+    if (_BRSnapshotU32(snapshot, len, &off) != BR_WALLET_SNAPSHOT_MAGIC) return NULL;
+    if (_BRSnapshotU32(snapshot, len, &off) != BR_WALLET_SNAPSHOT_VERSION) return NULL;
+    snapMpk.fingerPrint = _BRSnapshotU32(snapshot, len, &off);
+    _BRSnapshotBytes(snapshot, len, &off, &snapMpk.chainCode, sizeof(UInt256));
+    _BRSnapshotBytes(snapshot, len, &off, snapMpk.pubKey, sizeof(snapMpk.pubKey));
+
+    if (snapMpk.fingerPrint != mpk.fingerPrint || ! UInt256Eq(snapMpk.chainCode, mpk.chainCode) ||
+        memcmp(snapMpk.pubKey, mpk.pubKey, sizeof(mpk.pubKey)) != 0) return NULL;
+
+    wallet = _BRWalletAlloc(txCount, mpk);
+    wallet->blockHeight = _BRSnapshotU32(snapshot, len, &off);
+    wallet->balanceHeight = _BRSnapshotU32(snapshot, len, &off);
+    wallet->balanceTime = (time_t)_BRSnapshotU64(snapshot, len, &off);
+    balanceFrom = _BRSnapshotU64(snapshot, len, &off);
+    wallet->balanceFrom = (balanceFrom < SIZE_MAX) ? (size_t)balanceFrom : SIZE_MAX;
+    balance = _BRSnapshotU64(snapshot, len, &off);
+    wallet->totalSent = _BRSnapshotU64(snapshot, len, &off);
+    wallet->totalReceived = _BRSnapshotU64(snapshot, len, &off);
+
+    for (i = 0; transactions && i < txCount; i++) {
+        tx = transactions[i];
+        if (! BRTransactionIsSigned(tx) || BRSetContains(wallet->allTx, tx)) continue;
+        BRSetAdd(wallet->allTx, tx);
+        _BRWalletLinkTx(wallet, tx);
+    }
+
+    count = (size_t)_BRSnapshotVarInt(snapshot, len, &off);
+    if (count != BRSetCount(wallet->allTx)) r = 0;
+
+    for (i = 0; r && i < count; i++) { // transactions are already sorted, so append them with their sort keys
+        _BRSnapshotBytes(snapshot, len, &off, &txHash, sizeof(txHash));
+        blockHeight = _BRSnapshotU32(snapshot, len, &off);
+        n = (size_t)_BRSnapshotVarInt(snapshot, len, &off);
+        tx = BRSetGet(wallet->allTx, &txHash);
+        node = (tx) ? BRSetGet(wallet->txNodes, tx) : NULL;
+
+        if (! node || node->tx || tx->blockHeight != blockHeight || off > len ||
+            (i > 0 && (blockHeight < wallet->transactions[i - 1]->blockHeight ||
+                       (blockHeight == wallet->transactions[i - 1]->blockHeight &&
+                        n < ((BRWalletTxNode *)BRSetGet(wallet->txNodes, wallet->transactions[i - 1]))->rank)))) {
+            r = 0;
+            break;
+        }
+
+        node->tx = tx;
+        node->blockHeight = blockHeight;
+        node->rank = n;
+        array_add(wallet->transactions, tx);
+    }
+
+    count = (r) ? (size_t)_BRSnapshotVarInt(snapshot, len, &off) : 0;
+    if (count > array_count(wallet->transactions)) r = 0;
+
+    for (i = 0; r && i < count; i++) {
+        array_add(wallet->balanceHist, _BRSnapshotU64(snapshot, len, &off));
+        txUndo.undoIdx = (size_t)_BRSnapshotVarInt(snapshot, len, &off);
+        txUndo.totalSent = _BRSnapshotU64(snapshot, len, &off);
+        txUndo.totalReceived = _BRSnapshotU64(snapshot, len, &off);
+        if (off > len || txUndo.undoIdx < ((i > 0) ? wallet->txUndo[i - 1].undoIdx : 0)) r = 0;
+        array_add(wallet->txUndo, txUndo);
+    }
+
+    if (r && balance != ((count > 0) ? wallet->balanceHist[count - 1] : 0)) r = 0;
+    wallet->balance = balance;
+
+    for (k = 0; r && k < 2; k++) { // external then internal address chain
+        chain = (k == 0) ? &wallet->externalChain : &wallet->internalChain;
+        count = (size_t)_BRSnapshotVarInt(snapshot, len, &off);
+
+        for (i = 0; r && i < count; i++) {
+            n = (size_t)_BRSnapshotVarInt(snapshot, len, &off);
+            if (n >= sizeof(addr.s) || off + n > len) r = 0;
+            if (! r) break;
+            addr = BR_ADDRESS_NONE;
+            _BRSnapshotBytes(snapshot, len, &off, addr.s, n);
+            array_add(*chain, addr);
+            idx = calloc(1, sizeof(*idx));
+            assert(idx != NULL);
+            idx->address = addr;
+            idx->index = (uint32_t)i;
+            idx->internal = (int)k;
+            if (! BRSetContains(wallet->allAddrs, idx)) BRSetAdd(wallet->allAddrs, idx);
+            else free(idx);
+        }
+    }
+
+    count = (r) ? (size_t)_BRSnapshotVarInt(snapshot, len, &off) : 0;
+    n = array_count(wallet->txUndo);
+    if (r && ((n > 0 && wallet->txUndo[0].undoIdx != 0) || (n > 0 && wallet->txUndo[n - 1].undoIdx > count) ||
+              (n == 0 && count > 0))) r = 0;
+
+    // replay the balance journal to rebuild the spent output, invalid, pending and used address sets, and the utxos
+    for (j = 0, i = 0; r && j < count; j++) {
+        while (i + 1 < n && wallet->txUndo[i + 1].undoIdx <= j) i++;
+        memset(&u, 0, sizeof(u));
+        u.type = (BRWalletUndoType)_BRSnapshotVarInt(snapshot, len, &off);
+
+        if (u.type == BRWalletUndoSetAdd) {
+            k = (size_t)_BRSnapshotVarInt(snapshot, len, &off);
+            r = (off <= len && _BRWalletReplayUndo(wallet, wallet->transactions[i], &u, k,
+                                                   (size_t)_BRSnapshotVarInt(snapshot, len, &off)));
+        }
+        else if (u.type == BRWalletUndoUTXOAdd || u.type == BRWalletUndoUTXORm) {
+            _BRSnapshotBytes(snapshot, len, &off, &u.utxo.hash, sizeof(UInt256));
+            u.utxo.n = _BRSnapshotU32(snapshot, len, &off);
+            u.idx = (size_t)_BRSnapshotVarInt(snapshot, len, &off);
+            r = (off <= len && _BRWalletReplayUndo(wallet, wallet->transactions[i], &u, 0, 0));
+        }
+        else r = 0;
+
+        if (r) array_add(wallet->undo, u);
+    }
+
+    if (off != len) r = 0;
+    if (r && txCount > 0 && ! _BRWalletContainsTx(wallet, transactions[0])) r = 0; // verify tx match master pubKey
+
+    if (! r) {
+        BRSetClear(wallet->allTx); // leave transactions for the caller to pass to BRWalletNew()
+        BRWalletFree(wallet);
+        return NULL;
+    }
+
+    _BRWalletPublishBalance(wallet);
+
+    // only derives addresses if the snapshot was taken with a smaller gap limit
+    BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+    BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+    return wallet;
+}
+
 // not thread-safe, set callbacks once after BRWalletNew(), before calling other BRWallet functions
 // info is a void pointer that will be passed along with each callback call
 // void balanceChanged(void *, uint64_t) - called when the wallet balance changes
@@ -314,38 +1366,72 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
     wallet->txDeleted = txDeleted;
 }
 
-// wallets are composed of chains of addresses
-// each chain is traversed until a gap of a number of addresses is found that haven't been used in any transactions
-// this function writes to addrs an array of <gapLimit> unused addresses following the last used address in the chain
-// the internal chain is used for change addresses and the external chain for receive addresses
-// addrs may be NULL to only generate addresses for BRWalletContainsAddress()
-// returns the number addresses written to addrs
-size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, int internal)
+// derives the chunk'th BR_WALLET_ADDR_CHUNK addresses of batch
+static void _BRWalletDeriveAddrs(void *info, size_t chunk)
+{
+    BRWalletAddrBatch *batch = info;
+    size_t i = chunk*BR_WALLET_ADDR_CHUNK, j, n;
+    BRECPoint pubKeys[BR_WALLET_ADDR_CHUNK];
+    BRKey key;
+    
+    n = (batch->count - i < BR_WALLET_ADDR_CHUNK) ? batch->count - i : BR_WALLET_ADDR_CHUNK;
+    n = BRBIP32ChildPubKeyList(pubKeys, batch->chainPubKey, batch->start + (uint32_t)i, n);
+    
+    for (j = 0; j < n; j++) { // points are valid as derived, so skip BRKeySetPubKey() and its point parsing
+        memset(&key, 0, sizeof(key));
+        memcpy(key.pubKey, pubKeys[j].p, sizeof(pubKeys[j].p));
+        key.compressed = 1;
+        batch->addrs[i + j] = BR_ADDRESS_NONE;
+        BRKeyAddress(&key, batch->addrs[i + j].s, sizeof(batch->addrs[i + j]));
+    }
+    
+    for (; i + j < batch->count && j < BR_WALLET_ADDR_CHUNK; j++) batch->addrs[i + j] = BR_ADDRESS_NONE;
+}
+
+// non-threadsafe version of BRWalletUnusedAddrs()
+static size_t _BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, int internal)
 {
     BRAddress *addrChain;
-    size_t i, j = 0, count, startCount;
-    uint32_t chain = (internal) ? SEQUENCE_INTERNAL_CHAIN : SEQUENCE_EXTERNAL_CHAIN;
+    BRWalletAddrIdx *idx;
+    BRWalletAddrBatch batch;
+    size_t i, j = 0, k, n, chunks, count;
 
-    assert(wallet != NULL);
-    assert(gapLimit > 0);
-    pthread_mutex_lock(&wallet->lock);
     addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
-    i = count = startCount = array_count(addrChain);
+    i = count = array_count(addrChain);
     
     // keep only the trailing contiguous block of addresses with no transactions
     while (i > 0 && ! BRSetContains(wallet->usedAddrs, &addrChain[i - 1])) i--;
     
     while (i + gapLimit > count) { // generate new addresses up to gapLimit
-        BRKey key;
-        BRAddress address = BR_ADDRESS_NONE;
-        uint8_t pubKey[BRBIP32PubKey(NULL, 0, wallet->masterPubKey, chain, count)];
-        size_t len = BRBIP32PubKey(pubKey, sizeof(pubKey), wallet->masterPubKey, chain, (uint32_t)count);
+        n = i + gapLimit - count;
+        batch.chainPubKey = wallet->chainPubKeys[(internal) ? 1 : 0];
+        batch.start = (uint32_t)count;
+        batch.count = n;
+        batch.addrs = malloc(n*sizeof(*batch.addrs));
+        assert(batch.addrs != NULL);
+        chunks = (n + BR_WALLET_ADDR_CHUNK - 1)/BR_WALLET_ADDR_CHUNK;
+        if (chunks > 1) BRThreadPoolApply(BRThreadPoolShared(), &batch, _BRWalletDeriveAddrs, chunks);
+        else _BRWalletDeriveAddrs(&batch, 0);
+        
+        for (k = 0; k < n && ! BRAddressEq(&batch.addrs[k], &BR_ADDRESS_NONE); k++) {
+            array_add(addrChain, batch.addrs[k]);
+            idx = calloc(1, sizeof(*idx));
+            assert(idx != NULL);
+            idx->address = batch.addrs[k];
+            idx->index = (uint32_t)count;
+            idx->internal = internal;
+            if (! BRSetContains(wallet->allAddrs, idx)) BRSetAdd(wallet->allAddrs, idx);
+            else free(idx);
+            count++;
+
+            if (BRSetContains(wallet->usedAddrs, &batch.addrs[k])) {
+                wallet->balanceFrom = 0; // outputs to address were not included in the UTXO set
+                i = count;
+            }
+        }
         
-        if (! BRKeySetPubKey(&key, pubKey, len)) break;
-        if (! BRKeyAddress(&key, address.s, sizeof(address)) || BRAddressEq(&address, &BR_ADDRESS_NONE)) break;
-        array_add(addrChain, address);
-        count++;
-        if (BRSetContains(wallet->usedAddrs, &address)) i = count;
+        free(batch.addrs);
+        if (k < n) break; // derivation failed
     }
 
     if (addrs && i + gapLimit <= count) {
@@ -354,73 +1440,216 @@ size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimi
         }
     }
     
-    // was addrChain moved to a new memory location?
-    if (addrChain == (internal ? wallet->internalChain : wallet->externalChain)) {
-        for (i = startCount; i < count; i++) {
-            BRSetAdd(wallet->allAddrs, &addrChain[i]);
-        }
-    }
-    else {
-        if (internal) wallet->internalChain = addrChain;
-        if (! internal) wallet->externalChain = addrChain;
-        BRSetClear(wallet->allAddrs); // clear and rebuild allAddrs
+    if (internal) wallet->internalChain = addrChain;
+    if (! internal) wallet->externalChain = addrChain;
+    return j;
+}
 
-        for (i = array_count(wallet->internalChain); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->internalChain[i - 1]);
-        }
-        
-        for (i = array_count(wallet->externalChain); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->externalChain[i - 1]);
-        }
-    }
+// wallets are composed of chains of addresses
+// each chain is traversed until a gap of a number of addresses is found that haven't been used in any transactions
+// this function writes to addrs an array of <gapLimit> unused addresses following the last used address in the chain
+// the internal chain is used for change addresses and the external chain for receive addresses
+// addrs may be NULL to only generate addresses for BRWalletContainsAddress()
+// returns the number addresses written to addrs
+size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, int internal)
+{
+    size_t count;
 
-    pthread_mutex_unlock(&wallet->lock);
-    return j;
+    assert(wallet != NULL);
+    assert(gapLimit > 0);
+    pthread_rwlock_wrlock(&wallet->lock);
+    count = _BRWalletUnusedAddrs(wallet, addrs, gapLimit, internal);
+    pthread_rwlock_unlock(&wallet->lock);
+    return count;
 }
 
 // current wallet balance, not including transactions known to be invalid
+// doesn't wait on the wallet lock, nor do BRWalletTotalSent() and BRWalletTotalReceived(), so they can be polled
+// from any thread while the wallet is syncing
 uint64_t BRWalletBalance(BRWallet *wallet)
 {
-    uint64_t balance;
-
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    balance = wallet->balance;
-    pthread_mutex_unlock(&wallet->lock);
-    return balance;
+    return atomic_load_explicit(&wallet->pubBalance, memory_order_acquire);
 }
 
 // writes unspent outputs to utxos and returns the number of outputs written, or total number available if utxos is NULL
 size_t BRWalletUTXOs(BRWallet *wallet, BRUTXO *utxos, size_t utxosCount)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     if (! utxos || array_count(wallet->utxos) < utxosCount) utxosCount = array_count(wallet->utxos);
 
     for (size_t i = 0; utxos && i < utxosCount; i++) {
         utxos[i] = wallet->utxos[i];
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return utxosCount;
 }
 
+// writes up to utxosCount unspent outputs to utxos, starting at position *cursor in the list written by BRWalletUTXOs(),
+// and advances *cursor past them, holding the wallet lock only for this page
+// returns the number of outputs written, which is less than utxosCount only once the end of the list is reached
+size_t BRWalletUTXOsPage(BRWallet *wallet, size_t *cursor, BRUTXO utxos[], size_t utxosCount)
+{
+    size_t i;
+    
+    assert(wallet != NULL);
+    assert(cursor != NULL);
+    assert(utxos != NULL || utxosCount == 0);
+    pthread_rwlock_rdlock(&wallet->lock);
+
+    for (i = 0; i < utxosCount && *cursor < array_count(wallet->utxos); i++, (*cursor)++) {
+        utxos[i] = wallet->utxos[*cursor];
+    }
+
+    pthread_rwlock_unlock(&wallet->lock);
+    return i;
+}
+
 // writes transactions registered in the wallet, sorted by date, oldest first, to the given transactions array
 // returns the number of transactions written, or total number available if transactions is NULL
 size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], size_t txCount)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     if (! transactions || array_count(wallet->transactions) < txCount) txCount = array_count(wallet->transactions);
 
     for (size_t i = 0; transactions && i < txCount; i++) {
         transactions[i] = wallet->transactions[i];
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
+    return txCount;
+}
+
+// writes up to txCount transactions in the range of cursor to the given transactions array, sorted by date, oldest
+// first, and advances cursor past them, holding the wallet lock only for this page
+// each page resumes from the sort key of the last tx, so if the wallet changes between pages, only tx that moved
+// across the cursor are skipped or repeated
+// returns the number of transactions written, which is less than txCount only once the range is exhausted
+size_t BRWalletTransactionsPage(BRWallet *wallet, BRWalletTxCursor *cursor, BRTransaction *transactions[],
+                                size_t txCount)
+{
+    BRTransaction *tx;
+    BRWalletTxNode *node;
+    size_t i, j, count, n = 0;
+
+    assert(wallet != NULL);
+    assert(cursor != NULL);
+    assert(transactions != NULL || txCount == 0);
+    pthread_rwlock_rdlock(&wallet->lock);
+    count = array_count(wallet->transactions);
+
+    if (UInt256IsZero(cursor->lastHash)) { // first page, skip to the start of the blockHeight range
+        i = (cursor->minHeight > 0) ? _BRWalletTxUpperBound(wallet, cursor->minHeight - 1, SIZE_MAX) : 0;
+        i = (cursor->offset < count - i) ? i + cursor->offset : count;
+    }
+    else { // resume after the last tx, which is searched for among tx with an equal sort key
+        i = j = _BRWalletTxUpperBound(wallet, cursor->lastHeight, cursor->lastRank);
+
+        while (j > 0 && ! UInt256Eq(wallet->transactions[j - 1]->txHash, cursor->lastHash)) {
+            node = BRSetGet(wallet->txNodes, wallet->transactions[j - 1]);
+            if (node->blockHeight != cursor->lastHeight || node->rank != cursor->lastRank) break;
+            j--;
+        }
+
+        if (j > 0 && UInt256Eq(wallet->transactions[j - 1]->txHash, cursor->lastHash)) i = j;
+    }
+
+    for (tx = NULL; i < count && n < txCount; i++) {
+        if (wallet->transactions[i]->blockHeight > cursor->maxHeight) break;
+        tx = wallet->transactions[i];
+        if (tx->timestamp >= cursor->minTime && tx->timestamp <= cursor->maxTime) transactions[n++] = tx;
+    }
+
+    if (tx) {
+        node = BRSetGet(wallet->txNodes, tx);
+        cursor->lastHash = tx->txHash;
+        cursor->lastHeight = node->blockHeight;
+        cursor->lastRank = node->rank;
+    }
+
+    pthread_rwlock_unlock(&wallet->lock);
+    return n;
+}
+
+// orders BRWalletTxAtPos entries by position
+static int _BRWalletTxAtPosCmp(const void *a, const void *b)
+{
+    size_t p1 = ((const BRWalletTxAtPos *)a)->pos, p2 = ((const BRWalletTxAtPos *)b)->pos;
+
+    return (p1 > p2) - (p1 < p2);
+}
+
+// writes transactions registered in the wallet with an input or output at addr, sorted by date, oldest first, to the
+// given transactions array, taking time proportional to the number of such transactions rather than the wallet size
+// returns the number of transactions written, or total number available if transactions is NULL
+size_t BRWalletTransactionsForAddress(BRWallet *wallet, const char *addr, BRTransaction *transactions[],
+                                      size_t txCount)
+{
+    BRWalletAddrTxs *e;
+    BRWalletTxAtPos *sorted;
+    size_t i, count;
+
+    assert(wallet != NULL);
+    assert(addr != NULL);
+    pthread_rwlock_rdlock(&wallet->lock);
+    e = BRSetGet(wallet->addrTxs, addr);
+    count = (e) ? array_count(e->txs) : 0;
+    if (! transactions || count < txCount) txCount = count;
+
+    if (transactions && txCount > 0) {
+        sorted = malloc(count*sizeof(*sorted));
+        assert(sorted != NULL);
+
+        for (i = 0; i < count; i++) {
+            sorted[i].pos = _BRWalletTxPos(wallet, e->txs[i]);
+            sorted[i].tx = e->txs[i];
+        }
+
+        qsort(sorted, count, sizeof(*sorted), _BRWalletTxAtPosCmp);
+        for (i = 0; i < txCount; i++) transactions[i] = sorted[i].tx;
+        free(sorted);
+    }
+
+    pthread_rwlock_unlock(&wallet->lock);
     return txCount;
 }
 
+// writes the wallet's unspent outputs at addr to utxos, in no particular order
+// returns the number of outputs written, or total number available if utxos is NULL
+size_t BRWalletUTXOsForAddress(BRWallet *wallet, const char *addr, BRUTXO utxos[], size_t utxosCount)
+{
+    BRWalletAddrTxs *e;
+    size_t count;
+
+    assert(wallet != NULL);
+    assert(addr != NULL);
+    pthread_rwlock_rdlock(&wallet->lock);
+    e = BRSetGet(wallet->addrTxs, addr);
+    count = (e && e->utxos) ? array_count(e->utxos) : 0;
+    if (! utxos || count < utxosCount) utxosCount = count;
+    if (utxos && utxosCount > 0) memcpy(utxos, e->utxos, utxosCount*sizeof(*utxos));
+    pthread_rwlock_unlock(&wallet->lock);
+    return utxosCount;
+}
+
+// total amount of the wallet's unspent outputs at addr, not including transactions known to be invalid
+uint64_t BRWalletBalanceForAddress(BRWallet *wallet, const char *addr)
+{
+    BRWalletAddrTxs *e;
+    uint64_t balance;
+
+    assert(wallet != NULL);
+    assert(addr != NULL);
+    pthread_rwlock_rdlock(&wallet->lock);
+    e = BRSetGet(wallet->addrTxs, addr);
+    balance = (e) ? e->balance : 0;
+    pthread_rwlock_unlock(&wallet->lock);
+    return balance;
+}
+
 // writes transactions registered in the wallet, and that were unconfirmed before blockHeight, to the transactions array
 // returns the number of transactions written, or total number available if transactions is NULL
 size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions[], size_t txCount,
@@ -429,7 +1658,7 @@ size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions
     size_t total, n = 0;
 
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     total = array_count(wallet->transactions);
     while (n < total && wallet->transactions[(total - n) - 1]->blockHeight >= blockHeight) n++;
     if (! transactions || n < txCount) txCount = n;
@@ -438,32 +1667,22 @@ size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions
         transactions[i] = wallet->transactions[(total - n) + i];
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return txCount;
 }
 
 // total amount spent from the wallet (exluding change)
 uint64_t BRWalletTotalSent(BRWallet *wallet)
 {
-    uint64_t totalSent;
-    
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    totalSent = wallet->totalSent;
-    pthread_mutex_unlock(&wallet->lock);
-    return totalSent;
+    return atomic_load_explicit(&wallet->pubTotalSent, memory_order_acquire);
 }
 
 // total amount received by the wallet (exluding change)
 uint64_t BRWalletTotalReceived(BRWallet *wallet)
 {
-    uint64_t totalReceived;
-    
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    totalReceived = wallet->totalReceived;
-    pthread_mutex_unlock(&wallet->lock);
-    return totalReceived;
+    return atomic_load_explicit(&wallet->pubTotalReceived, memory_order_acquire);
 }
 
 // fee-per-kb of transaction size to use when creating a transaction
@@ -472,18 +1691,38 @@ uint64_t BRWalletFeePerKb(BRWallet *wallet)
     uint64_t feePerKb;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     feePerKb = wallet->feePerKb;
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return feePerKb;
 }
 
 void BRWalletSetFeePerKb(BRWallet *wallet, uint64_t feePerKb)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_wrlock(&wallet->lock);
     wallet->feePerKb = feePerKb;
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
+}
+
+void BRWalletSetCoinSelector(BRWallet *wallet, BRCoinSelector selector)
+{
+    assert(wallet != NULL);
+    assert(selector != NULL);
+    pthread_rwlock_wrlock(&wallet->lock);
+    wallet->coinSelector = selector;
+    pthread_rwlock_unlock(&wallet->lock);
+}
+
+// sets the total size in bytes of unconfirmed non-wallet tx the wallet keeps, DEFAULT_TX_POOL_SIZE by default
+// the least recently relayed tx are evicted to fit
+void BRWalletSetTxPoolSize(BRWallet *wallet, size_t maxSize)
+{
+    assert(wallet != NULL);
+    pthread_rwlock_wrlock(&wallet->lock);
+    wallet->poolMaxSize = maxSize;
+    _BRWalletPoolEvict(wallet, time(NULL));
+    pthread_rwlock_unlock(&wallet->lock);
 }
 
 // returns the first unused external address
@@ -502,7 +1741,7 @@ size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount)
     size_t i, internalCount = 0, externalCount = 0;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     internalCount = (! addrs || array_count(wallet->internalChain) < addrsCount) ?
                     array_count(wallet->internalChain) : addrsCount;
 
@@ -517,10 +1756,32 @@ size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount)
         addrs[internalCount + i] = wallet->externalChain[i];
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return internalCount + externalCount;
 }
 
+// writes up to addrsCount of the addresses listed by BRWalletAllAddrs() to addrs, starting at position *cursor, and
+// advances *cursor past them, holding the wallet lock only for this page
+// returns the number of addresses written, which is less than addrsCount only once the end of the list is reached
+size_t BRWalletAllAddrsPage(BRWallet *wallet, size_t *cursor, BRAddress addrs[], size_t addrsCount)
+{
+    size_t i, internalCount;
+    
+    assert(wallet != NULL);
+    assert(cursor != NULL);
+    assert(addrs != NULL || addrsCount == 0);
+    pthread_rwlock_rdlock(&wallet->lock);
+    internalCount = array_count(wallet->internalChain);
+
+    for (i = 0; i < addrsCount && *cursor < internalCount + array_count(wallet->externalChain); i++, (*cursor)++) {
+        addrs[i] = (*cursor < internalCount) ? wallet->internalChain[*cursor] :
+                   wallet->externalChain[*cursor - internalCount];
+    }
+
+    pthread_rwlock_unlock(&wallet->lock);
+    return i;
+}
+
 // true if the address was previously generated by BRWalletUnusedAddrs() (even if it's now used)
 int BRWalletContainsAddress(BRWallet *wallet, const char *addr)
 {
@@ -528,9 +1789,9 @@ int BRWalletContainsAddress(BRWallet *wallet, const char *addr)
 
     assert(wallet != NULL);
     assert(addr != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     if (addr) r = BRSetContains(wallet->allAddrs, addr);
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return r;
 }
 
@@ -541,9 +1802,9 @@ int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr)
 
     assert(wallet != NULL);
     assert(addr != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     if (addr) r = BRSetContains(wallet->usedAddrs, addr);
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return r;
 }
 
@@ -565,9 +1826,12 @@ BRTransaction *BRWalletCreateTransaction(BRWallet *wallet, uint64_t amount, cons
 // result must be freed by calling BRTransactionFree()
 BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput outputs[], size_t outCount)
 {
-    BRTransaction *tx, *transaction = BRTransactionNew();
-    uint64_t feeAmount, amount = 0, balance = 0, minAmount;
-    size_t i, j, cpfpSize = 0;
+    BRTransaction *tx, *transaction = NULL;
+    BRCoinTarget target = { 0, 0, 0, 0, 0, 0, TX_MAX_SIZE };
+    BRCoinSelection selection = { 0, 0, 0, 0 };
+    BRCoin *coins;
+    uint64_t lastAmount;
+    size_t i, *selected, count = 0, coinCount = 0;
     BRUTXO *o;
     BRAddress addr = BR_ADDRESS_NONE;
     
@@ -576,13 +1840,19 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
 
     for (i = 0; outputs && i < outCount; i++) {
         assert(outputs[i].script != NULL && outputs[i].scriptLen > 0);
-        BRTransactionAddOutput(transaction, outputs[i].amount, outputs[i].script, outputs[i].scriptLen);
-        amount += outputs[i].amount;
+        target.amount += outputs[i].amount;
+        target.outSize += sizeof(uint64_t) + BRVarIntSize(outputs[i].scriptLen) + outputs[i].scriptLen;
     }
     
-    minAmount = BRWalletMinOutputAmount(wallet);
-    pthread_mutex_lock(&wallet->lock);
-    feeAmount = _txFee(wallet->feePerKb, BRTransactionSize(transaction) + TX_OUTPUT_SIZE);
+    target.outCount = outCount;
+    target.minChange = BRWalletMinOutputAmount(wallet);
+    lastAmount = outputs[outCount - 1].amount;
+    pthread_rwlock_rdlock(&wallet->lock);
+    target.feePerKb = wallet->feePerKb;
+    target.balance = wallet->balance;
+    coins = malloc((array_count(wallet->utxos) + 1)*sizeof(*coins));
+    selected = malloc((array_count(wallet->utxos) + 1)*sizeof(*selected));
+    assert(coins != NULL && selected != NULL);
     
     // TODO: use up all UTXOs for all used addresses to avoid leaving funds in addresses whose public key is revealed
     // TODO: avoid combining addresses in a single transaction when possible to reduce information leakage
@@ -592,63 +1862,51 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
         o = &wallet->utxos[i];
         tx = BRSetGet(wallet->allTx, o);
         if (! tx || o->n >= tx->outCount) continue;
-        BRTransactionAddInput(transaction, tx->txHash, o->n, tx->outputs[o->n].amount,
-                              tx->outputs[o->n].script, tx->outputs[o->n].scriptLen, NULL, 0, TXIN_SEQUENCE);
-        
-        if (BRTransactionSize(transaction) + TX_OUTPUT_SIZE > TX_MAX_SIZE) { // transaction size-in-bytes too large
-            BRTransactionFree(transaction);
-            transaction = NULL;
+        coins[coinCount].amount = tx->outputs[o->n].amount;
+        coins[coinCount++].idx = i;
+    }
+    
+    while (target.outCount > 0) {
+        count = wallet->coinSelector(&target, coins, coinCount, selected, &selection);
+        if (count > 0 || selection.maxAmount == 0 || selection.maxAmount >= target.amount) break;
         
-            // check for sufficient total funds before building a smaller transaction
-            if (wallet->balance < amount + _txFee(wallet->feePerKb, 10 + array_count(wallet->utxos)*TX_INPUT_SIZE +
-                                                  (outCount + 1)*TX_OUTPUT_SIZE + cpfpSize)) break;
-            pthread_mutex_unlock(&wallet->lock);
-
-            if (outputs[outCount - 1].amount > amount + feeAmount + minAmount - balance) {
-                BRTxOutput newOutputs[outCount];
-                
-                for (j = 0; j < outCount; j++) {
-                    newOutputs[j] = outputs[j];
-                }
-                
-                newOutputs[outCount - 1].amount -= amount + feeAmount - balance; // reduce last output amount
-                transaction = BRWalletCreateTxForOutputs(wallet, newOutputs, outCount);
-            }
-            else transaction = BRWalletCreateTxForOutputs(wallet, outputs, outCount - 1); // remove last output
-
-            balance = amount = feeAmount = 0;
-            pthread_mutex_lock(&wallet->lock);
-            break;
+        // funds are only spendable in a smaller transaction, reduce last output amount or remove last output
+        if (lastAmount > target.amount - selection.maxAmount + target.minChange) {
+            lastAmount -= target.amount - selection.maxAmount;
+            target.amount = selection.maxAmount;
         }
-        
-        balance += tx->outputs[o->n].amount;
-        
-//        // size of unconfirmed, non-change inputs for child-pays-for-parent fee
-//        // don't include parent tx with more than 10 inputs or 10 outputs
-//        if (tx->blockHeight == TX_UNCONFIRMED && tx->inCount <= 10 && tx->outCount <= 10 &&
-//            ! _BRWalletTxIsSend(wallet, tx)) cpfpSize += BRTransactionSize(tx);
-
-        // fee amount after adding a change output
-        feeAmount = _txFee(wallet->feePerKb, BRTransactionSize(transaction) + TX_OUTPUT_SIZE + cpfpSize);
-
-        // increase fee to round off remaining wallet balance to nearest 100 satoshi
-        if (wallet->balance > amount + feeAmount) feeAmount += (wallet->balance - (amount + feeAmount)) % 100;
-        
-        if (balance == amount + feeAmount || balance >= amount + feeAmount + minAmount) break;
+        else {
+            i = --target.outCount;
+            target.amount -= lastAmount;
+            target.outSize -= sizeof(uint64_t) + BRVarIntSize(outputs[i].scriptLen) + outputs[i].scriptLen;
+            lastAmount = (i > 0) ? outputs[i - 1].amount : 0;
+        }
+    }
+    
+    if (count > 0) transaction = BRTransactionNew();
+    
+    for (i = 0; i < count; i++) {
+        o = &wallet->utxos[selected[i]];
+        tx = BRSetGet(wallet->allTx, o);
+        BRTransactionAddInput(transaction, tx->txHash, o->n, tx->outputs[o->n].amount,
+                              tx->outputs[o->n].script, tx->outputs[o->n].scriptLen, NULL, 0, TXIN_SEQUENCE);
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
+    free(selected);
+    free(coins);
     
-    if (transaction && (outCount < 1 || balance < amount + feeAmount)) { // no outputs/insufficient funds
-        BRTransactionFree(transaction);
-        transaction = NULL;
+    for (i = 0; transaction && i < target.outCount; i++) {
+        BRTransactionAddOutput(transaction, (i + 1 < target.outCount) ? outputs[i].amount : lastAmount,
+                               outputs[i].script, outputs[i].scriptLen);
     }
-    else if (transaction && balance - (amount + feeAmount) > minAmount) { // add change output
+    
+    if (transaction && selection.change > 0) { // add change output
         BRWalletUnusedAddrs(wallet, &addr, 1, 1);
         uint8_t script[BRAddressScriptPubKey(NULL, 0, addr.s)];
         size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.s);
     
-        BRTransactionAddOutput(transaction, balance - (amount + feeAmount), script, scriptLen);
+        BRTransactionAddOutput(transaction, selection.change, script, scriptLen);
         BRTransactionShuffleOutputs(transaction);
     }
     
@@ -661,25 +1919,22 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
 // returns true if all inputs were signed, or false if there was an error or not all inputs were able to be signed
 int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, int forkId, const void *seed, size_t seedLen)
 {
-    uint32_t j, internalIdx[tx->inCount], externalIdx[tx->inCount];
+    uint32_t internalIdx[tx->inCount], externalIdx[tx->inCount];
+    const BRWalletAddrIdx *idx;
     size_t i, internalCount = 0, externalCount = 0;
     int r = 0;
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     
     for (i = 0; tx && i < tx->inCount; i++) {
-        for (j = (uint32_t)array_count(wallet->internalChain); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->internalChain[j - 1])) internalIdx[internalCount++] = j - 1;
-        }
-
-        for (j = (uint32_t)array_count(wallet->externalChain); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->externalChain[j - 1])) externalIdx[externalCount++] = j - 1;
-        }
+        idx = BRSetGet(wallet->allAddrs, tx->inputs[i].address);
+        if (idx && idx->internal) internalIdx[internalCount++] = idx->index;
+        if (idx && ! idx->internal) externalIdx[externalCount++] = idx->index;
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
 
     BRKey keys[internalCount + externalCount];
 
@@ -703,22 +1958,26 @@ int BRWalletContainsTransaction(BRWallet *wallet, const BRTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     if (tx) r = _BRWalletContainsTx(wallet, tx);
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return r;
 }
 
 // adds a transaction to the wallet, or returns false if it isn't associated with the wallet
+// the wallet takes ownership of tx unless it already has a tx with the same hash, and keeps non-wallet tx only while
+// they're unconfirmed and fit in its bounded pool, freeing them otherwise, so use BRWalletTransactionForHash() rather
+// than tx after this returns false
 int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
 {
+    BRWalletPoolTx *e;
     int wasAdded = 0, r = 1;
     
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
     
     if (tx && BRTransactionIsSigned(tx)) {
-        pthread_mutex_lock(&wallet->lock);
+        pthread_rwlock_wrlock(&wallet->lock);
 
         if (! BRSetContains(wallet->allTx, tx)) {
             if (_BRWalletContainsTx(wallet, tx)) {
@@ -726,19 +1985,21 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
                 // TODO: handle tx replacement with input sequence numbers
                 //       (for now, replacements appear invalid until confirmation)
                 BRSetAdd(wallet->allTx, tx);
-                _BRWalletInsertTx(wallet, tx);
-                _BRWalletUpdateBalance(wallet);
+                _BRWalletLinkTx(wallet, tx);
+                _BRWalletUpdateBalance(wallet, _BRWalletInsertTx(wallet, tx));
                 wasAdded = 1;
             }
             else { // keep track of unconfirmed non-wallet tx for invalid tx checks and child-pays-for-parent fees
-                   // BUG: limit total non-wallet unconfirmed tx to avoid memory exhaustion attack
-                if (tx->blockHeight == TX_UNCONFIRMED) BRSetAdd(wallet->allTx, tx);
+                _BRWalletPoolAdd(wallet, tx, time(NULL));
                 r = 0;
-                // BUG: XXX memory leak if tx is not added to wallet->allTx, and we can't just free it
             }
         }
+        else if ((e = BRSetGet(wallet->poolTx, tx)) != NULL) { // non-wallet tx was relayed again
+            _BRWalletPoolTouch(wallet, e, time(NULL));
+            r = 0;
+        }
     
-        pthread_mutex_unlock(&wallet->lock);
+        pthread_rwlock_unlock(&wallet->lock);
     }
     else r = 0;
 
@@ -746,13 +2007,79 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
         // when a wallet address is used in a transaction, generate a new address to replace it
         BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
         BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
-        if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
+        if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, BRWalletBalance(wallet));
         if (wallet->txAdded) wallet->txAdded(wallet->callbackInfo, tx);
     }
 
     return r;
 }
 
+// adds transactions to the wallet with a single balance update, and returns the number of transactions added
+// each tx is handled as by BRWalletRegisterTransaction(), but tx may be given in any order, including before the tx
+// they spend from or before the tx that use the addresses they're sent to
+// balanceChanged is called once, followed by txAdded for each tx added
+size_t BRWalletRegisterTransactions(BRWallet *wallet, BRTransaction *transactions[], size_t txCount)
+{
+    BRTransaction *tx, **pending, **added;
+    size_t i, j, n, from = SIZE_MAX;
+
+    assert(wallet != NULL);
+    assert(transactions != NULL || txCount == 0);
+    array_new(pending, txCount);
+    array_new(added, txCount);
+    pthread_rwlock_wrlock(&wallet->lock);
+
+    for (i = 0; transactions && i < txCount; i++) {
+        assert(transactions[i] != NULL && BRTransactionIsSigned(transactions[i]));
+        if (transactions[i] && BRTransactionIsSigned(transactions[i])) array_add(pending, transactions[i]);
+    }
+
+    do { // each pass may add tx that the next pass depends on, or use addresses that extend the address chains
+        for (i = 0, j = 0; i < array_count(pending); i++) {
+            tx = pending[i];
+            if (BRSetContains(wallet->allTx, tx)) continue;
+
+            if (_BRWalletContainsTx(wallet, tx)) {
+                // TODO: verify signatures when possible
+                // TODO: handle tx replacement with input sequence numbers
+                //       (for now, replacements appear invalid until confirmation)
+                BRSetAdd(wallet->allTx, tx);
+                _BRWalletLinkTx(wallet, tx);
+                n = _BRWalletInsertTx(wallet, tx);
+                if (n < from) from = n;
+                array_add(added, tx);
+            }
+            else pending[j++] = tx;
+        }
+
+        array_set_count(pending, j);
+        if (from == SIZE_MAX) break;
+        _BRWalletUpdateBalance(wallet, from);
+        from = SIZE_MAX;
+
+        // when a wallet address is used in a transaction, generate a new address to replace it
+        _BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+        _BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+    } while (array_count(pending) > 0);
+
+    for (i = 0; i < array_count(pending); i++) {
+        // keep track of unconfirmed non-wallet tx for invalid tx checks and child-pays-for-parent fees
+        if (! BRSetContains(wallet->allTx, pending[i])) _BRWalletPoolAdd(wallet, pending[i], time(NULL));
+    }
+
+    pthread_rwlock_unlock(&wallet->lock);
+    n = array_count(added);
+    if (n > 0 && wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, BRWalletBalance(wallet));
+
+    for (i = 0; wallet->txAdded && i < n; i++) {
+        wallet->txAdded(wallet->callbackInfo, added[i]);
+    }
+
+    array_free(added);
+    array_free(pending);
+    return n;
+}
+
 // removes a tx from the wallet, along with any tx that depend on its outputs
 void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
 {
@@ -762,7 +2089,7 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
 
     assert(wallet != NULL);
     assert(! UInt256IsZero(txHash));
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_wrlock(&wallet->lock);
     tx = BRSetGet(wallet->allTx, &txHash);
 
     if (tx) {
@@ -781,7 +2108,7 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
         }
         
         if (array_count(hashes) > 0) {
-            pthread_mutex_unlock(&wallet->lock);
+            pthread_rwlock_unlock(&wallet->lock);
             
             for (size_t i = array_count(hashes); i > 0; i--) {
                 BRWalletRemoveTransaction(wallet, hashes[i - 1]);
@@ -790,14 +2117,12 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
             BRWalletRemoveTransaction(wallet, txHash);
         }
         else {
-            for (size_t i = array_count(wallet->transactions); i > 0; i--) {
-                if (! BRTransactionEq(wallet->transactions[i - 1], tx)) continue;
-                array_rm(wallet->transactions, i - 1);
-                break;
-            }
-            
-            _BRWalletUpdateBalance(wallet);
-            pthread_mutex_unlock(&wallet->lock);
+            size_t i = _BRWalletRemoveTx(wallet, tx);
+
+            _BRWalletUnlinkTx(wallet, tx);
+            if (i != SIZE_MAX) _BRWalletUpdateBalance(wallet, i);
+
+            pthread_rwlock_unlock(&wallet->lock);
             
             // if this is for a transaction we sent, and it wasn't already known to be invalid, notify user
             if (BRWalletAmountSentByTx(wallet, tx) > 0 && BRWalletTransactionIsValid(wallet, tx)) {
@@ -811,13 +2136,13 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
                 }
             }
 
-            if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
+            if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, BRWalletBalance(wallet));
             if (wallet->txDeleted) wallet->txDeleted(wallet->callbackInfo, txHash, notifyUser, recommendRescan);
         }
         
         array_free(hashes);
     }
-    else pthread_mutex_unlock(&wallet->lock);
+    else pthread_rwlock_unlock(&wallet->lock);
 }
 
 // returns the transaction with the given hash if it's been registered in the wallet
@@ -827,9 +2152,9 @@ BRTransaction *BRWalletTransactionForHash(BRWallet *wallet, UInt256 txHash)
     
     assert(wallet != NULL);
     assert(! UInt256IsZero(txHash));
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     tx = BRSetGet(wallet->allTx, &txHash);
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return tx;
 }
 
@@ -846,7 +2171,7 @@ int BRWalletTransactionIsValid(BRWallet *wallet, const BRTransaction *tx)
     // TODO: XXX conflicted tx with the same wallet outputs should be presented as the same tx to the user
 
     if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be invalid
-        pthread_mutex_lock(&wallet->lock);
+        pthread_rwlock_rdlock(&wallet->lock);
 
         if (! BRSetContains(wallet->allTx, tx)) {
             for (size_t i = 0; r && i < tx->inCount; i++) {
@@ -855,7 +2180,7 @@ int BRWalletTransactionIsValid(BRWallet *wallet, const BRTransaction *tx)
         }
         else if (BRSetContains(wallet->invalidTx, tx)) r = 0;
 
-        pthread_mutex_unlock(&wallet->lock);
+        pthread_rwlock_unlock(&wallet->lock);
 
         for (size_t i = 0; r && i < tx->inCount; i++) {
             t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
@@ -876,9 +2201,9 @@ int BRWalletTransactionIsPending(BRWallet *wallet, const BRTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     blockHeight = wallet->blockHeight;
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
 
     if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be postdated
         if (BRTransactionSize(tx) > TX_MAX_SIZE) r = 1; // check transaction size is under TX_MAX_SIZE
@@ -925,19 +2250,15 @@ int BRWalletTransactionIsVerified(BRWallet *wallet, const BRTransaction *tx)
     return r;
 }
 
-// set the block heights and timestamps for the given transactions
-// use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
-void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
-                                uint32_t timestamp)
+// non-threadsafe version of BRWalletUpdateTransactions(), without the balance update
+// writes the hashes of updated wallet tx to hashes and returns their number, and lowers from to the first position in
+// wallet->transactions that changed
+static size_t _BRWalletUpdateTxs(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
+                                 uint32_t timestamp, UInt256 hashes[], size_t *from)
 {
     BRTransaction *tx;
-    UInt256 hashes[txCount];
-    int needsUpdate = 0;
-    size_t i, j, k;
-    
-    assert(wallet != NULL);
-    assert(txHashes != NULL || txCount == 0);
-    pthread_mutex_lock(&wallet->lock);
+    size_t i, j, n;
+
     if (blockHeight > wallet->blockHeight) wallet->blockHeight = blockHeight;
     
     for (i = 0, j = 0; txHashes && i < txCount; i++) {
@@ -947,49 +2268,136 @@ void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size
         tx->blockHeight = blockHeight;
         
         if (_BRWalletContainsTx(wallet, tx)) {
-            for (k = array_count(wallet->transactions); k > 0; k--) { // remove and re-insert tx to keep wallet sorted
-                if (! BRTransactionEq(wallet->transactions[k - 1], tx)) continue;
-                array_rm(wallet->transactions, k - 1);
-                _BRWalletInsertTx(wallet, tx);
-                break;
+            if (_BRWalletTxPos(wallet, tx) != SIZE_MAX) { // re-insert tx to keep wallet sorted
+                n = _BRWalletInsertTx(wallet, tx);
+                if (n < *from) *from = n;
             }
             
             hashes[j++] = txHashes[i];
-            if (BRSetContains(wallet->pendingTx, tx) || BRSetContains(wallet->invalidTx, tx)) needsUpdate = 1;
         }
         else if (blockHeight != TX_UNCONFIRMED) { // remove and free confirmed non-wallet tx
+            _BRWalletPoolRemove(wallet, tx);
             BRSetRemove(wallet->allTx, tx);
             BRTransactionFree(tx);
         }
     }
+
+    return j;
+}
+
+// non-threadsafe version of BRWalletSetTxUnconfirmedAfter(), without the balance update
+// wallet->transactions is sorted by blockHeight, so the tx confirmed after blockHeight are the ones in the suffix
+// starting at the returned position, up to the tx that were already unconfirmed
+// writes the hashes of tx that were confirmed to hashes, and returns the suffix position
+static size_t _BRWalletUnconfirmAfter(BRWallet *wallet, uint32_t blockHeight, UInt256 hashes[])
+{
+    BRTransaction *tx;
+    BRWalletTxNode *node, *n;
+    size_t i, j, k, count, rank = 0;
+
+    wallet->blockHeight = blockHeight;
+    count = i = array_count(wallet->transactions);
+    while (i > 0 && wallet->transactions[i - 1]->blockHeight > blockHeight) i--;
+    count -= i;
+
+    for (j = 0; j < count; j++) {
+        tx = wallet->transactions[i + j];
+        tx->blockHeight = TX_UNCONFIRMED;
+        hashes[j] = tx->txHash;
+
+        // keep the current order, with ranks that still follow any wallet tx that each tx spends from
+        for (k = 0; k < tx->inCount; k++) {
+            n = BRSetGet(wallet->txNodes, &tx->inputs[k].txHash);
+            if (n && n->tx && n->blockHeight == TX_UNCONFIRMED && n->rank >= rank) rank = n->rank + 1;
+        }
+
+        node = BRSetGet(wallet->txNodes, tx);
+        node->blockHeight = TX_UNCONFIRMED;
+        node->rank = rank;
+    }
+
+    return i;
+}
+
+// set the block heights and timestamps for the given transactions
+// use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
+void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
+                                uint32_t timestamp)
+{
+    UInt256 hashes[txCount];
+    size_t j, from = SIZE_MAX;
     
-    if (needsUpdate) _BRWalletUpdateBalance(wallet);
-    pthread_mutex_unlock(&wallet->lock);
+    assert(wallet != NULL);
+    assert(txHashes != NULL || txCount == 0);
+    pthread_rwlock_wrlock(&wallet->lock);
+    j = _BRWalletUpdateTxs(wallet, txHashes, txCount, blockHeight, timestamp, hashes, &from);
+    if (from != SIZE_MAX) _BRWalletUpdateBalance(wallet, from);
+    pthread_rwlock_unlock(&wallet->lock);
     if (j > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, j, blockHeight, timestamp);
 }
 
 // marks all transactions confirmed after blockHeight as unconfirmed (useful for chain re-orgs)
 void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight)
 {
-    size_t i, j, count;
+    size_t i, count;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    wallet->blockHeight = blockHeight;
+    pthread_rwlock_wrlock(&wallet->lock);
     count = i = array_count(wallet->transactions);
     while (i > 0 && wallet->transactions[i - 1]->blockHeight > blockHeight) i--;
     count -= i;
 
     UInt256 hashes[count];
 
-    for (j = 0; j < count; j++) {
-        wallet->transactions[i + j]->blockHeight = TX_UNCONFIRMED;
-        hashes[j] = wallet->transactions[i + j]->txHash;
+    wallet->blockHeight = blockHeight;
+    if (count > 0) _BRWalletUpdateBalance(wallet, _BRWalletUnconfirmAfter(wallet, blockHeight, hashes));
+    pthread_rwlock_unlock(&wallet->lock);
+    if (count > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, count, TX_UNCONFIRMED, 0);
+}
+
+// switches the wallet to a fork that joins the current chain at blockHeight, marking all transactions confirmed after
+// blockHeight as unconfirmed and then confirming those in each block of the new branch, given oldest first
+// this has the same result as BRWalletSetTxUnconfirmedAfter() followed by BRWalletUpdateTransactions() for each block,
+// but with a single balance update, which only rolls back and re-applies the tx after the fork
+void BRWalletReorganize(BRWallet *wallet, uint32_t blockHeight, const BRWalletBlockTxs blocks[], size_t blockCount)
+{
+    UInt256 *hashes;
+    size_t i, j, n, total, count, from, *counts;
+    
+    assert(wallet != NULL);
+    assert(blocks != NULL || blockCount == 0);
+    pthread_rwlock_wrlock(&wallet->lock);
+    count = i = array_count(wallet->transactions);
+    while (i > 0 && wallet->transactions[i - 1]->blockHeight > blockHeight) i--;
+    count -= i;
+    for (j = 0, total = count; j < blockCount; j++) total += blocks[j].txCount;
+    hashes = malloc((total + 1)*sizeof(*hashes));
+    counts = malloc((blockCount + 1)*sizeof(*counts));
+    assert(hashes != NULL && counts != NULL);
+    wallet->blockHeight = blockHeight;
+    from = (count > 0) ? _BRWalletUnconfirmAfter(wallet, blockHeight, hashes) : SIZE_MAX;
+
+    for (j = 0, n = count; j < blockCount; j++) {
+        assert(blocks[j].txHashes != NULL || blocks[j].txCount == 0);
+        counts[j] = _BRWalletUpdateTxs(wallet, blocks[j].txHashes, blocks[j].txCount, blocks[j].blockHeight,
+                                       blocks[j].timestamp, &hashes[n], &from);
+        n += counts[j];
     }
     
-    if (count > 0) _BRWalletUpdateBalance(wallet);
-    pthread_mutex_unlock(&wallet->lock);
-    if (count > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, count, TX_UNCONFIRMED, 0);
+    if (from != SIZE_MAX) _BRWalletUpdateBalance(wallet, from);
+    pthread_rwlock_unlock(&wallet->lock);
+    
+    if (wallet->txUpdated) {
+        if (count > 0) wallet->txUpdated(wallet->callbackInfo, hashes, count, TX_UNCONFIRMED, 0);
+        
+        for (j = 0, n = count; j < blockCount; n += counts[j], j++) {
+            if (counts[j] > 0) wallet->txUpdated(wallet->callbackInfo, &hashes[n], counts[j], blocks[j].blockHeight,
+                                                 blocks[j].timestamp);
+        }
+    }
+    
+    free(counts);
+    free(hashes);
 }
 
 // returns the amount received by the wallet from the transaction (total outputs to change and/or receive addresses)
@@ -999,14 +2407,14 @@ uint64_t BRWalletAmountReceivedFromTx(BRWallet *wallet, const BRTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     
     // TODO: don't include outputs below TX_MIN_OUTPUT_AMOUNT
     for (size_t i = 0; tx && i < tx->outCount; i++) {
         if (BRSetContains(wallet->allAddrs, tx->outputs[i].address)) amount += tx->outputs[i].amount;
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return amount;
 }
 
@@ -1017,7 +2425,7 @@ uint64_t BRWalletAmountSentByTx(BRWallet *wallet, const BRTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     
     for (size_t i = 0; tx && i < tx->inCount; i++) {
         BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
@@ -1028,7 +2436,7 @@ uint64_t BRWalletAmountSentByTx(BRWallet *wallet, const BRTransaction *tx)
         }
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return amount;
 }
 
@@ -1039,7 +2447,7 @@ uint64_t BRWalletFeeForTx(BRWallet *wallet, const BRTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     
     for (size_t i = 0; tx && i < tx->inCount && amount != UINT64_MAX; i++) {
         BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
@@ -1051,7 +2459,7 @@ uint64_t BRWalletFeeForTx(BRWallet *wallet, const BRTransaction *tx)
         else amount = UINT64_MAX;
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     
     for (size_t i = 0; tx && i < tx->outCount && amount != UINT64_MAX; i++) {
         amount -= tx->outputs[i].amount;
@@ -1064,19 +2472,16 @@ uint64_t BRWalletFeeForTx(BRWallet *wallet, const BRTransaction *tx)
 uint64_t BRWalletBalanceAfterTx(BRWallet *wallet, const BRTransaction *tx)
 {
     uint64_t balance;
+    size_t i;
     
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     balance = wallet->balance;
-    
-    for (size_t i = array_count(wallet->transactions); tx && i > 0; i--) {
-        if (! BRTransactionEq(tx, wallet->transactions[i - 1])) continue;
-        balance = wallet->balanceHist[i - 1];
-        break;
-    }
+    i = (tx) ? _BRWalletTxPos(wallet, tx) : SIZE_MAX;
+    if (i != SIZE_MAX) balance = wallet->balanceHist[i];
 
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return balance;
 }
 
@@ -1086,9 +2491,9 @@ uint64_t BRWalletFeeForTxSize(BRWallet *wallet, size_t size)
     uint64_t fee;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
-    fee = _txFee(wallet->feePerKb, size);
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
+    fee = BRCoinTxFee(wallet->feePerKb, size);
+    pthread_rwlock_unlock(&wallet->lock);
     return fee;
 }
 
@@ -1122,9 +2527,9 @@ uint64_t BRWalletMinOutputAmount(BRWallet *wallet)
     uint64_t amount;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
     amount = (TX_MIN_OUTPUT_AMOUNT*wallet->feePerKb + MIN_FEE_PER_KB - 1)/MIN_FEE_PER_KB;
-    pthread_mutex_unlock(&wallet->lock);
+    pthread_rwlock_unlock(&wallet->lock);
     return (amount > TX_MIN_OUTPUT_AMOUNT) ? amount : TX_MIN_OUTPUT_AMOUNT;
 }
 
@@ -1137,7 +2542,7 @@ uint64_t BRWalletMaxOutputAmount(BRWallet *wallet)
     size_t i, txSize, cpfpSize = 0, inCount = 0;
 
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_rdlock(&wallet->lock);
 
     for (i = array_count(wallet->utxos); i > 0; i--) {
         o = &wallet->utxos[i - 1];
@@ -1153,8 +2558,8 @@ uint64_t BRWalletMaxOutputAmount(BRWallet *wallet)
     }
 
     txSize = 8 + BRVarIntSize(inCount) + TX_INPUT_SIZE*inCount + BRVarIntSize(2) + TX_OUTPUT_SIZE*2;
-    fee = _txFee(wallet->feePerKb, txSize + cpfpSize);
-    pthread_mutex_unlock(&wallet->lock);
+    fee = BRCoinTxFee(wallet->feePerKb, txSize + cpfpSize);
+    pthread_rwlock_unlock(&wallet->lock);
     
     return (amount > fee) ? amount - fee : 0;
 }
@@ -1164,11 +2569,40 @@ static void _setApplyFreeTx(void *info, void *tx)
     BRTransactionFree(tx);
 }
 
+static void _setApplyFreeAddrIdx(void *info, void *idx)
+{
+    free(idx);
+}
+
+static void _setApplyFreeUnspent(void *info, void *e)
+{
+    free(e);
+}
+
+static void _setApplyFreeTxNode(void *info, void *node)
+{
+    if (((BRWalletTxNode *)node)->spenders) array_free(((BRWalletTxNode *)node)->spenders);
+    free(node);
+}
+
+static void _setApplyFreePoolTx(void *info, void *e)
+{
+    free(e);
+}
+
+static void _setApplyFreeAddrTxs(void *info, void *e)
+{
+    array_free(((BRWalletAddrTxs *)e)->txs);
+    if (((BRWalletAddrTxs *)e)->utxos) array_free(((BRWalletAddrTxs *)e)->utxos);
+    free(e);
+}
+
 // frees memory allocated for wallet, and calls BRTransactionFree() for all registered transactions
 void BRWalletFree(BRWallet *wallet)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    pthread_rwlock_wrlock(&wallet->lock);
+    BRSetApply(wallet->allAddrs, NULL, _setApplyFreeAddrIdx);
     BRSetFree(wallet->allAddrs);
     BRSetFree(wallet->usedAddrs);
     BRSetFree(wallet->invalidTx);
@@ -1176,13 +2610,24 @@ void BRWalletFree(BRWallet *wallet)
     BRSetApply(wallet->allTx, NULL, _setApplyFreeTx);
     BRSetFree(wallet->allTx);
     BRSetFree(wallet->spentOutputs);
+    BRSetApply(wallet->unspent, NULL, _setApplyFreeUnspent);
+    BRSetFree(wallet->unspent);
+    array_free(wallet->unspentAt);
+    BRSetApply(wallet->txNodes, NULL, _setApplyFreeTxNode);
+    BRSetFree(wallet->txNodes);
+    BRSetApply(wallet->poolTx, NULL, _setApplyFreePoolTx);
+    BRSetFree(wallet->poolTx);
+    BRSetApply(wallet->addrTxs, NULL, _setApplyFreeAddrTxs);
+    BRSetFree(wallet->addrTxs);
     array_free(wallet->internalChain);
     array_free(wallet->externalChain);
     array_free(wallet->balanceHist);
     array_free(wallet->transactions);
     array_free(wallet->utxos);
-    pthread_mutex_unlock(&wallet->lock);
-    pthread_mutex_destroy(&wallet->lock);
+    array_free(wallet->undo);
+    array_free(wallet->txUndo);
+    pthread_rwlock_unlock(&wallet->lock);
+    pthread_rwlock_destroy(&wallet->lock);
     free(wallet);
 }
 
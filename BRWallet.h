@@ -26,6 +26,7 @@
 #define BRWallet_h
 
 #include "BRTransaction.h"
+#include "BRCoinSelection.h"
 #include "BRAddress.h"
 #include "BRBIP32Sequence.h"
 #include "BRInt.h"
@@ -39,6 +40,8 @@ extern "C" {
 #define MIN_FEE_PER_KB     TX_FEE_PER_KB                       // bitcoind 0.12 default min-relay fee
 #define MAX_FEE_PER_KB     ((TX_FEE_PER_KB*1000100 + 190)/191) // slightly higher than a 10,000bit fee on a 191byte tx
 
+#define DEFAULT_TX_POOL_SIZE 4000000 // bytes of unconfirmed non-wallet tx kept for invalid tx checks and cpfp fees
+
 typedef struct {
     UInt256 hash;
     uint32_t n;
@@ -61,6 +64,19 @@ typedef struct BRWalletStruct BRWallet;
 // allocates and populates a BRWallet struct that must be freed by calling BRWalletFree()
 BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk);
 
+// allocates and populates a BRWallet struct from transactions and a snapshot written by BRWalletSnapshot(), without
+// sorting transactions, deriving address chains or rebuilding the balance as BRWalletNew() does
+// transactions must be the same set of wallet transactions the snapshot was taken with
+// returns NULL if the snapshot fails its checksum, is from another version, or doesn't match mpk or transactions, in
+// which case transactions are left as they were and may be passed to BRWalletNew() instead
+BRWallet *BRWalletNewFromSnapshot(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk,
+                                  const uint8_t *snapshot, size_t snapshotLen);
+
+// writes a versioned snapshot of wallet state to buf, covering the sorted tx order, address chains, utxos, balance
+// history and the balance journal that spent outputs and the utxo set are restored from
+// returns number of bytes written, or total bufLen needed if buf is NULL or too small
+size_t BRWalletSnapshot(BRWallet *wallet, uint8_t *buf, size_t bufLen);
+
 // not thread-safe, set callbacks once after BRWalletNew(), before calling other BRWallet functions
 // info is a void pointer that will be passed along with each callback call
 // void balanceChanged(void *, uint64_t) - called when the wallet balance changes
@@ -90,6 +106,11 @@ BRAddress BRWalletReceiveAddress(BRWallet *wallet);
 // returns the number addresses written, or total number available if addrs is NULL
 size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount);
 
+// writes up to addrsCount of the addresses listed by BRWalletAllAddrs() to addrs, starting at position *cursor, and
+// advances *cursor past them, holding the wallet lock only for this page
+// returns the number of addresses written, which is less than addrsCount only once the end of the list is reached
+size_t BRWalletAllAddrsPage(BRWallet *wallet, size_t *cursor, BRAddress addrs[], size_t addrsCount);
+
 // true if the address was previously generated by BRWalletUnusedAddrs() (even if it's now used)
 int BRWalletContainsAddress(BRWallet *wallet, const char *addr);
 
@@ -100,12 +121,41 @@ int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr);
 // returns the number of transactions written, or total number available if transactions is NULL
 size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], size_t txCount);
 
+// a range of wallet transactions and a position within it, for BRWalletTransactionsPage()
+// start from BR_WALLET_TX_CURSOR_ALL, and narrow the range by setting its first five fields before the first page
+typedef struct {
+    uint32_t minHeight, maxHeight; // blockHeight range of tx to include, unconfirmed tx have blockHeight TX_UNCONFIRMED
+    uint32_t minTime, maxTime; // timestamp range of tx to include
+    size_t offset; // number of tx in the blockHeight range to skip before the first page
+    UInt256 lastHash; // hash of the last tx the cursor moved past, or zero before the first page
+    uint32_t lastHeight; // sort key of the last tx the cursor moved past
+    size_t lastRank;
+} BRWalletTxCursor;
+
+#define BR_WALLET_TX_CURSOR_ALL ((const BRWalletTxCursor) { 0, TX_UNCONFIRMED, 0, UINT32_MAX, 0 })
+
+// writes up to txCount transactions in the range of cursor to the given transactions array, sorted by date, oldest
+// first, and advances cursor past them, holding the wallet lock only for this page
+// each page resumes from the sort key of the last tx, so if the wallet changes between pages, only tx that moved
+// across the cursor are skipped or repeated
+// returns the number of transactions written, which is less than txCount only once the range is exhausted
+size_t BRWalletTransactionsPage(BRWallet *wallet, BRWalletTxCursor *cursor, BRTransaction *transactions[],
+                                size_t txCount);
+
+// writes transactions registered in the wallet with an input or output at addr, sorted by date, oldest first, to the
+// given transactions array, taking time proportional to the number of such transactions rather than the wallet size
+// returns the number of transactions written, or total number available if transactions is NULL
+size_t BRWalletTransactionsForAddress(BRWallet *wallet, const char *addr, BRTransaction *transactions[],
+                                      size_t txCount);
+
 // writes transactions registered in the wallet, and that were unconfirmed before blockHeight, to the transactions array
 // returns the number of transactions written, or total number available if transactions is NULL
 size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions[], size_t txCount,
                                    uint32_t blockHeight);
 
 // current wallet balance, not including transactions known to be invalid
+// doesn't wait on the wallet lock, nor do BRWalletTotalSent() and BRWalletTotalReceived(), so they can be polled
+// from any thread while the wallet is syncing
 uint64_t BRWalletBalance(BRWallet *wallet);
 
 // total amount spent from the wallet (exluding change)
@@ -117,10 +167,29 @@ uint64_t BRWalletTotalReceived(BRWallet *wallet);
 // writes unspent outputs to utxos and returns the number of outputs written, or number available if utxos is NULL
 size_t BRWalletUTXOs(BRWallet *wallet, BRUTXO utxos[], size_t utxosCount);
 
+// writes up to utxosCount unspent outputs to utxos, starting at position *cursor in the list written by BRWalletUTXOs(),
+// and advances *cursor past them, holding the wallet lock only for this page
+// returns the number of outputs written, which is less than utxosCount only once the end of the list is reached
+size_t BRWalletUTXOsPage(BRWallet *wallet, size_t *cursor, BRUTXO utxos[], size_t utxosCount);
+
+// writes the wallet's unspent outputs at addr to utxos, in no particular order
+// returns the number of outputs written, or total number available if utxos is NULL
+size_t BRWalletUTXOsForAddress(BRWallet *wallet, const char *addr, BRUTXO utxos[], size_t utxosCount);
+
+// total amount of the wallet's unspent outputs at addr, not including transactions known to be invalid
+uint64_t BRWalletBalanceForAddress(BRWallet *wallet, const char *addr);
+
 // fee-per-kb of transaction size to use when creating a transaction
 uint64_t BRWalletFeePerKb(BRWallet *wallet);
 void BRWalletSetFeePerKb(BRWallet *wallet, uint64_t feePerKb);
 
+// sets the strategy used to choose utxos when creating a transaction, BRCoinSelectFirstFit() by default
+void BRWalletSetCoinSelector(BRWallet *wallet, BRCoinSelector selector);
+
+// sets the total size in bytes of unconfirmed non-wallet tx the wallet keeps, DEFAULT_TX_POOL_SIZE by default
+// the least recently relayed tx are evicted to fit
+void BRWalletSetTxPoolSize(BRWallet *wallet, size_t maxSize);
+
 // returns an unsigned transaction that sends the specified amount from the wallet to the given address
 // result must be freed using BRTransactionFree()
 BRTransaction *BRWalletCreateTransaction(BRWallet *wallet, uint64_t amount, const char *addr);
@@ -139,8 +208,16 @@ int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, int forkId, con
 int BRWalletContainsTransaction(BRWallet *wallet, const BRTransaction *tx);
 
 // adds a transaction to the wallet, or returns false if it isn't associated with the wallet
+// the wallet takes ownership of tx unless it already has a tx with the same hash, and keeps non-wallet tx only while
+// they're unconfirmed and fit in its bounded pool, freeing them otherwise, so use BRWalletTransactionForHash() rather
+// than tx after this returns false
 int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx);
 
+// adds transactions to the wallet with a single balance update, and returns the number of transactions added
+// tx may be given in any order, and are otherwise handled as by BRWalletRegisterTransaction()
+// balanceChanged is called once, followed by txAdded for each tx added
+size_t BRWalletRegisterTransactions(BRWallet *wallet, BRTransaction *transactions[], size_t txCount);
+
 // removes a tx from the wallet, along with any tx that depend on its outputs
 void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash);
 
@@ -164,6 +241,20 @@ void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size
 // marks all transactions confirmed after blockHeight as unconfirmed (useful for chain re-orgs)
 void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight);
 
+// transactions confirmed in a block, for BRWalletReorganize()
+typedef struct {
+    const UInt256 *txHashes;
+    size_t txCount;
+    uint32_t blockHeight;
+    uint32_t timestamp;
+} BRWalletBlockTxs;
+
+// switches the wallet to a fork that joins the current chain at blockHeight, marking all transactions confirmed after
+// blockHeight as unconfirmed and then confirming those in each block of the new branch, given oldest first
+// this has the same result as BRWalletSetTxUnconfirmedAfter() followed by BRWalletUpdateTransactions() for each block,
+// but with a single balance update, which only rolls back and re-applies the tx after the fork
+void BRWalletReorganize(BRWallet *wallet, uint32_t blockHeight, const BRWalletBlockTxs blocks[], size_t blockCount);
+
 // returns the amount received by the wallet from the transaction (total outputs to change and/or receive addresses)
 uint64_t BRWalletAmountReceivedFromTx(BRWallet *wallet, const BRTransaction *tx);
 
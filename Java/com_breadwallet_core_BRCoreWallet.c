@@ -444,8 +444,20 @@ Java_com_breadwallet_core_BRCoreWallet_jniRegisterTransaction
     BRWallet  *wallet  = (BRWallet  *) getJNIReference (env, thisObject);
     BRTransaction *transaction = (BRTransaction *) getJNIReference (env, transactionObject);
 
-    // The `transaction` is now owned by Core; it may be freed.
-    return (jboolean) BRWalletRegisterTransaction (wallet, transaction);
+    // An unsigned transaction is never registered, and the wallet wouldn't free a copy of one.
+    if (!BRTransactionIsSigned (transaction)) return JNI_FALSE;
+
+    // The wallet takes ownership of a transaction with a new hash, keeping it or, for a non-wallet
+    // transaction it doesn't keep in its pool, freeing it right away.  Give it a copy so that
+    // `transaction` stays owned by Java, whatever the result, and is freed by dispose().  A copy
+    // of an already known transaction is not taken by the wallet, so it is freed here.
+    int isKnown = NULL != BRWalletTransactionForHash (wallet, transaction->txHash);
+    BRTransaction *copy = BRTransactionCopy (transaction);
+
+    jboolean registered = (jboolean) BRWalletRegisterTransaction (wallet, copy);
+    if (isKnown) BRTransactionFree (copy);
+
+    return registered;
 }
 
 /*
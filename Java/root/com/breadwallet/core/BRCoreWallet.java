@@ -180,14 +180,9 @@ public class BRCoreWallet extends BRCoreJniReference
     public native boolean containsTransaction (BRCoreTransaction transaction);
 
     public boolean registerTransaction (BRCoreTransaction transaction) {
-        // Try to register; this might fail on a 're-register' attempt.
-        boolean registered = jniRegisterTransaction(transaction);
-
-        // Make isRegistered sticky.
-        transaction.isRegistered = transaction.isRegistered || registered;
-
-        // Return the status of the register.
-        return registered;
+        // The wallet is given a copy, so `transaction` is never owned by Core and isRegistered is
+        // left as is.  Returns false for a transaction that isn't associated with the wallet.
+        return jniRegisterTransaction(transaction);
     }
 
     private native boolean jniRegisterTransaction (BRCoreTransaction transaction);
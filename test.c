@@ -24,6 +24,7 @@
 
 #include "BRCrypto.h"
 #include "BRBloomFilter.h"
+#include "BRGCSFilter.h"
 #include "BRMerkleBlock.h"
 #include "BRWallet.h"
 #include "BRKey.h"
@@ -41,7 +42,9 @@
 #include "BRInt.h"
 #include "BRArray.h"
 #include "BRSet.h"
+#include "BRThreadPool.h"
 #include "BRTransaction.h"
+#include "BRCoinSelection.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,6 +52,8 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 
 #define SKIP_BIP38 1
@@ -218,6 +223,39 @@ int BRSetTests()
     return r;
 }
 
+static void apply_square(void *info, size_t i)
+{
+    ((size_t *)info)[i] = i*i;
+}
+
+static void job_count(void *info)
+{
+    BRThreadPoolApply(BRThreadPoolShared(), (size_t *)info + 1, apply_square, 1);
+    ((size_t *)info)[0]++;
+}
+
+int BRThreadPoolTests()
+{
+    int r = 1;
+    size_t i, squares[1000] = { 0 }, counter[2] = { 0, 0 };
+    BRThreadPool *pool = BRThreadPoolShared();
+    
+    if (BRThreadPoolThreadCount(pool) < 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRThreadPoolShared() test\n", __func__);
+
+    BRThreadPoolApply(pool, squares, apply_square, sizeof(squares)/sizeof(*squares));
+    
+    for (i = 0; i < sizeof(squares)/sizeof(*squares); i++) {
+        if (squares[i] != i*i) r = 0, fprintf(stderr, "***FAILED*** %s: BRThreadPoolApply() test\n", __func__);
+    }
+    
+    pool = BRThreadPoolNew(1); // a single thread runs jobs one at a time in the order they were added
+    for (i = 0; i < 100; i++) BRThreadPoolAdd(pool, counter, job_count);
+    BRThreadPoolFree(pool); // waits for queued jobs
+    if (counter[0] != 100) r = 0, fprintf(stderr, "***FAILED*** %s: BRThreadPoolAdd() test\n", __func__);
+    return r;
+}
+
 int BRBase58Tests()
 {
     int r = 1;
@@ -435,6 +473,30 @@ int BRHashTests()
     if (! UInt256Eq(*(UInt256 *)"\xca\x97\x81\x12\xca\x1b\xbd\xca\xfa\xc2\x31\xb3\x9a\x23\xdc\x4d\xa7\x86\xef\xf8"
                     "\x14\x7c\x4e\x72\xb9\x80\x77\x85\xaf\xee\x48\xbb", *(UInt256 *)md))
         r = 0, fprintf(stderr, "\n***FAILED*** %s: BRSHA256() test 6", __func__);
+    
+    uint8_t *a = malloc(1000001); // one million 'a's, many blocks at an unaligned address
+    
+    memset(a, 'a', 1000001);
+    BRSHA256(md, &a[1], 1000000);
+    if (! UInt256Eq(*(UInt256 *)"\xcd\xc7\x6e\x5c\x99\x14\xfb\x92\x81\xa1\xc7\xe2\x84\xd7\x3e\x67\xf1\x80\x9a\x48"
+                    "\xa4\x97\x20\x0e\x04\x6d\x39\xcc\xc7\x11\x2c\xd0", *(UInt256 *)md))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRSHA256() test 7", __func__);
+    
+    uint8_t mds[37*32]; // enough messages for two groups of the widest simd lanes plus a remainder
+    
+    for (int i = 0; i < 37*120; i++) a[i] = (uint8_t)(i*7);
+    
+    for (size_t len = 0; len <= 120; len += 40) {
+        BRSHA256_2_Multi(mds, a, len, 37);
+        
+        for (int i = 0; i < 37; i++) {
+            BRSHA256_2(md, &a[i*len], len);
+            if (! UInt256Eq(*(UInt256 *)md, *(UInt256 *)&mds[i*32]))
+                r = 0, fprintf(stderr, "\n***FAILED*** %s: BRSHA256_2_Multi() test %zu", __func__, len);
+        }
+    }
+    
+    free(a);
 
     // test sha512
     
@@ -608,6 +670,43 @@ int BRHashTests()
 
     if (BRSip64(k, d,15) != 0xa129ca6149be45e5) r = 0, fprintf(stderr, "***FAILED*** %s: BRSip64() test 4\n", __func__);
 
+    // test scrypt proof-of-work
+    
+    const char hdr[] = "\x01\x00\x00\x00\x06\xe5\x33\xfd\x1a\xda\x86\x39\x1f\x3f\x6c\x34\x32\x04\xb0\xd2\x78\xd4"
+    "\xaa\xec\x1c\x0b\x20\xaa\x27\xba\x03\x00\x00\x00\x00\x00\x6a\xbb\xb3\xeb\x3d\x73\x3a\x9f\xe1\x89\x67\xfd"
+    "\x7d\x4c\x11\x7e\x4c\xcb\xba\xc5\xbe\xc4\xd9\x10\xd9\x00\xb3\xae\x07\x93\xe7\x7f\x54\x24\x1b\x4d\x4c\x86"
+    "\x04\x1b\x40\x89\xcc\x9b";
+    uint8_t hdrs[9*80], pow[9*32];
+    
+    BRScryptPoW(md, hdr, 1);
+    if (! UInt256Eq(*(UInt256 *)"\x6c\x1c\x7a\xa8\x86\x45\x77\xd8\x15\x08\x23\x84\xf8\xbb\xfa\x17\x06\x7d\x30\xe0"
+                    "\x1d\x97\xc5\xdb\x99\xeb\x9c\xf9\xb5\xee\x12\x32", *(UInt256 *)md))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRScryptPoW() test 1\n", __func__);
+    
+    for (int i = 0; i < 9; i++) memcpy(&hdrs[i*80], hdr, 80), hdrs[i*80 + 76] += i; // vary the nonce
+    BRScryptPoW(pow, hdrs, 9); // hashes a full group of simd lanes plus a padded partial group
+    
+    for (int i = 0; i < 9; i++) {
+        BRScrypt(md, 32, &hdrs[i*80], 80, &hdrs[i*80], 80, 1024, 1, 1);
+        if (! UInt256Eq(*(UInt256 *)&pow[i*32], *(UInt256 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRScryptPoW() test %d\n", __func__, i + 2);
+    }
+    
+    BRScryptCtx *pubCtx = BRScryptCtxNew(1024, 1, 1), *ctx = BRScryptCtxNew(1024, 1, 0);
+    
+    for (int i = 0; i < 9; i++) { // reused scratchpads must give the same result for each header
+        BRScryptCtxPoW((i & 1) ? pubCtx : ctx, md, &hdrs[i*80], 1);
+        if (! UInt256Eq(*(UInt256 *)&pow[i*32], *(UInt256 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRScryptCtxPoW() test %d\n", __func__, i + 1);
+    }
+    
+    BRScryptCtxDerive(pubCtx, md, 32, &hdrs[80], 80, &hdrs[80], 80, 1);
+    if (! UInt256Eq(*(UInt256 *)&pow[32], *(UInt256 *)md))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRScryptCtxDerive() test\n", __func__);
+    
+    BRScryptCtxFree(pubCtx);
+    BRScryptCtxFree(ctx);
+
     if (! r) fprintf(stderr, "\n                                    ");
     return r;
 }
@@ -668,6 +767,36 @@ int BRMacTests()
                "\x27\x0c\xd7\xea\x25\x05\x54\x97\x58\xbf\x75\xc0\x5a\x99\x4a\x6d\x03\x4f\x65\xf8\xf0\xe6\xfd\xca\xea"
                "\xb1\xa3\x4d\x4a\x6b\x4b\x63\x6e\x07\x0a\x38\xbc\xe7\x37", mac, 64) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRHMAC() sha512 test 2\n", __func__);
+
+    // test hmac key schedule against BRHMAC() across block boundaries of key and data
+    
+    uint8_t k3[200], d3[300], mac2[64];
+    BRHMACCtx ctx;
+    
+    for (size_t i = 0; i < sizeof(k3); i++) k3[i] = (uint8_t)(i*7 + 1);
+    for (size_t i = 0; i < sizeof(d3); i++) d3[i] = (uint8_t)(i*13 + 5);
+    
+    for (size_t i = 0; i < sizeof(k3); i += 37) {
+        BRHMACCtxInit(&ctx, BRSHA256, k3, i);
+        
+        for (size_t j = 0; j < sizeof(d3); j += 11) {
+            BRHMAC(mac, BRSHA256, 256/8, k3, i, d3, j);
+            BRHMACCtxMac(&ctx, mac2, d3, j);
+            if (memcmp(mac, mac2, 32) != 0)
+                r = 0, fprintf(stderr, "***FAILED*** %s: BRHMACCtxMac() sha256 test\n", __func__);
+        }
+        
+        BRHMACCtxInit(&ctx, BRSHA512, k3, i);
+        
+        for (size_t j = 0; j < sizeof(d3); j += 11) {
+            BRHMAC(mac, BRSHA512, 512/8, k3, i, d3, j);
+            BRHMACCtxMac(&ctx, mac2, d3, j);
+            if (memcmp(mac, mac2, 64) != 0)
+                r = 0, fprintf(stderr, "***FAILED*** %s: BRHMACCtxMac() sha512 test\n", __func__);
+        }
+    }
+    
+    BRHMACCtxClean(&ctx);
     
     // test poly1305
 
@@ -1745,6 +1874,24 @@ int BRBIP32SequenceTests()
                     uint256("7b6a7dd645507d775215a9035be06700e1ed8c541da9351b4bd14bd50ab61428")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32PubKey() test\n", __func__);
 
+    uint8_t childPubKey[33];
+    
+    BRBIP32ChildPubKey(childPubKey, sizeof(childPubKey), BRBIP32ChainPubKey(mpk, SEQUENCE_EXTERNAL_CHAIN), 0);
+    if (memcmp(childPubKey, pubKey, sizeof(pubKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32ChildPubKey() test\n", __func__);
+
+    BRECPoint childPubKeys[40];
+    
+    if (BRBIP32ChildPubKeyList(childPubKeys, BRBIP32ChainPubKey(mpk, SEQUENCE_INTERNAL_CHAIN), 10, 40) != 40)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32ChildPubKeyList() test 1\n", __func__);
+    
+    for (uint32_t i = 0; i < 40; i++) {
+        BRBIP32PubKey(childPubKey, sizeof(childPubKey), mpk, SEQUENCE_INTERNAL_CHAIN, 10 + i);
+        
+        if (memcmp(childPubKey, childPubKeys[i].p, sizeof(childPubKey)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32ChildPubKeyList() test 2\n", __func__);
+    }
+
     UInt512 dk;
     BRAddress addr;
 
@@ -1938,6 +2085,73 @@ int BRTransactionTests()
     return r;
 }
 
+int BRCoinSelectionTests()
+{
+    int r = 1;
+    BRCoinTarget target = { 100000, 1, TX_OUTPUT_SIZE, DEFAULT_FEE_PER_KB, TX_MIN_OUTPUT_AMOUNT, 0, TX_MAX_SIZE };
+    BRCoin coins[1000] = { { 50000, 0 }, { 80000, 1 }, { 1000000, 2 } };
+    BRCoinSelection sel;
+    BRCoinSelector selectors[] = { BRCoinSelectFirstFit, BRCoinSelectLargestFirst, BRCoinSelectBranchAndBound };
+    size_t i, j, n, selected[1000];
+    uint64_t fee, amount;
+    
+    n = BRCoinSelectFirstFit(&target, coins, 3, selected, &sel);
+    fee = BRCoinTxFee(target.feePerKb, 10 + TX_OUTPUT_SIZE*2 + TX_INPUT_SIZE*2);
+    if (n != 2 || selected[0] != 0 || selected[1] != 1 || sel.amount != 130000 || sel.fee != fee ||
+        sel.change != 130000 - 100000 - fee)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRCoinSelectFirstFit() test 1", __func__);
+    
+    n = BRCoinSelectLargestFirst(&target, coins, 3, selected, &sel);
+    if (n != 1 || selected[0] != 2 || sel.change != 1000000 - 100000 - sel.fee)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRCoinSelectLargestFirst() test 1", __func__);
+    
+    // 70000 + 30000 + fee is an exact match without change, 100000 alone can't pay the fee
+    fee = BRCoinTxFee(target.feePerKb, 10 + TX_OUTPUT_SIZE + TX_INPUT_SIZE*2);
+    coins[0].amount = 5000000, coins[1].amount = 100000, coins[2].amount = 70000;
+    coins[3].amount = 30000 + fee, coins[3].idx = 3;
+    n = BRCoinSelectBranchAndBound(&target, coins, 4, selected, &sel);
+    if (n != 2 || selected[0] != 2 || selected[1] != 3 || sel.change != 0 || sel.fee != fee)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRCoinSelectBranchAndBound() test 1", __func__);
+    
+    n = BRCoinSelectBranchAndBound(&target, coins, 2, selected, &sel); // no changeless match, fall back to largest
+    if (n != 1 || selected[0] != 0 || sel.change == 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRCoinSelectBranchAndBound() test 2", __func__);
+    
+    // funds are only spendable in a tx larger than maxSize
+    target.maxSize = 10 + TX_OUTPUT_SIZE*2 + TX_INPUT_SIZE*2;
+    fee = BRCoinTxFee(target.feePerKb, target.maxSize);
+    for (i = 0; i < 3; i++) coins[i].amount = 40000, coins[i].idx = i;
+    n = BRCoinSelectFirstFit(&target, coins, 3, selected, &sel);
+    if (n != 0 || sel.maxAmount != 80000 - fee)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRCoinSelectFirstFit() test 2", __func__);
+    
+    target.amount = sel.maxAmount;
+    n = BRCoinSelectFirstFit(&target, coins, 3, selected, &sel);
+    if (n != 2 || sel.change != 0 || sel.fee != fee)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRCoinSelectFirstFit() test 3", __func__);
+    
+    target.amount = 1000000, target.maxSize = TX_MAX_SIZE;
+    n = BRCoinSelectLargestFirst(&target, coins, 3, selected, &sel);
+    if (n != 0 || sel.maxAmount != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRCoinSelectLargestFirst() test 2", __func__);
+    
+    // selected coins must add up to the amount, fee and change reported
+    for (i = 0; i < 1000; i++) coins[i].amount = 1000 + (i*2654435761u % 1000000), coins[i].idx = i;
+    target.amount = 12345678;
+    
+    for (i = 0; i < sizeof(selectors)/sizeof(*selectors); i++) {
+        n = selectors[i](&target, coins, 1000, selected, &sel);
+        for (j = 0, amount = 0; j < n; j++) amount += coins[selected[j]].amount;
+        
+        if (n == 0 || amount != sel.amount || sel.amount != target.amount + sel.fee + sel.change ||
+            sel.fee < BRCoinTxFee(target.feePerKb, 10 + TX_OUTPUT_SIZE + TX_INPUT_SIZE*n))
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: selector %zu consistency test", __func__, i);
+    }
+    
+    if (! r) fprintf(stderr, "\n                                    ");
+    return r;
+}
+
 static void walletBalanceChanged(void *info, uint64_t balance)
 {
     printf("balance changed %"PRIu64"\n", balance);
@@ -1959,6 +2173,29 @@ static void walletTxDeleted(void *info, UInt256 txHash, int notifyUser, int reco
     printf("tx deleted: %s\n", u256hex(txHash));
 }
 
+typedef struct {
+    BRWallet *wallet;
+    BRTransaction **txs;
+    size_t txCount;
+    volatile int failed;
+} BRWalletConcurrencyInfo;
+
+// job 0 registers transactions paying SATOSHIS each, while the other jobs query the wallet
+static void walletConcurrentJob(void *info, size_t i)
+{
+    BRWalletConcurrencyInfo *c = info;
+    uint64_t balance;
+
+    for (size_t j = 0; i == 0 && j < c->txCount; j++) BRWalletRegisterTransaction(c->wallet, c->txs[j]);
+
+    for (size_t j = 0; i > 0 && j < 1000; j++) {
+        balance = BRWalletBalance(c->wallet);
+        if (balance % SATOSHIS != 0 || balance > c->txCount*SATOSHIS) c->failed = 1;
+        if (BRWalletTransactionForHash(c->wallet, c->txs[j % c->txCount]->txHash) == NULL &&
+            BRWalletTotalReceived(c->wallet) == c->txCount*SATOSHIS) c->failed = 1;
+    }
+}
+
 // TODO: test standard free transaction no change
 // TODO: test free transaction who's inputs are too new to hit min free priority
 // TODO: test transaction with change below min allowable output
@@ -2040,6 +2277,15 @@ int BRWalletTests()
     if (BRWalletBalance(w) != SATOSHIS*2)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTransactions() test\n", __func__);
 
+    BRWalletSetTxUnconfirmedAfter(w, 998); // lockTime is in the future again, so tx is pending
+    if (BRWalletBalance(w) != SATOSHIS || BRWalletBalanceAfterTx(w, tx) != 0 || BRWalletUTXOs(w, NULL, 0) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSetTxUnconfirmedAfter() test\n", __func__);
+
+    BRWalletUpdateTransactions(w, &tx->txHash, 1, 1000, 1);
+    if (BRWalletBalance(w) != SATOSHIS*2 || BRWalletBalanceAfterTx(w, tx) != SATOSHIS ||
+        BRWalletTotalReceived(w) != SATOSHIS*2 || BRWalletUTXOs(w, NULL, 0) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTransactions() test 2\n", __func__);
+
     BRWalletFree(w);
     tx = BRTransactionNew();
     BRTransactionAddInput(tx, inHash, 0, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
@@ -2100,6 +2346,310 @@ int BRWalletTests()
     printf("                                    ");
     BRWalletFree(w);
 
+    BRTransaction *child, *txs[2], *copies[2];
+
+    w = BRWalletNew(NULL, 0, mpk);
+    tx = BRTransactionNew();
+    BRTransactionAddInput(tx, inHash, 2, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, SATOSHIS, outScript, outScriptLen);
+    BRTransactionSign(tx, 0, &k, 1);
+    child = BRTransactionNew();
+    BRTransactionAddInput(child, tx->txHash, 0, SATOSHIS, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(child, SATOSHIS/2, outScript, outScriptLen);
+    BRTransactionSign(child, 0, &k, 1);
+    copies[0] = BRTransactionCopy(child);
+    copies[1] = BRTransactionCopy(tx);
+    BRWalletRegisterTransaction(w, child); // test registering a tx before the tx it spends from
+    BRWalletRegisterTransaction(w, tx);
+    
+    if (BRWalletTransactions(w, txs, 2) != 2 || txs[0] != tx || txs[1] != child)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactions() test 4\n", __func__);
+
+    BRWalletFree(w);
+    w = BRWalletNew(NULL, 0, mpk);
+    
+    if (BRWalletRegisterTransactions(w, copies, 2) != 2 || BRWalletBalance(w) != SATOSHIS/2 ||
+        BRWalletTransactions(w, NULL, 0) != 2) // test registering a batch with a tx before the tx it spends from
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransactions() test\n", __func__);
+
+    size_t snapshotLen = BRWalletSnapshot(w, NULL, 0);
+    uint8_t *snapshot = malloc(snapshotLen);
+    BRTransaction *restored[2];
+    BRWallet *w2;
+
+    BRWalletSnapshot(w, snapshot, snapshotLen);
+    BRWalletTransactions(w, txs, 2);
+    copies[0] = BRTransactionCopy(txs[1]);
+    copies[1] = BRTransactionCopy(txs[0]);
+    snapshot[snapshotLen/2] ^= 1;
+    w2 = BRWalletNewFromSnapshot(copies, 2, mpk, snapshot, snapshotLen);
+    if (w2) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNewFromSnapshot() test 1\n", __func__);
+
+    snapshot[snapshotLen/2] ^= 1;
+    w2 = BRWalletNewFromSnapshot(copies, 1, mpk, snapshot, snapshotLen); // tx missing from the given transactions
+    if (w2) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNewFromSnapshot() test 2\n", __func__);
+
+    w2 = BRWalletNewFromSnapshot(copies, 2, mpk, snapshot, snapshotLen);
+
+    if (! w2 || BRWalletBalance(w2) != BRWalletBalance(w) || BRWalletUTXOs(w2, NULL, 0) != BRWalletUTXOs(w, NULL, 0) ||
+        BRWalletAllAddrs(w2, NULL, 0) != BRWalletAllAddrs(w, NULL, 0) ||
+        ! BRAddressEq(BRWalletReceiveAddress(w2).s, BRWalletReceiveAddress(w).s) ||
+        BRWalletTransactions(w2, restored, 2) != 2 || ! BRTransactionEq(restored[0], txs[0]) ||
+        ! BRTransactionEq(restored[1], txs[1]) || BRWalletTotalReceived(w2) != BRWalletTotalReceived(w))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNewFromSnapshot() test 3\n", __func__);
+
+    if (w2) BRWalletRemoveTransaction(w2, restored[1]->txHash); // roll back the restored balance journal
+    if (! w2 || BRWalletBalance(w2) != SATOSHIS || BRWalletTransactions(w2, NULL, 0) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNewFromSnapshot() test 4\n", __func__);
+
+    if (w2) BRWalletFree(w2);
+    free(snapshot);
+    BRWalletFree(w);
+
+    BRTransaction *batch[20];
+    BRWalletConcurrencyInfo info = { BRWalletNew(NULL, 0, mpk), batch, 20, 0 };
+
+    for (size_t i = 0; i < info.txCount; i++) {
+        batch[i] = BRTransactionNew();
+        BRTransactionAddInput(batch[i], inHash, (uint32_t)i + 3, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+        BRTransactionAddOutput(batch[i], SATOSHIS, outScript, outScriptLen);
+        BRTransactionSign(batch[i], 0, &k, 1);
+    }
+
+    BRThreadPoolApply(BRThreadPoolShared(), &info, walletConcurrentJob, 8); // query the wallet while it's updated
+    if (info.failed || BRWalletBalance(info.wallet) != info.txCount*SATOSHIS ||
+        BRWalletTotalReceived(info.wallet) != info.txCount*SATOSHIS)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletBalance() concurrency test\n", __func__);
+
+    BRWalletFree(info.wallet);
+
+    BRTransaction *chain[40], *chainCopies[40], *wtxs[40], *w2txs[40];
+    UInt256 blockHashes[40];
+    BRWalletBlockTxs blocks[128];
+    uint32_t seq = 1, tip = 0, join, height;
+    size_t i, j, l, n, pick, unconfirmed, blockCount;
+
+    w = BRWalletNew(NULL, 0, mpk);
+    w2 = BRWalletNew(NULL, 0, mpk);
+
+    for (i = 0; i < 40; i++) { // odd tx spend the output of the tx before them, even ones receive from outside
+        chain[i] = BRTransactionNew();
+        
+        if (i % 2 == 0) {
+            BRTransactionAddInput(chain[i], inHash, (uint32_t)i + 100, 1, inScript, inScriptLen, NULL, 0,
+                                  TXIN_SEQUENCE);
+            BRTransactionAddOutput(chain[i], SATOSHIS + i*1000, outScript, outScriptLen);
+        }
+        else {
+            BRTransactionAddInput(chain[i], chain[i - 1]->txHash, 0, SATOSHIS + (i - 1)*1000, inScript, inScriptLen,
+                                  NULL, 0, TXIN_SEQUENCE);
+            BRTransactionAddOutput(chain[i], SATOSHIS/2, outScript, outScriptLen);
+            BRTransactionAddOutput(chain[i], SATOSHIS/4, inScript, inScriptLen);
+        }
+        
+        BRTransactionSign(chain[i], 0, &k, 1);
+        chainCopies[i] = BRTransactionCopy(chain[i]);
+    }
+    
+    BRWalletRegisterTransactions(w, chain, 40);
+    BRWalletRegisterTransactions(w2, chainCopies, 40);
+    
+    for (size_t round = 0; round < 50 && r; round++) { // random forks, checked against unconfirming and updating
+        seq = seq*1103515245 + 12345;
+        join = (round % 8 == 7) ? (seq >> 16) % (tip + 1) : // every so often, a fork from deep in the chain
+               (tip > (seq >> 16) % 6) ? tip - (seq >> 16) % 6 : 0;
+        blockCount = tip - join + 1 + (seq >> 20) % 2;
+        BRWalletSetTxUnconfirmedAfter(w2, join);
+        n = BRWalletTransactions(w2, w2txs, 40);
+        
+        for (i = 0, unconfirmed = 0; i < n; i++) {
+            if (w2txs[i]->blockHeight == TX_UNCONFIRMED) w2txs[unconfirmed++] = w2txs[i];
+        }
+        
+        for (i = 0, j = 0; i < blockCount; i++) { // confirm some of the unconfirmed tx in each block
+            seq = seq*1103515245 + 12345;
+            height = join + (uint32_t)i + 1;
+            blocks[i].txHashes = &blockHashes[j];
+            blocks[i].txCount = 0;
+            blocks[i].blockHeight = height;
+            blocks[i].timestamp = height*600;
+            
+            for (n = (seq >> 16) % 3; n > 0 && j < unconfirmed; n--, j++) { // pick a random tx, or its parent first
+                seq = seq*1103515245 + 12345;
+                pick = j + (seq >> 16) % (unconfirmed - j);
+                
+                for (l = j; l < unconfirmed; l++) {
+                    if (UInt256Eq(w2txs[l]->txHash, w2txs[pick]->inputs[0].txHash)) pick = l;
+                }
+                
+                tx = w2txs[pick], w2txs[pick] = w2txs[j], w2txs[j] = tx;
+                blockHashes[j] = tx->txHash;
+                blocks[i].txCount++;
+            }
+            
+            BRWalletUpdateTransactions(w2, blocks[i].txHashes, blocks[i].txCount, height, height*600);
+        }
+        
+        BRWalletReorganize(w, join, blocks, blockCount);
+        tip = join + (uint32_t)blockCount;
+        n = BRWalletTransactions(w, wtxs, 40);
+        
+        if (n != BRWalletTransactions(w2, w2txs, 40) || BRWalletBalance(w) != BRWalletBalance(w2) ||
+            BRWalletTotalSent(w) != BRWalletTotalSent(w2) || BRWalletTotalReceived(w) != BRWalletTotalReceived(w2) ||
+            BRWalletUTXOs(w, NULL, 0) != BRWalletUTXOs(w2, NULL, 0))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletReorganize() test 1\n", __func__);
+        
+        for (i = 0; r && i < n; i++) {
+            if (UInt256Eq(wtxs[i]->txHash, w2txs[i]->txHash) && wtxs[i]->blockHeight == w2txs[i]->blockHeight &&
+                BRWalletBalanceAfterTx(w, wtxs[i]) == BRWalletBalanceAfterTx(w2, w2txs[i])) continue;
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletReorganize() test 2\n", __func__);
+        }
+    }
+    
+    BRWalletTxCursor cursor = BR_WALLET_TX_CURSOR_ALL;
+    BRTransaction *page[7];
+    BRUTXO utxos[40], utxoPage[3];
+    BRAddress addrs[200], addrPage[16];
+    size_t pos;
+
+    n = BRWalletTransactions(w, wtxs, 40);
+    
+    for (i = 0; (j = BRWalletTransactionsPage(w, &cursor, page, 7)) > 0; i += j) { // page through all tx
+        if (i + j > n || memcmp(&wtxs[i], page, j*sizeof(*page)) != 0) break;
+    }
+    
+    if (i != n) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionsPage() test 1\n", __func__);
+    
+    cursor = BR_WALLET_TX_CURSOR_ALL;
+    cursor.minHeight = wtxs[5]->blockHeight;
+    cursor.maxHeight = wtxs[20]->blockHeight;
+    cursor.minTime = wtxs[8]->timestamp;
+    cursor.offset = 2;
+    for (i = 0; i < n && wtxs[i]->blockHeight < cursor.minHeight; i++);
+    
+    for (i += cursor.offset, l = 0; i < n && wtxs[i]->blockHeight <= cursor.maxHeight; i++) { // expected tx in range
+        if (wtxs[i]->timestamp >= cursor.minTime) w2txs[l++] = wtxs[i];
+    }
+    
+    for (i = 0; (j = BRWalletTransactionsPage(w, &cursor, page, 3)) > 0; i += j) {
+        if (i + j > l || memcmp(&w2txs[i], page, j*sizeof(*page)) != 0) break;
+    }
+    
+    if (l == 0 || i != l) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionsPage() test 2\n", __func__);
+    
+    cursor = BR_WALLET_TX_CURSOR_ALL;
+    BRWalletTransactionsPage(w, &cursor, page, 7);
+    BRWalletSetTxUnconfirmedAfter(w, 0); // moves tx the cursor has passed to the end, to be returned again
+    for (i = 7; (j = BRWalletTransactionsPage(w, &cursor, page, 7)) > 0; i += j);
+    if (i != n + 7) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionsPage() test 3\n", __func__);
+
+    n = BRWalletUTXOs(w, utxos, 40);
+    for (pos = 0, i = 0; (j = BRWalletUTXOsPage(w, &pos, utxoPage, 3)) > 0 && i + j <= n; i += j) {
+        if (memcmp(&utxos[i], utxoPage, j*sizeof(*utxoPage)) != 0) break;
+    }
+    
+    if (n == 0 || i != n || pos != n) r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUTXOsPage() test\n", __func__);
+    
+    n = BRWalletAllAddrs(w, addrs, 200);
+    for (pos = 0, i = 0; (j = BRWalletAllAddrsPage(w, &pos, addrPage, 16)) > 0 && i + j <= n; i += j) {
+        if (memcmp(&addrs[i], addrPage, j*sizeof(*addrPage)) != 0) break;
+    }
+    
+    if (n == 0 || n == 200 || i != n || pos != n)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletAllAddrsPage() test\n", __func__);
+    
+    BRTransaction *addrTxs[40];
+    const char *address;
+    uint64_t addrBalance;
+    size_t addrUTXOCount, txCount = BRWalletTransactions(w, wtxs, 40), utxoCount = BRWalletUTXOs(w, utxos, 40);
+
+    BRWalletRemoveTransaction(w, wtxs[txCount - 1]->txHash); // the index should follow removed tx
+    txCount = BRWalletTransactions(w, wtxs, 40);
+    utxoCount = BRWalletUTXOs(w, utxos, 40);
+
+    for (pos = 0; pos < n + txCount; pos++) { // check each wallet address, and each address in a wallet tx
+        if (pos < n) address = addrs[pos].s;
+        else if (wtxs[pos - n]->inCount > 0) address = wtxs[pos - n]->inputs[0].address;
+        else continue;
+
+        for (i = 0, l = 0; i < txCount; i++) { // full scan for tx at address
+            for (j = 0; j < wtxs[i]->inCount && ! BRAddressEq(wtxs[i]->inputs[j].address, address); j++);
+            if (j == wtxs[i]->inCount) {
+                for (j = 0; j < wtxs[i]->outCount && ! BRAddressEq(wtxs[i]->outputs[j].address, address); j++);
+                if (j == wtxs[i]->outCount) continue;
+            }
+
+            w2txs[l++] = wtxs[i];
+        }
+
+        for (i = 0, addrBalance = 0, addrUTXOCount = 0; i < utxoCount; i++) { // full scan for utxos at address
+            tx = BRWalletTransactionForHash(w, utxos[i].hash);
+            if (! BRAddressEq(tx->outputs[utxos[i].n].address, address)) continue;
+            addrBalance += tx->outputs[utxos[i].n].amount;
+            addrUTXOCount++;
+        }
+
+        if (BRWalletTransactionsForAddress(w, address, NULL, 0) != l ||
+            BRWalletTransactionsForAddress(w, address, addrTxs, 40) != l ||
+            memcmp(addrTxs, w2txs, l*sizeof(*addrTxs)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionsForAddress() test\n", __func__);
+
+        if (BRWalletBalanceForAddress(w, address) != addrBalance ||
+            BRWalletUTXOsForAddress(w, address, NULL, 0) != addrUTXOCount)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletBalanceForAddress() test\n", __func__);
+    }
+
+    BRWalletFree(w2);
+    BRWalletFree(w);
+
+    BRTransaction *foreign[6];
+    
+    w = BRWalletNew(NULL, 0, mpk);
+    
+    for (i = 0; i < 6; i++) { // unconfirmed tx that aren't associated with the wallet
+        foreign[i] = BRTransactionNew();
+        BRTransactionAddInput(foreign[i], inHash, (uint32_t)i + 200, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+        BRTransactionAddOutput(foreign[i], SATOSHIS, inScript, inScriptLen);
+        BRTransactionSign(foreign[i], 0, &k, 1);
+    }
+    
+    BRWalletSetTxPoolSize(w, BRTransactionSize(foreign[0])*3);
+    tx = BRTransactionNew(); // wallet tx spending from foreign[0]
+    BRTransactionAddInput(tx, foreign[0]->txHash, 0, SATOSHIS, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, SATOSHIS, outScript, outScriptLen);
+    BRTransactionSign(tx, 0, &k, 1);
+    hash = foreign[1]->txHash;
+
+    for (i = 0; i < 3; i++) {
+        if (BRWalletRegisterTransaction(w, foreign[i]))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransaction() pool test 1\n", __func__);
+    }
+    
+    BRWalletRegisterTransaction(w, tx);
+    BRWalletRegisterTransaction(w, foreign[2]); // relayed again, so it's the most recently seen
+    BRWalletRegisterTransaction(w, foreign[3]); // evicts foreign[1], since a wallet tx spends from foreign[0]
+    
+    if (! BRWalletTransactionForHash(w, foreign[0]->txHash) || BRWalletTransactionForHash(w, hash) ||
+        ! BRWalletTransactionForHash(w, foreign[2]->txHash) || ! BRWalletTransactionForHash(w, foreign[3]->txHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransaction() pool test 2\n", __func__);
+    
+    hash = foreign[4]->txHash;
+    foreign[4]->blockHeight = 1000; // confirmed non-wallet tx aren't kept
+    BRWalletRegisterTransaction(w, foreign[4]);
+    if (BRWalletTransactionForHash(w, hash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransaction() pool test 3\n", __func__);
+
+    hash = foreign[3]->txHash;
+    BRWalletRegisterTransaction(w, foreign[5]);
+    BRWalletUpdateTransactions(w, &foreign[5]->txHash, 1, 1000, 1); // confirmed pool tx are freed
+    BRWalletSetTxPoolSize(w, 0); // evicts all but foreign[0]
+    
+    if (! BRWalletTransactionForHash(w, foreign[0]->txHash) || BRWalletTransactionForHash(w, hash) ||
+        BRWalletTransactionIsPending(w, tx) || BRWalletBalance(w) != SATOSHIS)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSetTxPoolSize() test\n", __func__);
+    
+    BRWalletFree(w);
+
     int64_t amt;
     
     tx = BRTransactionNew();
@@ -2205,6 +2755,53 @@ int BRBloomFilterTests()
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterSerialize() test 2\n", __func__);
     
     BRBloomFilterFree(f);
+
+    // BIP158 basic filter test vector for the bitcoin testnet genesis block
+    UInt256 blockHash = UInt256Reverse(uint256("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943"));
+    char script1[] = "\x41\x04\x67\x8a\xfd\xb0\xfe\x55\x48\x27\x19\x67\xf1\xa6\x71\x30\xb7\x10\x5c\xd6\xa8\x28\xe0"
+    "\x39\x09\xa6\x79\x62\xe0\xea\x1f\x61\xde\xb6\x49\xf6\xbc\x3f\x4c\xef\x38\xc4\xf3\x55\x04\xe5\x1e\xc1\x12\xde\x5c"
+    "\x38\x4d\xf7\xba\x0b\x8d\x57\x8a\x4c\x70\x2b\x6b\xf1\x1d\x5f\xac",
+         script2[] = "\x76\xa9\x14\xb9\x30\x06\x70\xb4\xc5\x36\x6e\x95\xb2\x69\x9e\x8b\x18\xbc\x75\xe5\xf7\x29\xc5"
+    "\x88\xac";
+    const uint8_t *items[] = { (uint8_t *)script1, (uint8_t *)script2 };
+    size_t itemLens[] = { sizeof(script1) - 1, sizeof(script2) - 1 };
+    uint8_t buf3[BRGCSFilterBuild(NULL, 0, blockHash, items, itemLens, 1)];
+    size_t len3 = BRGCSFilterBuild(buf3, sizeof(buf3), blockHash, items, itemLens, 1);
+    char d3[] = "\x01\x9d\xfc\xa8";
+    UInt256 header = BRGCSFilterHeader(BRGCSFilterHash(buf3, len3), UINT256_ZERO);
+    
+    if (len3 != sizeof(d3) - 1 || memcmp(buf3, d3, len3) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRGCSFilterBuild() test 1\n", __func__);
+    
+    if (! UInt256Eq(header, UInt256Reverse(uint256("21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750"))))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRGCSFilterHeader() test 1\n", __func__);
+    
+    if (BRGCSFilterCount(buf3, len3) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRGCSFilterCount() test 1\n", __func__);
+    
+    if (! BRGCSFilterMatchAny(buf3, len3, blockHash, items, itemLens, 2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRGCSFilterMatchAny() test 1\n", __func__);
+    
+    if (BRGCSFilterMatchAny(buf3, len3, blockHash, &items[1], &itemLens[1], 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRGCSFilterMatchAny() test 2\n", __func__);
+
+    // the same filter with a count that isn't minimally encoded
+    char d5[] = "\xfd\x01\x00\x9d\xfc\xa8";
+    
+    if (BRGCSFilterCount((uint8_t *)d5, sizeof(d5) - 1) != 1 ||
+        ! BRGCSFilterMatchAny((uint8_t *)d5, sizeof(d5) - 1, blockHash, items, itemLens, 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRGCSFilterMatchAny() test 5\n", __func__);
+
+    // a filter keyed with a different block hash shouldn't match
+    if (BRGCSFilterMatchAny(buf3, len3, UINT256_ZERO, items, itemLens, 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRGCSFilterMatchAny() test 3\n", __func__);
+
+    uint8_t buf4[BRGCSFilterBuild(NULL, 0, blockHash, items, itemLens, 2)];
+    size_t len4 = BRGCSFilterBuild(buf4, sizeof(buf4), blockHash, items, itemLens, 2);
+    
+    if (BRGCSFilterCount(buf4, len4) != 2 || ! BRGCSFilterMatchAny(buf4, len4, blockHash, &items[1], &itemLens[1], 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRGCSFilterMatchAny() test 4\n", __func__);
+    
     return r;
 }
 
@@ -2286,6 +2883,43 @@ int BRMerkleBlockTests()
     
     // TODO: test (CVE-2012-2459) vulnerability
 
+    BRPoWCache *cache = BRPoWCacheNew(BRPoWCacheTrustAll, 0), *cache2 = BRPoWCacheNew(BRPoWCacheTrustAll, 0);
+    UInt256 powHash = UINT256_ZERO;
+    BRMerkleBlock *d;
+    
+    powHash.u8[0] = 1; // a hash that scrypt would never produce, so it's clear when the cache was used
+    BRPoWCacheAdd(cache, b->blockHash, powHash, 10001);
+    d = BRMerkleBlockParseCached((uint8_t *)block, sizeof(block) - 1, cache);
+    if (! UInt256Eq(d->powHash, powHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseCached() test 1\n", __func__);
+    BRMerkleBlockFree(d);
+
+    BRPoWCacheSetTrust(cache, BRPoWCacheTrustBelowHeight, 10000); // cached hash is above trustHeight
+    d = BRMerkleBlockParseCached((uint8_t *)block, sizeof(block) - 1, cache);
+    if (! UInt256Eq(d->powHash, b->powHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseCached() test 2\n", __func__);
+    BRMerkleBlockFree(d);
+
+    BRPoWCacheSetTrust(cache, BRPoWCacheTrustBelowHeight, 10001);
+    BRMerkleBlockParseHeaders(&d, (uint8_t *)block, 80, 1, cache);
+    if (! UInt256Eq(d->powHash, powHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseHeaders() test\n", __func__);
+    BRMerkleBlockFree(d);
+
+    uint8_t cacheBuf[BRPoWCacheSerialize(cache, NULL, 0)];
+
+    if (BRPoWCacheSerialize(cache, cacheBuf, sizeof(cacheBuf)) != sizeof(cacheBuf) ||
+        BRPoWCacheParse(cache2, cacheBuf, sizeof(cacheBuf)) != 1 || BRPoWCacheCount(cache2) != 1 ||
+        ! BRPoWCacheLookup(cache2, b->blockHash, &powHash) || powHash.u8[0] != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPoWCacheParse() test\n", __func__);
+
+    BRPoWCacheSetTrust(cache2, BRPoWCacheTrustNone, 0);
+    if (BRPoWCacheLookup(cache2, b->blockHash, &powHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPoWCacheLookup() test\n", __func__);
+    
+    BRPoWCacheFree(cache);
+    BRPoWCacheFree(cache2);
+
     BRMerkleBlock *c = BRMerkleBlockCopy(b);
 
     if (!BRMerkleBlockEqual(b, c))
@@ -2740,6 +3374,97 @@ int BRPaymentProtocolEncryptionTests()
 
 void BRPeerAcceptMessageTest(BRPeer *peer, const uint8_t *msg, size_t len, const char *type);
 
+typedef struct {
+    volatile int connected, disconnected, error, pongs, cleanups, congested, drained, blockInvs;
+    UInt256 blockHash;
+} BRPeerLoopTestInfo;
+
+static void peerLoopTestConnected(void *info)
+{
+    ((BRPeerLoopTestInfo *)info)->connected = 1;
+}
+
+static void peerLoopTestDisconnected(void *info, int error)
+{
+    ((BRPeerLoopTestInfo *)info)->error = error;
+    ((BRPeerLoopTestInfo *)info)->disconnected = 1;
+}
+
+static void peerLoopTestPong(void *info, int success)
+{
+    if (success) ((BRPeerLoopTestInfo *)info)->pongs++;
+}
+
+static void peerLoopTestSendQueue(void *info, int congested)
+{
+    if (congested) ((BRPeerLoopTestInfo *)info)->congested++;
+    else ((BRPeerLoopTestInfo *)info)->drained++;
+}
+
+static int peerLoopTestBlockInv(void *info, const UInt256 blockHashes[], size_t blockCount)
+{
+    ((BRPeerLoopTestInfo *)info)->blockHash = blockHashes[blockCount - 1];
+    ((BRPeerLoopTestInfo *)info)->blockInvs++;
+    return 1; // the test requests the blocks itself
+}
+
+static void peerLoopTestCleanup(void *info)
+{
+    ((BRPeerLoopTestInfo *)info)->cleanups++;
+}
+
+// waits up to 5 seconds for *flag to reach value, returns true if it did
+static int peerLoopTestWait(volatile int *flag, int value)
+{
+    for (int i = 0; *flag < value && i < 500; i++) usleep(10000);
+    return (*flag >= value);
+}
+
+// serializes a message with the given type and payload to buf, preceded by garbageLen bytes of garbage that repeat the
+// start of the magic number, and returns the serialized length
+static size_t peerLoopTestMessage(uint8_t *buf, size_t garbageLen, const char *type, const uint8_t *payload,
+                                  size_t payloadLen)
+{
+    uint8_t hash[32];
+    size_t i;
+
+    for (i = 0; i < garbageLen; i++) buf[i] = (BR_CHAIN_PARAMS.magicNumber >> (i % 3)*8) & 0xff;
+    UInt32SetLE(&buf[garbageLen], BR_CHAIN_PARAMS.magicNumber);
+    memset(&buf[garbageLen + 4], 0, 12);
+    strncpy((char *)&buf[garbageLen + 4], type, 12);
+    UInt32SetLE(&buf[garbageLen + 16], (uint32_t)payloadLen);
+    BRSHA256_2(hash, payload, payloadLen);
+    memcpy(&buf[garbageLen + 20], hash, 4);
+    if (payloadLen > 0) memcpy(&buf[garbageLen + 24], payload, payloadLen);
+    return garbageLen + 24 + payloadLen;
+}
+
+// writes a message with the given type and payload to the socket, preceded by garbageLen bytes of garbage
+static void peerLoopTestWrite(int fd, size_t garbageLen, const char *type, const uint8_t *payload, size_t payloadLen)
+{
+    uint8_t buf[0x1000];
+    size_t len = peerLoopTestMessage(buf, garbageLen, type, payload, payloadLen);
+
+    if (write(fd, buf, len) < 0) printf("write failed: %s\n", strerror(errno));
+}
+
+// reads a message from the socket, writes its type to type and its payload to payload, and returns the payload length
+static size_t peerLoopTestRead(int fd, char type[12], uint8_t payload[], size_t payloadLen)
+{
+    uint8_t header[24];
+    size_t len = 0, msgLen;
+    ssize_t n = 1;
+
+    while (n > 0 && len < sizeof(header)) len += (n = read(fd, &header[len], sizeof(header) - len)) > 0 ? n : 0;
+    if (len < sizeof(header)) return 0;
+    memcpy(type, &header[4], 12);
+    msgLen = UInt32GetLE(&header[16]);
+    if (msgLen > payloadLen) return 0;
+
+    for (len = 0; n > 0 && len < msgLen; len += (n > 0) ? n : 0) n = read(fd, &payload[len], msgLen - len);
+    return (len == msgLen) ? msgLen : 0;
+}
+
 int BRPeerTests()
 {
     int r = 1;
@@ -2747,6 +3472,138 @@ int BRPeerTests()
     const char msg[] = "my message";
     
     BRPeerAcceptMessageTest(p, (const uint8_t *)msg, sizeof(msg) - 1, "inv");
+    BRPeerFree(p);
+
+    BRPeerLoop *loop = BRPeerLoopNew(2);
+
+    if (loop) { // connect to a local listening socket through the peer loop
+        BRPeerLoopTestInfo info = { 0, 0, 0, 0, 0, 0, 0, 0, UINT256_ZERO };
+        struct sockaddr_in sin;
+        socklen_t sinLen = sizeof(sin);
+        struct timeval tv = { 5, 0 };
+        uint8_t version[86], payload[0x1000], nonce[8];
+        char type[12] = "";
+        uint8_t *big = calloc(1, 0x400000);
+        size_t i, len;
+        ssize_t n;
+        int listener = socket(AF_INET, SOCK_STREAM, 0), fd = -1;
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)); // limits how long accept() waits
+        if (bind(listener, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(listener, 1) < 0 ||
+            getsockname(listener, (struct sockaddr *)&sin, &sinLen) < 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: listen() %s\n", __func__, strerror(errno));
+
+        p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+        p->address.u16[5] = 0xffff;
+        p->address.u32[3] = sin.sin_addr.s_addr;
+        p->port = ntohs(sin.sin_port);
+        BRPeerSetCallbacks(p, &info, peerLoopTestConnected, peerLoopTestDisconnected, NULL, NULL, NULL, NULL, NULL,
+                           NULL, NULL, NULL, NULL, peerLoopTestCleanup);
+        BRPeerSetLoop(p, loop);
+        BRPeerSetBlockInvCallback(p, peerLoopTestBlockInv);
+        BRPeerConnect(p);
+        if (r) fd = accept(listener, NULL, NULL);
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        if (fd < 0 || peerLoopTestRead(fd, type, payload, sizeof(payload)) < 85 || strcmp(type, MSG_VERSION) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerLoop version test\n", __func__);
+
+        memset(version, 0, sizeof(version));
+        UInt32SetLE(version, 70015);
+        peerLoopTestWrite(fd, 7, MSG_VERSION, version, sizeof(version)); // the peer must skip leading garbage
+        peerLoopTestWrite(fd, 0, MSG_VERACK, NULL, 0);
+
+        if (! peerLoopTestWait(&info.connected, 1) || BRPeerConnectStatus(p) != BRPeerStatusConnected ||
+            peerLoopTestRead(fd, type, payload, sizeof(payload)) != 0 || strcmp(type, MSG_VERACK) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerLoop handshake test\n", __func__);
+
+        UInt64SetLE(nonce, 42);
+        peerLoopTestWrite(fd, 0, MSG_PING, nonce, sizeof(nonce)); // answered from the loop thread
+
+        if (peerLoopTestRead(fd, type, payload, sizeof(payload)) != sizeof(nonce) || strcmp(type, MSG_PONG) != 0 ||
+            UInt64GetLE(payload) != 42)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerLoop pong test\n", __func__);
+
+        // a long run of partial magic numbers followed by two messages in a single write
+        len = peerLoopTestMessage(payload, 3000, MSG_PING, nonce, sizeof(nonce));
+        UInt64SetLE(nonce, 43);
+        len += peerLoopTestMessage(&payload[len], 0, MSG_PING, nonce, sizeof(nonce));
+        if (write(fd, payload, len) < 0) printf("write failed: %s\n", strerror(errno));
+
+        if (peerLoopTestRead(fd, type, payload, sizeof(payload)) != sizeof(nonce) || strcmp(type, MSG_PONG) != 0 ||
+            UInt64GetLE(payload) != 42 || peerLoopTestRead(fd, type, payload, sizeof(payload)) != sizeof(nonce) ||
+            strcmp(type, MSG_PONG) != 0 || UInt64GetLE(payload) != 43)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerLoop magic resync test\n", __func__);
+
+        // block hashes taken by the block inv callback aren't requested with getdata, so the pong is the next message
+        BRPeerSendFilterload(p, nonce, sizeof(nonce)); // block hashes in inv messages are ignored before a filterload
+        if (peerLoopTestRead(fd, type, payload, sizeof(payload)) != sizeof(nonce) || strcmp(type, MSG_FILTERLOAD) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSetBlockInvCallback() test 1\n", __func__);
+
+        memset(payload, 0, 1 + 2*36);
+        payload[0] = 2; // two block hashes
+
+        for (i = 0; i < 2; i++) {
+            UInt32SetLE(&payload[1 + i*36], 2); // inv_merkleblock
+            payload[1 + i*36 + 4] = 0xf1 + i;
+        }
+
+        peerLoopTestWrite(fd, 0, MSG_INV, payload, 1 + 2*36);
+        UInt64SetLE(nonce, 44);
+        peerLoopTestWrite(fd, 0, MSG_PING, nonce, sizeof(nonce));
+
+        if (peerLoopTestRead(fd, type, payload, sizeof(payload)) != sizeof(nonce) || strcmp(type, MSG_PONG) != 0 ||
+            UInt64GetLE(payload) != 44 || info.blockInvs != 1 || info.blockHash.u8[0] != 0xf2)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSetBlockInvCallback() test 2\n", __func__);
+
+        // what the socket doesn't take right away is queued, and the queue callback reports crossing the high water mark
+        BRPeerSetSendQueueCallback(p, 0x100000, peerLoopTestSendQueue);
+        for (i = 0; i < 8 && ! info.congested; i++) BRPeerSendMessage(p, big, 0x400000, "test");
+
+        if (info.congested != 1 || BRPeerSendQueueLength(p) <= 0x100000)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSendQueueCallback() test 1\n", __func__);
+
+        for (len = i*(24 + 0x400000); len > 0 && (n = read(fd, big, (len < 0x400000) ? len : 0x400000)) > 0;) len -= n;
+
+        if (len > 0 || ! peerLoopTestWait(&info.drained, 1) || BRPeerSendQueueLength(p) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSendQueueCallback() test 2\n", __func__);
+
+        BRPeerSendPing(p, &info, peerLoopTestPong); // sent from this thread
+
+        if (peerLoopTestRead(fd, type, payload, sizeof(payload)) != sizeof(nonce) || strcmp(type, MSG_PING) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerLoop ping test 1\n", __func__);
+
+        peerLoopTestWrite(fd, 0, MSG_PONG, payload, sizeof(nonce));
+        if (! peerLoopTestWait(&info.pongs, 1))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerLoop ping test 2\n", __func__);
+
+        BRPeerDisconnect(p);
+
+        if (! peerLoopTestWait(&info.disconnected, 1) || info.error != ECONNRESET ||
+            ! peerLoopTestWait(&info.cleanups, 1) || BRPeerConnectStatus(p) != BRPeerStatusDisconnected ||
+            read(fd, payload, sizeof(payload)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerLoop disconnect test\n", __func__);
+
+        if (fd >= 0) close(fd);
+        info.disconnected = 0;
+        BRPeerConnect(p); // reconnect, then let the connect timeout expire without a handshake
+        fd = (r) ? accept(listener, NULL, NULL) : -1;
+        BRPeerScheduleDisconnect(p, 0.5);
+
+        if (fd < 0 || ! peerLoopTestWait(&info.disconnected, 1) || info.error != ETIMEDOUT ||
+            ! peerLoopTestWait(&info.cleanups, 2))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerLoop timeout test\n", __func__);
+
+        if (fd >= 0) close(fd);
+        close(listener);
+        free(big);
+        BRPeerFree(p);
+        BRPeerLoopFree(loop);
+    }
+
     return r;
 }
 
@@ -2760,6 +3617,8 @@ int BRRunTests()
     printf("%s\n", (BRArrayTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRSetTests...                       ");
     printf("%s\n", (BRSetTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRThreadPoolTests...                ");
+    printf("%s\n", (BRThreadPoolTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRBase58Tests...                    ");
     printf("%s\n", (BRBase58Tests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRBech32Tests...                    ");
@@ -2794,6 +3653,8 @@ int BRRunTests()
     printf("%s\n", (BRBIP32SequenceTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRTransactionTests...               ");
     printf("%s\n", (BRTransactionTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRCoinSelectionTests...             ");
+    printf("%s\n", (BRCoinSelectionTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRWalletTests...                    ");
     printf("%s\n", (BRWalletTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRBloomFilterTests...               ");
@@ -2812,6 +3673,174 @@ int BRRunTests()
     return (fail == 0);
 }
 
+#if BITCOIN_BENCH
+// compares proof-of-work hashing of header batches and a reused scratchpad with BRScrypt() called once per header
+void BRScryptPoWBench()
+{
+    const size_t count = 2000; // max headers in a single headers message
+    uint8_t *headers = malloc(count*80), *md = malloc(count*32);
+    clock_t start;
+    double t1, t2, t3;
+    
+    for (size_t i = 0; i < count*80; i++) headers[i] = (uint8_t)(i*2654435761u >> 24);
+    start = clock();
+    
+    for (size_t i = 0; i < count; i++) {
+        BRScrypt(&md[i*32], 32, &headers[i*80], 80, &headers[i*80], 80, 1024, 1, 1);
+    }
+    
+    t1 = (double)(clock() - start)/CLOCKS_PER_SEC;
+    start = clock();
+    BRScryptPoW(md, headers, count);
+    t2 = (double)(clock() - start)/CLOCKS_PER_SEC;
+    start = clock();
+    for (size_t i = 0; i < count; i++) BRScryptCtxPoW(BRScryptPoWThreadCtx(), &md[i*32], &headers[i*80], 1);
+    t3 = (double)(clock() - start)/CLOCKS_PER_SEC;
+    printf("BRScrypt:       %8.0f headers/s\n", count/t1);
+    printf("BRScryptCtxPoW: %8.0f headers/s (%.2fx) one header per call\n", count/t3, t1/t3);
+    printf("BRScryptPoW:    %8.0f headers/s (%.2fx)\n", count/t2, t1/t2);
+    free(headers);
+    free(md);
+}
+
+// sha256 and double-sha256 throughput for the buffer sizes seen in p2p messages, txids and block hashes
+void BRSHA256Bench()
+{
+    const size_t sizes[] = { 32, 64, 80, 250, 1024, 16384, 1000000 };
+    uint8_t md[32], *buf = calloc(1, 1000000);
+    clock_t start;
+    double t;
+    size_t count;
+    
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(*sizes); i++) {
+        count = 100000000/(sizes[i] + 64);
+        start = clock();
+        for (size_t j = 0; j < count; j++) BRSHA256(md, buf, sizes[i]), buf[0] ^= md[0];
+        t = (double)(clock() - start)/CLOCKS_PER_SEC;
+        printf("BRSHA256   %7zu bytes: %8.1f MB/s %10.0f hashes/s\n", sizes[i], count*sizes[i]/t/1e6, count/t);
+        start = clock();
+        for (size_t j = 0; j < count; j++) BRSHA256_2(md, buf, sizes[i]), buf[0] ^= md[0];
+        t = (double)(clock() - start)/CLOCKS_PER_SEC;
+        printf("BRSHA256_2 %7zu bytes: %8.1f MB/s %10.0f hashes/s\n", sizes[i], count*sizes[i]/t/1e6, count/t);
+    }
+    
+    for (size_t len = 64; len <= 80; len += 16) { // merkle node pairs and block headers, 1000 messages per call
+        uint8_t *mds = malloc(1000*32);
+        
+        count = 1000;
+        start = clock();
+        for (size_t j = 0; j < count; j++) BRSHA256_2_Multi(mds, buf, len, 1000), buf[0] ^= mds[0];
+        t = (double)(clock() - start)/CLOCKS_PER_SEC;
+        printf("BRSHA256_2_Multi %2zu bytes: %8.1f MB/s %10.0f hashes/s\n", len, count*1000*len/t/1e6, count*1000/t);
+        free(mds);
+    }
+    
+    free(buf);
+}
+
+// coin selection time for wallets with many utxos, each selector funding the same payment
+void BRCoinSelectionBench()
+{
+    const size_t counts[] = { 10000, 100000 };
+    const char *names[] = { "BRCoinSelectFirstFit:      ", "BRCoinSelectLargestFirst:  ",
+                            "BRCoinSelectBranchAndBound:" };
+    BRCoinSelector selectors[] = { BRCoinSelectFirstFit, BRCoinSelectLargestFirst, BRCoinSelectBranchAndBound };
+    BRCoinTarget target = { 0, 2, TX_OUTPUT_SIZE*2, DEFAULT_FEE_PER_KB, TX_MIN_OUTPUT_AMOUNT, 0, TX_MAX_SIZE };
+    BRCoinSelection sel;
+    clock_t start;
+    double t;
+    size_t n;
+    
+    for (size_t i = 0; i < sizeof(counts)/sizeof(*counts); i++) {
+        BRCoin *coins = malloc(counts[i]*sizeof(*coins));
+        size_t *selected = malloc(counts[i]*sizeof(*selected));
+        
+        for (size_t j = 0; j < counts[i]; j++) {
+            coins[j].amount = 1000 + ((j*2654435761u) >> 8) % 10000000;
+            coins[j].idx = j;
+            target.balance += coins[j].amount;
+        }
+        
+        target.amount = 123456789;
+        
+        for (size_t k = 0; k < sizeof(selectors)/sizeof(*selectors); k++) {
+            start = clock();
+            n = selectors[k](&target, coins, counts[i], selected, &sel);
+            t = (double)(clock() - start)/CLOCKS_PER_SEC;
+            printf("%s %6zu utxos: %8.3f ms, %zu inputs, %"PRIu64" fee, %"PRIu64" change\n", names[k], counts[i],
+                   t*1000, n, sel.fee, sel.change);
+        }
+        
+        target.balance = 0;
+        free(selected);
+        free(coins);
+    }
+}
+
+// wallet startup time from a full rebuild with BRWalletNew(), and from a snapshot with BRWalletNewFromSnapshot()
+void BRWalletSnapshotBench()
+{
+    const size_t count = 5000;
+    UInt512 seed = UINT512_ZERO;
+    UInt256 secret = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    BRMasterPubKey mpk = BRBIP32MasterPubKey(&seed, sizeof(seed));
+    BRWallet *w = BRWalletNew(NULL, 0, mpk);
+    BRTransaction **txs = malloc(count*sizeof(*txs)), **copies = malloc(count*sizeof(*copies));
+    BRAddress *addrs = malloc(count*sizeof(*addrs)), addr;
+    BRKey k;
+    uint8_t script[25], *snapshot;
+    size_t i, scriptLen, snapshotLen;
+    clock_t start;
+    double t1, t2;
+    
+    BRKeySetSecret(&k, &secret, 1);
+    BRKeyAddress(&k, addr.s, sizeof(addr));
+    BRWalletUnusedAddrs(w, addrs, (uint32_t)count, 0);
+    BRWalletFree(w);
+    
+    for (i = 0; i < count; i++) { // one payment to each address of the external chain
+        txs[i] = BRTransactionNew();
+        scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.s);
+        BRTransactionAddInput(txs[i], secret, (uint32_t)i, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+        scriptLen = BRAddressScriptPubKey(script, sizeof(script), addrs[i].s);
+        BRTransactionAddOutput(txs[i], SATOSHIS, script, scriptLen);
+        BRTransactionSign(txs[i], 0, &k, 1);
+        txs[i]->blockHeight = (uint32_t)(i/10 + 1);
+        copies[i] = BRTransactionCopy(txs[i]);
+    }
+    
+    start = clock();
+    w = BRWalletNew(txs, count, mpk);
+    t1 = (double)(clock() - start)/CLOCKS_PER_SEC;
+    snapshotLen = BRWalletSnapshot(w, NULL, 0);
+    snapshot = malloc(snapshotLen);
+    BRWalletSnapshot(w, snapshot, snapshotLen);
+    BRWalletFree(w);
+    start = clock();
+    w = BRWalletNewFromSnapshot(copies, count, mpk, snapshot, snapshotLen);
+    t2 = (double)(clock() - start)/CLOCKS_PER_SEC;
+    printf("BRWalletNew:             %zu tx in %.3fs\n", count, t1);
+    printf("BRWalletNewFromSnapshot: %zu tx in %.3fs (%.1fx), %zu byte snapshot\n", count, t2, t1/t2, snapshotLen);
+    if (w) BRWalletFree(w);
+    free(snapshot);
+    free(addrs);
+    free(copies);
+    free(txs);
+}
+
+void BRRunBenchmarks()
+{
+    printf("\nBRSHA256Bench...\n");
+    BRSHA256Bench();
+    printf("\nBRScryptPoWBench...\n");
+    BRScryptPoWBench();
+    printf("\nBRCoinSelectionBench...\n");
+    BRCoinSelectionBench();
+    printf("\nBRWalletSnapshotBench...\n");
+    BRWalletSnapshotBench();
+}
+#endif
+
 #ifndef BITCOIN_TEST_NO_MAIN
 void syncStarted(void *info)
 {
@@ -2832,6 +3861,10 @@ int main(int argc, const char *argv[])
 {
     int r = BRRunTests();
 
+#if BITCOIN_BENCH
+    BRRunBenchmarks();
+#endif
+
 //    int err = 0;
 //    UInt512 seed = UINT512_ZERO;
 //    BRMasterPubKey mpk = BR_MASTER_PUBKEY_NONE;